@@ -1,3 +1,4 @@
+#define _GNU_SOURCE       /* memfd_create and the F_ADD_SEALS file sealing interface */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -5,11 +6,38 @@
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <termios.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <pwd.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <strings.h>
+#include <time.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <stdint.h>
+#include <poll.h>
+#include <regex.h>
 
 
 #define MAX_LENGTH 1024   /* Maximum length of a command line */
 #define MAX_ARGS 64       /* Maximum number of arguments */
 #define BUFFER_SIZE 5     /* History buffer size */
+#define MAX_PARTS 256     /* Maximum number of parts (literals, expansions) in one word */
+#define VAR_EXPORT 1      /* Variable flag: passed to child processes in the environment */
+#define VAR_ARRAY 2       /* Variable flag: an indexed array */
+#define VAR_ASSOC 4       /* Variable flag: an associative array */
 
 
 /*  Global history buffer and tracking variables */
@@ -19,8 +47,688 @@ int next_command = 0;     /*  Next insertion index (always between 0 and BUFFER_
 int buffer_index = -1;    /*  Index for browsing history (-1 means not browsing) */
 
 
+/*  Elements of an array variable. An indexed array is a vector with NULL for unset elements
+*   (its element 0 is also kept as the variable's value, so $name works); an associative one is
+*   an open-addressing table probed the same way as the variables themselves. */
+struct array_entry {
+   char *key;         /* NULL for a never used slot, TOMBSTONE for a deleted one */
+   char *value;
+};
+struct array {
+   char **items;                  /* indexed: element i, or NULL */
+   size_t count;                  /* indexed: one past the highest element set */
+   size_t capacity;
+   struct array_entry *entries;   /* associative */
+   size_t entries_capacity;       /* always a power of two */
+   size_t entries_used;           /* live entries plus tombstones */
+};
+
+
+/*  Shell variables live in an open-addressing hash table with linear probing */
+struct var {
+   char *name;        /* NULL for a never used slot, TOMBSTONE for a deleted one */
+   char *value;
+   char *env_entry;   /* "NAME=value" handed to exec, only for exported variables */
+   int flags;         /* VAR_EXPORT, VAR_ARRAY, VAR_ASSOC */
+   struct array *array;   /* elements of an array variable, NULL for a plain one */
+};
+char tombstone_marker;
+#define TOMBSTONE (&tombstone_marker)
+struct var *var_table = NULL;
+size_t var_capacity = 0;  /* always a power of two */
+size_t var_used = 0;      /* live entries plus tombstones */
+char **env_cache = NULL;  /* envp built from exported variables */
+int env_dirty = 1;        /* env_cache must be rebuilt before the next exec */
+
+
+/*  Special parameters */
+int last_status = 0;            /* $? */
+pid_t shell_pid = 0;            /* $$ */
+pid_t last_background_pid = 0;  /* $! */
+int expansion_failed = 0;       /* an expansion reported an error: the command isn't run */
+
+
+/*  A growable, null terminated list of allocated strings (expanded arguments) */
+struct wordlist {
+   char **words;
+   int count;
+   int capacity;
+};
+
+
+/*  One piece of a word: a slice of the raw text plus what to do with it */
+enum { WP_LIT, WP_PARAM, WP_TILDE, WP_CMDSUB, WP_BACKQUOTE, WP_ARITH, WP_PROCSUB };
+#define WF_QUOTED 1       /* came from quotes or a backslash: no splitting */
+#define WF_OUTPUT 2       /* WP_PROCSUB: >(...), the command reads what is written to it */
+struct wpart {
+   unsigned char type;    /* WP_LIT, WP_PARAM, WP_TILDE, WP_CMDSUB, WP_BACKQUOTE, WP_ARITH or WP_PROCSUB */
+   unsigned char flags;   /* WF_QUOTED, WF_OUTPUT */
+   int off;               /* start of the slice in the raw word */
+   int len;               /* length of the slice */
+   int block;             /* $(...) or <(...) compiled into the program's block table, for $((...))
+                             its arithmetic table entry + 1; 0 if it wasn't compiled */
+};
+
+
+/*  A growable null terminated string */
+struct strbuf {
+   char *buf;
+   size_t len;
+   size_t capacity;
+};
+
+
+/*  A field under construction during expansion */
+struct field {
+   struct strbuf text;      /* the field's value */
+   struct strbuf pattern;   /* the same value with quoted glob characters backslash-escaped */
+   int active;              /* set once the field exists, even if empty ("") */
+   int has_magic;           /* an unquoted *, ? or [ was added */
+   int allow_glob;          /* pathname expansion applies to this word */
+   int regex;               /* the pattern is a regular expression: quoted regex characters are escaped */
+};
+
+
+/*  A compiled shell pattern: one operation per pattern character or extglob group */
+enum { PAT_CHAR, PAT_ANY, PAT_STAR, PAT_CLASS, PAT_GROUP, PAT_END };
+struct pat_op {
+   unsigned char type;    /* PAT_CHAR, PAT_ANY, PAT_STAR, PAT_CLASS or PAT_GROUP (PAT_END only in a pattern_set) */
+   unsigned char c;       /* character for PAT_CHAR; for PAT_GROUP which of ?*+@! it was */
+   int set;               /* index into classes for PAT_CLASS, into groups for PAT_GROUP */
+};
+struct pattern;
+struct pat_group {
+   struct pattern *alts;  /* the |-separated alternatives of ?(...) *(...) +(...) @(...) !(...) */
+   int nalts;
+};
+struct pattern {
+   struct pat_op *ops;
+   int nops;
+   unsigned char (*classes)[32];  /* 256-bit membership sets for [...] */
+   int nclasses;
+   struct pat_group *groups;      /* extglob groups: matched by backtracking */
+   int ngroups;
+   char *literal;     /* the PAT_CHAR characters by position, for prefix/suffix checks */
+   int prefix_len;    /* leading literal characters */
+   int suffix_len;    /* trailing literal characters */
+   int min_len;       /* characters matched by everything but stars */
+   int has_star;      /* a star or group: the length can vary */
+};
+
+/*  Compiled patterns by text, so a pattern used over and over is only compiled once */
+#define PATTERN_CACHE_SIZE 64
+struct pattern_cache_entry {
+   char *text;
+   struct pattern pat;
+};
+struct pattern_cache_entry pattern_cache[PATTERN_CACHE_SIZE];
+
+/*  The patterns of all the arms of a case, run together over the subject in one pass: each
+*   pattern's ops are numbered states, followed by a PAT_END state that accepts */
+struct pattern_set {
+   struct pat_op *states;
+   int nstates;
+   unsigned char (*classes)[32];
+   int *accepts;          /* the PAT_END state of each pattern, in the order the arms try them */
+   int *words;            /* the pattern word each of them came from */
+   int npatterns;
+   int nclasses;
+   unsigned long *current, *next;   /* bit sets of live states */
+   int status;            /* 0 until built, 1 once built, -1 if the arms have to be tried one by one */
+};
+#define LONG_BITS (8 * sizeof(unsigned long))
+
+
+/*  Directory scanning with getdents64 */
+#define GLOB_DIRBUF_SIZE (256 * 1024)   /* large buffer: few syscalls even for huge directories */
+struct linux_dirent64 {
+   ino64_t d_ino;
+   off64_t d_off;
+   unsigned short d_reclen;
+   unsigned char d_type;
+   char d_name[];
+};
+struct dir_scan {
+   int fd;
+   char *buf;
+   long nread;    /* bytes returned by the last getdents64 */
+   long pos;      /* offset of the next entry in buf */
+};
+struct glob_component {
+   char *text;           /* the component, still backslash-escaped if magic */
+   int magic;            /* needs a directory scan */
+   int recursive;        /* the component is ** */
+   struct pattern pat;   /* compiled once per expansion */
+};
+
+
+/*  Compiled programs. The parser turns source text into flat tables and bytecode, so loops
+*   never look at the text again. Entries refer to each other by index, never by pointer. */
+enum {
+   OP_END,          /* return from the block */
+   OP_SIMPLE,       /* run command a */
+   OP_PIPELINE,     /* run blocks a .. a+b-1 as the stages of a pipeline */
+   OP_SUBSHELL,     /* run block a in a child and wait */
+   OP_BACKGROUND,   /* run block a in a child and don't wait */
+   OP_JUMP,         /* continue at a */
+   OP_JUMP_FALSE,   /* continue at a if $? is non-zero */
+   OP_JUMP_TRUE,    /* continue at a if $? is zero */
+   OP_NOT,          /* negate $? */
+   OP_STATUS,       /* set $? to a */
+   OP_LOOP_INIT,    /* push a while/until frame */
+   OP_LOOP_NEXT,    /* keep the body's status, continue at a */
+   OP_LOOP_END,     /* pop the loop frame, $? is the body's last status */
+   OP_FOR_INIT,     /* push a for frame: variable name a, words b .. b+c-1 (c < 0: positional parameters) */
+   OP_FOR_NEXT,     /* assign the next word, or continue at a when there are none left */
+   OP_FOR_END,      /* pop the for frame */
+   OP_CASE_BEGIN,   /* push a case frame for the subject word a; b > 0: the patterns are fixed, b-1 is the case's pattern set */
+   OP_CASE_MATCH,   /* try patterns a .. a+b-1, continue at c if none match */
+   OP_CASE_END,     /* pop the case frame */
+   OP_REDIR_PUSH,   /* apply redirections a .. a+b-1 to the shell, continue at c if they fail */
+   OP_REDIR_POP,    /* undo them */
+   OP_BREAK,        /* pop frames down to b, leave the loop at a */
+   OP_CONTINUE,     /* pop frames down to b, next iteration at a */
+   OP_FUNCTION,     /* define function a (pool offset of the name) with body block b */
+   OP_ARITH,        /* evaluate arithmetic table entry a: $? is 0 if it is non-zero */
+   OP_COND,         /* evaluate condition a: $? is 0 if true, 1 if false, 2 after an error */
+   OP_COPROC        /* start block b as coprocess a (pool offset of the name) */
+};
+#define INSTR_BACKGROUND 1   /* OP_SIMPLE, OP_PIPELINE: don't wait */
+#define SIMPLE_EXEC 2        /* run_simple: already in a child with nothing left to do, exec directly */
+struct instr {
+   unsigned char op;
+   unsigned char flags;
+   int a, b, c;
+};
+
+/*  A word of the program: its raw text and its parts */
+struct cword {
+   int text;          /* pool offset of the raw word (for a here-document, of the body) */
+   int first_part;    /* index of the first part in the part table */
+   int nparts;
+   int first_element; /* NAME=(...): the element words, consecutive in the word table */
+   int nelements;     /* -1 for any other word */
+};
+
+/*  A simple command: assignments, words and redirections */
+struct ccommand {
+   int first_word;    /* the NAME=value words come first */
+   int nassigns;
+   int nwords;        /* assignments included */
+   int first_redir;
+   int nredirs;
+};
+
+/*  A redirection: [fd]< > >> <& >& &> &>> << <<- <<< */
+enum { R_IN, R_OUT, R_APPEND, R_DUP_IN, R_DUP_OUT, R_OUT_ERR, R_APPEND_ERR, R_HEREDOC, R_HERESTRING };
+struct credir {
+   int type;
+   int fd;            /* descriptor redirected, -1 for the operator's default */
+   int word;          /* target word; for R_HEREDOC the word holding the body */
+};
+
+/*  Arithmetic expressions, parsed into nodes over 64-bit integers */
+enum { A_NUM, A_VAR, A_UNARY, A_BINARY, A_ASSIGN, A_INCDEC, A_COND, A_COMMA };
+enum { AO_NONE, AO_POW, AO_MUL, AO_DIV, AO_MOD, AO_ADD, AO_SUB, AO_SHL, AO_SHR, AO_LT, AO_LE, AO_GT, AO_GE,
+       AO_EQ, AO_NE, AO_BAND, AO_XOR, AO_BOR, AO_AND, AO_OR, AO_NEG, AO_PLUS, AO_NOT, AO_BNOT };
+#define AF_TEXTUAL 1   /* A_VAR written $name: its value is used as text, so it must be a number */
+#define AF_POSTFIX 1   /* A_INCDEC: x++ rather than ++x */
+#define MAX_ARITH_DEPTH 64   /* variables whose values are expressions naming further variables */
+struct anode {
+   unsigned char type;    /* A_* */
+   unsigned char op;      /* AO_*; AO_NONE for a plain =, AO_ADD or AO_SUB for ++ and -- */
+   unsigned char flags;   /* AF_TEXTUAL, AF_POSTFIX */
+   int a, b, c;           /* operand nodes; a variable name is offset a, length b in the text */
+   long long value;       /* A_NUM */
+};
+
+/*  Parsing an arithmetic expression into a growable node table */
+struct arith_parser {
+   const char *base;       /* variable names are recorded as offsets from here */
+   const char *p;          /* next character */
+   struct anode **nodes;
+   int *count, *capacity;
+   int dollars;            /* the text is unexpanded: $name may appear */
+   const char *error;      /* the first error, NULL while there is none */
+   int has_dollar;         /* a $name was seen */
+   int has_assign;         /* an assignment, ++ or -- was seen */
+};
+
+/*  An arithmetic operator as written */
+struct arith_binop {
+   const char *text;
+   int op;            /* AO_* */
+   int prec;          /* binary operators: higher binds tighter */
+};
+
+/*  Evaluating parsed nodes */
+struct arith_eval {
+   const struct anode *nodes;
+   const char *base;       /* what the nodes' names are offsets from */
+   const char *text;       /* the expression, for error messages */
+   int depth;              /* nesting through variables' values */
+   int failed;             /* an error was reported: stop evaluating */
+   int fallback;           /* a $name isn't a number: the text has to be expanded and parsed */
+};
+
+/*  A $((...)) or ((...)) of a program */
+struct carith {
+   int word;          /* the expression as a word, expanded and parsed at run time if root is -1 */
+   int root;          /* its parsed form in the node table, names pointing into the pool, or -1 */
+};
+
+/*  A [[ ... ]] expression, a tree in the condition table */
+enum { C_AND, C_OR, C_NOT, C_STRING, C_UNARY, C_BINARY };
+enum { CO_MATCH, CO_NOMATCH, CO_REGEX, CO_LESS, CO_GREATER, CO_EQ, CO_NE, CO_LT, CO_LE, CO_GT, CO_GE,
+       CO_NT, CO_OT, CO_EF };
+struct ccond {
+   int type;          /* C_* */
+   int op;            /* C_UNARY: the test letter ('f' for -f); C_BINARY: CO_* */
+   int a, b;          /* C_AND, C_OR, C_NOT: operand conditions; otherwise operand words */
+   int regex;         /* CO_REGEX: its slot in the program's regex cache */
+};
+
+/*  An =~ pattern compiled the first time it runs */
+struct regex_slot {
+   char *source;      /* the expanded pattern it was compiled from, NULL until then */
+   regex_t re;
+};
+
+struct program {
+   struct instr *code;
+   int ncode, code_cap;
+   int *blocks;               /* entry points: 0 is the main code, then $(...) bodies, pipeline stages, ... */
+   int nblocks, blocks_cap;
+   struct ccommand *commands;
+   int ncommands, commands_cap;
+   struct cword *words;
+   int nwords, words_cap;
+   struct wpart *parts;
+   int nparts, parts_cap;
+   struct credir *redirs;
+   int nredirs, redirs_cap;
+   struct carith *arith;      /* $((...)) and ((...)) */
+   int narith, arith_cap;
+   struct anode *exprs;       /* nodes of the arithmetic expressions parsed at compile time */
+   int nexprs, exprs_cap;
+   struct ccond *conds;       /* [[ ... ]] expressions */
+   int nconds, conds_cap;
+   int nregex;                /* =~ operators, one slot each in regexes */
+   struct regex_slot *regexes;   /* made on first use, never written to the script cache */
+   int ncases;                /* case statements whose patterns are fixed, one set each in case_sets */
+   struct pattern_set *case_sets;   /* likewise made on first use */
+   char *pool;                /* null terminated word text and here-document bodies */
+   int pool_len, pool_cap;
+   int refs;                  /* the code running it plus each function defined in it */
+   char *mapping;             /* loaded from the script cache: the tables point into this mapping */
+   size_t mapping_len;
+};
+
+/*  Script cache file: this header, the script's path, then the program's tables and pool as
+*   they are in memory (they hold indexes, never pointers, so they are valid wherever mapped) */
+#define SCRIPT_CACHE_MAGIC 0x4243534fu   /* "OSCB" */
+#define SCRIPT_CACHE_FORMAT 9
+#define CACHE_SECTIONS 11
+struct cache_header {
+   unsigned magic;
+   unsigned format;
+   unsigned long long build;  /* shell_build_id() of the shell that wrote it */
+   unsigned long long dev, ino;
+   long long size;            /* of the script */
+   long long mtime_sec, mtime_nsec;
+   int path_len;
+   int ncode, nblocks, ncommands, nwords, nparts, nredirs, narith, nexprs, nconds, nregex, ncases, pool_len;
+};
+
+
+/*  Lexer and parser */
+enum { TK_WORD, TK_REDIR, TK_NEWLINE, TK_SEMI, TK_AMP, TK_AND, TK_OR, TK_PIPE, TK_LPAREN, TK_RPAREN, TK_DSEMI, TK_EOF };
+enum { PARSE_OK, PARSE_ERROR, PARSE_INCOMPLETE };
+enum { WORD_PLAIN, WORD_ASSIGNMENT, WORD_ELEMENT, WORD_HEREDOC };   /* how compile_word_token splits a word */
+#define MAX_HEREDOCS 16   /* here-documents started on one line */
+struct token {
+   int type;
+   const char *text;  /* where the token starts in the source */
+   int len;
+   int redir;         /* TK_REDIR: R_* */
+   int fd;            /* TK_REDIR: descriptor number written before it, or -1 */
+   int strip_tabs;    /* TK_REDIR: the <<- form */
+};
+
+/*  Syntax tree, only kept until the code is generated */
+enum { N_SIMPLE, N_PIPELINE, N_AND, N_OR, N_NOT, N_SEQ, N_BACKGROUND, N_SUBSHELL, N_GROUP, N_REDIRECT,
+       N_IF, N_WHILE, N_UNTIL, N_FOR, N_CASE, N_CASE_ARM, N_FUNCTION, N_ARITH, N_COND, N_COPROC };
+struct node {
+   int type;
+   int a, b, c;           /* command, word, redirection or pool indexes, depending on the type */
+   struct node *left;     /* operand, condition, body, first child of a sequence or pipeline */
+   struct node *right;    /* second operand, loop or if body, case arm body */
+   struct node *extra;    /* else part of an if */
+   struct node *next;     /* next child of a sequence, pipeline or case */
+   struct node *all;      /* chain of every node, for freeing */
+};
+
+/*  State shared by the parser of a program and those of the $(...) inside it */
+struct compiler {
+   struct program *prog;
+   struct node *nodes;          /* every node allocated */
+   struct node **block_nodes;   /* syntax tree of each block */
+   int nblocks, blocks_cap;
+   int status;                  /* PARSE_OK, PARSE_ERROR or PARSE_INCOMPLETE */
+};
+struct pending_heredoc {
+   int word;          /* word that receives the body */
+   char *delimiter;
+   int strip_tabs;
+   int quoted;        /* part of the delimiter was quoted: the body isn't expanded */
+};
+#define MAX_ALIAS_DEPTH 16   /* aliases expanding into aliases */
+struct alias_frame {
+   const char *name;      /* the alias being lexed, never expanded again inside itself */
+   const char *resume;    /* where lexing continues once its text is used up */
+};
+struct parser {
+   struct compiler *cc;
+   const char *p;         /* next character to lex */
+   struct token tok;      /* current token */
+   int interactive;       /* running out of text means more lines are needed, not an error */
+   struct pending_heredoc pending[MAX_HEREDOCS];   /* bodies start after the next newline */
+   int npending;
+   struct alias_frame aliases[MAX_ALIAS_DEPTH];   /* alias texts being lexed, innermost last */
+   int nalias;
+   int pattern_word;      /* the word being lexed is a pattern: a leading !( starts an extglob group */
+   int element_word;      /* it is an element of NAME=(...): it may start with a [subscript]= */
+};
+
+/*  Code generation: open loops, for break and continue */
+#define MAX_LOOP_NESTING 64
+struct loop_ctx {
+   int depth;             /* runtime frames, the loop's own included */
+   int *breaks;           /* OP_BREAK instructions to point at the loop's end */
+   int nbreaks, breaks_cap;
+   int *continues;        /* OP_CONTINUE instructions to point at the next iteration */
+   int ncontinues, continues_cap;
+};
+struct codegen {
+   struct compiler *cc;
+   struct loop_ctx loops[MAX_LOOP_NESTING];
+   int nloops;
+   int depth;             /* frames the interpreter will have pushed at this point */
+};
+
+
+/*  Interpreter state */
+#define MAX_REDIRS 16     /* redirections on one command */
+struct saved_fds {
+   int count;
+   int fd[MAX_REDIRS];    /* descriptor that was redirected */
+   int copy[MAX_REDIRS];  /* where its original is parked, -1 if it wasn't open */
+   int procsubs;          /* process substitutions open before the redirections */
+};
+enum { FRAME_LOOP, FRAME_FOR, FRAME_CASE, FRAME_REDIR };
+#define CASE_EACH_ARM -2   /* the patterns of a case are tried arm by arm */
+struct vm_frame {
+   int type;
+   int status;            /* FRAME_LOOP, FRAME_FOR: last status of the body */
+   struct wordlist list;  /* FRAME_FOR: the words */
+   int index;             /* FRAME_FOR: next word; FRAME_CASE: the first pattern word matching, -1 if
+                             none, CASE_EACH_ARM if not known */
+   char *subject;         /* FRAME_CASE: the expanded word; FRAME_FOR: the variable name, in the pool */
+   struct saved_fds saved;   /* FRAME_REDIR */
+};
+char **positional = NULL;       /* $1, $2, ... */
+int positional_count = 0;       /* $# */
+const char *shell_name = "osc"; /* $0 */
+int interactive = 0;            /* reading commands from the prompt */
+int in_forked_child = 0;        /* this process is a subshell that exits when its block ends */
+int vm_nesting = 0;             /* vm_run calls active */
+long long pipe_size = 0;        /* set -o pipesize: capacity of the pipes between commands, 0 for the default */
+long long command_timeout = 0;  /* set -o cmdtimeout: deadline for each external command, pipeline and subshell
+                                   in milliseconds, 0 for none */
+int timed_group = 0;            /* this process runs in a group under a cmdtimeout deadline: it times nothing again */
+long long job_output_size = 0;  /* set -o joboutput: bytes of each background job's output kept for jobs -o, 0 to
+                                   leave it on the terminal */
+long long telemetry_mode = 0;   /* set -o telemetry: a JSON line per command to $OSC_TELEMETRY, 1 with its
+                                   argv as text, 2 as a hash, 0 off */
+#define KILL_GRACE_MS 5000      /* after a deadline, how long SIGTERM gets before SIGKILL */
+#define DEADLINE_POLL_MS 50     /* without a pidfd, how often a timed child is checked for */
+
+
+/*  Open process substitutions: the shell's end of each pipe, which commands see as /dev/fd/N,
+*   and the child at the other end. Closed when the command they were expanded for finishes */
+struct procsub {
+   int fd;
+   pid_t pid;
+   int output;            /* >(...): the shell holds the write end */
+};
+struct procsub *procsubs = NULL;
+int nprocsubs = 0;
+int procsubs_cap = 0;
+
+
+/*  The event loop: one epoll set holding the terminal, a pidfd per background job and the
+*   $TMOUT timer, so jobs are reaped (a batch per wakeup) while the prompt waits for a key */
+enum { EV_TTY, EV_TIMER, EV_JOB };
+#define EVENT_BATCH 64      /* events handled per epoll_wait */
+#define JOBS_KEPT 32        /* finished jobs whose captured output is kept for jobs -o */
+#define JOB_FOLLOW_MS 100   /* jobs -f: how often the ring is looked at for more output */
+
+/*  With set -o joboutput a job's stdout and stderr go down a pipe to a reader process of its
+*   own, which keeps the last size bytes in a shared ring, so the job never waits for the shell.
+*   The ring is this header, then the data from JOB_RING_HEADER on; the shell maps it read-only */
+#define JOB_RING_HEADER 64
+struct job_ring {
+   unsigned long long written;   /* bytes that have gone in, the oldest overwritten; stored after the data */
+   int done;                     /* the job has closed its output */
+};
+struct job {
+   pid_t pid;
+   int pidfd;             /* -1 once reaped, or if pidfd_open isn't available (then checked on each wakeup) */
+   int status;            /* exit status once it has finished */
+   int done;              /* reaped */
+   int reported;          /* its end has been reported; still listed only for its output */
+   int number;            /* %n of jobs */
+   const struct job_ring *ring;   /* its output, NULL if not captured */
+   long long size;        /* of the ring's data */
+};
+struct job *jobs = NULL;
+int njobs = 0;
+int jobs_cap = 0;
+int event_fd = -1;          /* the epoll set, made when first needed */
+pid_t event_owner = 0;      /* process that made it: a forked child shares it and needs its own */
+int timer_fd = -1;          /* timerfd for $TMOUT */
+int tty_watched = 0;        /* 1 once the terminal is in the set, -1 if it can't be (a regular file) */
+
+
+/*  Coprocesses: the shell's ends of each one's pipes, closed by unset NAME[1] (its input, so a
+*   helper that answers at end of input can be used), unset NAME[0] or unset NAME (both) */
+#define MAX_COPROCS 16
+struct coproc {
+   char *name;   /* NULL for a free slot */
+   int fds[2];   /* NAME[0] and NAME[1], -1 once closed */
+};
+struct coproc coprocs[MAX_COPROCS];
+
+
+/*  Telemetry: each record is a datagram to a writer process that appends it to the file, so a
+*   slow disk never holds up a command; one that doesn't fit in the socket is counted as dropped */
+struct telemetry_stage {
+   char *text;              /* the command's argv as a JSON array, NULL if it isn't a simple one */
+   int builtin;             /* ran inside the shell */
+   struct timespec start;   /* when the shell began starting it */
+   long long spawn_us;      /* until fork returned */
+   long long wall_us;
+   struct rusage usage;
+   int status;
+};
+int telemetry_fd = -1;            /* the shell's end of the socket to the writer */
+int telemetry_report_fd = -1;     /* in a pipeline stage's child: where its command's expanded argv goes */
+int telemetry_report_stage = 0;   /* and which stage it is */
+long long telemetry_dropped = 0;  /* records lost to a full socket, reported in the next one */
+struct rusage child_usage;        /* what the child wait_for_status last collected used */
+#define TELEMETRY_ARGV_MAX 65536  /* longer argv is recorded by hash and size, so the record fits */
+
+
+/*  Options of set -o name=value */
+struct shell_option {
+   const char *name;
+   long long *value;
+   int (*set)(const char *text);   /* parses, checks and stores a new value; -1 if it is bad */
+};
+
+
+/*  Command substitution runs builtins in-process as a "virtual subshell": output goes to
+*   capture_output and any variable or directory change is rolled back afterwards */
+struct var_undo {
+   char *name;
+   char *value;   /* NULL if the variable didn't exist */
+   int flags;
+   struct array *array;   /* copy of its elements if it was an array */
+};
+struct strbuf *capture_output = NULL;  /* where builtin output goes instead of stdout */
+struct var_undo *undo_log = NULL;      /* variable states to restore, oldest first */
+int undo_count = 0;
+int undo_capacity = 0;
+int undo_recording = 0;     /* variable changes are logged while this is non-zero */
+int undo_suspended = 0;     /* set while the log itself is being replayed */
+int subshell_depth = 0;     /* nesting of in-process subshells */
+int subshell_cwd_fd = -1;   /* directory to return to, saved by the first cd in a subshell */
+int subshell_exited = 0;    /* exit was called inside an in-process subshell */
+#define VIRTUAL_CALL_DEPTH 8   /* how deep $(f) follows f's calls before settling for a fork */
+int capture_memfd = -1;        /* kept for the next $(f) once one is done with it */
+pid_t capture_owner = 0;       /* process that kept it: a forked child shares it and needs its own */
+struct virtual_subshell {
+   struct strbuf *capture;  /* the enclosing capture_output */
+   int cwd_fd;              /* the enclosing subshell_cwd_fd */
+   int mark;                /* undo log position to roll back to */
+};
+
+
+/*  Builtin commands: name and implementation, which returns the exit status */
+struct builtin {
+   const char *name;
+   int (*run)(char *args[]);
+};
+
+
+/*  Command names live in an open-addressing hash table like the variables. An entry holds
+*   everything the name currently stands for, so resolving a command word is one lookup:
+*   alias (at parse time), then function, builtin and finally the cached PATH search */
+struct command_entry {
+   char *name;                 /* NULL for a never used slot, TOMBSTONE for a deleted one */
+   char *alias;                /* replacement text, or NULL */
+   struct program *function;   /* program holding the function body, or NULL */
+   int function_block;
+   struct builtin *builtin;
+   char *path;                 /* where the PATH search found the program, or NULL */
+   unsigned path_generation;   /* path is stale once PATH has changed since */
+};
+struct command_entry *command_table = NULL;
+size_t command_capacity = 0;    /* always a power of two */
+size_t command_used = 0;        /* live entries plus tombstones */
+unsigned path_generation = 0;   /* bumped whenever PATH is set or unset */
+int builtins_registered = 0;    /* the builtin table is entered on the first lookup */
+int function_depth = 0;         /* function calls in progress */
+int function_returning = 0;     /* return was run: leave the function body */
+
+
+/*  How copy_fd moves data, chosen from the file types at either end */
+enum { COPY_RANGE, COPY_SPLICE, COPY_SENDFILE, COPY_READ_WRITE };
+#define COPY_CHUNK (1 << 30)            /* bytes asked of the kernel per copy call */
+#define COPY_BUFFER_SIZE (128 * 1024)   /* read/write fallback buffer */
+
+
+/*  Read-ahead for the read builtin on seekable input, valid while the file is unchanged. A file
+*   changed within TIMESTAMP_SLACK of being read could change again without its times moving
+*   (filesystems with coarse timestamps), so what was read from it isn't kept */
+#define READ_AHEAD_SIZE (64 * 1024)
+#define READ_AHEAD_FIRST 512        /* first read after the cache starts over, doubled each time */
+#define TIMESTAMP_SLACK 2000000000LL  /* nanoseconds: the coarsest timestamps (FAT) */
+struct read_cache {
+   dev_t dev;
+   ino_t ino;
+   off_t size;
+   struct timespec mtime;
+   struct timespec ctime;
+   struct timespec filled;   /* when buf was last read, CLOCK_REALTIME */
+   off_t offset;      /* file offset of buf[0] */
+   char *buf;
+   size_t len;        /* bytes held */
+   size_t pos;        /* bytes consumed */
+   size_t chunk;      /* bytes asked for by the next read */
+};
+struct read_cache read_ahead;
+
+/*  Where the read builtin takes its bytes from */
+struct byte_source {
+   int fd;
+   int seekable;      /* served from read_ahead */
+   int tty;           /* saved_mode to restore */
+   struct termios saved_mode;
+};
+
+
+/*  Parser state for the test / [ builtin */
+struct test_state {
+   char **argv;
+   int pos;     /* next word to look at */
+   int end;     /* one past the last word */
+   int error;   /* a usage error was reported */
+};
+
+
+/*  Signal names understood by kill */
+struct signal_name {
+   const char *name;
+   int number;
+};
+struct signal_name signal_names[] = {
+   { "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "ILL", SIGILL }, { "TRAP", SIGTRAP },
+   { "ABRT", SIGABRT }, { "BUS", SIGBUS }, { "FPE", SIGFPE }, { "KILL", SIGKILL }, { "USR1", SIGUSR1 },
+   { "SEGV", SIGSEGV }, { "USR2", SIGUSR2 }, { "PIPE", SIGPIPE }, { "ALRM", SIGALRM }, { "TERM", SIGTERM },
+   { "CHLD", SIGCHLD }, { "CONT", SIGCONT }, { "STOP", SIGSTOP }, { "TSTP", SIGTSTP }, { "TTIN", SIGTTIN },
+   { "TTOU", SIGTTOU }, { "URG", SIGURG }, { "XCPU", SIGXCPU }, { "XFSZ", SIGXFSZ }, { "VTALRM", SIGVTALRM },
+   { "PROF", SIGPROF }, { "WINCH", SIGWINCH }, { "IO", SIGIO }, { "PWR", SIGPWR }, { "SYS", SIGSYS },
+   { NULL, 0 }
+};
+
+
 /*  Global variable to hold original terminal settings */
 struct termios canonicalSettings;
+int terminal_configured = 0;   /* set up on the first prompt, never for scripts or -c */
+
+
+/*  Startup: --startup-profile reports the time taken by each phase */
+int startup_profile = 0;
+struct timespec startup_time;  /* when main started */
+
+
+/*  Forward declarations for mutually recursive functions */
+void command_substitution(const char *text, size_t len, int backquoted, struct strbuf *out);
+int test_or(struct test_state *t);
+void capture_block(struct program *prog, int block, struct strbuf *out);
+int process_substitution(struct program *prog, int block, const char *text, int len, int output);
+int arith_expand(struct program *prog, int entry, const char *raw, int len, long long *result);
+const char *param_expand(const char *text, int len, char *tmp, size_t tmp_size, struct strbuf *out);
+int list_operator(const char *name, int n, const char *sub, int sublen, struct wordlist *list, const char *op,
+                 int oplen);
+const char *param_bad(const char *text, int len);
+const char *skip_construct(const char *p);
+char *expand_operand(const char *text, int len, int pattern);
+int arith_comma(struct arith_parser *ap);
+void event_wait_input();
+int run_builtin_captured(char *args[], struct strbuf *out);
+int builtin_jobs(char *args[]);
+void coproc_close(const char *name, int k);
+long long arith_evaluate(const char *text, int depth, int *failed);
+int add_arith(struct parser *ps, const char *text, int len);
+int compile_word_token(struct parser *ps, const char *text, int len, int assignment, struct cword *out);
+struct node *parse_list(struct parser *ps);
+struct node *parse_command(struct parser *ps);
+int cond_or(struct parser *ps);
+int pattern_compile(const char *text, size_t len, struct pattern *pat);
+int pattern_match(const struct pattern *pat, const char *s, size_t len);
+int vm_run(struct program *prog, int block);
 
 
 /*
@@ -29,21 +737,47 @@ struct termios canonicalSettings;
 * Restores the terminal to its original settings when the program exits.
 */
 void restore_canonical_mode() {
+   if (!terminal_configured || getpid() != shell_pid)
+       return;  /* a forked subshell exiting must not touch the terminal */
    tcsetattr(STDIN_FILENO, TCSAFLUSH, &canonicalSettings);
 }
 
 
+/*
+* Function: profile_phase
+* -----------------------
+* With --startup-profile, reports on stderr how long a startup phase took since *since, then
+* moves *since to now.
+*/
+void profile_phase(const char *phase, struct timespec *since) {
+   if (!startup_profile)
+       return;
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   double ms = (now.tv_sec - since->tv_sec) * 1e3 + (now.tv_nsec - since->tv_nsec) / 1e6;
+   fprintf(stderr, "osc: startup: %-12s %8.3f ms\n", phase, ms);
+   *since = now;
+}
+
+
 /*
 * Function: enable_noncanonical_mode
 * ----------------------------------
 * Configures the terminal to disable echo and canonical mode for real-time input processing.
+* Done once, right before the first prompt, and only when input is a terminal.
 */
 void enable_noncanonical_mode() {
+   if (terminal_configured || !isatty(STDIN_FILENO))
+       return;
+   terminal_configured = 1;
+   struct timespec start;
+   clock_gettime(CLOCK_MONOTONIC, &start);
    tcgetattr(STDIN_FILENO, &canonicalSettings); /*  Save the current terminal settings to restore later */
    atexit(restore_canonical_mode);              /*  Ensure terminal is restored on exit */
    struct termios noncanonical = canonicalSettings; /*  New termios struct based on the current settings */
    noncanonical.c_lflag &= ~(ECHO | ICANON);    /*  Disable echo and canonical mode */
    tcsetattr(STDIN_FILENO, TCSAFLUSH, &noncanonical); /*  Apply the new settings */
+   profile_phase("terminal", &start);
 }
 
 
@@ -136,9 +870,13 @@ int get_input(char *buf) {
 
    /* Infinite loop to read characters one by one */
    while (1) {
+       event_wait_input();   /* background jobs are reaped while waiting */
        ssize_t n = read(STDIN_FILENO, &c, 1);  /* Read another character from standard input */
-       if (n <= 0) /* End of file or error */
+       if (n <= 0) { /* End of file or error */
+           if (count == 0)
+               return -1;  /* Nothing was typed before the end of input */
            break;
+       }
 
 
        /* If Enter key is pressed, finish input */
@@ -275,291 +1013,10622 @@ void add_to_buffer(const char *cmd) {
 
 
 /*
-* Function: divide_args
-* ---------------------
-* Splits the input string into an array of arguments and detects background execution (&).
+* Function: hash_name
+* -------------------
+* FNV-1a hash of a name of the given length, used to index the variable table.
 */
-int divide_args(char *input, char *args[], int *background) {
-   int i = 0;
-   char *segment = strtok(input, " "); /* split input by space */
+unsigned long hash_name(const char *name, size_t len) {
+   unsigned long hash = 2166136261u;
+   for (size_t i = 0; i < len; i++) {
+       hash ^= (unsigned char)name[i];
+       hash *= 16777619u;
+   }
+   return hash;
+}
 
 
-   while (segment != NULL && i < MAX_ARGS - 1) {
-       if (strcmp(segment, "&") == 0) {
-           *background = 1;  /*  Mark for background execution if an ampersand is found */
-       } else {
-           args[i++] = segment;    /* store argument */
-       }
-       segment = strtok(NULL, " ");    /* get next */
+/*
+* Function: var_lookup
+* --------------------
+* Finds a variable by name (not necessarily null terminated) using linear probing; NULL if unset.
+*/
+struct var *var_lookup(const char *name, size_t len) {
+   if (var_capacity == 0)
+       return NULL;
+   size_t i = hash_name(name, len) & (var_capacity - 1);
+   /* probe until an empty slot; tombstones keep the chain going */
+   while (var_table[i].name != NULL) {
+       if (var_table[i].name != TOMBSTONE && strncmp(var_table[i].name, name, len) == 0 && var_table[i].name[len] == '\0')
+           return &var_table[i];
+       i = (i + 1) & (var_capacity - 1);
    }
-   /* null terminate argument array and return the count */
-   args[i] = NULL;
-   return i;
+   return NULL;
 }
 
 
 /*
-* Function: handle_cd_and_exit
-* ----------------------------
-* Implements the cd command to change directories and the exit command to terminate the shell.
+* Function: var_get
+* -----------------
+* Returns the value of a shell variable, or NULL if it isn't set.
+*/
+const char *var_get(const char *name) {
+   struct var *v = var_lookup(name, strlen(name));
+   return v ? v->value : NULL;
+}
+
+
+/*
+* Function: var_grow
+* ------------------
+* Doubles the variable table and reinserts the live entries, dropping tombstones.
 */
-int handle_cd_and_exit(char *args[]) {
-   /* check for exit command */
-   if (strcmp(args[0], "exit") == 0) {
-       exit(0);
+void var_grow() {
+   size_t old_capacity = var_capacity;
+   struct var *old_table = var_table;
+   var_capacity = old_capacity ? old_capacity * 2 : 64;
+   var_table = calloc(var_capacity, sizeof(struct var));
+   if (var_table == NULL) {
+       perror("calloc failed");
+       exit(EXIT_FAILURE);
    }
-   /* check for cd command */
-   if (strcmp(args[0], "cd") == 0) {
-       /* case no directory provided */
-       if (args[1] == NULL) {
-           fprintf(stderr, "cd: expected argument\n");
-       } else {
-           /* change directory */
-           if (chdir(args[1]) != 0) {
-               perror("chdir failed");
-           }
-       }
-       return 1; /* worked */
+   var_used = 0;
+   for (size_t j = 0; j < old_capacity; j++) {
+       if (old_table[j].name == NULL || old_table[j].name == TOMBSTONE)
+           continue;
+       size_t i = hash_name(old_table[j].name, strlen(old_table[j].name)) & (var_capacity - 1);
+       while (var_table[i].name != NULL)
+           i = (i + 1) & (var_capacity - 1);
+       var_table[i] = old_table[j];
+       var_used++;
    }
-   return 0; /* didn't work */
+   free(old_table);
 }
 
 
 /*
-* Function: handle_pipe
-* ---------------------
-* Detects and executes commands with a pipe (|).
+* Function: var_update_env_entry
+* ------------------------------
+* Rebuilds the "NAME=value" string of an exported variable and marks the cached envp stale.
 */
-int handle_pipe(char *args[], int argc) {
-   int pipe_index = -1;
-   /* scan for | and store index if found */
-   for (int j = 0; j < argc; j++) {
-       if (strcmp(args[j], "|") == 0) {
-           pipe_index = j;
-           break;
+void var_update_env_entry(struct var *v) {
+   free(v->env_entry);
+   v->env_entry = NULL;
+   if (v->flags & VAR_EXPORT) {
+       size_t name_len = strlen(v->name), value_len = strlen(v->value);
+       v->env_entry = malloc(name_len + value_len + 2);
+       if (v->env_entry == NULL) {
+           perror("malloc failed");
+           exit(EXIT_FAILURE);
        }
+       memcpy(v->env_entry, v->name, name_len);
+       v->env_entry[name_len] = '=';
+       memcpy(v->env_entry + name_len + 1, v->value, value_len + 1);
    }
-   /* if pipe found */
-   if (pipe_index != -1) {
-       args[pipe_index] = NULL;  /*  Terminate left command's argument list */
+   env_dirty = 1;
+}
 
 
-       int pipe_ends[2];   /* read and write */
-       if (pipe(pipe_ends) < 0) {
-           perror("pipe failed");
-           return 1;
+/*
+* Function: array_free
+* --------------------
+* Frees the elements of an array variable.
+*/
+void array_free(struct array *a) {
+   if (a == NULL)
+       return;
+   for (size_t i = 0; i < a->count; i++)
+       free(a->items[i]);
+   for (size_t i = 0; i < a->entries_capacity; i++) {
+       if (a->entries[i].key != NULL && a->entries[i].key != TOMBSTONE) {
+           free(a->entries[i].key);
+           free(a->entries[i].value);
        }
+   }
+   free(a->items);
+   free(a->entries);
+   free(a);
+}
 
 
-       /*  Fork first child for left-hand command  */
-       pid_t pid1 = fork();
-       if (pid1 < 0) {
-           perror("fork failed");
-           return 1;
-       } else if (pid1 == 0) {
-           /* child process for left hand */
-           close(pipe_ends[0]);  /*  Close unused read end */
-           if (dup2(pipe_ends[1], STDOUT_FILENO) < 0) {
-               perror("dup2 failed");
-               exit(EXIT_FAILURE);
-           }
-           close(pipe_ends[1]); /* close write end and execute left command */
-           if (execvp(args[0], args) == -1) {
-               perror("execvp (left command) failed");
-           }
-           exit(EXIT_FAILURE);
+/*
+* Function: assoc_find
+* --------------------
+* Finds a key in an associative array by linear probing. With insert set a missing key is
+* added (with no value yet); otherwise NULL is returned for it.
+*/
+struct array_entry *assoc_find(struct array *a, const char *key, int insert) {
+   if (insert && (a->entries_used + 1) * 4 >= a->entries_capacity * 3) {
+       /* keep at least a quarter of the slots empty, dropping tombstones as the table grows */
+       size_t old_capacity = a->entries_capacity;
+       struct array_entry *old = a->entries;
+       size_t capacity = old_capacity ? old_capacity * 2 : 16;
+       struct array_entry *grown = calloc(capacity, sizeof(struct array_entry));
+       if (grown == NULL) {
+           perror("calloc failed");
+           return NULL;
        }
-
-
-       /*  Fork second child for right-hand command */
-       pid_t pid2 = fork();
-       if (pid2 < 0) {
-           perror("fork failed");
-           return 1;
-       } else if (pid2 == 0) {
-           /* child process for right hand */
-           close(pipe_ends[1]);  /*  Close unused write end */
-           if (dup2(pipe_ends[0], STDIN_FILENO) < 0) {
-               perror("dup2 failed");
-               exit(EXIT_FAILURE);
-           }
-           close(pipe_ends[0]);    /* close read end and execute right command */
-           if (execvp(args[pipe_index + 1], &args[pipe_index + 1]) == -1) {
-               perror("execvp (right command) failed");
-           }
-           exit(EXIT_FAILURE);
+       a->entries = grown;
+       a->entries_capacity = capacity;
+       a->entries_used = 0;
+       for (size_t j = 0; j < old_capacity; j++) {
+           if (old[j].key == NULL || old[j].key == TOMBSTONE)
+               continue;
+           size_t i = hash_name(old[j].key, strlen(old[j].key)) & (capacity - 1);
+           while (a->entries[i].key != NULL)
+               i = (i + 1) & (capacity - 1);
+           a->entries[i] = old[j];
+           a->entries_used++;
        }
+       free(old);
+   }
+   if (a->entries_capacity == 0)
+       return NULL;
 
 
-       /*  Parent process: close both ends of the pipe and wait for both children */
-       close(pipe_ends[0]);
-       close(pipe_ends[1]);
-       waitpid(pid1, NULL, 0);
-       waitpid(pid2, NULL, 0);
-
-
-       return 1; /* worked */
+   size_t mask = a->entries_capacity - 1;
+   size_t i = hash_name(key, strlen(key)) & mask;
+   struct array_entry *slot = NULL;
+   while (a->entries[i].key != NULL) {
+       if (a->entries[i].key == TOMBSTONE) {
+           if (slot == NULL)
+               slot = &a->entries[i];   /* reuse the first deleted slot on the chain */
+       } else if (strcmp(a->entries[i].key, key) == 0) {
+           return &a->entries[i];
+       }
+       i = (i + 1) & mask;
    }
-   return 0;   /* didnt work */
+   if (!insert)
+       return NULL;
+   if (slot == NULL) {
+       slot = &a->entries[i];
+       a->entries_used++;
+   }
+   slot->key = strdup(key);
+   slot->value = NULL;
+   return slot;
 }
 
 
 /*
-* Function: handle_input_or_output
-* --------------------------------
-* Identifies and processes input (<) and output (>) redirection in the command.
+* Function: array_store
+* ---------------------
+* Sets element index of an indexed array, or unsets it for a NULL value.
 */
-void handle_input_or_output(char *args[], int argc, char **input_file, char **output_file) {
-   for (int j = 0; j < argc; j++) {
-       /* output redirection check */
-       if (strcmp(args[j], ">") == 0) {
-           *output_file = args[j + 1]; /* store filename */
-           args[j] = NULL; /* cut off command at operator */
-           break;
-       } else if (strcmp(args[j], "<") == 0) {
-           *input_file = args[j + 1];  /* store filename */
-           args[j] = NULL; /* cut off command at operator */
-           break;
+void array_store(struct array *a, size_t index, const char *value) {
+   if (index >= a->capacity) {
+       if (value == NULL)
+           return;
+       size_t capacity = a->capacity ? a->capacity : 8;
+       while (capacity <= index)
+           capacity *= 2;
+       char **grown = realloc(a->items, capacity * sizeof(char *));
+       if (grown == NULL) {
+           perror("realloc failed");
+           return;
        }
+       memset(grown + a->capacity, 0, (capacity - a->capacity) * sizeof(char *));
+       a->items = grown;
+       a->capacity = capacity;
    }
+   free(a->items[index]);
+   a->items[index] = value ? strdup(value) : NULL;
+   if (value != NULL && index >= a->count)
+       a->count = index + 1;
+   while (a->count > 0 && a->items[a->count - 1] == NULL)
+       a->count--;
 }
 
 
 /*
-* Function: run_instruction
-* -------------------------
-* Executes the command in a child process, handling background execution and I/O redirection.
+* Function: assoc_store
+* ---------------------
+* Sets a key of an associative array, or deletes it for a NULL value.
 */
-void run_instruction(char *args[], int background, char *input_file, char *output_file) {
-   pid_t pid = fork();
-   if (pid < 0) {
-       perror("fork failed");
+void assoc_store(struct array *a, const char *key, const char *value) {
+   struct array_entry *e = assoc_find(a, key, value != NULL);
+   if (e == NULL)
        return;
+   free(e->value);
+   if (value != NULL) {
+       e->value = strdup(value);
+   } else {
+       free(e->key);
+       e->key = TOMBSTONE;
+       e->value = NULL;
    }
-   else if (pid == 0) {  /* Child process */
+}
 
 
-       if (output_file != NULL) {
-           /* open file for writing, create one if it doesnt exist */
-           int redirect_fd  = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-           if (redirect_fd  < 0) { /* error check */
-               fprintf(stderr, "Error: Unable to open output file '%s'\n", output_file);
-               exit(EXIT_FAILURE);
-           }
-           if (dup2(redirect_fd , STDOUT_FILENO) < 0) {    /* redirect stdout to the file */
-               fprintf(stderr, "Error: Unable to redirect standard output to '%s'\n", output_file);
-               exit(EXIT_FAILURE);
-           }
-           /* close file descriptor */
-           close(redirect_fd );
-       /* input redirection */
-       } else if (input_file != NULL) {
-           /* open file for reading ONLY */
-           int redirect_fd  = open(input_file, O_RDONLY);
-           if (redirect_fd  < 0) { /* error check */
-               fprintf(stderr, "Error: Unable to open input file '%s'\n", input_file);
-               exit(EXIT_FAILURE);
-           }
-           if (dup2(redirect_fd , STDIN_FILENO) < 0) {/* redorect stdin to the file */
-               fprintf(stderr, "Error: Unable to redirect standard input from '%s'\n", input_file);
-               exit(EXIT_FAILURE);
-           }
-           /* close file descriptor */
-           close(redirect_fd );
-       }
+/*
+* Function: array_copy
+* --------------------
+* Duplicates the elements of an array variable, to be put back by var_rollback.
+*/
+struct array *array_copy(const struct array *a) {
+   struct array *copy = calloc(1, sizeof(struct array));
+   if (copy == NULL)
+       return NULL;
+   for (size_t i = 0; i < a->count; i++)
+       if (a->items[i] != NULL)
+           array_store(copy, i, a->items[i]);
+   for (size_t i = 0; i < a->entries_capacity; i++)
+       if (a->entries[i].key != NULL && a->entries[i].key != TOMBSTONE)
+           assoc_store(copy, a->entries[i].key, a->entries[i].value);
+   return copy;
+}
 
 
-       /* Execute the actual command */
-       if (execvp(args[0], args) == -1) {
-           perror("execvp failed");
+/*
+* Function: var_record_undo
+* -------------------------
+* Remembers the current state of a variable before an in-process subshell or a temporary
+* assignment changes it.
+*/
+void var_record_undo(const char *name, struct var *v) {
+   if (undo_count == undo_capacity) {
+       int capacity = undo_capacity ? undo_capacity * 2 : 16;
+       struct var_undo *grown = realloc(undo_log, capacity * sizeof(struct var_undo));
+       if (grown == NULL) {
+           perror("realloc failed");
+           return;
        }
-       _exit(EXIT_FAILURE);
+       undo_log = grown;
+       undo_capacity = capacity;
    }
-   else { /* Parent process */
-       if (!background) {
-           waitpid(pid, NULL, 0);
-       } else {
-           printf("Process running in background (PID: %d)\n", pid);
-           fflush(stdout);
+   struct var_undo *entry = &undo_log[undo_count++];
+   entry->name = strdup(name);
+   entry->value = v ? strdup(v->value) : NULL;
+   entry->flags = v ? v->flags : 0;
+   entry->array = (v && v->array) ? array_copy(v->array) : NULL;
+}
+
+
+/*
+* Function: var_set
+* -----------------
+* Sets (creating if needed) a shell variable. Flags such as VAR_EXPORT are added, never cleared.
+* A NULL value keeps the current value, which is how export marks an existing variable.
+*/
+void var_set(const char *name, const char *value, int flags) {
+   size_t len = strlen(name);
+   struct var *v = var_lookup(name, len);
+   if (undo_recording > 0 && !undo_suspended)
+       var_record_undo(name, v);
+   if (name[0] == 'P' && strcmp(name, "PATH") == 0)
+       path_generation++;   /* cached command paths no longer apply */
+   if (v == NULL) {
+       /* keep at least a quarter of the slots empty so probes stay short */
+       if ((var_used + 1) * 4 >= var_capacity * 3)
+           var_grow();
+       size_t i = hash_name(name, len) & (var_capacity - 1);
+       struct var *slot = NULL;
+       while (var_table[i].name != NULL) {
+           if (var_table[i].name == TOMBSTONE && slot == NULL)
+               slot = &var_table[i];  /* reuse the first deleted slot on the chain */
+           i = (i + 1) & (var_capacity - 1);
        }
+       if (slot == NULL) {
+           slot = &var_table[i];
+           var_used++;
+       }
+       slot->name = strdup(name);
+       slot->value = strdup("");
+       slot->env_entry = NULL;
+       slot->flags = 0;
+       slot->array = NULL;
+       v = slot;
+   }
+   int was_exported = v->flags & VAR_EXPORT;
+   v->flags |= flags;
+   if (value != NULL) {
+       char *copy = strdup(value);
+       free(v->value);
+       v->value = copy;
+       if (v->flags & VAR_ARRAY)
+           array_store(v->array, 0, value);   /* $name is element 0 */
    }
+   /* only exported variables affect the environment handed to children */
+   if ((v->flags & VAR_EXPORT) && (value != NULL || !was_exported))
+       var_update_env_entry(v);
 }
 
 
 /*
-* Main function:
-* --------------
-* The main loop of the shell, handling prompt printing, user input, argument division, etc.
+* Function: var_unset
+* -------------------
+* Removes a shell variable, leaving a tombstone so other probe chains stay intact.
 */
-int main(void) {
-   enable_noncanonical_mode();
+void var_unset(const char *name) {
+   struct var *v = var_lookup(name, strlen(name));
+   if (v == NULL)
+       return;
+   if (undo_recording > 0 && !undo_suspended)
+       var_record_undo(name, v);
+   if (strcmp(name, "PATH") == 0)
+       path_generation++;
+   if (v->flags & VAR_EXPORT)
+       env_dirty = 1;
+   free(v->name);
+   free(v->value);
+   free(v->env_entry);
+   array_free(v->array);
+   v->name = TOMBSTONE;
+   v->value = NULL;
+   v->env_entry = NULL;
+   v->flags = 0;
+   v->array = NULL;
+}
 
 
-   char input[MAX_LENGTH];  /* stores user input */
-   char *args[MAX_ARGS];    /* stores arguments */
-   int background = 0;      /* background flag */
-   int argc = 0;            /* number of arguments */
+/*
+* Function: var_rollback
+* ----------------------
+* Undoes variable changes recorded since mark, newest first, restoring values and flags exactly.
+*/
+void var_rollback(int mark) {
+   undo_suspended = 1;
+   while (undo_count > mark) {
+       struct var_undo *entry = &undo_log[--undo_count];
+       if (entry->value == NULL) {
+           var_unset(entry->name);
+       } else {
+           var_set(entry->name, entry->value, entry->flags);
+           struct var *v = var_lookup(entry->name, strlen(entry->name));
+           if (v != NULL && v->flags != entry->flags) {
+               v->flags = entry->flags;  /* var_set only adds flags */
+               var_update_env_entry(v);
+           }
+           if (v != NULL) {
+               array_free(v->array);
+               v->array = entry->array;
+               entry->array = NULL;
+           }
+       }
+       array_free(entry->array);
+       free(entry->name);
+       free(entry->value);
+   }
+   undo_suspended = 0;
+}
 
 
-   while (1) {
-       /* Print the prompt once per loop, right before reading input. */
-       print_prompt();
+/*
+* Function: build_envp
+* --------------------
+* Returns the environment array for exec. The array is cached and only rebuilt after an
+* exported variable changed, so launching commands doesn't cost a walk over the environment.
+*/
+char **build_envp() {
+   if (!env_dirty && env_cache != NULL)
+       return env_cache;
+   size_t count = 0;
+   for (size_t i = 0; i < var_capacity; i++) {
+       if (var_table[i].name != NULL && var_table[i].name != TOMBSTONE && var_table[i].env_entry != NULL)
+           count++;
+   }
+   char **grown = realloc(env_cache, (count + 1) * sizeof(char *));
+   if (grown == NULL) {
+       perror("realloc failed");
+       return env_cache ? env_cache : environ;
+   }
+   env_cache = grown;
+   count = 0;
+   for (size_t i = 0; i < var_capacity; i++) {
+       if (var_table[i].name != NULL && var_table[i].name != TOMBSTONE && var_table[i].env_entry != NULL)
+           env_cache[count++] = var_table[i].env_entry;
+   }
+   env_cache[count] = NULL;
+   env_dirty = 0;
+   return env_cache;
+}
 
 
-       /*  Get user input using non-canonical mode (with arrow key handling) */
-       if (get_input(input) < 0)
-           break;
+/*
+* Function: import_environment
+* ----------------------------
+* Loads the environment the shell was started with into the variable table as exported variables.
+*/
+void import_environment() {
+   for (char **entry = environ; *entry != NULL; entry++) {
+       char *equals = strchr(*entry, '=');
+       if (equals == NULL)
+           continue;
+       char *name = strndup(*entry, equals - *entry);
+       if (name == NULL)
+           continue;
+       var_set(name, equals + 1, VAR_EXPORT);
+       free(name);
+   }
+   shell_pid = getpid();
+}
 
 
-       /*  Ignore empty input */
-       if (strlen(input) == 0)
-           continue;
+/*
+* Function: pattern_set_free
+* --------------------------
+* Releases the memory held by a pattern set.
+*/
+void pattern_set_free(struct pattern_set *set) {
+   free(set->states);
+   free(set->classes);
+   free(set->accepts);
+   free(set->words);
+   free(set->current);
+   free(set->next);
+   memset(set, 0, sizeof(*set));
+}
 
 
-       /* Check for !! */
-       if (strcmp(input, "!!") == 0) {
-           if (command_count == 0) {
-               printf("No commands in history.\n");
-               continue;
-           }
-           int last_index = (next_command - 1 + BUFFER_SIZE) % BUFFER_SIZE;
-           char last_cmd[MAX_LENGTH];
-           strcpy(last_cmd, history[last_index]);
-           printf("%s\n", last_cmd); /* display last command */
-           strcpy(input, last_cmd);  /* Replace input with the last command */
-       } else {
-           /*  Add non-"!!" commands to history */
-           add_to_buffer(input);
+/*
+* Function: program_free
+* ----------------------
+* Releases everything a compiled program holds (or unmaps its cache file) and leaves it empty.
+*/
+void program_free(struct program *prog) {
+   for (int i = 0; prog->regexes != NULL && i < prog->nregex; i++) {
+       if (prog->regexes[i].source != NULL) {
+           regfree(&prog->regexes[i].re);
+           free(prog->regexes[i].source);
        }
+   }
+   free(prog->regexes);
+   for (int i = 0; prog->case_sets != NULL && i < prog->ncases; i++)
+       pattern_set_free(&prog->case_sets[i]);
+   free(prog->case_sets);
+   if (prog->mapping != NULL) {
+       munmap(prog->mapping, prog->mapping_len);
+       memset(prog, 0, sizeof(*prog));
+       return;
+   }
+   free(prog->code);
+   free(prog->blocks);
+   free(prog->commands);
+   free(prog->words);
+   free(prog->parts);
+   free(prog->redirs);
+   free(prog->arith);
+   free(prog->exprs);
+   free(prog->conds);
+   free(prog->pool);
+   memset(prog, 0, sizeof(*prog));
+}
 
 
-       background = 0; /* Reset background flag for each new command */
+/*
+* Function: program_release
+* -------------------------
+* Drops one reference to a heap-allocated program, freeing it with the last one. Functions
+* keep the program they were defined in alive after the code that defined them finished.
+*/
+void program_release(struct program *prog) {
+   if (prog == NULL || --prog->refs > 0)
+       return;
+   program_free(prog);
+   free(prog);
+}
 
 
-       /* Split input into arguments, check for & */
-       argc = divide_args(input, args, &background);
-       if (args[0] == NULL)
-           continue;
+/*
+* Function: command_lookup
+* ------------------------
+* Finds the command table entry for a name (not necessarily null terminated); NULL if none.
+*/
+struct command_entry *command_lookup(const char *name, size_t len) {
+   if (command_capacity == 0)
+       return NULL;
+   size_t i = hash_name(name, len) & (command_capacity - 1);
+   while (command_table[i].name != NULL) {
+       if (command_table[i].name != TOMBSTONE && strncmp(command_table[i].name, name, len) == 0 && command_table[i].name[len] == '\0')
+           return &command_table[i];
+       i = (i + 1) & (command_capacity - 1);
+   }
+   return NULL;
+}
 
 
-       /* Handle cd/exit built-ins */
-       if (handle_cd_and_exit(args))
+/*
+* Function: command_grow
+* ----------------------
+* Doubles the command table and reinserts the live entries, dropping tombstones.
+*/
+void command_grow() {
+   size_t old_capacity = command_capacity;
+   struct command_entry *old_table = command_table;
+   command_capacity = old_capacity ? old_capacity * 2 : 64;
+   command_table = calloc(command_capacity, sizeof(struct command_entry));
+   if (command_table == NULL) {
+       perror("calloc failed");
+       exit(EXIT_FAILURE);
+   }
+   command_used = 0;
+   for (size_t j = 0; j < old_capacity; j++) {
+       if (old_table[j].name == NULL || old_table[j].name == TOMBSTONE)
            continue;
+       size_t i = hash_name(old_table[j].name, strlen(old_table[j].name)) & (command_capacity - 1);
+       while (command_table[i].name != NULL)
+           i = (i + 1) & (command_capacity - 1);
+       command_table[i] = old_table[j];
+       command_used++;
+   }
+   free(old_table);
+}
 
 
-       /* Check for pipe */
-       if (handle_pipe(args, argc))
-           continue;
+/*
+* Function: command_insert
+* ------------------------
+* Returns the entry for a name, creating an empty one if needed. Pointers to entries are only
+* good until the next insertion.
+*/
+struct command_entry *command_insert(const char *name) {
+   size_t len = strlen(name);
+   struct command_entry *e = command_lookup(name, len);
+   if (e != NULL)
+       return e;
+   if ((command_used + 1) * 4 >= command_capacity * 3)
+       command_grow();
+   size_t i = hash_name(name, len) & (command_capacity - 1);
+   struct command_entry *slot = NULL;
+   while (command_table[i].name != NULL) {
+       if (command_table[i].name == TOMBSTONE && slot == NULL)
+           slot = &command_table[i];  /* reuse the first deleted slot on the chain */
+       i = (i + 1) & (command_capacity - 1);
+   }
+   if (slot == NULL) {
+       slot = &command_table[i];
+       command_used++;
+   }
+   memset(slot, 0, sizeof(*slot));
+   slot->name = strdup(name);
+   return slot;
+}
 
 
-       /* Check for < or > redirection */
-       char *input_file = NULL;
-       char *output_file = NULL;
-       handle_input_or_output(args, argc, &input_file, &output_file);
+/*
+* Function: command_drop_if_unused
+* --------------------------------
+* Deletes an entry that no longer stands for anything, leaving a tombstone.
+*/
+void command_drop_if_unused(struct command_entry *e) {
+   if (e->alias != NULL || e->function != NULL || e->builtin != NULL || e->path != NULL)
+       return;
+   free(e->name);
+   e->name = TOMBSTONE;
+}
+
+
+/*
+* Function: function_set
+* ----------------------
+* Defines (or redefines) a function whose body is a block of a compiled program.
+*/
+void function_set(const char *name, struct program *prog, int block) {
+   struct command_entry *e = command_insert(name);
+   struct program *old = e->function;
+   prog->refs++;
+   e->function = prog;
+   e->function_block = block;
+   program_release(old);
+}
+
+
+/*
+* Function: function_unset
+* ------------------------
+* Removes a function; returns -1 if there was none.
+*/
+int function_unset(const char *name) {
+   struct command_entry *e = command_lookup(name, strlen(name));
+   if (e == NULL || e->function == NULL)
+       return -1;
+   program_release(e->function);
+   e->function = NULL;
+   command_drop_if_unused(e);
+   return 0;
+}
+
+
+/*
+* Function: command_path
+* ----------------------
+* Returns the full path PATH gives for a command name, from the cache when PATH hasn't changed
+* since it was found, or NULL if it isn't there (or the name has a slash and needs no search).
+*/
+const char *command_path(const char *name) {
+   if (strchr(name, '/') != NULL)
+       return NULL;
+   struct command_entry *e = command_lookup(name, strlen(name));
+   if (e != NULL && e->path != NULL && e->path_generation == path_generation)
+       return e->path;
+
+
+   const char *dir = var_get("PATH");
+   if (dir == NULL)
+       dir = "/bin:/usr/bin";   /* what execvp falls back to */
+   char candidate[PATH_MAX];
+   while (1) {
+       const char *colon = strchr(dir, ':');
+       int n = colon ? (int)(colon - dir) : (int)strlen(dir);
+       struct stat st;
+       /* an empty entry means the current directory */
+       if (snprintf(candidate, sizeof(candidate), "%.*s/%s", n ? n : 1, n ? dir : ".", name) < (int)sizeof(candidate) &&
+           stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0) {
+           e = command_insert(name);
+           free(e->path);
+           e->path = strdup(candidate);
+           e->path_generation = path_generation;
+           return e->path;
+       }
+       if (colon == NULL)
+           return NULL;
+       dir = colon + 1;
+   }
+}
+
+
+/*
+* Function: is_name_char
+* ----------------------
+* Returns true if c may appear in a variable name (first is set for the leading character).
+*/
+int is_name_char(char c, int first) {
+   if (c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))
+       return 1;
+   return !first && c >= '0' && c <= '9';
+}
+
+
+/*
+* Function: subscript_end
+* -----------------------
+* Given the [ of an array subscript, returns its closing ], or NULL if the line ends first.
+* Quoted parts and substitutions are skipped, so a key can hold spaces and brackets: m["x y"].
+*/
+const char *subscript_end(const char *p) {
+   int depth = 0;
+   while (*p != '\0' && *p != '\n') {
+       if (*p == '\\' && p[1] != '\0') {
+           p += 2;
+       } else if (*p == '\'' || *p == '"' || *p == '`' || (p[0] == '$' && (p[1] == '(' || p[1] == '{'))) {
+           p = skip_construct(p);
+           if (p == NULL)
+               return NULL;
+       } else {
+           if (*p == '[')
+               depth++;
+           else if (*p == ']' && --depth == 0)
+               return p;
+           p++;
+       }
+   }
+   return NULL;
+}
+
+
+/*
+* Function: element_subscript
+* ---------------------------
+* Returns the length of the [subscript]= in front of an element of NAME=(...), or 0.
+*/
+int element_subscript(const char *word) {
+   if (word[0] != '[')
+       return 0;
+   const char *end = subscript_end(word);
+   return (end != NULL && end[1] == '=') ? end - word + 2 : 0;
+}
+
+
+/*
+* Function: is_assignment
+* -----------------------
+* Returns the length of NAME (or NAME[subscript]) if the raw word has the form NAME=value or
+* NAME[subscript]=value, otherwise 0. For NAME+=value the + is counted in the length.
+*/
+int is_assignment(const char *word) {
+   if (!is_name_char(word[0], 1))
+       return 0;
+   int i = 1;
+   while (is_name_char(word[i], 0))
+       i++;
+   if (word[i] == '[') {
+       const char *end = subscript_end(word + i);
+       if (end == NULL)
+           return 0;
+       i = end - word + 1;
+   }
+   if (word[i] == '+' && word[i + 1] == '=')
+       i++;
+   return word[i] == '=' ? i : 0;
+}
+
+
+/*
+* Function: match_operator
+* ------------------------
+* Returns the operator starting at p (as a shared static string), or NULL if there is none.
+*/
+char *match_operator(const char *p) {
+   static char *operators[] = { "<<<", "<<-", "<<", "<&", "<", ">>", ">&", ">", "&>>", "&>", "&&", "&",
+                                "||", "|", ";;", ";", "(", ")", NULL };
+   if (strchr("<>&|;()", *p) == NULL || *p == '\0')
+       return NULL;
+   for (int i = 0; operators[i] != NULL; i++) {
+       size_t n = strlen(operators[i]);
+       if (strncmp(p, operators[i], n) == 0)
+           return operators[i];
+   }
+   return NULL;
+}
+
+
+/*
+* Function: is_process_substitution
+* ---------------------------------
+* True if p starts a <(...) or >(...), which is a word rather than a redirection.
+*/
+int is_process_substitution(const char *p) {
+   return (p[0] == '<' || p[0] == '>') && p[1] == '(';
+}
+
+
+/*
+* Function: skip_construct
+* ------------------------
+* Given p at a quote, backquote, $(, ${, <( or >(, returns a pointer just past its matching close,
+* skipping anything nested inside it. Returns NULL if it is never closed.
+*/
+const char *skip_construct(const char *p) {
+   if (*p == '\'') {
+       const char *end = strchr(p + 1, '\'');  /* single quotes end at the next single quote */
+       return end ? end + 1 : NULL;
+   }
+   char close;
+   if (*p == '"' || *p == '`') {
+       close = *p++;
+   } else {
+       close = (p[1] == '(') ? ')' : '}';
+       p += 2;
+   }
+   int depth = 0;   /* unmatched ( inside $( ... ) */
+   while (*p != '\0') {
+       if (*p == '\\' && p[1] != '\0') {
+           p += 2;  /* escaped character */
+           continue;
+       }
+       if (*p == close && depth == 0)
+           return p + 1;
+       if (close == ')' && (*p == '(' || *p == ')')) {
+           depth += (*p == '(') ? 1 : -1;
+           p++;
+           continue;
+       }
+       /* constructs that can nest: substitutions anywhere, quotes outside double quotes */
+       if ((p[0] == '$' && (p[1] == '(' || p[1] == '{')) || (*p == '`' && close != '`') ||
+           (close != '"' && (*p == '\'' || *p == '"'))) {
+           p = skip_construct(p);
+           if (p == NULL)
+               return NULL;
+           continue;
+       }
+       p++;
+   }
+   return NULL;
+}
+
+
+/*
+* Function: is_arithmetic
+* -----------------------
+* Tells whether the body of a $(...), from open up to end, is a single parenthesised group,
+* making the whole a $((...)) rather than a command substitution starting with a subshell.
+*/
+int is_arithmetic(const char *open, const char *end) {
+   if (end - open < 2 || open[0] != '(' || end[-1] != ')')
+       return 0;
+   int depth = 0;
+   for (const char *p = open; p < end - 1; p++) {
+       if (*p == '(')
+           depth++;
+       else if (*p == ')' && --depth == 0)
+           return 0;
+   }
+   return depth == 1;
+}
+
+
+/*
+* Function: skip_word
+* -------------------
+* Returns a pointer just past the word starting at p, honouring quotes, backslashes, ${...},
+* $(...), `...`, <(...), >(...) and extglob groups, or NULL if one of them is never closed.
+* A !( at the start is ! and a subshell unless the word is known to be a pattern. The subscript
+* of NAME[subscript]=value (or, for an element of NAME=(...), of [subscript]=value) is part of
+* the word even if it holds spaces.
+*/
+char *skip_word(char *p, int pattern, int element) {
+   const char *start = p;
+   const char *bracket = p;
+   if (is_name_char(*bracket, 1)) {
+       while (is_name_char(*bracket, 0))
+           bracket++;
+   } else if (!element) {
+       bracket = NULL;
+   }
+   if (bracket != NULL && *bracket == '[') {
+       const char *end = subscript_end(bracket);
+       if (end != NULL && (end[1] == '=' || (end[1] == '+' && end[2] == '=')))
+           p = (char *)end + 1;
+   }
+   while (*p != '\0' && *p != ' ' && *p != '\t' && *p != '\n' && (match_operator(p) == NULL || is_process_substitution(p))) {
+       if (*p == '\\') {
+           p += p[1] ? 2 : 1;  /* escaped character */
+       } else if (p[1] == '(' && strchr("?*+@!", *p) != NULL && (*p != '!' || p > start || pattern)) {
+           /* an extglob group is part of the word, | and all */
+           int depth = 0;
+           p++;
+           do {
+               if (*p == '\\' && p[1] != '\0') {
+                   p += 2;
+               } else if (*p == '\'' || *p == '"' || *p == '`' || (p[0] == '$' && (p[1] == '(' || p[1] == '{'))) {
+                   p = (char *)skip_construct(p);
+               } else {
+                   depth += (*p == '(') - (*p == ')');
+                   p++;
+               }
+           } while (p != NULL && *p != '\0' && depth > 0);
+           if (p == NULL || depth > 0)
+               return NULL;
+       } else if (*p == '\'' || *p == '"' || *p == '`' || (p[0] == '$' && (p[1] == '(' || p[1] == '{')) ||
+                  is_process_substitution(p)) {
+           p = (char *)skip_construct(p);
+           if (p == NULL)
+               return NULL;
+       } else {
+           p++;
+       }
+   }
+   return p;
+}
+
+
+/*
+* Function: wordlist_add
+* ----------------------
+* Appends an allocated string to a word list (which takes ownership), keeping it null terminated.
+*/
+void wordlist_add(struct wordlist *list, char *word) {
+   if (list->count + 2 > list->capacity) {
+       int capacity = list->capacity ? list->capacity * 2 : 16;
+       char **grown = realloc(list->words, capacity * sizeof(char *));
+       if (grown == NULL) {
+           perror("realloc failed");
+           free(word);
+           return;
+       }
+       list->words = grown;
+       list->capacity = capacity;
+   }
+   list->words[list->count++] = word;
+   list->words[list->count] = NULL;
+}
+
+
+/*
+* Function: wordlist_free
+* -----------------------
+* Frees every string in a word list and the list itself.
+*/
+void wordlist_free(struct wordlist *list) {
+   for (int i = 0; i < list->count; i++)
+       free(list->words[i]);
+   free(list->words);
+   list->words = NULL;
+   list->count = list->capacity = 0;
+}
+
+
+/*
+* Function: compile_word
+* ----------------------
+* Breaks a raw word into parts: literal slices (flagged when they came from quotes or a
+* backslash), parameter references, command and process substitutions and a leading tilde.
+* The body of a here-document (heredoc set) is read as if in double quotes, except that a "
+* is just a character and a backslash-newline joins lines. Returns the number of parts or -1.
+*/
+int compile_word(const char *w, struct wpart parts[], int max, int heredoc) {
+   int n = 0;
+   int i = 0;
+   int in_double = heredoc;  /* inside "..." */
+
+
+   /* ~ or ~user at the start of the word */
+   if (w[0] == '~' && !heredoc) {
+       int end = 1;
+       while (w[end] != '\0' && w[end] != '/' && is_name_char(w[end], 0))
+           end++;
+       if (w[end] == '\0' || w[end] == '/') {
+           parts[n++] = (struct wpart){ WP_TILDE, 0, 1, end - 1, 0 };
+           i = end;
+       }
+   }
+
+
+   while (w[i] != '\0') {
+       if (n >= max)
+           return -1;
+       char c = w[i];
+       if (c == '\'' && !in_double) {
+           int start = ++i;
+           while (w[i] != '\0' && w[i] != '\'')
+               i++;
+           parts[n++] = (struct wpart){ WP_LIT, WF_QUOTED, start, i - start, 0 };
+           if (w[i] != '\0')
+               i++;
+       } else if (c == '"' && !heredoc) {
+           in_double = !in_double;
+           i++;
+           /* an empty "" still produces an (empty) argument */
+           if (!in_double && w[i - 2] == '"')
+               parts[n++] = (struct wpart){ WP_LIT, WF_QUOTED, i, 0, 0 };
+       } else if (c == '\\' && heredoc && w[i + 1] == '\n') {
+           i += 2;
+       } else if (c == '\\') {
+           /* inside double quotes a backslash only escapes $ ` " \ (in a here-document not ") */
+           if (w[i + 1] == '\0' || (in_double && strchr(heredoc ? "$`\\" : "$`\"\\", w[i + 1]) == NULL)) {
+               parts[n++] = (struct wpart){ WP_LIT, in_double ? WF_QUOTED : 0, i, 1, 0 };
+               i++;
+           } else {
+               parts[n++] = (struct wpart){ WP_LIT, WF_QUOTED, i + 1, 1, 0 };
+               i += 2;
+           }
+       } else if ((c == '$' && (w[i + 1] == '{' || w[i + 1] == '(')) || c == '`') {
+           const char *end = skip_construct(w + i);
+           if (end == NULL)
+               return -1;
+           int start = i + (c == '`' ? 1 : 2);
+           int type = (c == '`') ? WP_BACKQUOTE : (w[i + 1] == '(') ? WP_CMDSUB : WP_PARAM;
+           if (type == WP_CMDSUB && is_arithmetic(w + i + 2, end - 1)) {
+               type = WP_ARITH;
+               start++;
+               end--;
+           }
+           parts[n++] = (struct wpart){ type, in_double ? WF_QUOTED : 0, start, (int)(end - w) - 1 - start, 0 };
+           i = end - w + (type == WP_ARITH);
+       } else if (is_process_substitution(w + i) && !in_double) {
+           const char *end = skip_construct(w + i);
+           if (end == NULL)
+               return -1;
+           parts[n++] = (struct wpart){ WP_PROCSUB, c == '>' ? WF_OUTPUT : 0, i + 2, (int)(end - w) - 3 - i, 0 };
+           i = end - w;
+       } else if (c == '$' && is_name_char(w[i + 1], 1)) {
+           int start = ++i;
+           while (is_name_char(w[i], 0))
+               i++;
+           parts[n++] = (struct wpart){ WP_PARAM, in_double ? WF_QUOTED : 0, start, i - start, 0 };
+       } else if (c == '$' && w[i + 1] != '\0' && strchr("?$!#@*0123456789", w[i + 1]) != NULL) {
+           parts[n++] = (struct wpart){ WP_PARAM, in_double ? WF_QUOTED : 0, i + 1, 1, 0 };
+           i += 2;   /* special parameter */
+       } else {
+           /* plain run of characters up to the next quote, backslash, $ or <( */
+           int start = i++;
+           while (w[i] != '\0' && (w[i] != '"' || heredoc) && w[i] != '\\' && w[i] != '$' && w[i] != '`' &&
+                  (in_double || (w[i] != '\'' && !is_process_substitution(w + i))))
+               i++;
+           parts[n++] = (struct wpart){ WP_LIT, in_double ? WF_QUOTED : 0, start, i - start, 0 };
+       }
+   }
+   return n;
+}
+
+
+/*
+* Function: strbuf_append
+* -----------------------
+* Appends bytes to a growable string buffer, keeping it null terminated.
+*/
+void strbuf_append(struct strbuf *sb, const char *text, size_t len) {
+   if (sb->len + len + 1 > sb->capacity) {
+       size_t capacity = (sb->len + len + 1) * 2;
+       char *grown = realloc(sb->buf, capacity);
+       if (grown == NULL) {
+           perror("realloc failed");
+           return;
+       }
+       sb->buf = grown;
+       sb->capacity = capacity;
+   }
+   memcpy(sb->buf + sb->len, text, len);
+   sb->len += len;
+   sb->buf[sb->len] = '\0';
+}
+
+
+/*
+* Function: list_join
+* -------------------
+* Joins a list of words into out with spaces or, for $* and ${name[*]} (star set), with the
+* first character of IFS: a space if IFS is unset, nothing if it is empty.
+*/
+void list_join(char *const words[], int count, int star, struct strbuf *out) {
+   const char *ifs = star ? var_get("IFS") : NULL;
+   const char *separator = ifs != NULL ? ifs : " ";
+   strbuf_append(out, "", 0);
+   for (int i = 0; i < count; i++) {
+       if (i > 0 && separator[0] != '\0')
+           strbuf_append(out, separator, 1);
+       strbuf_append(out, words[i], strlen(words[i]));
+   }
+}
+
+
+/*
+* Function: param_value
+* ---------------------
+* Returns the value of a parameter name (variable, positional or special parameter like $? and $$).
+* Numbers are formatted into tmp; unset parameters give NULL.
+*/
+const char *param_value(const char *name, size_t len, char *tmp, size_t tmp_size) {
+   if (len == 1) {
+       switch (name[0]) {
+       case '?':
+           snprintf(tmp, tmp_size, "%d", last_status);
+           return tmp;
+       case '$':
+           snprintf(tmp, tmp_size, "%d", (int)shell_pid);
+           return tmp;
+       case '!':
+           if (last_background_pid == 0)
+               return NULL;
+           snprintf(tmp, tmp_size, "%d", (int)last_background_pid);
+           return tmp;
+       case '#':
+           snprintf(tmp, tmp_size, "%d", positional_count);
+           return tmp;
+       case '0':
+           return shell_name;
+       case '@':
+       case '*': {
+           /* all positional parameters, joined as "$*" would be */
+           static struct strbuf joined = { NULL, 0, 0 };
+           joined.len = 0;
+           list_join(positional, positional_count, name[0] == '*', &joined);
+           return joined.buf;
+       }
+       }
+   }
+   if (name[0] >= '1' && name[0] <= '9') {
+       size_t digits = 0;
+       while (digits < len && name[digits] >= '0' && name[digits] <= '9')
+           digits++;
+       if (digits == len) {
+           long index = 0;
+           for (size_t i = 0; i < len && index <= positional_count; i++)
+               index = index * 10 + (name[i] - '0');
+           return index <= positional_count ? positional[index - 1] : NULL;
+       }
+   }
+   struct var *v = var_lookup(name, len);
+   return v ? v->value : NULL;
+}
+
+
+/*
+* Function: compare_strings
+* -------------------------
+* qsort comparator for an array of strings.
+*/
+int compare_strings(const void *a, const void *b) {
+   return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+
+/*
+* Function: pattern_parse_class
+* -----------------------------
+* Parses a bracket expression starting at text[start] == '[' into a 256-bit set.
+* Returns the index just past the closing ']', or 0 if the bracket is never closed.
+*/
+size_t pattern_parse_class(const char *text, size_t len, size_t start, unsigned char set[32]) {
+   static const struct { const char *name; int (*test)(int); } named[] = {
+       { "alpha", isalpha }, { "digit", isdigit }, { "alnum", isalnum }, { "upper", isupper },
+       { "lower", islower }, { "space", isspace }, { "punct", ispunct }, { "xdigit", isxdigit },
+       { "print", isprint }, { "graph", isgraph }, { "cntrl", iscntrl }, { "blank", isblank },
+       { NULL, NULL }
+   };
+   size_t i = start + 1;
+   int negate = 0;
+   if (i < len && (text[i] == '!' || text[i] == '^')) {
+       negate = 1;
+       i++;
+   }
+   int first = 1;   /* a ']' right after the opening bracket is a member */
+   while (i < len && (text[i] != ']' || first)) {
+       first = 0;
+       unsigned char lo = (unsigned char)text[i];
+       if (text[i] == '[' && i + 1 < len && text[i + 1] == ':') {
+           const char *close = NULL;
+           for (size_t k = i + 2; k + 1 < len; k++) {
+               if (text[k] == ':' && text[k + 1] == ']') {
+                   close = &text[k];
+                   break;
+               }
+           }
+           if (close != NULL) {
+               size_t name_len = close - &text[i + 2];
+               for (int n = 0; named[n].name != NULL; n++) {
+                   if (strlen(named[n].name) == name_len && strncmp(named[n].name, &text[i + 2], name_len) == 0) {
+                       for (int c = 0; c < 256; c++) {
+                           if (named[n].test(c))
+                               set[c >> 3] |= 1 << (c & 7);
+                       }
+                   }
+               }
+               i = (close - text) + 2;
+               continue;
+           }
+       }
+       if (text[i] == '\\' && i + 1 < len)
+           lo = (unsigned char)text[++i];
+       unsigned char hi = lo;
+       if (i + 2 < len && text[i + 1] == '-' && text[i + 2] != ']') {
+           i += 2;
+           if (text[i] == '\\' && i + 1 < len)
+               i++;
+           hi = (unsigned char)text[i];
+       }
+       for (int c = lo; c <= hi; c++)
+           set[c >> 3] |= 1 << (c & 7);
+       i++;
+   }
+   if (i >= len)
+       return 0;
+   if (negate) {
+       for (int b = 0; b < 32; b++)
+           set[b] = ~set[b];
+   }
+   return i + 1;
+}
+
+
+/*
+* Function: pattern_group_end
+* ---------------------------
+* Given the ( of an extglob group, returns the index of its closing ), or 0 if it has none.
+*/
+size_t pattern_group_end(const char *text, size_t len, size_t open) {
+   int depth = 0;
+   for (size_t i = open; i < len; i++) {
+       if (text[i] == '\\')
+           i++;
+       else if (text[i] == '(')
+           depth++;
+       else if (text[i] == ')' && --depth == 0)
+           return i;
+   }
+   return 0;
+}
+
+
+/*
+* Function: pattern_add_group
+* ---------------------------
+* Compiles the |-separated alternatives between open and close into a new group of the
+* pattern, returning its index or -1.
+*/
+int pattern_add_group(struct pattern *pat, const char *text, size_t open, size_t close) {
+   struct pat_group *grown = realloc(pat->groups, (pat->ngroups + 1) * sizeof(struct pat_group));
+   if (grown == NULL)
+       return -1;
+   pat->groups = grown;
+   struct pat_group *g = &pat->groups[pat->ngroups];
+   g->alts = NULL;
+   g->nalts = 0;
+   pat->ngroups++;
+   size_t start = open + 1;
+   int depth = 0;
+   for (size_t i = start; i <= close; i++) {
+       if (text[i] == '\\' && i < close) {
+           i++;
+           continue;
+       }
+       if (text[i] == '(') {
+           depth++;
+       } else if (text[i] == ')' && i < close) {
+           depth--;
+       } else if (i == close || (text[i] == '|' && depth == 0)) {
+           struct pattern *alts = realloc(g->alts, (g->nalts + 1) * sizeof(struct pattern));
+           if (alts == NULL)
+               return -1;
+           g->alts = alts;
+           if (pattern_compile(text + start, i - start, &g->alts[g->nalts++]) < 0)
+               return -1;
+           start = i + 1;
+       }
+   }
+   return pat->ngroups - 1;
+}
+
+
+/*
+* Function: pattern_compile
+* -------------------------
+* Compiles a shell pattern (*, ?, [...], the extglob groups ?(...) *(...) +(...) @(...) and
+* !(...), and backslash escapes) into a list of match operations, and records its literal
+* prefix and suffix so most non-matching names are rejected with a memcmp. Returns 0 on success.
+*/
+int pattern_compile(const char *text, size_t len, struct pattern *pat) {
+   memset(pat, 0, sizeof(*pat));
+   pat->ops = malloc((len + 1) * sizeof(struct pat_op));
+   if (pat->ops == NULL)
+       return -1;
+
+
+   size_t i = 0;
+   while (i < len) {
+       struct pat_op op = { PAT_CHAR, (unsigned char)text[i], -1 };
+       size_t close;
+       if (i + 1 < len && text[i + 1] == '(' && strchr("?*+@!", text[i]) != NULL &&
+           (close = pattern_group_end(text, len, i + 1)) != 0) {
+           op.type = PAT_GROUP;
+           op.set = pattern_add_group(pat, text, i + 1, close);
+           if (op.set < 0)
+               return -1;
+           i = close + 1;
+       } else if (text[i] == '\\' && i + 1 < len) {
+           op.c = (unsigned char)text[i + 1];  /* escaped: always literal */
+           i += 2;
+       } else if (text[i] == '*') {
+           op.type = PAT_STAR;
+           i++;
+           while (i < len && text[i] == '*' && !(i + 1 < len && text[i + 1] == '('))
+               i++;   /* a run of stars is one star, short of a *(...) group */
+       } else if (text[i] == '?') {
+           op.type = PAT_ANY;
+           i++;
+       } else if (text[i] == '[') {
+           unsigned char set[32] = { 0 };
+           size_t end = pattern_parse_class(text, len, i, set);
+           if (end == 0) {
+               i++;   /* no closing ]: an ordinary '[' */
+           } else {
+               unsigned char (*grown)[32] = realloc(pat->classes, (pat->nclasses + 1) * sizeof(*grown));
+               if (grown == NULL)
+                   return -1;
+               pat->classes = grown;
+               memcpy(pat->classes[pat->nclasses], set, 32);
+               op.type = PAT_CLASS;
+               op.set = pat->nclasses++;
+               i = end;
+           }
+       } else {
+           i++;
+       }
+       pat->ops[pat->nops++] = op;
+   }
+
+
+   /* literal runs at both ends let the matcher bail out early */
+   int first = 0;
+   while (first < pat->nops && pat->ops[first].type == PAT_CHAR)
+       first++;
+   int last = pat->nops;
+   while (last > first && pat->ops[last - 1].type == PAT_CHAR)
+       last--;
+   pat->prefix_len = first;
+   pat->suffix_len = pat->nops - last;
+   pat->has_star = 0;
+   pat->min_len = 0;
+   for (int j = 0; j < pat->nops; j++) {
+       if (pat->ops[j].type == PAT_STAR || pat->ops[j].type == PAT_GROUP)
+           pat->has_star = 1;
+       else
+           pat->min_len++;
+   }
+   pat->literal = malloc(pat->nops + 1);
+   if (pat->literal == NULL)
+       return -1;
+   for (int j = 0; j < pat->nops; j++)
+       pat->literal[j] = pat->ops[j].type == PAT_CHAR ? (char)pat->ops[j].c : '\0';
+   return 0;
+}
+
+
+/*
+* Function: pattern_op_matches
+* ----------------------------
+* True if a single-character operation (PAT_CHAR, PAT_ANY or PAT_CLASS) accepts c.
+*/
+int pattern_op_matches(const struct pat_op *op, unsigned char (*classes)[32], unsigned char c) {
+   return op->type == PAT_ANY || (op->type == PAT_CHAR && op->c == c) ||
+          (op->type == PAT_CLASS && (classes[op->set][c >> 3] & (1 << (c & 7))));
+}
+
+
+/*
+* Function: pattern_group_any
+* ---------------------------
+* True if one of a group's alternatives matches the whole of s.
+*/
+int pattern_group_any(const struct pat_group *g, const char *s, size_t len) {
+   for (int a = 0; a < g->nalts; a++) {
+       if (pattern_match(&g->alts[a], s, len))
+           return 1;
+   }
+   return 0;
+}
+
+
+/*
+* Function: pattern_match_from
+* ----------------------------
+* Matches the whole of s against the pattern's operations from pi on, backtracking over stars
+* and groups. Only used for patterns with extglob groups.
+*/
+int pattern_match_from(const struct pattern *pat, int pi, const char *s, size_t len) {
+   while (pi < pat->nops && pat->ops[pi].type != PAT_STAR && pat->ops[pi].type != PAT_GROUP) {
+       if (len == 0 || !pattern_op_matches(&pat->ops[pi], pat->classes, (unsigned char)*s))
+           return 0;
+       pi++;
+       s++;
+       len--;
+   }
+   if (pi == pat->nops)
+       return len == 0;
+   const struct pat_op *op = &pat->ops[pi];
+   if (op->type == PAT_STAR) {
+       for (size_t k = 0; k <= len; k++) {
+           if (pattern_match_from(pat, pi + 1, s + k, len - k))
+               return 1;
+       }
+       return 0;
+   }
+
+
+   const struct pat_group *g = &pat->groups[op->set];
+   /* ?(...), *(...) and !(...) may match nothing */
+   if ((op->c == '?' || op->c == '*' || (op->c == '!' && !pattern_group_any(g, s, 0))) &&
+       pattern_match_from(pat, pi + 1, s, len))
+       return 1;
+   for (size_t k = 1; k <= len; k++) {
+       int taken = pattern_group_any(g, s, k);
+       if (op->c == '!')
+           taken = !taken;
+       if (!taken)
+           continue;
+       if (pattern_match_from(pat, pi + 1, s + k, len - k))
+           return 1;
+       /* *(...) and +(...) repeat: the rest may start with the same group again */
+       if ((op->c == '*' || op->c == '+') && pattern_match_from(pat, pi, s + k, len - k))
+           return 1;
+   }
+   return 0;
+}
+
+
+/*
+* Function: pattern_match
+* -----------------------
+* Matches a whole string against a compiled pattern. Stars are handled by remembering only the
+* last one and retrying from it, which is linear for the patterns people actually write;
+* patterns with extglob groups backtrack.
+*/
+int pattern_match(const struct pattern *pat, const char *s, size_t len) {
+   if (len < (size_t)pat->min_len || (!pat->has_star && len != (size_t)pat->min_len))
+       return 0;
+   if (memcmp(s, pat->literal, pat->prefix_len) != 0)
+       return 0;
+   if (pat->suffix_len > 0 && memcmp(s + len - pat->suffix_len, pat->literal + pat->nops - pat->suffix_len, pat->suffix_len) != 0)
+       return 0;
+   if (pat->ngroups > 0)
+       return pattern_match_from(pat, 0, s, len);
+
+
+   int pi = 0;
+   size_t si = 0;
+   int star_pi = -1;     /* op after the last star seen */
+   size_t star_si = 0;   /* where that star's match currently ends */
+   while (si < len) {
+       if (pi < pat->nops) {
+           const struct pat_op *op = &pat->ops[pi];
+           unsigned char c = (unsigned char)s[si];
+           if (op->type == PAT_STAR) {
+               star_pi = ++pi;
+               star_si = si;
+               continue;
+           }
+           if (pattern_op_matches(op, pat->classes, c)) {
+               pi++;
+               si++;
+               continue;
+           }
+       }
+       if (star_pi < 0)
+           return 0;
+       pi = star_pi;     /* let the last star swallow one more character */
+       si = ++star_si;
+   }
+   while (pi < pat->nops && pat->ops[pi].type == PAT_STAR)
+       pi++;
+   return pi == pat->nops;
+}
+
+
+/*
+* Function: pattern_free
+* ----------------------
+* Releases the memory held by a compiled pattern.
+*/
+void pattern_free(struct pattern *pat) {
+   for (int g = 0; g < pat->ngroups; g++) {
+       for (int a = 0; a < pat->groups[g].nalts; a++)
+           pattern_free(&pat->groups[g].alts[a]);
+       free(pat->groups[g].alts);
+   }
+   free(pat->groups);
+   free(pat->ops);
+   free(pat->classes);
+   free(pat->literal);
+   memset(pat, 0, sizeof(*pat));
+}
+
+
+/*
+* Function: pattern_cached
+* ------------------------
+* Returns the compiled form of a pattern, compiling it only if it isn't among the recently used
+* ones (a direct-mapped cache keyed by the text). The result stays valid until the next call.
+* NULL if it can't be compiled.
+*/
+const struct pattern *pattern_cached(const char *text) {
+   size_t len = strlen(text);
+   struct pattern_cache_entry *e = &pattern_cache[hash_name(text, len) & (PATTERN_CACHE_SIZE - 1)];
+   if (e->text != NULL && strcmp(e->text, text) == 0)
+       return &e->pat;
+   if (e->text != NULL) {
+       pattern_free(&e->pat);
+       free(e->text);
+   }
+   e->text = strdup(text);
+   if (e->text == NULL || pattern_compile(text, len, &e->pat) < 0) {
+       pattern_free(&e->pat);
+       free(e->text);
+       e->text = NULL;
+       return NULL;
+   }
+   return &e->pat;
+}
+
+
+/*
+* Function: pattern_set_add
+* -------------------------
+* Adds the states of a compiled pattern to a set, followed by its accepting state. Returns -1
+* if it can't be run in a single pass (it has extglob groups) or memory runs out.
+*/
+int pattern_set_add(struct pattern_set *set, const struct pattern *pat, int word) {
+   if (pat->ngroups > 0)
+       return -1;
+   struct pat_op *states = realloc(set->states, (set->nstates + pat->nops + 1) * sizeof(struct pat_op));
+   if (states == NULL)
+       return -1;
+   set->states = states;
+   if (pat->nclasses > 0) {
+       unsigned char (*classes)[32] = realloc(set->classes, (set->nclasses + pat->nclasses) * sizeof(*classes));
+       if (classes == NULL)
+           return -1;
+       set->classes = classes;
+       memcpy(set->classes + set->nclasses, pat->classes, pat->nclasses * sizeof(*classes));
+   }
+   int *accepts = realloc(set->accepts, (set->npatterns + 1) * sizeof(int));
+   if (accepts == NULL)
+       return -1;
+   set->accepts = accepts;
+   int *words = realloc(set->words, (set->npatterns + 1) * sizeof(int));
+   if (words == NULL)
+       return -1;
+   set->words = words;
+
+
+   for (int j = 0; j < pat->nops; j++) {
+       struct pat_op op = pat->ops[j];
+       if (op.type == PAT_CLASS)
+           op.set += set->nclasses;
+       set->states[set->nstates++] = op;
+   }
+   set->states[set->nstates] = (struct pat_op){ PAT_END, 0, -1 };
+   set->accepts[set->npatterns] = set->nstates++;
+   set->words[set->npatterns++] = word;
+   set->nclasses += pat->nclasses;
+   return 0;
+}
+
+
+/*
+* Function: pattern_set_close
+* ---------------------------
+* A live star may also match nothing, making the state after it live too. Runs of stars are
+* compiled into one, so a single pass is enough.
+*/
+void pattern_set_close(const struct pattern_set *set, unsigned long *live, size_t nlongs) {
+   for (size_t w = 0; w < nlongs; w++) {
+       for (unsigned long bits = live[w]; bits != 0; bits &= bits - 1) {
+           size_t state = w * LONG_BITS + __builtin_ctzl(bits);
+           if (set->states[state].type == PAT_STAR)
+               live[(state + 1) / LONG_BITS] |= 1UL << ((state + 1) % LONG_BITS);
+       }
+   }
+}
+
+
+/*
+* Function: pattern_set_match
+* ---------------------------
+* Runs every pattern of a set over s at once, one character at a time, and returns the word of
+* the first pattern (in the set's order) that matches all of it, or -1.
+*/
+int pattern_set_match(struct pattern_set *set, const char *s, size_t len) {
+   size_t nlongs = (set->nstates + LONG_BITS - 1) / LONG_BITS;
+   unsigned long *live = set->current, *next = set->next;
+   memset(live, 0, nlongs * sizeof(unsigned long));
+   for (int p = 0; p < set->npatterns; p++) {
+       int first = p ? set->accepts[p - 1] + 1 : 0;
+       live[first / LONG_BITS] |= 1UL << (first % LONG_BITS);
+   }
+   pattern_set_close(set, live, nlongs);
+
+
+   for (size_t i = 0; i < len; i++) {
+       unsigned char c = (unsigned char)s[i];
+       int any = 0;
+       memset(next, 0, nlongs * sizeof(unsigned long));
+       for (size_t w = 0; w < nlongs; w++) {
+           for (unsigned long bits = live[w]; bits != 0; bits &= bits - 1) {
+               size_t state = w * LONG_BITS + __builtin_ctzl(bits);
+               const struct pat_op *op = &set->states[state];
+               if (op->type == PAT_STAR) {
+                   next[w] |= bits & -bits;   /* a star takes any character and stays */
+                   any = 1;
+               } else if (op->type != PAT_END && pattern_op_matches(op, set->classes, c)) {
+                   next[(state + 1) / LONG_BITS] |= 1UL << ((state + 1) % LONG_BITS);
+                   any = 1;
+               }
+           }
+       }
+       if (!any)
+           return -1;   /* every pattern has failed already */
+       pattern_set_close(set, next, nlongs);
+       unsigned long *swap = live;
+       live = next;
+       next = swap;
+   }
+   for (int p = 0; p < set->npatterns; p++) {
+       if (live[set->accepts[p] / LONG_BITS] & (1UL << (set->accepts[p] % LONG_BITS)))
+           return set->words[p];
+   }
+   return -1;
+}
+
+
+/*
+* Function: has_glob_magic
+* ------------------------
+* Returns true if a pattern component contains an unescaped *, ? or [.
+*/
+int has_glob_magic(const char *text) {
+   for (const char *p = text; *p != '\0'; p++) {
+       if (*p == '\\' && p[1] != '\0')
+           p++;
+       else if (*p == '*' || *p == '?' || *p == '[' || (p[1] == '(' && strchr("+@!", *p) != NULL))
+           return 1;
+   }
+   return 0;
+}
+
+
+/*
+* Function: dir_open
+* ------------------
+* Opens a directory for scanning with getdents64 into a large buffer ("" means the current directory).
+*/
+int dir_open(struct dir_scan *d, const char *path) {
+   d->fd = open(path[0] ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+   if (d->fd < 0)
+       return -1;
+   d->buf = malloc(GLOB_DIRBUF_SIZE);
+   if (d->buf == NULL) {
+       close(d->fd);
+       return -1;
+   }
+   d->nread = d->pos = 0;
+   return 0;
+}
+
+
+/*
+* Function: dir_next
+* ------------------
+* Returns the next directory entry, refilling the buffer with one getdents64 call when it runs out.
+*/
+struct linux_dirent64 *dir_next(struct dir_scan *d) {
+   if (d->pos >= d->nread) {
+       d->nread = syscall(SYS_getdents64, d->fd, d->buf, GLOB_DIRBUF_SIZE);
+       d->pos = 0;
+       if (d->nread <= 0)
+           return NULL;  /* end of directory or error */
+   }
+   struct linux_dirent64 *entry = (struct linux_dirent64 *)(d->buf + d->pos);
+   d->pos += entry->d_reclen;
+   return entry;
+}
+
+
+/*
+* Function: dir_close
+* -------------------
+* Releases a directory scan.
+*/
+void dir_close(struct dir_scan *d) {
+   close(d->fd);
+   free(d->buf);
+}
+
+
+/*
+* Function: entry_is_dir
+* ----------------------
+* Uses d_type to tell whether a directory entry is a directory, only falling back to fstatat
+* when the filesystem doesn't report types (or for symlinks, when follow is set).
+*/
+int entry_is_dir(struct dir_scan *d, struct linux_dirent64 *entry, int follow) {
+   if (entry->d_type == DT_DIR)
+       return 1;
+   if (entry->d_type != DT_UNKNOWN && !(entry->d_type == DT_LNK && follow))
+       return 0;
+   struct stat st;
+   if (fstatat(d->fd, entry->d_name, &st, follow ? 0 : AT_SYMLINK_NOFOLLOW) < 0)
+       return 0;
+   return S_ISDIR(st.st_mode);
+}
+
+
+/*
+* Function: path_push
+* -------------------
+* Appends a component to a path buffer, adding a separating slash if needed. Returns the old length.
+*/
+size_t path_push(char *path, size_t len, const char *name) {
+   size_t old = len;
+   if (len > 0 && path[len - 1] != '/')
+       path[len++] = '/';
+   size_t n = strlen(name);
+   if (len + n >= PATH_MAX)
+       n = PATH_MAX - 1 - len;
+   memcpy(path + len, name, n);
+   path[len + n] = '\0';
+   return old;
+}
+
+
+/*
+* Function: glob_walk
+* -------------------
+* Matches components ci.. of a glob below the directory in path, adding hits to matches.
+* verified tells whether path is already known to exist (it came from a directory scan), and
+* below whether a ** at ci has already descended into it.
+*/
+void glob_walk(struct glob_component comps[], int ncomp, int ci, char *path, size_t len, int verified,
+              int below, struct wordlist *matches) {
+   if (ci == ncomp) {
+       struct stat st;
+       if (!verified && lstat(path, &st) < 0)
+           return;
+       wordlist_add(matches, strdup(path));
+       return;
+   }
+   struct glob_component *comp = &comps[ci];
+
+
+   /* literal component: no need to read the directory */
+   if (!comp->magic) {
+       path_push(path, len, comp->text);
+       glob_walk(comps, ncomp, ci + 1, path, strlen(path), 0, 0, matches);
+       path[len] = '\0';
+       return;
+   }
+
+
+   /* ** matches zero directories first, then recurses into every subdirectory */
+   if (comp->recursive && ci + 1 < ncomp)
+       glob_walk(comps, ncomp, ci + 1, path, len, verified, 0, matches);
+
+
+   struct dir_scan d;
+   if (dir_open(&d, path) < 0)
+       return;
+   struct wordlist descend = { NULL, 0, 0 };   /* matching directories to visit after the scan */
+   int last = (ci + 1 == ncomp);
+   if (comp->recursive && last && !below && len > 0) {
+       /* a trailing ** also matches the directory it starts from: dir/ when it was spelled out */
+       char *self = malloc(len + 2);
+       if (self != NULL) {
+           memcpy(self, path, len);
+           strcpy(self + len, verified || path[len - 1] == '/' ? "" : "/");
+           wordlist_add(matches, self);
+       }
+   }
+   struct linux_dirent64 *entry;
+   while ((entry = dir_next(&d)) != NULL) {
+       const char *name = entry->d_name;
+       if (name[0] == '.') {
+           /* hidden names only match a pattern that starts with a literal dot; . and .. never do */
+           if (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))
+               continue;
+           if (comp->recursive || comp->text[0] != '.')
+               continue;
+       }
+       if (comp->recursive) {
+           int is_dir = entry_is_dir(&d, entry, 0);
+           if (last) {
+               size_t old = path_push(path, len, name);
+               wordlist_add(matches, strdup(path));
+               path[old] = '\0';
+           }
+           if (is_dir)
+               wordlist_add(&descend, strdup(name));
+           continue;
+       }
+       if (!pattern_match(&comp->pat, name, strlen(name)))
+           continue;
+       if (last) {
+           size_t old = path_push(path, len, name);
+           wordlist_add(matches, strdup(path));
+           path[old] = '\0';
+       } else if (entry_is_dir(&d, entry, 1)) {
+           wordlist_add(&descend, strdup(name));
+       }
+   }
+   dir_close(&d);
+
+
+   for (int i = 0; i < descend.count; i++) {
+       path_push(path, len, descend.words[i]);
+       glob_walk(comps, ncomp, comp->recursive ? ci : ci + 1, path, strlen(path), 1, comp->recursive,
+                 matches);
+       path[len] = '\0';
+   }
+   wordlist_free(&descend);
+}
+
+
+/*
+* Function: strip_backslashes
+* ---------------------------
+* Removes escaping backslashes from a literal pattern component in place.
+*/
+void strip_backslashes(char *text) {
+   char *out = text;
+   for (char *in = text; *in != '\0'; in++) {
+       if (*in == '\\' && in[1] != '\0')
+           in++;
+       *out++ = *in;
+   }
+   *out = '\0';
+}
+
+
+/*
+* Function: glob_expand
+* ---------------------
+* Expands a pathname pattern (backslash-escaped where characters were quoted) into sorted
+* matches appended to out. Each component is compiled once before the walk. Returns the match count.
+*/
+int glob_expand(const char *pattern, struct wordlist *out) {
+   char *copy = strdup(pattern);
+   if (copy == NULL)
+       return 0;
+   struct glob_component comps[MAX_ARGS];
+   int ncomp = 0;
+   int trailing_slash = 0;
+
+
+   /* split into components, compiling the ones that need a directory scan */
+   char *p = copy;
+   while (*p != '\0' && ncomp < MAX_ARGS) {
+       char *slash = p;
+       while (*slash != '\0' && *slash != '/')
+           slash += (slash[0] == '\\' && slash[1] != '\0') ? 2 : 1;
+       int at_end = (*slash == '\0');
+       *slash = '\0';
+       if (*p != '\0') {
+           struct glob_component *comp = &comps[ncomp++];
+           comp->text = p;
+           comp->magic = has_glob_magic(p);
+           comp->recursive = (strcmp(p, "**") == 0);
+           if (comp->magic && !comp->recursive)
+               pattern_compile(p, strlen(p), &comp->pat);
+           if (!comp->magic)
+               strip_backslashes(p);
+       }
+       if (at_end)
+           break;
+       p = slash + 1;
+       if (*p == '\0')
+           trailing_slash = 1;
+   }
+
+
+   char path[PATH_MAX];
+   size_t len = 0;
+   if (pattern[0] == '/')
+       path[len++] = '/';
+   path[len] = '\0';
+   struct wordlist matches = { NULL, 0, 0 };
+   glob_walk(comps, ncomp, 0, path, len, 1, 0, &matches);
+
+
+   qsort(matches.words, matches.count, sizeof(char *), compare_strings);
+   int count = 0;
+   for (int i = 0; i < matches.count; i++) {
+       if (trailing_slash) {
+           /* pattern/ only matches directories */
+           struct stat st;
+           if (stat(matches.words[i], &st) < 0 || !S_ISDIR(st.st_mode))
+               continue;
+           size_t n = strlen(matches.words[i]);
+           char *with_slash = malloc(n + 2);
+           if (with_slash == NULL)
+               continue;
+           memcpy(with_slash, matches.words[i], n);
+           strcpy(with_slash + n, matches.words[i][n - 1] == '/' ? "" : "/");
+           wordlist_add(out, with_slash);
+       } else {
+           wordlist_add(out, matches.words[i]);
+           matches.words[i] = NULL;
+       }
+       count++;
+   }
+   wordlist_free(&matches);
+   for (int i = 0; i < ncomp; i++) {
+       if (comps[i].magic && !comps[i].recursive)
+           pattern_free(&comps[i].pat);
+   }
+   free(copy);
+   return count;
+}
+
+
+/*
+* Function: field_append
+* ----------------------
+* Appends text to the field being built. The glob pattern copy gets quoted glob characters
+* escaped so only the unquoted ones take part in pathname expansion.
+*/
+void field_append(struct field *f, const char *text, size_t len, int quoted) {
+   strbuf_append(&f->text, text, len);
+   const char *special = f->regex ? "\\.[]()*+?{}|^$" : "*?[\\(";
+   size_t start = 0;   /* start of the run not yet copied to the pattern */
+   for (size_t i = 0; i < len; i++) {
+       char c = text[i];
+       if (c == '\0' || strchr(special, c) == NULL)
+           continue;
+       if (quoted || (c == '\\' && !f->regex)) {
+           strbuf_append(&f->pattern, text + start, i - start);
+           strbuf_append(&f->pattern, "\\", 1);
+           start = i;
+       } else if (!f->regex && (c != '(' || (i > 0 && strchr("?*+@!", text[i - 1]) != NULL))) {
+           f->has_magic = 1;   /* a glob character, or the ( of an extglob group */
+       }
+   }
+   strbuf_append(&f->pattern, text + start, len - start);
+   f->active = 1;
+}
+
+
+/*
+* Function: field_finish
+* ----------------------
+* Moves the field being built into the output list (if it holds anything) and starts a new one.
+* A field with unquoted glob characters is replaced by the matching path names, if there are any.
+*/
+void field_finish(struct field *f, struct wordlist *out) {
+   if (f->active) {
+       if (f->allow_glob && f->has_magic && glob_expand(f->pattern.buf, out) > 0) {
+           free(f->text.buf);
+       } else {
+           wordlist_add(out, f->text.buf ? f->text.buf : strdup(""));
+       }
+       free(f->pattern.buf);
+       f->text = (struct strbuf){ NULL, 0, 0 };
+       f->pattern = (struct strbuf){ NULL, 0, 0 };
+   }
+   f->active = 0;
+   f->has_magic = 0;
+}
+
+
+/*
+* Function: split_fields
+* ----------------------
+* Appends an unquoted expansion to the current field, breaking it into new fields at IFS characters.
+*/
+void split_fields(struct field *f, const char *value, struct wordlist *out) {
+   const char *ifs = var_get("IFS");
+   if (ifs == NULL)
+       ifs = " \t\n";
+   for (const char *p = value; *p != '\0'; p++) {
+       if (*ifs == '\0' || strchr(ifs, *p) == NULL) {
+           field_append(f, p, 1, 0);
+       } else if (*p == ' ' || *p == '\t' || *p == '\n') {
+           field_finish(f, out);  /* runs of IFS white space separate fields */
+       } else {
+           f->active = 1;         /* other IFS characters delimit, even empty fields */
+           field_finish(f, out);
+       }
+   }
+}
+
+
+/*
+* Function: param_name_length
+* ---------------------------
+* Returns the length of the parameter name at the start of the inside of a ${...}: a variable
+* name, a positional parameter number or a special parameter. 0 if there is none.
+*/
+int param_name_length(const char *name, int len) {
+   int n = 0;
+   if (len > 0 && is_name_char(name[0], 1)) {
+       while (n < len && is_name_char(name[n], 0))
+           n++;
+   } else if (len > 0 && isdigit((unsigned char)name[0])) {
+       while (n < len && isdigit((unsigned char)name[n]))
+           n++;
+   } else if (len > 0 && strchr("?$!#@*", name[0]) != NULL) {
+       n = 1;
+   }
+   return n;
+}
+
+
+/*
+* Function: array_list
+* --------------------
+* Adds copies of the values (or, with keys set, the subscripts) of a variable's elements to a
+* word list, indexed ones in order. A plain variable is an array of one element.
+*/
+void array_list(const char *name, int len, int keys, struct wordlist *out) {
+   struct var *v = var_lookup(name, len);
+   if (v == NULL)
+       return;
+   if (v->array == NULL) {
+       wordlist_add(out, strdup(keys ? "0" : v->value));
+       return;
+   }
+   char number[32];
+   for (size_t i = 0; i < v->array->count; i++) {
+       if (v->array->items[i] == NULL)
+           continue;
+       snprintf(number, sizeof(number), "%zu", i);
+       wordlist_add(out, strdup(keys ? number : v->array->items[i]));
+   }
+   for (size_t i = 0; i < v->array->entries_capacity; i++) {
+       struct array_entry *e = &v->array->entries[i];
+       if (e->key != NULL && e->key != TOMBSTONE)
+           wordlist_add(out, strdup(keys ? e->key : e->value));
+   }
+}
+
+
+/*
+* Function: find_unquoted
+* -----------------------
+* Returns the first c between p and end that isn't escaped, quoted or inside a substitution,
+* or end if there is none.
+*/
+const char *find_unquoted(const char *p, const char *end, char c) {
+   while (p < end && *p != c) {
+       if (*p == '\\') {
+           p += (p + 1 < end) ? 2 : 1;
+       } else if (*p == '\'' || *p == '"' || *p == '`' || (p[0] == '$' && (p[1] == '(' || p[1] == '{'))) {
+           p = skip_construct(p);
+           if (p == NULL || p > end)
+               return end;
+       } else {
+           p++;
+       }
+   }
+   return p;
+}
+
+
+/*
+* Function: is_slice
+* ------------------
+* Tells whether the operator after a parameter is :offset or :offset:length rather than one of
+* the :-word defaults.
+*/
+int is_slice(const char *op, int len) {
+   return len > 1 && op[0] == ':' && strchr("-=+?", op[1]) == NULL;
+}
+
+
+/*
+* Function: array_slice
+* ---------------------
+* ${name[@]:offset:length}: keeps that many elements of a list from the offset on (a negative
+* one counting from the end), freeing the rest. Returns -1 after an error.
+*/
+int array_slice(struct wordlist *list, const char *word, int wlen) {
+   const char *colon = find_unquoted(word, word + wlen, ':');
+   long long offset, count = list->count;
+   int failed = 0;
+   char *text = expand_operand(word, colon - word, 0);
+   offset = arith_evaluate(text, 0, &failed);
+   free(text);
+   if (!failed && colon < word + wlen) {
+       text = expand_operand(colon + 1, word + wlen - colon - 1, 0);
+       count = arith_evaluate(text, 0, &failed);
+       free(text);
+   }
+   if (!failed && count < 0) {
+       fprintf(stderr, "%.*s: substring expression < 0\n", wlen, word);
+       failed = 1;
+   }
+   if (offset < 0)
+       offset += list->count;
+   if (failed || offset < 0 || offset > list->count)
+       offset = count = 0;
+   if (count > list->count - offset)
+       count = list->count - offset;
+   for (int i = 0; i < list->count; i++) {
+       if (i < offset || i >= offset + count)
+           free(list->words[i]);
+   }
+   if (count > 0)
+       memmove(list->words, list->words + offset, count * sizeof(char *));
+   list->count = count;
+   if (list->words != NULL)
+       list->words[count] = NULL;
+   return failed ? -1 : 0;
+}
+
+
+/*
+* Function: param_list
+* --------------------
+* Adds copies of the elements of $@ or $* (name "@" or "*") or of an array (with keys set, its
+* subscripts) to a word list. For a slice the positional parameters start with $0, so ${@:1}
+* starts at $1.
+*/
+void param_list(const char *name, int n, int keys, int slice, struct wordlist *out) {
+   if (n == 1 && (name[0] == '@' || name[0] == '*')) {
+       char tmp[32];
+       if (slice) {
+           const char *zero = param_value("0", 1, tmp, sizeof(tmp));
+           wordlist_add(out, strdup(zero ? zero : ""));
+       }
+       for (int i = 0; i < positional_count; i++)
+           wordlist_add(out, strdup(positional[i]));
+   } else {
+       array_list(name, n, keys, out);
+   }
+}
+
+
+/*
+* Function: param_elements
+* ------------------------
+* Recognises $@, ${name[@]} and ${!name[@]} (each maybe followed by :offset:length or another
+* operator), which inside double quotes give each element a field of its own, and lists the
+* elements. Unquoted, $* and ${name[*]} are the same. Returns 0 for any other parameter.
+*/
+int param_elements(const char *text, int len, int quoted, struct wordlist *out) {
+   int keys = (text[0] == '!');
+   int n = param_name_length(text + keys, len - keys);
+   int end = keys + n;
+   const char *sub = NULL;
+   int positional_list = (!keys && n == 1 && (text[0] == '@' || (!quoted && text[0] == '*')));
+   if (!positional_list) {
+       if (n == 0 || !is_name_char(text[keys], 1) || len - end < 3 || text[end] != '[' || text[end + 2] != ']' ||
+           (text[end + 1] != '@' && (quoted || text[end + 1] != '*')))
+           return 0;
+       sub = text + end + 1;
+       end += 3;
+   }
+
+
+   struct wordlist elements = { NULL, 0, 0 };
+   int slice = end < len && is_slice(text + end, len - end);
+   param_list(text + keys, n, keys, slice, &elements);
+   if (slice) {
+       if (array_slice(&elements, text + end + 1, len - end - 1) < 0)
+           expansion_failed = 1;
+   } else if (end < len && list_operator(text + keys, n, sub, sub != NULL, &elements, text + end, len - end) < 0) {
+       param_bad(text, len);
+   }
+   for (int i = 0; i < elements.count; i++)
+       wordlist_add(out, elements.words[i]);
+   free(elements.words);
+   return 1;
+}
+
+
+/*
+* Function: expand_parts
+* ----------------------
+* Performs tilde, parameter, arithmetic, command and process substitution on the parts of a raw
+* word and removes quotes, adding the result to the field being built. Unquoted expansions are split on
+* IFS into out when split is set. A $(...) or $((...)) compiled into prog runs from there, others
+* are parsed here.
+*/
+void expand_parts(const char *raw, const struct wpart *parts, int n, struct program *prog,
+                 struct field *f, struct wordlist *out, int split) {
+   char tmp[32];
+   struct wordlist elements = { NULL, 0, 0 };
+   for (int i = 0; i < n; i++) {
+       const char *text = raw + parts[i].off;
+       if (parts[i].type == WP_LIT) {
+           field_append(f, text, parts[i].len, parts[i].flags & WF_QUOTED);
+       } else if (parts[i].type == WP_TILDE) {
+           const char *home = NULL;
+           if (parts[i].len == 0) {
+               home = var_get("HOME");
+           } else {
+               char user[MAX_LENGTH];
+               snprintf(user, sizeof(user), "%.*s", parts[i].len, text);
+               struct passwd *pw = getpwnam(user);
+               home = pw ? pw->pw_dir : NULL;
+           }
+           if (home != NULL)
+               field_append(f, home, strlen(home), 1);
+           else
+               field_append(f, text - 1, parts[i].len + 1, 1);  /* unknown user: keep ~user */
+       } else if (parts[i].type == WP_PARAM && split && out != NULL &&
+                  param_elements(text, parts[i].len, parts[i].flags & WF_QUOTED, &elements)) {
+           /* "$@" and "${name[@]}": one field per element, never split; unquoted, each is split on its own */
+           for (int j = 0; j < elements.count; j++) {
+               if (j > 0)
+                   field_finish(f, out);
+               if (parts[i].flags & WF_QUOTED)
+                   field_append(f, elements.words[j], strlen(elements.words[j]), 1);
+               else
+                   split_fields(f, elements.words[j], out);
+           }
+           wordlist_free(&elements);
+       } else if (parts[i].type == WP_PROCSUB) {
+           /* <(cmd) and >(cmd) become the name of the shell's end of a pipe to cmd */
+           int fd = process_substitution(prog, parts[i].block, text, parts[i].len, parts[i].flags & WF_OUTPUT);
+           if (fd < 0) {
+               expansion_failed = 1;
+               continue;
+           }
+           snprintf(tmp, sizeof(tmp), "/dev/fd/%d", fd);
+           field_append(f, tmp, strlen(tmp), 1);
+       } else {
+           struct strbuf output = { NULL, 0, 0 };
+           const char *value;
+           if (parts[i].type == WP_PARAM) {
+               value = param_expand(text, parts[i].len, tmp, sizeof(tmp), &output);
+           } else if (parts[i].type == WP_ARITH) {
+               long long result = 0;
+               arith_expand(prog, parts[i].block, text, parts[i].len, &result);
+               snprintf(tmp, sizeof(tmp), "%lld", result);
+               value = tmp;
+           } else {
+               if (prog != NULL && parts[i].block > 0)
+                   capture_block(prog, parts[i].block, &output);
+               else
+                   command_substitution(text, parts[i].len, parts[i].type == WP_BACKQUOTE, &output);
+               value = output.buf;
+           }
+           if (value == NULL)
+               value = "";
+           if ((parts[i].flags & WF_QUOTED) || !split) {
+               field_append(f, value, strlen(value), parts[i].flags & WF_QUOTED);
+           } else {
+               split_fields(f, value, out);
+           }
+           free(output.buf);
+       }
+   }
+}
+
+
+/*
+* Function: expand_word
+* ---------------------
+* Expands a raw word that isn't part of a compiled program and appends the resulting fields to
+* out. Fields are split and glob expanded only when split is set.
+*/
+void expand_word(const char *raw, struct wordlist *out, int split) {
+   struct wpart parts[MAX_PARTS];
+   int n = compile_word(raw, parts, MAX_PARTS, 0);
+   if (n < 0) {
+       fprintf(stderr, "word too complex: %s\n", raw);
+       return;
+   }
+   struct field f = { { NULL, 0, 0 }, { NULL, 0, 0 }, 0, 0, split, 0 };
+   expand_parts(raw, parts, n, NULL, &f, out, split);
+   field_finish(&f, out);
+}
+
+
+/*
+* Function: expand_cword
+* ----------------------
+* Expands a compiled word of a program, appending the resulting fields to out.
+*/
+void expand_cword(struct program *prog, const struct cword *w, struct wordlist *out, int split) {
+   struct field f = { { NULL, 0, 0 }, { NULL, 0, 0 }, 0, 0, split, 0 };
+   expand_parts(prog->pool + w->text, prog->parts + w->first_part, w->nparts, prog, &f, out, split);
+   field_finish(&f, out);
+}
+
+
+/*
+* Function: expand_cword_string
+* -----------------------------
+* Expands a compiled word into a single allocated string, without field splitting.
+*/
+char *expand_cword_string(struct program *prog, const struct cword *w) {
+   struct wordlist fields = { NULL, 0, 0 };
+   expand_cword(prog, w, &fields, 0);
+   char *result = fields.count > 0 ? fields.words[0] : strdup("");
+   if (fields.count > 0)
+       fields.words[0] = NULL;
+   fields.count = 0;
+   wordlist_free(&fields);
+   return result;
+}
+
+
+/*
+* Function: expand_pattern
+* ------------------------
+* Expands a compiled word for use as a pattern (case): quoted glob characters come out
+* backslash-escaped so they only match themselves. Returns an allocated string.
+*/
+char *expand_pattern(struct program *prog, const struct cword *w) {
+   struct field f = { { NULL, 0, 0 }, { NULL, 0, 0 }, 0, 0, 0, 0 };
+   expand_parts(prog->pool + w->text, prog->parts + w->first_part, w->nparts, prog, &f, NULL, 0);
+   free(f.text.buf);
+   return f.pattern.buf ? f.pattern.buf : strdup("");
+}
+
+
+/*
+* Function: expand_regex
+* ----------------------
+* Expands a compiled word for use as an extended regular expression (=~): quoted characters
+* come out escaped so they only match themselves. Returns an allocated string.
+*/
+char *expand_regex(struct program *prog, const struct cword *w) {
+   struct field f = { { NULL, 0, 0 }, { NULL, 0, 0 }, 0, 0, 0, 1 };
+   expand_parts(prog->pool + w->text, prog->parts + w->first_part, w->nparts, prog, &f, NULL, 0);
+   free(f.text.buf);
+   return f.pattern.buf ? f.pattern.buf : strdup("");
+}
+
+
+/*
+* Function: expand_string
+* -----------------------
+* Expands a raw word into a single allocated string, without field splitting (for assignments
+* and file names).
+*/
+char *expand_string(const char *raw) {
+   struct wordlist fields = { NULL, 0, 0 };
+   expand_word(raw, &fields, 0);
+   char *result = fields.count > 0 ? fields.words[0] : strdup("");
+   if (fields.count > 0)
+       fields.words[0] = NULL;
+   fields.count = 0;
+   wordlist_free(&fields);
+   return result;
+}
+
+
+/*
+* Function: expand_operand
+* ------------------------
+* Expands the word after the operator of a ${...}. For a pattern, quoted glob characters come
+* out backslash-escaped so they only match themselves. Returns an allocated string.
+*/
+char *expand_operand(const char *text, int len, int pattern) {
+   char *raw = strndup(text, len);
+   struct wpart parts[MAX_PARTS];
+   int n = raw ? compile_word(raw, parts, MAX_PARTS, 0) : -1;
+   struct field f = { { NULL, 0, 0 }, { NULL, 0, 0 }, 0, 0, 0, 0 };
+   if (n > 0)
+       expand_parts(raw, parts, n, NULL, &f, NULL, 0);
+   free(raw);
+   char *result = pattern ? f.pattern.buf : f.text.buf;
+   free(pattern ? f.text.buf : f.pattern.buf);
+   return result ? result : strdup("");
+}
+
+
+/*
+* Function: array_var
+* -------------------
+* Returns a variable as an array, creating it or turning a plain variable into one (its value
+* becoming element 0). Returns NULL for an indexed array wanted as an associative one.
+*/
+struct var *array_var(const char *name, int assoc) {
+   var_set(name, NULL, 0);   /* creates it, and logs its state if changes are being undone */
+   struct var *v = var_lookup(name, strlen(name));
+   if (v == NULL)
+       return NULL;
+   if (v->array != NULL) {
+       if (assoc && !(v->flags & VAR_ASSOC)) {
+           fprintf(stderr, "%s: cannot convert indexed to associative array\n", name);
+           return NULL;
+       }
+       return v;
+   }
+   v->array = calloc(1, sizeof(struct array));
+   if (v->array == NULL) {
+       perror("calloc failed");
+       return NULL;
+   }
+   v->flags |= assoc ? VAR_ASSOC : VAR_ARRAY;
+   if (!assoc && v->value[0] != '\0')
+       array_store(v->array, 0, v->value);
+   return v;
+}
+
+
+/*
+* Function: array_subscript
+* -------------------------
+* Works out which element a subscript names. For an associative array its expanded text is the
+* key (stored in *key, allocated); otherwise it is evaluated as arithmetic, a negative index
+* counting back from the end. Returns -1 after an error.
+*/
+int array_subscript(struct var *v, const char *sub, int len, char **key, long long *index) {
+   char *text = expand_operand(sub, len, 0);
+   *key = NULL;
+   if (v != NULL && (v->flags & VAR_ASSOC)) {
+       *key = text;
+       return 0;
+   }
+   int failed;
+   *index = arith_evaluate(text, 0, &failed);
+   free(text);
+   if (failed)
+       return -1;
+   if (*index < 0)
+       *index += (v && v->array) ? (long long)v->array->count : 1;
+   if (*index < 0) {
+       fprintf(stderr, "%.*s: bad array subscript\n", len, sub);
+       return -1;
+   }
+   return 0;
+}
+
+
+/*
+* Function: array_element
+* -----------------------
+* Returns element sub of the named variable (a plain variable being an array of one), or NULL
+* if it isn't set.
+*/
+const char *array_element(const char *name, int len, const char *sub, int sublen) {
+   struct var *v = var_lookup(name, len);
+   char *key;
+   long long index;
+   if (array_subscript(v, sub, sublen, &key, &index) < 0) {
+       expansion_failed = 1;
+       return NULL;
+   }
+   if (v == NULL)
+       return NULL;
+   if (key != NULL) {
+       struct array_entry *e = v->array ? assoc_find(v->array, key, 0) : NULL;
+       free(key);
+       return e ? e->value : NULL;
+   }
+   if (v->array == NULL)
+       return index == 0 ? v->value : NULL;
+   return (unsigned long long)index < v->array->count ? v->array->items[index] : NULL;
+}
+
+
+/*
+* Function: array_set_element
+* ---------------------------
+* Assigns name[sub], or unsets it for a NULL value. Returns -1 after an error.
+*/
+int array_set_element(const char *name, const char *sub, int sublen, const char *value) {
+   if (value == NULL && var_get(name) == NULL)
+       return 0;
+   struct var *v = array_var(name, 0);
+   char *key;
+   long long index;
+   if (v == NULL || array_subscript(v, sub, sublen, &key, &index) < 0)
+       return -1;
+   if (key != NULL) {
+       assoc_store(v->array, key, value);
+       free(key);
+       return 0;
+   }
+   array_store(v->array, index, value);
+   if (index == 0) {
+       /* element 0 doubles as the variable's value */
+       free(v->value);
+       v->value = strdup(value ? value : "");
+       if (v->flags & VAR_EXPORT)
+           var_update_env_entry(v);
+   }
+   return 0;
+}
+
+
+/*
+* Function: param_match
+* ---------------------
+* Finds the longest or shortest match of a pattern at the start (or, anchored at the end, the
+* end) of value, returning its length or -1.
+*/
+int param_match(const struct pattern *pat, const char *value, int len, int at_end, int longest) {
+   for (int i = 0; i <= len; i++) {
+       int k = longest ? len - i : i;
+       if (pattern_match(pat, at_end ? value + len - k : value, k))
+           return k;
+   }
+   return -1;
+}
+
+
+/*
+* Function: param_replace
+* -----------------------
+* ${name/pattern/string}: replaces the first (with //, every; with /#, a leading; with /%, a
+* trailing) longest match of the pattern in value, appending the result to out.
+*/
+void param_replace(const char *value, const char *word, int wlen, struct strbuf *out) {
+   int mode = (wlen > 0 && strchr("/#%", word[0]) != NULL) ? word[0] : 0;
+   if (mode) {
+       word++;
+       wlen--;
+   }
+   const char *slash = find_unquoted(word, word + wlen, '/');
+   char *pat_text = expand_operand(word, slash - word, 1);
+   char *replacement = (slash < word + wlen) ? expand_operand(slash + 1, word + wlen - slash - 1, 0) : strdup("");
+   const struct pattern *pat = NULL;
+   int len = strlen(value);
+   /* an empty pattern only means something anchored: ${x/#/pre} */
+   if ((*pat_text == '\0' && mode != '#' && mode != '%') || replacement == NULL ||
+       (pat = pattern_cached(pat_text)) == NULL) {
+       strbuf_append(out, value, len);
+       free(pat_text);
+       free(replacement);
+       return;
+   }
+
+
+   int i = 0;
+   if (mode == '#' || mode == '%') {
+       int k = param_match(pat, value, len, mode == '%', 1);
+       if (k >= 0 && mode == '#') {
+           strbuf_append(out, replacement, strlen(replacement));
+           i = k;
+       } else if (k >= 0) {
+           strbuf_append(out, value, len - k);
+           strbuf_append(out, replacement, strlen(replacement));
+           i = len;
+       }
+   } else {
+       while (i < len) {
+           int k = param_match(pat, value + i, len - i, 0, 1);
+           if (k > 0) {
+               strbuf_append(out, replacement, strlen(replacement));
+               i += k;
+               if (mode == 0)
+                   break;
+           } else {
+               strbuf_append(out, value + i, 1);
+               i++;
+           }
+       }
+   }
+   strbuf_append(out, value + i, len - i);
+   free(pat_text);
+   free(replacement);
+}
+
+
+/*
+* Function: param_substring
+* -------------------------
+* ${name:offset} and ${name:offset:length}, both arithmetic; a negative offset counts from the
+* end and a negative length leaves that many characters off the end. Returns -1 after an error.
+*/
+int param_substring(const char *value, const char *word, int wlen, struct strbuf *out) {
+   const char *colon = find_unquoted(word, word + wlen, ':');
+   long long len = strlen(value), offset, count = len;
+   int failed = 0;
+   char *text = expand_operand(word, colon - word, 0);
+   offset = arith_evaluate(text, 0, &failed);
+   free(text);
+   if (!failed && colon < word + wlen) {
+       text = expand_operand(colon + 1, word + wlen - colon - 1, 0);
+       count = arith_evaluate(text, 0, &failed);
+       free(text);
+   }
+   if (failed)
+       return -1;
+   if (offset < 0)
+       offset += len;
+   if (offset < 0 || offset > len)
+       return 0;
+   if (count < 0) {
+       count += len - offset;
+       if (count < 0) {
+           fprintf(stderr, "%.*s: substring expression < 0\n", wlen, word);
+           return -1;
+       }
+   }
+   if (count > len - offset)
+       count = len - offset;
+   strbuf_append(out, value + offset, count);
+   return 0;
+}
+
+
+/*
+* Function: param_case
+* --------------------
+* ${name^pattern}, ${name^^pattern}, ${name,pattern} and ${name,,pattern}: changes the case of
+* the first (or every) character matching the pattern, any character if there is none.
+*/
+void param_case(const char *value, const char *word, int wlen, struct strbuf *out) {
+   int upper = (word[0] == '^');
+   int all = (wlen > 1 && word[1] == word[0]);
+   char *pat_text = expand_operand(word + 1 + all, wlen - 1 - all, 1);
+   const struct pattern *pat = (*pat_text != '\0') ? pattern_cached(pat_text) : NULL;
+   for (size_t i = 0; value[i] != '\0'; i++) {
+       char c = value[i];
+       if ((i == 0 || all) && (pat == NULL || pattern_match(pat, value + i, 1)))
+           c = upper ? toupper((unsigned char)c) : tolower((unsigned char)c);
+       strbuf_append(out, &c, 1);
+   }
+   free(pat_text);
+}
+
+
+/*
+* Function: param_bad
+* -------------------
+* Reports a ${...} that can't be expanded and fails the command it is in.
+*/
+const char *param_bad(const char *text, int len) {
+   fprintf(stderr, "${%.*s}: bad substitution\n", len, text);
+   expansion_failed = 1;
+   return "";
+}
+
+
+/*
+* Function: param_operator
+* ------------------------
+* Applies the operator after the parameter in a ${...} to its value (NULL if unset): the
+* defaults ${name:-word}, ${name:=word}, ${name:+word} and ${name:?word} (without the colon an
+* empty value counts as set), prefix and suffix removal ${name#pattern} ${name##pattern}
+* ${name%pattern} ${name%%pattern}, ${name/pattern/string}, ${name:offset:length} and case
+* changes. Everything happens in the shell, patterns with the glob matcher. A result that isn't
+* the value itself is built in out. Returns NULL for an unknown operator.
+*/
+const char *param_operator(const char *name, int n, const char *sub, int sublen, const char *value,
+                          const char *op, int oplen, struct strbuf *out) {
+   int colon = (op[0] == ':' && oplen > 1 && strchr("-=+?", op[1]) != NULL);
+   const char *word = op + colon + 1;
+   int wlen = oplen - colon - 1;
+   strbuf_append(out, "", 0);
+   if (strchr("-=+?", op[colon]) != NULL) {
+       int set = (value != NULL && (!colon || value[0] != '\0'));
+       if ((op[colon] == '+') != set)
+           return (op[colon] == '+') ? "" : value;
+       char *expanded = expand_operand(word, wlen, 0);
+       strbuf_append(out, expanded, strlen(expanded));
+       if (op[colon] == '=') {
+           char var_name[MAX_LENGTH];
+           snprintf(var_name, sizeof(var_name), "%.*s", n, name);
+           if (sub != NULL) {
+               array_set_element(var_name, sub, sublen, expanded);
+           } else if (is_name_char(name[0], 1)) {
+               var_set(var_name, expanded, 0);
+           } else {
+               fprintf(stderr, "$%s: cannot assign in this way\n", var_name);
+               expansion_failed = 1;
+           }
+       } else if (op[colon] == '?') {
+           fprintf(stderr, "%.*s: %s\n", n, name, *expanded ? expanded : "parameter null or not set");
+           expansion_failed = 1;
+       }
+       free(expanded);
+       return out->buf;
+   }
+
+
+   if (value == NULL)
+       value = "";
+   if (op[0] == '#' || op[0] == '%') {
+       int longest = (oplen > 1 && op[1] == op[0]);
+       char *pat_text = expand_operand(op + 1 + longest, oplen - 1 - longest, 1);
+       const struct pattern *pat = pattern_cached(pat_text);
+       int value_len = strlen(value);
+       int k = pat ? param_match(pat, value, value_len, op[0] == '%', longest) : -1;
+       free(pat_text);
+       if (k < 0)
+           return value;
+       strbuf_append(out, value + (op[0] == '#' ? k : 0), value_len - k);
+   } else if (op[0] == '/') {
+       param_replace(value, op + 1, oplen - 1, out);
+   } else if (op[0] == ':') {
+       if (param_substring(value, op + 1, oplen - 1, out) < 0)
+           expansion_failed = 1;
+   } else if (op[0] == '^' || op[0] == ',') {
+       param_case(value, op, oplen, out);
+   } else {
+       return NULL;
+   }
+   return out->buf;
+}
+
+
+/*
+* Function: list_operator
+* -----------------------
+* Applies the operator after ${name[@]} or $@ to a list of elements in place. The defaults
+* (${name[@]:-word} and the like) look at the list as a whole and either keep it or replace it
+* with their one result; anything else (#, %, /, case changes) works on each element.
+* Returns -1 for an unknown operator.
+*/
+int list_operator(const char *name, int n, const char *sub, int sublen, struct wordlist *list, const char *op,
+                 int oplen) {
+   int colon = (op[0] == ':' && oplen > 1 && strchr("-=+?", op[1]) != NULL);
+   struct strbuf out = { NULL, 0, 0 };
+   if (strchr("-=+?", op[colon]) != NULL) {
+       struct strbuf joined = { NULL, 0, 0 };
+       list_join(list->words, list->count, 0, &joined);
+       const char *value = list->count > 0 ? joined.buf : NULL;
+       const char *result = param_operator(name, n, sub, sublen, value, op, oplen, &out);
+       if (result != value) {
+           for (int i = 0; i < list->count; i++)
+               free(list->words[i]);
+           list->count = 0;
+           wordlist_add(list, strdup(result));
+       }
+       free(joined.buf);
+       free(out.buf);
+       return 0;
+   }
+   for (int i = 0; i < list->count; i++) {
+       out.len = 0;
+       const char *result = param_operator(name, n, sub, sublen, list->words[i], op, oplen, &out);
+       if (result == NULL) {
+           free(out.buf);
+           return -1;
+       }
+       if (result != list->words[i]) {
+           char *copy = strdup(result);
+           free(list->words[i]);
+           list->words[i] = copy;
+       }
+   }
+   free(out.buf);
+   return 0;
+}
+
+
+/*
+* Function: param_expand
+* ----------------------
+* Expands the inside of a ${...} (or a bare $name): a parameter or array element name[sub],
+* all of an array's elements name[@] or name[*] or the positional parameters $@ and $* (each put
+* through any operator, then joined by list_join), ${#...} for a length or element count, ${!name[@]} for an array's subscripts, then
+* any operator (see param_operator). Returns NULL for an unset parameter with no operator.
+*/
+const char *param_expand(const char *text, int len, char *tmp, size_t tmp_size, struct strbuf *out) {
+   int length_of = (len > 1 && text[0] == '#');
+   int keys = (len > 1 && text[0] == '!');
+   const char *name = text + length_of + keys;
+   int rest = len - length_of - keys;
+   int n = param_name_length(name, rest);
+   int name_len = n;
+   const char *sub = NULL;
+   int sublen = 0;
+   if (n > 0 && n < rest && name[n] == '[' && is_name_char(name[0], 1)) {
+       const char *close = subscript_end(name + n);
+       if (close == NULL || close >= name + rest)
+           return param_bad(text, len);
+       sub = name + n + 1;
+       sublen = close - sub;
+       n = close + 1 - name;
+   }
+   int all = (sub != NULL && sublen == 1 && (*sub == '@' || *sub == '*')) ||
+             (sub == NULL && n == 1 && (name[0] == '@' || name[0] == '*'));
+   if (n == 0 || (length_of && n != rest) || (keys && (!all || sub == NULL)))
+       return param_bad(text, len);
+
+
+   const char *value;
+   struct strbuf joined = { NULL, 0, 0 };
+   if (all) {
+       struct wordlist elements = { NULL, 0, 0 };
+       int slice = !length_of && is_slice(name + n, rest - n);
+       param_list(name, name_len, keys, slice, &elements);
+       if (slice) {
+           if (array_slice(&elements, name + n + 1, rest - n - 1) < 0)
+               expansion_failed = 1;
+       } else if (!length_of && n < rest &&
+                  list_operator(name, name_len, sub, sublen, &elements, name + n, rest - n) < 0) {
+           wordlist_free(&elements);
+           return param_bad(text, len);
+       }
+       if (!length_of)
+           n = rest;
+       list_join(elements.words, elements.count, sub != NULL ? *sub == '*' : name[0] == '*', &joined);
+       if (length_of) {
+           snprintf(tmp, tmp_size, "%d", elements.count);
+           wordlist_free(&elements);
+           free(joined.buf);
+           return tmp;
+       }
+       value = elements.count > 0 ? joined.buf : NULL;
+       wordlist_free(&elements);
+   } else if (sub != NULL) {
+       value = array_element(name, name_len, sub, sublen);
+   } else {
+       value = param_value(name, n, tmp, tmp_size);
+   }
+   if (length_of) {
+       size_t value_len = value ? strlen(value) : 0;
+       snprintf(tmp, tmp_size, "%zu", value_len);
+       value = tmp;
+   } else if (n < rest) {
+       value = param_operator(name, name_len, sub, sublen, value, name + n, rest - n, out);
+       if (value == NULL)
+           value = param_bad(text, len);
+   }
+   if (value != NULL && value == joined.buf) {
+       /* the joined elements are about to be freed */
+       strbuf_append(out, value, strlen(value));
+       value = out->buf;
+   }
+   free(joined.buf);
+   return value;
+}
+
+
+/*
+* Function: array_assign
+* ----------------------
+* Assigns NAME=(...), replacing all of the array's elements, or with append (NAME+=(...)) adding
+* to them. An element written [subscript]=value sets that element; any other word is split and
+* glob expanded into the next indexes. If an element's expansion fails the array is left as it was.
+*/
+void array_assign(struct program *prog, const struct cword *w, const char *name, int append) {
+   struct var *v = var_lookup(name, strlen(name));
+   int assoc = (v != NULL && (v->flags & VAR_ASSOC));
+   /* expand everything first: the words may refer to the array's old elements */
+   struct wordlist values = { NULL, 0, 0 };
+   struct wordlist subscripts = { NULL, 0, 0 };   /* raw subscript of each value, "" if none */
+   for (int i = 0; i < w->nelements; i++) {
+       const struct cword *e = &prog->words[w->first_element + i];
+       const char *raw = prog->pool + e->text;
+       int prefix = element_subscript(raw);
+       if (prefix > 0) {
+           wordlist_add(&values, expand_cword_string(prog, e));
+           wordlist_add(&subscripts, strndup(raw + 1, prefix - 3));
+       } else {
+           expand_cword(prog, e, &values, 1);
+       }
+       while (subscripts.count < values.count)
+           wordlist_add(&subscripts, strdup(""));
+   }
+   if (expansion_failed) {
+       wordlist_free(&values);
+       wordlist_free(&subscripts);
+       return;
+   }
+
+
+   var_set(name, NULL, 0);   /* logs the old state if changes are being undone */
+   v = var_lookup(name, strlen(name));
+   if (append) {
+       v = array_var(name, assoc);
+   } else if (v != NULL) {
+       array_free(v->array);
+       v->array = NULL;
+       v->flags &= ~(VAR_ARRAY | VAR_ASSOC);
+       free(v->value);
+       v->value = strdup("");
+       v = array_var(name, assoc);
+   }
+   long long next = (append && v != NULL) ? (long long)v->array->count : 0;
+   for (int i = 0; v != NULL && i < values.count; i++) {
+       char *key = NULL;
+       long long index = next;
+       const char *sub = subscripts.words[i];
+       if (*sub != '\0') {
+           if (array_subscript(v, sub, strlen(sub), &key, &index) < 0)
+               continue;
+       } else if (assoc) {
+           fprintf(stderr, "%s: %s: must use subscript when assigning associative array\n", name, values.words[i]);
+           continue;
+       }
+       if (key != NULL) {
+           assoc_store(v->array, key, values.words[i]);
+           free(key);
+       } else {
+           array_store(v->array, index, values.words[i]);
+           next = index + 1;
+       }
+   }
+   if (v != NULL && !assoc) {
+       free(v->value);
+       v->value = strdup(v->array->count > 0 && v->array->items[0] ? v->array->items[0] : "");
+   }
+   wordlist_free(&values);
+   wordlist_free(&subscripts);
+}
+
+
+/*
+* Function: apply_assignments
+* ---------------------------
+* Performs the NAME=value and NAME+=value words of a command, expanding each value first. Stops at the first
+* value whose expansion fails, which is not assigned, and returns -1 (expansion_failed is left
+* set); otherwise returns 0.
+*/
+int apply_assignments(struct program *prog, const struct ccommand *cmd, int flags) {
+   for (int i = 0; i < cmd->nassigns; i++) {
+       const struct cword *w = &prog->words[cmd->first_word + i];
+       const char *raw = prog->pool + w->text;
+       int name_len = is_assignment(raw);
+       int append = raw[name_len - 1] == '+';
+       const char *bracket = memchr(raw, '[', name_len);
+       int sub_len = bracket ? raw + name_len - append - 1 - (bracket + 1) : 0;
+       char name[MAX_LENGTH];
+       snprintf(name, sizeof(name), "%.*s", bracket ? (int)(bracket - raw) : name_len - append, raw);
+       if (w->nelements >= 0) {
+           array_assign(prog, w, name, append);
+           if (expansion_failed)
+               return -1;
+           continue;
+       }
+       char *value = expand_cword_string(prog, w);   /* the parts only cover the value */
+       if (expansion_failed) {
+           free(value);
+           return -1;
+       }
+       const char *old = !append ? NULL : bracket ? array_element(name, strlen(name), bracket + 1, sub_len) : var_get(name);
+       if (old != NULL && old[0] != '\0') {
+           struct strbuf joined = { NULL, 0, 0 };
+           strbuf_append(&joined, old, strlen(old));
+           strbuf_append(&joined, value, strlen(value));
+           free(value);
+           value = joined.buf;
+       }
+       if (bracket != NULL)
+           array_set_element(name, bracket + 1, sub_len, value);
+       else
+           var_set(name, value, flags);
+       free(value);
+   }
+   return 0;
+}
+
+
+/*
+* Function: shell_write
+* ---------------------
+* Writes builtin output: into the capture buffer during an in-process $(...), otherwise to stdout.
+*/
+void shell_write(const char *text, size_t len) {
+   if (capture_output != NULL) {
+       strbuf_append(capture_output, text, len);
+       return;
+   }
+   fflush(stdout);  /* keep ordering with anything printed through stdio */
+   while (len > 0) {
+       ssize_t n = write(STDOUT_FILENO, text, len);
+       if (n < 0) {
+           if (errno == EINTR)
+               continue;
+           return;   /* reader went away */
+       }
+       text += n;
+       len -= n;
+   }
+}
+
+
+/*
+* Function: shell_printf
+* ----------------------
+* printf-style wrapper around shell_write for builtins.
+*/
+void shell_printf(const char *format, ...) {
+   char small[512];
+   va_list ap;
+   va_start(ap, format);
+   int n = vsnprintf(small, sizeof(small), format, ap);
+   va_end(ap);
+   if (n < 0)
+       return;
+   if ((size_t)n < sizeof(small)) {
+       shell_write(small, n);
+       return;
+   }
+   char *big = malloc(n + 1);
+   if (big == NULL)
+       return;
+   va_start(ap, format);
+   vsnprintf(big, n + 1, format, ap);
+   va_end(ap);
+   shell_write(big, n);
+   free(big);
+}
+
+
+/*
+* Function: strbuf_printf
+* -----------------------
+* printf-style append to a string buffer.
+*/
+void strbuf_printf(struct strbuf *sb, const char *format, ...) {
+   char small[256];
+   va_list ap;
+   va_start(ap, format);
+   int n = vsnprintf(small, sizeof(small), format, ap);
+   va_end(ap);
+   if (n < 0)
+       return;
+   if ((size_t)n < sizeof(small)) {
+       strbuf_append(sb, small, n);
+       return;
+   }
+   char *big = malloc(n + 1);
+   if (big == NULL)
+       return;
+   va_start(ap, format);
+   vsnprintf(big, n + 1, format, ap);
+   va_end(ap);
+   strbuf_append(sb, big, n);
+   free(big);
+}
+
+
+/*
+* Function: append_escape
+* -----------------------
+* Appends the character(s) for the backslash escape at *p (just after the backslash) and moves
+* *p past it. octal_zero selects the echo/%b form \0NNN instead of printf's \NNN.
+* Returns 1 for \c, which means "stop output here".
+*/
+int append_escape(const char **p, struct strbuf *out, int octal_zero) {
+   const char *s = *p;
+   char c = *s++;
+   char value;
+   switch (c) {
+   case 'a': value = '\a'; break;
+   case 'b': value = '\b'; break;
+   case 'e': value = 27; break;
+   case 'f': value = '\f'; break;
+   case 'n': value = '\n'; break;
+   case 'r': value = '\r'; break;
+   case 't': value = '\t'; break;
+   case 'v': value = '\v'; break;
+   case '\\': value = '\\'; break;
+   case 'c':
+       *p = s;
+       return 1;
+   case 'x': {
+       int digits = 0, v = 0;
+       while (digits < 2 && isxdigit((unsigned char)*s)) {
+           v = v * 16 + (isdigit((unsigned char)*s) ? *s - '0' : (tolower((unsigned char)*s) - 'a' + 10));
+           s++;
+           digits++;
+       }
+       if (digits == 0) {
+           strbuf_append(out, "\\x", 2);   /* not an escape after all */
+           *p = s;
+           return 0;
+       }
+       value = (char)v;
+       break;
+   }
+   default:
+       if (c >= '0' && c <= '7' && (!octal_zero || c == '0')) {
+           int v = octal_zero ? 0 : c - '0';
+           int digits = octal_zero ? 0 : 1;
+           while (digits < 3 && *s >= '0' && *s <= '7') {
+               v = v * 8 + (*s++ - '0');
+               digits++;
+           }
+           value = (char)v;
+           break;
+       }
+       /* unknown escape: keep the backslash */
+       strbuf_append(out, "\\", 1);
+       if (c == '\0') {
+           *p = s - 1;
+           return 0;
+       }
+       value = c;
+   }
+   strbuf_append(out, &value, 1);
+   *p = s;
+   return 0;
+}
+
+
+/*
+* Function: builtin_cd
+* --------------------
+* Implements the cd command to change directories.
+*/
+int builtin_cd(char *args[]) {
+   /* case no directory provided */
+   if (args[1] == NULL) {
+       fprintf(stderr, "cd: expected argument\n");
+       return 1;
+   }
+   /* an in-process subshell remembers where to come back to */
+   if (subshell_depth > 0 && subshell_cwd_fd < 0)
+       subshell_cwd_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+   /* change directory */
+   if (chdir(args[1]) != 0) {
+       perror("chdir failed");
+       return 1;
+   }
+   return 0;
+}
+
+
+/*
+* Function: builtin_exit
+* ----------------------
+* Implements the exit command to terminate the shell.
+*/
+int builtin_exit(char *args[]) {
+   int code = args[1] ? atoi(args[1]) : last_status;
+   if (subshell_depth > 0) {
+       /* inside an in-process $(...) only the substitution ends */
+       subshell_exited = 1;
+       return code;
+   }
+   exit(code);
+}
+
+
+/*
+* Function: builtin_export
+* ------------------------
+* Marks variables for the environment (optionally assigning them), or lists them.
+*/
+int builtin_export(char *args[]) {
+   int status = 0;
+   /* no arguments: list the exported variables in a form that can be read back */
+   if (args[1] == NULL || strcmp(args[1], "-p") == 0) {
+       char **env = build_envp();
+       size_t count = 0;
+       while (env[count] != NULL)
+           count++;
+       char **sorted = malloc((count + 1) * sizeof(char *));
+       if (sorted == NULL) {
+           perror("malloc failed");
+           return 1;
+       }
+       memcpy(sorted, env, count * sizeof(char *));
+       qsort(sorted, count, sizeof(char *), compare_strings);
+       for (size_t i = 0; i < count; i++) {
+           char *equals = strchr(sorted[i], '=');
+           shell_printf("export %.*s=\"%s\"\n", (int)(equals - sorted[i]), sorted[i], equals + 1);
+       }
+       free(sorted);
+       return 0;
+   }
+   for (int i = 1; args[i] != NULL; i++) {
+       char *equals = strchr(args[i], '=');
+       if (equals != NULL)
+           *equals = '\0';   /* split NAME=value */
+       if (!is_name_char(args[i][0], 1)) {
+           fprintf(stderr, "export: '%s': not a valid identifier\n", args[i]);
+           status = 1;
+           continue;
+       }
+       var_set(args[i], equals ? equals + 1 : NULL, VAR_EXPORT);
+   }
+   return status;
+}
+
+
+/*
+* Function: builtin_unset
+* -----------------------
+* Removes shell variables, or functions with -f. Without -v a name that is no variable but a
+* function removes the function.
+*/
+int builtin_unset(char *args[]) {
+   int functions = 0, variables = 0;
+   int i = 1;
+   for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+       if (strcmp(args[i], "-f") == 0) {
+           functions = 1;
+       } else if (strcmp(args[i], "-v") == 0) {
+           variables = 1;
+       } else {
+           fprintf(stderr, "unset: %s: invalid option\n", args[i]);
+           return 2;
+       }
+   }
+   for (; args[i] != NULL; i++) {
+       char *bracket = functions ? NULL : strchr(args[i], '[');
+       size_t len = strlen(args[i]);
+       if (bracket != NULL && args[i][len - 1] == ']') {
+           /* unset name[subscript] removes one element (for a coprocess's 0 or 1, closing it) */
+           *bracket = '\0';
+           array_set_element(args[i], bracket + 1, args[i] + len - 1 - (bracket + 1), NULL);
+           if (len - (bracket - args[i]) == 3 && (bracket[1] == '0' || bracket[1] == '1'))
+               coproc_close(args[i], bracket[1] - '0');
+       } else if (functions) {
+           function_unset(args[i]);
+       } else {
+           if (var_get(args[i]) != NULL || variables)
+               var_unset(args[i]);
+           else
+               function_unset(args[i]);
+           coproc_close(args[i], -1);
+       }
+   }
+   return 0;
+}
+
+
+/*
+* Function: declare_print
+* -----------------------
+* Prints a variable as the declare command that would recreate it.
+*/
+void declare_print(struct var *v) {
+   const char *kind = (v->flags & VAR_ASSOC) ? "A" : (v->flags & VAR_ARRAY) ? "a" : "-";
+   const char *exported = (v->flags & VAR_EXPORT) ? "x" : "";
+   if (v->array == NULL) {
+       shell_printf("declare -%s%s %s=\"%s\"\n", kind, exported, v->name, v->value);
+       return;
+   }
+   struct wordlist keys = { NULL, 0, 0 };
+   struct wordlist values = { NULL, 0, 0 };
+   array_list(v->name, strlen(v->name), 1, &keys);
+   array_list(v->name, strlen(v->name), 0, &values);
+   shell_printf("declare -%s%s %s=(", kind, exported, v->name);
+   for (int i = 0; i < keys.count; i++)
+       shell_printf("%s[%s]=\"%s\"", i ? " " : "", keys.words[i], values.words[i]);
+   shell_printf(")\n");
+   wordlist_free(&keys);
+   wordlist_free(&values);
+}
+
+
+/*
+* Function: builtin_declare
+* -------------------------
+* Declares variables: -a makes indexed arrays, -A associative ones and -x exports them. A
+* NAME=value argument assigns element 0 of an array; NAME=(...) arguments are assigned by
+* run_simple once this has run. -p prints the named variables.
+*/
+int builtin_declare(char *args[]) {
+   int flags = 0, print = 0, status = 0;
+   int i = 1;
+   for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+       for (const char *o = args[i] + 1; *o != '\0'; o++) {
+           if (*o == 'a')
+               flags |= VAR_ARRAY;
+           else if (*o == 'A')
+               flags |= VAR_ASSOC;
+           else if (*o == 'x')
+               flags |= VAR_EXPORT;
+           else if (*o == 'p')
+               print = 1;
+           else {
+               fprintf(stderr, "declare: -%c: invalid option\n", *o);
+               return 2;
+           }
+       }
+   }
+   for (; args[i] != NULL; i++) {
+       char *equals = strchr(args[i], '=');
+       int append = 0;
+       if (equals != NULL) {
+           *equals = '\0';   /* split NAME=value */
+           append = equals > args[i] && equals[-1] == '+';
+           if (append)
+               equals[-1] = '\0';
+       }
+       if (!is_name_char(args[i][0], 1)) {
+           fprintf(stderr, "declare: '%s': not a valid identifier\n", args[i]);
+           status = 1;
+           continue;
+       }
+       if (print) {
+           struct var *v = var_lookup(args[i], strlen(args[i]));
+           if (v != NULL) {
+               declare_print(v);
+           } else {
+               fprintf(stderr, "declare: %s: not found\n", args[i]);
+               status = 1;
+           }
+           continue;
+       }
+       const char *value = equals ? equals + 1 : NULL;
+       struct strbuf joined = { NULL, 0, 0 };
+       const char *old = append ? var_get(args[i]) : NULL;
+       if (old != NULL) {
+           /* NAME+=value */
+           strbuf_append(&joined, old, strlen(old));
+           strbuf_append(&joined, value, strlen(value));
+           value = joined.buf;
+       }
+       if (flags & (VAR_ARRAY | VAR_ASSOC)) {
+           struct var *v = array_var(args[i], flags & VAR_ASSOC);
+           if (v == NULL) {
+               free(joined.buf);
+               status = 1;
+               continue;
+           }
+           if (value != NULL)
+               array_set_element(args[i], "0", 1, value);
+       }
+       var_set(args[i], !(flags & (VAR_ARRAY | VAR_ASSOC)) ? value : NULL, flags & VAR_EXPORT);
+       free(joined.buf);
+   }
+   return status;
+}
+
+
+/*
+* Function: builtin_true
+* ----------------------
+* Does nothing, successfully.
+*/
+int builtin_true(char *args[]) {
+   (void)args;
+   return 0;
+}
+
+
+/*
+* Function: builtin_false
+* -----------------------
+* Does nothing, unsuccessfully.
+*/
+int builtin_false(char *args[]) {
+   (void)args;
+   return 1;
+}
+
+
+/*
+* Function: builtin_echo
+* ----------------------
+* Prints its arguments separated by spaces. -n drops the newline, -e interprets backslash
+* escapes and -E (the default) doesn't.
+*/
+int builtin_echo(char *args[]) {
+   int newline = 1, escapes = 0;
+   int i = 1;
+   /* options only count if every letter is one echo knows */
+   while (args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0' && strspn(args[i] + 1, "neE") == strlen(args[i] + 1)) {
+       for (char *o = args[i] + 1; *o != '\0'; o++) {
+           if (*o == 'n')
+               newline = 0;
+           else
+               escapes = (*o == 'e');
+       }
+       i++;
+   }
+
+
+   struct strbuf out = { NULL, 0, 0 };
+   for (int first = i; args[i] != NULL; i++) {
+       if (i > first)
+           strbuf_append(&out, " ", 1);
+       if (!escapes) {
+           strbuf_append(&out, args[i], strlen(args[i]));
+           continue;
+       }
+       for (const char *p = args[i]; *p != '\0'; ) {
+           if (*p != '\\') {
+               strbuf_append(&out, p++, 1);
+               continue;
+           }
+           p++;
+           if (append_escape(&p, &out, 1)) {
+               shell_write(out.buf, out.len);   /* \c: stop right here */
+               free(out.buf);
+               return 0;
+           }
+       }
+   }
+   if (newline)
+       strbuf_append(&out, "\n", 1);
+   shell_write(out.buf ? out.buf : "", out.len);
+   free(out.buf);
+   return 0;
+}
+
+
+/*
+* Function: printf_number
+* -----------------------
+* Converts a printf argument to a number: 'c or "c gives the character code. Reports bad input.
+*/
+long long printf_number(const char *arg, int *status) {
+   if (arg == NULL || *arg == '\0')
+       return 0;
+   if (arg[0] == '\'' || arg[0] == '"')
+       return (unsigned char)arg[1];
+   char *end;
+   errno = 0;
+   long long value = strtoll(arg, &end, 0);
+   if (*end != '\0' || errno != 0) {
+       fprintf(stderr, "printf: '%s': invalid number\n", arg);
+       *status = 1;
+   }
+   return value;
+}
+
+
+/*
+* Function: builtin_printf
+* ------------------------
+* Formats its arguments like printf(1): %s %b %c %d %i %u %o %x %X %f %e %g %% with flags, width
+* and precision (including *). The format is reused until all arguments are consumed.
+*/
+int builtin_printf(char *args[]) {
+   if (args[1] == NULL) {
+       fprintf(stderr, "printf: usage: printf format [arguments]\n");
+       return 2;
+   }
+   const char *format = args[1];
+   char **argp = &args[2];
+   struct strbuf out = { NULL, 0, 0 };
+   int status = 0;
+   int stop = 0;   /* \c seen */
+
+
+   do {
+       char **round_start = argp;
+       for (const char *p = format; *p != '\0' && !stop; ) {
+           if (*p == '\\') {
+               p++;
+               stop = append_escape(&p, &out, 0);
+               continue;
+           }
+           if (*p != '%') {
+               const char *next = p;
+               while (*next != '\0' && *next != '%' && *next != '\\')
+                   next++;
+               strbuf_append(&out, p, next - p);
+               p = next;
+               continue;
+           }
+           if (p[1] == '%') {
+               strbuf_append(&out, "%", 1);
+               p += 2;
+               continue;
+           }
+
+
+           /* collect "%[flags][width][.precision]" into spec, resolving * from the arguments */
+           char spec[64];
+           size_t n = 0;
+           spec[n++] = *p++;
+           while (*p != '\0' && strchr("-+ #0", *p) != NULL && n < 20)
+               spec[n++] = *p++;
+           if (*p == '*') {
+               n += snprintf(spec + n, sizeof(spec) - n, "%d", (int)printf_number(*argp, &status));
+               if (*argp != NULL)
+                   argp++;
+               p++;
+           } else {
+               while (isdigit((unsigned char)*p) && n < 40)
+                   spec[n++] = *p++;
+           }
+           if (*p == '.') {
+               spec[n++] = *p++;
+               if (*p == '*') {
+                   n += snprintf(spec + n, sizeof(spec) - n, "%d", (int)printf_number(*argp, &status));
+                   if (*argp != NULL)
+                       argp++;
+                   p++;
+               } else {
+                   while (isdigit((unsigned char)*p) && n < 60)
+                       spec[n++] = *p++;
+               }
+           }
+           while (*p != '\0' && strchr("hlLqjzt", *p) != NULL)
+               p++;   /* length modifiers are meaningless here */
+           char conversion = *p;
+           if (conversion == '\0') {
+               fprintf(stderr, "printf: missing format character\n");
+               status = 1;
+               break;
+           }
+           p++;
+           const char *arg = *argp;
+           if (arg != NULL)
+               argp++;
+
+
+           switch (conversion) {
+           case 's':
+           case 'b':
+           case 'c': {
+               struct strbuf text = { NULL, 0, 0 };
+               if (conversion == 'b' && arg != NULL) {
+                   for (const char *a = arg; *a != '\0' && !stop; ) {
+                       if (*a == '\\') {
+                           a++;
+                           stop = append_escape(&a, &text, 1);
+                       } else {
+                           strbuf_append(&text, a++, 1);
+                       }
+                   }
+               } else if (arg != NULL) {
+                   strbuf_append(&text, arg, conversion == 'c' ? (arg[0] != '\0') : strlen(arg));
+               }
+               spec[n++] = 's';
+               spec[n] = '\0';
+               strbuf_printf(&out, spec, text.buf ? text.buf : "");
+               free(text.buf);
+               break;
+           }
+           case 'd':
+           case 'i':
+               spec[n++] = 'l';
+               spec[n++] = 'l';
+               spec[n++] = 'd';
+               spec[n] = '\0';
+               strbuf_printf(&out, spec, printf_number(arg, &status));
+               break;
+           case 'u':
+           case 'o':
+           case 'x':
+           case 'X':
+               spec[n++] = 'l';
+               spec[n++] = 'l';
+               spec[n++] = conversion;
+               spec[n] = '\0';
+               strbuf_printf(&out, spec, (unsigned long long)printf_number(arg, &status));
+               break;
+           case 'f':
+           case 'F':
+           case 'e':
+           case 'E':
+           case 'g':
+           case 'G':
+           case 'a':
+           case 'A': {
+               double value = 0;
+               if (arg != NULL && *arg != '\0') {
+                   char *end;
+                   value = strtod(arg, &end);
+                   if (*end != '\0') {
+                       fprintf(stderr, "printf: '%s': invalid number\n", arg);
+                       status = 1;
+                   }
+               }
+               spec[n++] = conversion;
+               spec[n] = '\0';
+               strbuf_printf(&out, spec, value);
+               break;
+           }
+           default:
+               fprintf(stderr, "printf: '%c': invalid format character\n", conversion);
+               status = 1;
+               stop = 1;
+           }
+       }
+       /* reuse the format while it keeps consuming arguments */
+       if (argp == round_start)
+           break;
+   } while (*argp != NULL && !stop);
+
+
+   shell_write(out.buf ? out.buf : "", out.len);
+   free(out.buf);
+   return status;
+}
+
+
+/*
+* Function: builtin_pwd
+* ---------------------
+* Prints the current working directory.
+*/
+int builtin_pwd(char *args[]) {
+   (void)args;
+   char path[PATH_MAX];
+   if (getcwd(path, sizeof(path)) == NULL) {
+       perror("pwd");
+       return 1;
+   }
+   shell_printf("%s\n", path);
+   return 0;
+}
+
+
+/*
+* Function: test_integer
+* ----------------------
+* Parses an integer operand for test, flagging an error if it isn't one.
+*/
+long long test_integer(struct test_state *t, const char *text) {
+   char *end;
+   errno = 0;
+   long long value = strtoll(text, &end, 10);
+   while (*end == ' ' || *end == '\t')
+       end++;
+   if (*text == '\0' || *end != '\0' || errno != 0) {
+       fprintf(stderr, "test: %s: integer expression expected\n", text);
+       t->error = 1;
+   }
+   return value;
+}
+
+
+/*
+* Function: test_binary_op
+* ------------------------
+* Returns true if word is one of test's binary operators.
+*/
+int test_binary_op(const char *word) {
+   static const char *ops[] = { "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge",
+                                "-nt", "-ot", "-ef", NULL };
+   for (int i = 0; ops[i] != NULL; i++) {
+       if (strcmp(word, ops[i]) == 0)
+           return 1;
+   }
+   return 0;
+}
+
+
+/*
+* Function: test_unary
+* --------------------
+* Evaluates a unary test such as -f file or -z string.
+*/
+int test_unary(struct test_state *t, char op, const char *arg) {
+   struct stat st;
+   switch (op) {
+   case 'z': return arg[0] == '\0';
+   case 'n': return arg[0] != '\0';
+   case 't': return isatty(atoi(arg));
+   case 'r': return access(arg, R_OK) == 0;
+   case 'w': return access(arg, W_OK) == 0;
+   case 'x': return access(arg, X_OK) == 0;
+   case 'L':
+   case 'h': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+   }
+   if (stat(arg, &st) != 0)
+       return 0;
+   switch (op) {
+   case 'e': return 1;
+   case 'f': return S_ISREG(st.st_mode);
+   case 'd': return S_ISDIR(st.st_mode);
+   case 'b': return S_ISBLK(st.st_mode);
+   case 'c': return S_ISCHR(st.st_mode);
+   case 'p': return S_ISFIFO(st.st_mode);
+   case 'S': return S_ISSOCK(st.st_mode);
+   case 's': return st.st_size > 0;
+   case 'u': return (st.st_mode & S_ISUID) != 0;
+   case 'g': return (st.st_mode & S_ISGID) != 0;
+   case 'k': return (st.st_mode & S_ISVTX) != 0;
+   case 'O': return st.st_uid == geteuid();
+   case 'G': return st.st_gid == getegid();
+   }
+   fprintf(stderr, "test: -%c: unary operator expected\n", op);
+   t->error = 1;
+   return 0;
+}
+
+
+/*
+* Function: test_binary
+* ---------------------
+* Evaluates a binary test such as a = b, 3 -lt 4 or f1 -nt f2.
+*/
+int test_binary(struct test_state *t, const char *left, const char *op, const char *right) {
+   if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0)
+       return strcmp(left, right) == 0;
+   if (strcmp(op, "!=") == 0)
+       return strcmp(left, right) != 0;
+   if (strcmp(op, "<") == 0)
+       return strcmp(left, right) < 0;
+   if (strcmp(op, ">") == 0)
+       return strcmp(left, right) > 0;
+   if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0) {
+       struct stat a, b;
+       int have_a = stat(left, &a) == 0, have_b = stat(right, &b) == 0;
+       if (op[1] == 'e')
+           return have_a && have_b && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+       if (!have_a || !have_b)
+           return op[1] == 'n' ? have_a : have_b;   /* an existing file is newer than a missing one */
+       int cmp = (a.st_mtim.tv_sec != b.st_mtim.tv_sec) ? (a.st_mtim.tv_sec > b.st_mtim.tv_sec ? 1 : -1)
+               : (a.st_mtim.tv_nsec > b.st_mtim.tv_nsec) - (a.st_mtim.tv_nsec < b.st_mtim.tv_nsec);
+       return op[1] == 'n' ? cmp > 0 : cmp < 0;
+   }
+   long long l = test_integer(t, left), r = test_integer(t, right);
+   if (strcmp(op, "-eq") == 0) return l == r;
+   if (strcmp(op, "-ne") == 0) return l != r;
+   if (strcmp(op, "-lt") == 0) return l < r;
+   if (strcmp(op, "-le") == 0) return l <= r;
+   if (strcmp(op, "-gt") == 0) return l > r;
+   return l >= r;
+}
+
+
+/*
+* Function: test_primary
+* ----------------------
+* Parses and evaluates one test primary: ( expr ), ! primary, a unary or binary test, or a string.
+*/
+int test_primary(struct test_state *t) {
+   if (t->pos >= t->end) {
+       fprintf(stderr, "test: argument expected\n");
+       t->error = 1;
+       return 0;
+   }
+   char **a = t->argv;
+   int left = t->end - t->pos;   /* words remaining */
+
+
+   /* binary operators win over everything else: [ ! = x ] compares "!" with "x" */
+   if (left >= 3 && test_binary_op(a[t->pos + 1])) {
+       int result = test_binary(t, a[t->pos], a[t->pos + 1], a[t->pos + 2]);
+       t->pos += 3;
+       return result;
+   }
+   if (strcmp(a[t->pos], "!") == 0 && left >= 2) {
+       t->pos++;
+       return !test_primary(t);
+   }
+   if (strcmp(a[t->pos], "(") == 0 && left >= 3) {
+       t->pos++;
+       int result = test_or(t);
+       if (t->pos >= t->end || strcmp(a[t->pos], ")") != 0) {
+           fprintf(stderr, "test: ')' expected\n");
+           t->error = 1;
+           return 0;
+       }
+       t->pos++;
+       return result;
+   }
+   if (a[t->pos][0] == '-' && a[t->pos][1] != '\0' && a[t->pos][2] == '\0' && left >= 2) {
+       int result = test_unary(t, a[t->pos][1], a[t->pos + 1]);
+       t->pos += 2;
+       return result;
+   }
+   return a[t->pos++][0] != '\0';   /* a lone string is true when not empty */
+}
+
+
+/*
+* Function: test_and
+* ------------------
+* Parses primaries joined by -a.
+*/
+int test_and(struct test_state *t) {
+   int result = test_primary(t);
+   while (t->pos < t->end && strcmp(t->argv[t->pos], "-a") == 0) {
+       t->pos++;
+       result = test_primary(t) && result;
+   }
+   return result;
+}
+
+
+/*
+* Function: test_or
+* -----------------
+* Parses -a groups joined by -o (lower precedence than -a).
+*/
+int test_or(struct test_state *t) {
+   int result = test_and(t);
+   while (t->pos < t->end && strcmp(t->argv[t->pos], "-o") == 0) {
+       t->pos++;
+       result = test_and(t) || result;
+   }
+   return result;
+}
+
+
+/*
+* Function: builtin_test
+* ----------------------
+* Implements test and [ ... ]: file, string and integer tests with !, -a, -o and parentheses.
+* Exit status 0 is true, 1 false and 2 a usage error.
+*/
+int builtin_test(char *args[]) {
+   int argc = 0;
+   while (args[argc] != NULL)
+       argc++;
+   if (strcmp(args[0], "[") == 0) {
+       if (strcmp(args[argc - 1], "]") != 0) {
+           fprintf(stderr, "[: missing ']'\n");
+           return 2;
+       }
+       argc--;   /* drop the closing bracket */
+   }
+   struct test_state t = { args, 1, argc, 0 };
+   if (argc == 1)
+       return 1;   /* no expression is false */
+   int result = test_or(&t);
+   if (!t.error && t.pos < t.end) {
+       fprintf(stderr, "test: %s: unexpected argument\n", args[t.pos]);
+       t.error = 1;
+   }
+   return t.error ? 2 : !result;
+}
+
+
+/*
+* Function: cond_regex
+* --------------------
+* text =~ pattern for a [[ ... ]]. The regex_t is kept in the operator's slot and only compiled
+* again if the expanded pattern changes, so a loop doesn't recompile it on every pass. The
+* matched text and groups go into BASH_REMATCH.
+*/
+int cond_regex(struct program *prog, const struct ccond *c, const char *text, int *error) {
+   if (prog->regexes == NULL) {
+       prog->regexes = calloc(prog->nregex, sizeof(struct regex_slot));
+       if (prog->regexes == NULL) {
+           perror("calloc failed");
+           *error = 1;
+           return 0;
+       }
+   }
+   struct regex_slot *slot = &prog->regexes[c->regex];
+   char *source = expand_regex(prog, &prog->words[c->b]);
+   if (slot->source != NULL && strcmp(slot->source, source) == 0) {
+       free(source);
+   } else {
+       if (slot->source != NULL) {
+           regfree(&slot->re);
+           free(slot->source);
+           slot->source = NULL;
+       }
+       int rc = regcomp(&slot->re, source, REG_EXTENDED);
+       if (rc != 0) {
+           char message[128];
+           regerror(rc, &slot->re, message, sizeof(message));
+           fprintf(stderr, "%s: %s\n", source, message);
+           free(source);
+           *error = 1;
+           return 0;
+       }
+       slot->source = source;
+   }
+
+
+   size_t ngroups = slot->re.re_nsub + 1;
+   regmatch_t *groups = malloc(ngroups * sizeof(regmatch_t));
+   if (groups == NULL) {
+       perror("malloc failed");
+       *error = 1;
+       return 0;
+   }
+   int matched = (regexec(&slot->re, text, ngroups, groups, 0) == 0);
+   var_unset("BASH_REMATCH");
+   struct var *v = matched ? array_var("BASH_REMATCH", 0) : NULL;
+   for (size_t i = 0; v != NULL && i < ngroups; i++) {
+       if (groups[i].rm_so < 0)
+           continue;
+       char *group = strndup(text + groups[i].rm_so, groups[i].rm_eo - groups[i].rm_so);
+       if (group == NULL)
+           continue;
+       array_store(v->array, i, group);
+       if (i == 0) {
+           free(v->value);
+           v->value = group;
+       } else {
+           free(group);
+       }
+   }
+   free(groups);
+   return matched;
+}
+
+
+/*
+* Function: cond_eval
+* -------------------
+* Evaluates a [[ ... ]] expression. Words are expanded without splitting or globbing, the right
+* side of == and != is a pattern, numeric operands are arithmetic expressions, and file tests
+* are made here with no test command. *error is set after an error.
+*/
+int cond_eval(struct program *prog, int index, int *error) {
+   const struct ccond *c = &prog->conds[index];
+   switch (c->type) {
+   case C_AND:
+       return cond_eval(prog, c->a, error) && !*error && cond_eval(prog, c->b, error);
+   case C_OR:
+       return (cond_eval(prog, c->a, error) && !*error) || (!*error && cond_eval(prog, c->b, error));
+   case C_NOT:
+       return !cond_eval(prog, c->a, error);
+   }
+
+
+   char *left = expand_cword_string(prog, &prog->words[c->a]);
+   struct test_state t = { NULL, 0, 0, 0 };
+   int result = 0;
+   if (c->type == C_STRING) {
+       result = (left[0] != '\0');
+   } else if (c->type == C_UNARY) {
+       if (c->op == 'v')
+           result = (var_get(left) != NULL);
+       else
+           result = test_unary(&t, c->op == 'a' ? 'e' : c->op, left);
+   } else if (c->op == CO_REGEX) {
+       result = cond_regex(prog, c, left, error);
+   } else if (c->op == CO_MATCH || c->op == CO_NOMATCH) {
+       char *text = expand_pattern(prog, &prog->words[c->b]);
+       const struct pattern *pat = pattern_cached(text);
+       result = (pat != NULL && pattern_match(pat, left, strlen(left)));
+       free(text);
+       result = (c->op == CO_MATCH) ? result : !result;
+   } else {
+       char *right = expand_cword_string(prog, &prog->words[c->b]);
+       if (c->op == CO_LESS || c->op == CO_GREATER) {
+           int cmp = strcmp(left, right);
+           result = (c->op == CO_LESS) ? cmp < 0 : cmp > 0;
+       } else if (c->op >= CO_NT) {
+           static const char *file_ops[] = { "-nt", "-ot", "-ef" };
+           result = test_binary(&t, left, file_ops[c->op - CO_NT], right);
+       } else {
+           int failed = 0;
+           long long l = arith_evaluate(left, 0, &failed);
+           long long r = failed ? 0 : arith_evaluate(right, 0, &failed);
+           t.error = failed;
+           switch (c->op) {
+           case CO_EQ: result = (l == r); break;
+           case CO_NE: result = (l != r); break;
+           case CO_LT: result = (l < r); break;
+           case CO_LE: result = (l <= r); break;
+           case CO_GT: result = (l > r); break;
+           default: result = (l >= r); break;
+           }
+       }
+       free(right);
+   }
+   free(left);
+   if (t.error || expansion_failed)
+       *error = 1;
+   return result;
+}
+
+
+/*
+* Function: parse_duration
+* ------------------------
+* Parses a time interval in seconds, which may be fractional and end in s, m, h or d.
+* Returns -1 if it isn't one.
+*/
+double parse_duration(const char *text) {
+   char *end;
+   double value = strtod(text, &end);
+   double scale = 1;
+   if (*end == 'm')
+       scale = 60;
+   else if (*end == 'h')
+       scale = 3600;
+   else if (*end == 'd')
+       scale = 86400;
+   if (end == text || value < 0 || (*end != '\0' && (strchr("smhd", *end) == NULL || end[1] != '\0')))
+       return -1;
+   return value * scale;
+}
+
+
+/*
+* Function: builtin_sleep
+* -----------------------
+* Sleeps for the sum of its arguments; each may be fractional and end in s, m, h or d.
+*/
+int builtin_sleep(char *args[]) {
+   if (args[1] == NULL) {
+       fprintf(stderr, "sleep: missing operand\n");
+       return 1;
+   }
+   double seconds = 0;
+   for (int i = 1; args[i] != NULL; i++) {
+       double value = parse_duration(args[i]);
+       if (value < 0) {
+           fprintf(stderr, "sleep: invalid time interval '%s'\n", args[i]);
+           return 1;
+       }
+       seconds += value;
+   }
+   struct timespec remaining;
+   remaining.tv_sec = (time_t)seconds;
+   remaining.tv_nsec = (long)((seconds - (double)remaining.tv_sec) * 1e9);
+   while (nanosleep(&remaining, &remaining) < 0) {
+       if (errno != EINTR)
+           return 1;
+   }
+   return 0;
+}
+
+
+/*
+* Function: signal_from_name
+* --------------------------
+* Converts a signal name (TERM, SIGTERM) or number to a signal number, or -1.
+*/
+int signal_from_name(const char *name) {
+   if (isdigit((unsigned char)name[0])) {
+       int number = atoi(name);
+       return (number >= 0 && number < NSIG) ? number : -1;
+   }
+   if (strncasecmp(name, "SIG", 3) == 0)
+       name += 3;
+   for (int i = 0; signal_names[i].name != NULL; i++) {
+       if (strcasecmp(name, signal_names[i].name) == 0)
+           return signal_names[i].number;
+   }
+   return -1;
+}
+
+
+/*
+* Function: builtin_kill
+* ----------------------
+* Sends a signal to processes (a negative pid means a process group). Accepts -SIG, -s SIG,
+* -n NUM and -l [status | name ...] to list signal names or look them up.
+*/
+int builtin_kill(char *args[]) {
+   int sig = SIGTERM;
+   int i = 1;
+   if (args[1] != NULL && strcmp(args[1], "-l") == 0) {
+       if (args[2] != NULL) {
+           int status = 0;
+           for (int k = 2; args[k] != NULL; k++) {
+               if (!isdigit((unsigned char)args[k][0])) {
+                   /* a name: kill -l TERM prints its number */
+                   int number = signal_from_name(args[k]);
+                   if (number > 0) {
+                       shell_printf("%d\n", number);
+                       continue;
+                   }
+               } else {
+                   int number = atoi(args[k]);
+                   if (number > 128)
+                       number -= 128;   /* kill -l $? after a signal death */
+                   int j = 0;
+                   while (signal_names[j].name != NULL && signal_names[j].number != number)
+                       j++;
+                   if (signal_names[j].name != NULL) {
+                       shell_printf("%s\n", signal_names[j].name);
+                       continue;
+                   }
+               }
+               fprintf(stderr, "kill: %s: invalid signal specification\n", args[k]);
+               status = 1;
+           }
+           return status;
+       }
+       for (int j = 0; signal_names[j].name != NULL; j++)
+           shell_printf("%2d) SIG%s\n", signal_names[j].number, signal_names[j].name);
+       return 0;
+   }
+   if (args[1] != NULL && (strcmp(args[1], "-s") == 0 || strcmp(args[1], "-n") == 0)) {
+       if (args[2] == NULL || (sig = signal_from_name(args[2])) < 0) {
+           fprintf(stderr, "kill: %s: invalid signal specification\n", args[2] ? args[2] : "");
+           return 1;
+       }
+       i = 3;
+   } else if (args[1] != NULL && args[1][0] == '-' && strcmp(args[1], "--") != 0 && !isdigit((unsigned char)args[1][1])) {
+       if ((sig = signal_from_name(args[1] + 1)) < 0) {
+           fprintf(stderr, "kill: %s: invalid signal specification\n", args[1] + 1);
+           return 1;
+       }
+       i = 2;
+   } else if (args[1] != NULL && args[1][0] == '-' && isdigit((unsigned char)args[1][1]) && args[2] != NULL) {
+       sig = atoi(args[1] + 1);   /* kill -9 pid */
+       i = 2;
+   }
+   if (args[i] != NULL && strcmp(args[i], "--") == 0)
+       i++;
+   if (args[i] == NULL) {
+       fprintf(stderr, "kill: usage: kill [-s sigspec | -n signum | -sigspec] pid ...\n");
+       return 2;
+   }
+
+
+   int status = 0;
+   for (; args[i] != NULL; i++) {
+       char *end;
+       long pid = strtol(args[i], &end, 10);
+       if (*end != '\0' || end == args[i]) {
+           fprintf(stderr, "kill: %s: arguments must be process IDs\n", args[i]);
+           status = 1;
+           continue;
+       }
+       if (kill((pid_t)pid, sig) < 0) {
+           fprintf(stderr, "kill: (%ld) - %s\n", pid, strerror(errno));
+           status = 1;
+       }
+   }
+   return status;
+}
+
+
+/*
+* Function: wait_for_status
+* -------------------------
+* Waits for a child and records its exit status in $?, and in child_usage what it used.
+*/
+void wait_for_status(pid_t pid) {
+   int status;
+   while (wait4(pid, &status, 0, &child_usage) < 0) {
+       if (errno != EINTR)
+           return;
+   }
+   last_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+
+/*
+* Function: elapsed_us
+* --------------------
+* Microseconds since a CLOCK_MONOTONIC time.
+*/
+long long elapsed_us(const struct timespec *since) {
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (now.tv_sec - since->tv_sec) * 1000000LL + (now.tv_nsec - since->tv_nsec) / 1000;
+}
+
+
+/*
+* Function: json_string
+* ---------------------
+* Appends text as a quoted JSON string.
+*/
+void json_string(struct strbuf *out, const char *text) {
+   strbuf_append(out, "\"", 1);
+   for (const unsigned char *c = (const unsigned char *)text; *c != '\0'; c++) {
+       char escaped[8];
+       if (*c == '"' || *c == '\\') {
+           escaped[0] = '\\';
+           escaped[1] = *c;
+           strbuf_append(out, escaped, 2);
+       } else if (*c < 0x20) {
+           snprintf(escaped, sizeof(escaped), "\\u%04x", *c);
+           strbuf_append(out, escaped, 6);
+       } else {
+           strbuf_append(out, (const char *)c, 1);
+       }
+   }
+   strbuf_append(out, "\"", 1);
+}
+
+
+/*
+* Function: json_argv
+* -------------------
+* Returns words (up to count of them, or the NULL that ends them) as a JSON array of strings,
+* allocated, or NULL for no words.
+*/
+char *json_argv(char *const words[], int count) {
+   if (words == NULL)
+       return NULL;
+   struct strbuf out = { NULL, 0, 0 };
+   strbuf_append(&out, "[", 1);
+   for (int i = 0; i < count && words[i] != NULL; i++) {
+       if (i > 0)
+           strbuf_append(&out, ",", 1);
+       json_string(&out, words[i]);
+   }
+   strbuf_append(&out, "]", 1);
+   return out.buf;
+}
+
+
+/*
+* Function: telemetry_begin
+* -------------------------
+* Starts the figures for one stage of a command about to be started, describing it by its
+* words (or NULL).
+*/
+void telemetry_begin(struct telemetry_stage *t, char *const words[], int count) {
+   memset(t, 0, sizeof(*t));
+   clock_gettime(CLOCK_MONOTONIC, &t->start);
+   t->text = json_argv(words, count);
+}
+
+
+/*
+* Function: telemetry_begin_block
+* -------------------------------
+* telemetry_begin for a pipeline stage, described by its words as written if it is a simple
+* command, until the stage reports them expanded (telemetry_report).
+*/
+void telemetry_begin_block(struct telemetry_stage *t, struct program *prog, int block) {
+   const struct instr *code = &prog->code[prog->blocks[block]];
+   char *words[MAX_ARGS];
+   int n = 0;
+   if (code[0].op == OP_SIMPLE && code[1].op == OP_END) {
+       const struct ccommand *cmd = &prog->commands[code[0].a];
+       for (int i = cmd->nassigns; i < cmd->nwords && n < MAX_ARGS; i++)
+           words[n++] = prog->pool + prog->words[cmd->first_word + i].text;
+   }
+   telemetry_begin(t, n > 0 ? words : NULL, n);
+}
+
+
+/*
+* Function: telemetry_end
+* -----------------------
+* Completes a stage's figures once wait_for_status has collected it.
+*/
+void telemetry_end(struct telemetry_stage *t) {
+   t->wall_us = elapsed_us(&t->start);
+   t->usage = child_usage;
+   t->status = last_status;
+}
+
+
+/*
+* Function: telemetry_usage_begin
+* -------------------------------
+* Notes what the shell and the children it has waited for have used so far, before a builtin
+* runs in it.
+*/
+void telemetry_usage_begin(struct rusage before[2]) {
+   getrusage(RUSAGE_SELF, &before[0]);
+   getrusage(RUSAGE_CHILDREN, &before[1]);
+}
+
+
+/*
+* Function: telemetry_usage_end
+* -----------------------------
+* Puts what a builtin has used since telemetry_usage_begin, in the shell and in any children it
+* waited for, into child_usage for telemetry_end.
+*/
+void telemetry_usage_end(const struct rusage before[2]) {
+   struct rusage self, children;
+   getrusage(RUSAGE_SELF, &self);
+   getrusage(RUSAGE_CHILDREN, &children);
+   timersub(&self.ru_utime, &before[0].ru_utime, &self.ru_utime);
+   timersub(&self.ru_stime, &before[0].ru_stime, &self.ru_stime);
+   timersub(&children.ru_utime, &before[1].ru_utime, &children.ru_utime);
+   timersub(&children.ru_stime, &before[1].ru_stime, &children.ru_stime);
+   child_usage = self;
+   timeradd(&self.ru_utime, &children.ru_utime, &child_usage.ru_utime);
+   timeradd(&self.ru_stime, &children.ru_stime, &child_usage.ru_stime);
+}
+
+
+/*
+* Function: telemetry_report
+* --------------------------
+* In a pipeline stage's child, sends the parent the argv its command runs with, once expanded,
+* to replace the words as written in the stage's record. Only the stage's own command does:
+* the descriptor is taken before anything nested in its expansion can run. Never waits; if the
+* socket is full the record keeps the words as written.
+*/
+void telemetry_report(int fd, char *const words[], int count) {
+   char *argv = json_argv(words, count);
+   struct strbuf msg = { NULL, 0, 0 };
+   strbuf_append(&msg, (const char *)&telemetry_report_stage, sizeof(int));
+   if (argv != NULL)
+       strbuf_append(&msg, argv, strlen(argv));
+   send(fd, msg.buf, msg.len, MSG_DONTWAIT | MSG_NOSIGNAL);
+   close(fd);
+   free(msg.buf);
+   free(argv);
+}
+
+
+/*
+* Function: telemetry_collect
+* ---------------------------
+* Reads what the children of a pipeline's stages reported with telemetry_report, sizing each
+* message before receiving it, into the stages' records.
+*/
+void telemetry_collect(int fd, struct telemetry_stage *stats, int count) {
+   while (1) {
+       ssize_t size = recv(fd, NULL, 0, MSG_PEEK | MSG_TRUNC | MSG_DONTWAIT);
+       if (size < (ssize_t)sizeof(int))
+           break;
+       char *msg = malloc(size + 1);
+       if (msg == NULL || recv(fd, msg, size, MSG_DONTWAIT) != size) {
+           free(msg);
+           break;
+       }
+       msg[size] = '\0';
+       int stage;
+       memcpy(&stage, msg, sizeof(int));
+       if (stage >= 0 && stage < count && size > (ssize_t)sizeof(int)) {
+           free(stats[stage].text);
+           stats[stage].text = strdup(msg + sizeof(int));
+       }
+       free(msg);
+   }
+}
+
+
+/*
+* Function: telemetry_record
+* --------------------------
+* Sends the record of a command (what kind it is and the figures of each stage) to the writer
+* and frees the stages' text. It never waits: if the writer is behind, the record is dropped.
+*/
+void telemetry_record(const char *shape, struct telemetry_stage *stages, int count) {
+   char field[256];
+   struct timespec now;
+   clock_gettime(CLOCK_REALTIME, &now);
+   char cwd[PATH_MAX];
+   if (getcwd(cwd, sizeof(cwd)) == NULL)
+       cwd[0] = '\0';
+   struct strbuf rec = { NULL, 0, 0 };
+   snprintf(field, sizeof(field), "{\"ts\":%lld.%06ld,\"pid\":%d,\"cwd\":", (long long)now.tv_sec,
+            now.tv_nsec / 1000, (int)getpid());
+   strbuf_append(&rec, field, strlen(field));
+   json_string(&rec, cwd);
+   snprintf(field, sizeof(field), ",\"shape\":\"%s\",\"stages\":[", shape);
+   strbuf_append(&rec, field, strlen(field));
+   for (int k = 0; k < count; k++) {
+       struct telemetry_stage *t = &stages[k];
+       strbuf_append(&rec, k ? ",{" : "{", k ? 2 : 1);
+       if (t->text != NULL && (telemetry_mode == 2 || strlen(t->text) > TELEMETRY_ARGV_MAX)) {
+           size_t len = strlen(t->text);
+           if (telemetry_mode == 2)
+               snprintf(field, sizeof(field), "\"argv_hash\":\"%016lx\",", hash_name(t->text, len));
+           else
+               snprintf(field, sizeof(field), "\"argv_hash\":\"%016lx\",\"argv_bytes\":%zu,",
+                        hash_name(t->text, len), len);
+           strbuf_append(&rec, field, strlen(field));
+       } else if (t->text != NULL) {
+           strbuf_append(&rec, "\"argv\":", 7);
+           strbuf_append(&rec, t->text, strlen(t->text));
+           strbuf_append(&rec, ",", 1);
+       }
+       snprintf(field, sizeof(field),
+                "\"builtin\":%s,\"spawn_us\":%lld,\"wall_us\":%lld,\"user_us\":%lld,\"sys_us\":%lld,\"maxrss_kb\":%ld,\"status\":%d}",
+                t->builtin ? "true" : "false", t->spawn_us, t->wall_us,
+                t->usage.ru_utime.tv_sec * 1000000LL + t->usage.ru_utime.tv_usec,
+                t->usage.ru_stime.tv_sec * 1000000LL + t->usage.ru_stime.tv_usec,
+                t->usage.ru_maxrss, t->status);
+       strbuf_append(&rec, field, strlen(field));
+       free(t->text);
+       t->text = NULL;
+   }
+   snprintf(field, sizeof(field), "],\"status\":%d,\"dropped\":%lld}\n", last_status, telemetry_dropped);
+   strbuf_append(&rec, field, strlen(field));
+   if (send(telemetry_fd, rec.buf, rec.len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+       telemetry_dropped++;
+   else
+       telemetry_dropped = 0;
+   free(rec.buf);
+}
+
+
+/*
+* Function: drain_fd
+* ------------------
+* Reads a file descriptor until end of file, appending everything to out.
+*/
+void drain_fd(int fd, struct strbuf *out) {
+   while (1) {
+       if (out->capacity - out->len < 4096) {
+           size_t capacity = out->capacity ? out->capacity * 2 : 65536;
+           char *grown = realloc(out->buf, capacity);
+           if (grown == NULL) {
+               perror("realloc failed");
+               return;
+           }
+           out->buf = grown;
+           out->capacity = capacity;
+       }
+       ssize_t n = read(fd, out->buf + out->len, out->capacity - out->len - 1);
+       if (n < 0 && errno == EINTR)
+           continue;
+       if (n <= 0)
+           break;
+       out->len += n;
+       out->buf[out->len] = '\0';
+   }
+}
+
+
+/*
+* Function: open_pipe
+* -------------------
+* Creates a close-on-exec pipe between commands, with the capacity set by set -o pipesize.
+*/
+int open_pipe(int ends[2]) {
+   if (pipe2(ends, O_CLOEXEC) < 0)
+       return -1;
+   if (pipe_size > 0)
+       fcntl(ends[1], F_SETPIPE_SZ, (int)pipe_size);
+   return 0;
+}
+
+
+/*
+* Function: procsub_inherit
+* -------------------------
+* Lets the pipes of the open process substitutions survive exec (or makes them close-on-exec
+* again), so the program being started can open the /dev/fd/N it was given.
+*/
+void procsub_inherit(int inherit) {
+   for (int i = 0; i < nprocsubs; i++)
+       fcntl(procsubs[i].fd, F_SETFD, inherit ? 0 : FD_CLOEXEC);
+}
+
+
+/*
+* Function: procsub_close
+* -----------------------
+* Closes the process substitutions opened since mark, newest first, and with wait set reaps
+* their children (a >(...) sees end of file and finishes its output first).
+*/
+void procsub_close(int mark, int wait) {
+   while (nprocsubs > mark) {
+       struct procsub *sub = &procsubs[--nprocsubs];
+       close(sub->fd);
+       int status;
+       while (wait && waitpid(sub->pid, &status, 0) < 0 && errno == EINTR)
+           ;
+   }
+}
+
+
+/*
+* Function: timer_arm
+* -------------------
+* Sets a timerfd to go off once, milliseconds from now (0 disarms it).
+*/
+void timer_arm(int timer, long long milliseconds) {
+   struct itimerspec when = { { 0, 0 }, { milliseconds / 1000, (milliseconds % 1000) * 1000000 } };
+   timerfd_settime(timer, 0, &when, NULL);
+}
+
+
+/*
+* Function: wait_deadline
+* -----------------------
+* Waits for a child leading a process group of its own, as wait_for_status does, but after
+* timeout milliseconds signals the group with sig and, if it is still there grace milliseconds
+* later (0: never), SIGKILL. The child's pidfd and a timerfd are polled together, so no helper
+* process is needed; output arriving on drain (-1 for none) is read into out meanwhile. If the
+* shell's stdin is the terminal and the shell is in its foreground group, the child gets the
+* terminal while it runs. After a deadline $? is 124, or 137 if the group got SIGKILL, as with
+* coreutils timeout. Where pidfds or timerfds are missing the same loop polls the child every
+* DEADLINE_POLL_MS and keeps time with the monotonic clock.
+*/
+void wait_deadline(pid_t pid, long long timeout, int sig, long long grace, int drain, struct strbuf *out) {
+   int pidfd = syscall(SYS_pidfd_open, pid, 0);
+   int timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+   setpgid(pid, pid);   /* in case the child hasn't got that far yet */
+   int handoff = isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == getpgrp();
+   if (handoff) {
+       tcsetpgrp(STDIN_FILENO, pid);
+       kill(-pid, SIGCONT);   /* it may have stopped reading the terminal before it was its own */
+   }
+
+
+   struct timespec start;
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   long long due = timeout;   /* without a timerfd: next signal, in milliseconds from start; -1 for none */
+   if (timer >= 0)
+       timer_arm(timer, timeout);
+   int signals_sent = 0;
+   int exited = 0;
+   while (!exited || drain >= 0) {
+       int wait_ms = -1;
+       if (timer < 0 && due >= 0) {
+           long long left = due - elapsed_us(&start) / 1000;
+           wait_ms = left > 0 ? (int)(left < INT_MAX ? left : INT_MAX) : 0;
+       }
+       if (pidfd < 0 && !exited && (wait_ms < 0 || wait_ms > DEADLINE_POLL_MS))
+           wait_ms = DEADLINE_POLL_MS;
+       struct pollfd fds[3] = { { timer, POLLIN, 0 }, { exited ? -1 : pidfd, POLLIN, 0 }, { drain, POLLIN, 0 } };
+       if (poll(fds, 3, wait_ms) < 0) {
+           if (errno == EINTR)
+               continue;
+           break;
+       }
+       if (fds[2].revents != 0) {
+           char buf[4096];
+           ssize_t n = read(drain, buf, sizeof(buf));
+           if (n > 0)
+               strbuf_append(out, buf, n);
+           else if (n == 0 || errno != EINTR)
+               drain = -1;
+       }
+       if (fds[1].revents != 0) {
+           exited = 1;
+       } else if (pidfd < 0 && !exited) {
+           siginfo_t info;
+           info.si_pid = 0;
+           if (waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) < 0 || info.si_pid == pid)
+               exited = 1;   /* left for wait_for_status to reap */
+       }
+       int fire;
+       if (timer >= 0) {
+           uint64_t expirations;
+           fire = fds[0].revents != 0 && read(timer, &expirations, sizeof(expirations)) > 0;
+       } else {
+           fire = due >= 0 && elapsed_us(&start) / 1000 >= due;
+       }
+       if (fire) {
+           kill(-pid, signals_sent == 0 ? sig : SIGKILL);
+           if (++signals_sent == 1 && grace > 0 && sig != SIGKILL) {
+               if (timer >= 0)
+                   timer_arm(timer, grace);
+               else
+                   due = elapsed_us(&start) / 1000 + grace;
+           } else {
+               due = -1;
+           }
+       }
+   }
+   if (timer >= 0)
+       close(timer);
+   if (pidfd >= 0)
+       close(pidfd);
+   wait_for_status(pid);
+   if (signals_sent > 0)
+       last_status = (signals_sent > 1 || sig == SIGKILL) ? 128 + SIGKILL : 124;
+
+
+   if (handoff) {
+       /* taking the terminal back from the background needs SIGTTOU held off */
+       sigset_t ttou, saved;
+       sigemptyset(&ttou);
+       sigaddset(&ttou, SIGTTOU);
+       sigprocmask(SIG_BLOCK, &ttou, &saved);
+       tcsetpgrp(STDIN_FILENO, getpgrp());
+       sigprocmask(SIG_SETMASK, &saved, NULL);
+   }
+}
+
+
+/*
+* Function: spawn_captured
+* ------------------------
+* Runs an external command with posix_spawn (vfork-speed, no copy of the shell's page tables)
+* and reads its standard output into out.
+*/
+void spawn_captured(char *args[], struct strbuf *out) {
+   int pipe_ends[2];
+   if (open_pipe(pipe_ends) < 0) {
+       perror("pipe failed");
+       return;
+   }
+   posix_spawn_file_actions_t actions;
+   posix_spawn_file_actions_init(&actions);
+   posix_spawn_file_actions_adddup2(&actions, pipe_ends[1], STDOUT_FILENO);
+   posix_spawnattr_t attr;
+   posix_spawnattr_init(&attr);
+   int timed = command_timeout > 0 && !timed_group;
+   if (timed) {
+       /* a process group of its own, so the deadline can stop all of it */
+       posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+       posix_spawnattr_setpgroup(&attr, 0);
+   }
+   pid_t pid;
+   const char *path = command_path(args[0]);
+   struct telemetry_stage stage;
+   if (telemetry_fd >= 0)
+       telemetry_begin(&stage, args, INT_MAX);
+   procsub_inherit(1);
+   int err = path ? posix_spawn(&pid, path, &actions, &attr, args, build_envp())
+                  : posix_spawnp(&pid, args[0], &actions, &attr, args, build_envp());
+   procsub_inherit(0);
+   if (telemetry_fd >= 0)
+       stage.spawn_us = elapsed_us(&stage.start);
+   posix_spawn_file_actions_destroy(&actions);
+   posix_spawnattr_destroy(&attr);
+   close(pipe_ends[1]);
+   if (err != 0) {
+       fprintf(stderr, "%s: %s\n", args[0], strerror(err));
+       last_status = (err == ENOENT) ? 127 : 126;
+       close(pipe_ends[0]);
+       if (telemetry_fd >= 0)
+           free(stage.text);
+       return;
+   }
+   if (timed) {
+       wait_deadline(pid, command_timeout, SIGTERM, KILL_GRACE_MS, pipe_ends[0], out);
+   } else {
+       drain_fd(pipe_ends[0], out);
+       wait_for_status(pid);
+   }
+   close(pipe_ends[0]);
+   if (telemetry_fd >= 0) {
+       telemetry_end(&stage);
+       telemetry_record("substitution", &stage, 1);
+   }
+}
+
+
+/*
+* Function: run_external
+* ----------------------
+* Runs the program of the same name from PATH for whatever a builtin leaves to it (options it
+* doesn't implement), with the shell's current stdin/stdout, and returns its exit status.
+*/
+int run_external(char *args[]) {
+   if (capture_output != NULL) {
+       spawn_captured(args, capture_output);
+       return last_status;
+   }
+   fflush(stdout);
+   pid_t pid;
+   struct telemetry_stage stage;
+   if (telemetry_fd >= 0)
+       telemetry_begin(&stage, args, INT_MAX);
+   procsub_inherit(1);
+   int err = posix_spawnp(&pid, args[0], NULL, NULL, args, build_envp());
+   procsub_inherit(0);
+   if (telemetry_fd >= 0)
+       stage.spawn_us = elapsed_us(&stage.start);
+   if (err != 0) {
+       fprintf(stderr, "%s: %s\n", args[0], strerror(err));
+       if (telemetry_fd >= 0)
+           free(stage.text);
+       return (err == ENOENT) ? 127 : 126;
+   }
+   wait_for_status(pid);
+   if (telemetry_fd >= 0) {
+       telemetry_end(&stage);
+       telemetry_record("simple", &stage, 1);
+   }
+   return last_status;
+}
+
+
+/*
+* Function: builtin_timeout
+* -------------------------
+* timeout [-k DURATION] [-s SIGNAL] DURATION command [arg...]: runs a program in a process group
+* of its own and signals the group (TERM unless -s says otherwise) if it is still running after
+* DURATION, then KILL after the -k grace period (5s by default, 0 for never). Returns 124 on a
+* timeout, like coreutils timeout, but with no timeout process of its own.
+*/
+int builtin_timeout(char *args[]) {
+   long long grace = KILL_GRACE_MS;
+   int sig = SIGTERM;
+   int i = 1;
+   for (; args[i] != NULL && args[i + 1] != NULL && (strcmp(args[i], "-k") == 0 || strcmp(args[i], "-s") == 0); i += 2) {
+       if (args[i][1] == 's') {
+           sig = signal_from_name(args[i + 1]);
+           if (sig < 0) {
+               fprintf(stderr, "timeout: %s: invalid signal\n", args[i + 1]);
+               return 125;
+           }
+       } else {
+           double seconds = parse_duration(args[i + 1]);
+           if (seconds < 0) {
+               fprintf(stderr, "timeout: invalid time interval '%s'\n", args[i + 1]);
+               return 125;
+           }
+           grace = (long long)(seconds * 1000);
+       }
+   }
+   if (args[i] != NULL && strcmp(args[i], "--") == 0)
+       i++;
+   if (args[i] == NULL || args[i + 1] == NULL) {
+       fprintf(stderr, "timeout: usage: timeout [-k duration] [-s signal] duration command [arg ...]\n");
+       return 125;
+   }
+   double seconds = parse_duration(args[i]);
+   if (seconds < 0) {
+       fprintf(stderr, "timeout: invalid time interval '%s'\n", args[i]);
+       return 125;
+   }
+   char **command = args + i + 1;
+
+
+   int pipe_ends[2] = { -1, -1 };
+   if (capture_output != NULL && open_pipe(pipe_ends) < 0) {
+       perror("pipe failed");
+       return 125;
+   }
+   posix_spawn_file_actions_t actions;
+   posix_spawn_file_actions_init(&actions);
+   if (pipe_ends[1] >= 0)
+       posix_spawn_file_actions_adddup2(&actions, pipe_ends[1], STDOUT_FILENO);
+   posix_spawnattr_t attr;
+   posix_spawnattr_init(&attr);
+   posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+   posix_spawnattr_setpgroup(&attr, 0);
+   fflush(stdout);
+   pid_t pid;
+   const char *path = command_path(command[0]);
+   procsub_inherit(1);
+   int err = path ? posix_spawn(&pid, path, &actions, &attr, command, build_envp())
+                  : posix_spawnp(&pid, command[0], &actions, &attr, command, build_envp());
+   procsub_inherit(0);
+   posix_spawn_file_actions_destroy(&actions);
+   posix_spawnattr_destroy(&attr);
+   if (pipe_ends[1] >= 0)
+       close(pipe_ends[1]);
+   if (err != 0) {
+       fprintf(stderr, "timeout: %s: %s\n", command[0], strerror(err));
+       if (pipe_ends[0] >= 0)
+           close(pipe_ends[0]);
+       return (err == ENOENT) ? 127 : 126;
+   }
+   wait_deadline(pid, (long long)(seconds * 1000), sig, grace, pipe_ends[0], capture_output);
+   if (pipe_ends[0] >= 0)
+       close(pipe_ends[0]);
+   return last_status;
+}
+
+
+/*
+* Function: write_all
+* -------------------
+* Writes a whole buffer to a file descriptor, retrying short writes. Returns -1 on error.
+*/
+int write_all(int fd, const char *data, size_t len) {
+   while (len > 0) {
+       ssize_t n = write(fd, data, len);
+       if (n < 0) {
+           if (errno == EINTR)
+               continue;
+           return -1;
+       }
+       data += n;
+       len -= n;
+   }
+   return 0;
+}
+
+
+/*
+* Function: copy_fd
+* -----------------
+* Copies everything from in to out and lets the kernel move the data where it can:
+* copy_file_range between regular files (which may reflink), splice when either side is a
+* pipe, sendfile from a regular file to anything else. A read/write loop is the last resort.
+* Returns 0 on success, -1 with errno set on failure.
+*/
+int copy_fd(int in, int out) {
+   struct stat in_st, out_st;
+   if (fstat(in, &in_st) < 0 || fstat(out, &out_st) < 0)
+       return -1;
+   int method;
+   if (S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode))
+       method = COPY_RANGE;
+   else if (S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode))
+       method = COPY_SPLICE;
+   else if (S_ISREG(in_st.st_mode))
+       method = COPY_SENDFILE;
+   else
+       method = COPY_READ_WRITE;
+
+
+   char *buf = NULL;   /* only allocated for the read/write fallback */
+   while (1) {
+       ssize_t n;
+       if (method == COPY_RANGE) {
+           n = copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0);
+           if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF)) {
+               method = COPY_SENDFILE;  /* e.g. across filesystems on old kernels, or O_APPEND output */
+               continue;
+           }
+       } else if (method == COPY_SPLICE) {
+           n = splice(in, NULL, out, NULL, COPY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+           if (n < 0 && errno == EINVAL) {
+               method = S_ISREG(in_st.st_mode) ? COPY_SENDFILE : COPY_READ_WRITE;  /* e.g. a tty on the other side */
+               continue;
+           }
+       } else if (method == COPY_SENDFILE) {
+           n = sendfile(out, in, NULL, COPY_CHUNK);
+           if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+               method = COPY_READ_WRITE;
+               continue;
+           }
+       } else {
+           if (buf == NULL && (buf = malloc(COPY_BUFFER_SIZE)) == NULL)
+               return -1;
+           n = read(in, buf, COPY_BUFFER_SIZE);
+           if (n > 0 && write_all(out, buf, n) < 0)
+               n = -1;
+       }
+       if (n < 0 && errno == EINTR)
+           continue;
+       if (n <= 0) {
+           int saved_errno = errno;
+           free(buf);
+           errno = saved_errno;
+           return n < 0 ? -1 : 0;
+       }
+   }
+}
+
+
+/*
+* Function: copy_to_output
+* ------------------------
+* Sends a file descriptor's contents to the builtin's standard output: straight into the
+* capture buffer during an in-process $(...), otherwise through copy_fd.
+*/
+int copy_to_output(int in) {
+   if (capture_output != NULL) {
+       drain_fd(in, capture_output);
+       return 0;
+   }
+   fflush(stdout);
+   return copy_fd(in, STDOUT_FILENO);
+}
+
+
+/*
+* Function: input_is_output
+* -------------------------
+* True, as GNU cat checks, when an input is the regular file standard output writes to and
+* copying it would never end: the output appends to it or is positioned before its end, so
+* every byte written would be read again.
+*/
+int input_is_output(int fd) {
+   struct stat in_st, out_st;
+   if (capture_output != NULL || fstat(fd, &in_st) < 0 || fstat(STDOUT_FILENO, &out_st) < 0)
+       return 0;
+   if (!S_ISREG(in_st.st_mode) || in_st.st_dev != out_st.st_dev || in_st.st_ino != out_st.st_ino)
+       return 0;
+   int flags = fcntl(STDOUT_FILENO, F_GETFL);
+   return (flags >= 0 && (flags & O_APPEND)) || lseek(STDOUT_FILENO, 0, SEEK_CUR) < in_st.st_size;
+}
+
+
+/*
+* Function: builtin_cat
+* ---------------------
+* Concatenates files ("-" is stdin) to standard output without a process or a userspace copy.
+* A file that is also the output is skipped, as it would be copied forever. Options other than -u
+* are handed to the real cat.
+*/
+int builtin_cat(char *args[]) {
+   int i = 1;
+   if (args[i] != NULL && strcmp(args[i], "-u") == 0)
+       i++;   /* unbuffered is all we do anyway */
+   if (args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0' && strcmp(args[i], "--") != 0)
+       return run_external(args);
+   if (args[i] != NULL && strcmp(args[i], "--") == 0)
+       i++;
+
+
+   if (args[i] == NULL) {
+       if (input_is_output(STDIN_FILENO)) {
+           fprintf(stderr, "cat: -: input file is output file\n");
+           return 1;
+       }
+       if (copy_to_output(STDIN_FILENO) < 0) {
+           fprintf(stderr, "cat: %s\n", strerror(errno));
+           return 1;
+       }
+       return 0;
+   }
+   int status = 0;
+   for (; args[i] != NULL; i++) {
+       int fd = strcmp(args[i], "-") == 0 ? STDIN_FILENO : open(args[i], O_RDONLY | O_CLOEXEC);
+       if (fd >= 0 && input_is_output(fd)) {
+           fprintf(stderr, "cat: %s: input file is output file\n", args[i]);
+           status = 1;
+       } else if (fd < 0 || copy_to_output(fd) < 0) {
+           fprintf(stderr, "cat: %s: %s\n", args[i], strerror(errno));
+           status = 1;
+       }
+       if (fd > STDIN_FILENO)
+           close(fd);
+   }
+   return status;
+}
+
+
+/*
+* Function: copy_file
+* -------------------
+* Copies one file to another path, keeping the permission bits; the data moves with copy_fd.
+*/
+int copy_file(const char *source, const char *target) {
+   int in = open(source, O_RDONLY | O_CLOEXEC);
+   struct stat in_st, out_st;
+   if (in < 0 || fstat(in, &in_st) < 0) {
+       fprintf(stderr, "cp: cannot stat '%s': %s\n", source, strerror(errno));
+       if (in >= 0)
+           close(in);
+       return 1;
+   }
+   if (S_ISDIR(in_st.st_mode)) {
+       fprintf(stderr, "cp: -r not specified; omitting directory '%s'\n", source);
+       close(in);
+       return 1;
+   }
+   if (stat(target, &out_st) == 0 && out_st.st_dev == in_st.st_dev && out_st.st_ino == in_st.st_ino) {
+       fprintf(stderr, "cp: '%s' and '%s' are the same file\n", source, target);
+       close(in);
+       return 1;
+   }
+   int out = open(target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, in_st.st_mode & 0777);
+   if (out < 0) {
+       fprintf(stderr, "cp: cannot create regular file '%s': %s\n", target, strerror(errno));
+       close(in);
+       return 1;
+   }
+   int status = 0;
+   if (copy_fd(in, out) < 0) {
+       fprintf(stderr, "cp: error copying '%s' to '%s': %s\n", source, target, strerror(errno));
+       status = 1;
+   }
+   close(in);
+   if (close(out) < 0 && status == 0) {
+       fprintf(stderr, "cp: error writing '%s': %s\n", target, strerror(errno));
+       status = 1;
+   }
+   return status;
+}
+
+
+/*
+* Function: builtin_cp
+* --------------------
+* Copies files (cp src dst, or cp src... dir) in-process. Options other than -f (recursive,
+* preserving, ...) are handed to the real cp.
+*/
+int builtin_cp(char *args[]) {
+   int i = 1;
+   while (args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0') {
+       if (strcmp(args[i], "--") == 0) {
+           i++;
+           break;
+       }
+       if (strcmp(args[i], "-f") != 0)
+           return run_external(args);
+       i++;
+   }
+   int count = 0;
+   while (args[i + count] != NULL)
+       count++;
+   if (count < 2) {
+       fprintf(stderr, "cp: missing destination file operand\n");
+       return 1;
+   }
+
+
+   char *dest = args[i + count - 1];
+   struct stat st;
+   int dest_is_dir = (stat(dest, &st) == 0 && S_ISDIR(st.st_mode));
+   if (count > 2 && !dest_is_dir) {
+       fprintf(stderr, "cp: target '%s' is not a directory\n", dest);
+       return 1;
+   }
+   int status = 0;
+   for (int j = i; j < i + count - 1; j++) {
+       if (!dest_is_dir) {
+           status |= copy_file(args[j], dest);
+           continue;
+       }
+       /* copying into a directory keeps the source's base name */
+       const char *base = strrchr(args[j], '/');
+       base = base ? base + 1 : args[j];
+       char target[PATH_MAX];
+       snprintf(target, sizeof(target), "%s/%s", dest, base);
+       status |= copy_file(args[j], target);
+   }
+   return status;
+}
+
+
+/*
+* Function: splice_all
+* --------------------
+* Moves exactly len bytes from one fd to another with splice (one side must be a pipe).
+*/
+int splice_all(int from, int to, size_t len) {
+   while (len > 0) {
+       ssize_t n = splice(from, NULL, to, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+       if (n < 0 && errno == EINTR)
+           continue;
+       if (n <= 0)
+           return -1;
+       len -= n;
+   }
+   return 0;
+}
+
+
+/*
+* Function: tee_splice
+* --------------------
+* Copies a pipe on stdin to several outputs (pipes or regular files) without the data ever
+* reaching userspace: tee(2) duplicates the pending data into a scratch pipe which is spliced to
+* each output in turn, and the last output consumes the original with splice. Needs at least
+* two outputs; a single one is just copy_fd.
+*/
+int tee_splice(int outputs[], int count) {
+   int scratch[2];
+   if (pipe2(scratch, O_CLOEXEC) < 0)
+       return -1;
+   /* the scratch pipe must hold everything stdin can, so one tee takes it all */
+   int size = fcntl(STDIN_FILENO, F_GETPIPE_SZ);
+   if (size > 0)
+       fcntl(scratch[1], F_SETPIPE_SZ, size);
+
+
+   int status = 0;
+   while (1) {
+       ssize_t available = tee(STDIN_FILENO, scratch[1], INT_MAX, 0);
+       if (available < 0 && errno == EINTR)
+           continue;
+       if (available <= 0) {
+           status = available < 0 ? -1 : 0;
+           break;
+       }
+       if (splice_all(scratch[0], outputs[0], available) < 0)
+           status = -1;
+       for (int k = 1; k < count - 1; k++) {
+           ssize_t n = tee(STDIN_FILENO, scratch[1], available, 0);
+           if (n != available || splice_all(scratch[0], outputs[k], available) < 0)
+               status = -1;
+       }
+       if (count > 1 && splice_all(STDIN_FILENO, outputs[count - 1], available) < 0)
+           status = -1;
+       if (status < 0)
+           break;
+   }
+   close(scratch[0]);
+   close(scratch[1]);
+   return status;
+}
+
+
+/*
+* Function: builtin_tee
+* ---------------------
+* Copies standard input to standard output and to each file (-a appends). A pipe on stdin feeding
+* pipes or regular files is handled entirely in the kernel; anything else uses one buffer.
+*/
+int builtin_tee(char *args[]) {
+   int append = 0;
+   int i = 1;
+   while (args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0') {
+       if (strcmp(args[i], "--") == 0) {
+           i++;
+           break;
+       }
+       if (strcmp(args[i], "-a") == 0)
+           append = 1;
+       else if (strcmp(args[i], "-i") != 0)
+           return run_external(args);
+       i++;
+   }
+
+
+   int outputs[MAX_ARGS];
+   int count = 0;
+   int status = 0;
+   if (capture_output == NULL)
+       outputs[count++] = STDOUT_FILENO;
+   for (; args[i] != NULL && count < MAX_ARGS; i++) {
+       int fd = open(args[i], O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0666);
+       if (fd < 0) {
+           fprintf(stderr, "tee: %s: %s\n", args[i], strerror(errno));
+           status = 1;
+           continue;
+       }
+       outputs[count++] = fd;
+   }
+   fflush(stdout);
+
+
+   /* the zero-copy path needs a pipe in and only pipes or plain files out */
+   struct stat st;
+   int kernel_path = (capture_output == NULL && count > 1 && !append && fstat(STDIN_FILENO, &st) == 0 && S_ISFIFO(st.st_mode));
+   for (int k = 0; k < count && kernel_path; k++) {
+       if (fstat(outputs[k], &st) < 0 || !(S_ISREG(st.st_mode) || S_ISFIFO(st.st_mode)))
+           kernel_path = 0;
+   }
+
+
+   if (kernel_path) {
+       if (tee_splice(outputs, count) < 0) {
+           fprintf(stderr, "tee: %s\n", strerror(errno));
+           status = 1;
+       }
+   } else if (count == 1 && capture_output == NULL) {
+       if (copy_fd(STDIN_FILENO, outputs[0]) < 0) {
+           fprintf(stderr, "tee: %s\n", strerror(errno));
+           status = 1;
+       }
+   } else {
+       char *buf = malloc(COPY_BUFFER_SIZE);
+       ssize_t n;
+       while (buf != NULL && ((n = read(STDIN_FILENO, buf, COPY_BUFFER_SIZE)) > 0 || (n < 0 && errno == EINTR))) {
+           if (n < 0)
+               continue;
+           if (capture_output != NULL)
+               strbuf_append(capture_output, buf, n);
+           for (int k = 0; k < count; k++) {
+               if (write_all(outputs[k], buf, n) < 0)
+                   status = 1;
+           }
+       }
+       free(buf);
+   }
+   for (int k = 0; k < count; k++) {
+       if (outputs[k] != STDOUT_FILENO)
+           close(outputs[k]);
+   }
+   return status;
+}
+
+
+/*
+* Function: source_open
+* ---------------------
+* Prepares to read a record from fd. Seekable input is served from the read-ahead buffer, which
+* is kept across calls while the file (size, inode change and modification times) and offset
+* still match and the file last changed well before it was read, so a while-read loop over a
+* file costs a few cheap syscalls per line instead of one read per byte. Pipes and terminals must be
+* read a byte at a time so nothing past the record is consumed; a terminal is put back in
+* canonical mode for the duration.
+*/
+void source_open(struct byte_source *src, int fd) {
+   src->fd = fd;
+   src->seekable = 0;
+   src->tty = 0;
+   struct stat st;
+   off_t current = lseek(fd, 0, SEEK_CUR);
+   if (current >= 0 && fstat(fd, &st) == 0) {
+       src->seekable = 1;
+       long long changed = st.st_ctim.tv_sec * 1000000000LL + st.st_ctim.tv_nsec;
+       long long filled = read_ahead.filled.tv_sec * 1000000000LL + read_ahead.filled.tv_nsec;
+       int same = (read_ahead.buf != NULL && read_ahead.dev == st.st_dev && read_ahead.ino == st.st_ino
+                   && read_ahead.size == st.st_size && read_ahead.mtime.tv_sec == st.st_mtim.tv_sec
+                   && read_ahead.mtime.tv_nsec == st.st_mtim.tv_nsec && read_ahead.ctime.tv_sec == st.st_ctim.tv_sec
+                   && read_ahead.ctime.tv_nsec == st.st_ctim.tv_nsec && changed + TIMESTAMP_SLACK < filled);
+       if (same && current >= read_ahead.offset && current <= read_ahead.offset + (off_t)read_ahead.len) {
+           read_ahead.pos = current - read_ahead.offset;
+       } else {
+           read_ahead.dev = st.st_dev;
+           read_ahead.ino = st.st_ino;
+           read_ahead.size = st.st_size;
+           read_ahead.mtime = st.st_mtim;
+           read_ahead.ctime = st.st_ctim;
+           read_ahead.offset = current;
+           read_ahead.len = 0;
+           read_ahead.pos = 0;
+           read_ahead.chunk = READ_AHEAD_FIRST;   /* no more than a line or two if it isn't kept */
+       }
+       if (read_ahead.buf == NULL && (read_ahead.buf = malloc(READ_AHEAD_SIZE)) == NULL)
+           src->seekable = 0;
+   } else if (isatty(fd) && tcgetattr(fd, &src->saved_mode) == 0) {
+       src->tty = 1;
+       tcsetattr(fd, TCSANOW, &canonicalSettings);
+   }
+}
+
+
+/*
+* Function: source_byte
+* ---------------------
+* Returns the next input byte, -1 at end of file or -2 on a read error.
+*/
+int source_byte(struct byte_source *src) {
+   if (src->seekable) {
+       if (read_ahead.pos == read_ahead.len) {
+           /* pread leaves the file offset alone; source_close moves it once at the end */
+           read_ahead.offset += read_ahead.len;
+           read_ahead.pos = 0;
+           ssize_t n;
+           clock_gettime(CLOCK_REALTIME, &read_ahead.filled);
+           while ((n = pread(src->fd, read_ahead.buf, read_ahead.chunk, read_ahead.offset)) < 0 && errno == EINTR)
+               ;
+           read_ahead.len = n > 0 ? n : 0;
+           if (read_ahead.chunk < READ_AHEAD_SIZE)
+               read_ahead.chunk *= 2;
+           if (n <= 0)
+               return n < 0 ? -2 : -1;
+       }
+       return (unsigned char)read_ahead.buf[read_ahead.pos++];
+   }
+   unsigned char c;
+   ssize_t n;
+   while ((n = read(src->fd, &c, 1)) < 0 && errno == EINTR)
+       ;
+   if (n <= 0)
+       return n < 0 ? -2 : -1;
+   return c;
+}
+
+
+/*
+* Function: source_close
+* ----------------------
+* Leaves the file offset just past what was consumed, so the next command sees the rest of
+* the input, and restores the terminal mode.
+*/
+void source_close(struct byte_source *src) {
+   if (src->seekable)
+       lseek(src->fd, read_ahead.offset + read_ahead.pos, SEEK_SET);
+   if (src->tty)
+       tcsetattr(src->fd, TCSANOW, &src->saved_mode);
+}
+
+
+/*
+* Function: read_record
+* ---------------------
+* Reads up to the delimiter (or nchars bytes, when not negative) into line. Unless raw, a
+* backslash escapes the next byte, which is marked in escaped so it isn't split on, and a
+* backslash before the delimiter continues the record. Returns 0 when a delimiter or
+* nchars ended the record, 1 at end of file and 2 on a read error.
+*/
+int read_record(int fd, int delim, int nchars, int raw, struct strbuf *line, struct strbuf *escaped) {
+   struct byte_source src;
+   source_open(&src, fd);
+   int status = 0;
+   int count = 0;
+   while (nchars < 0 || count < nchars) {
+       int c = source_byte(&src);
+       if (c < 0) {
+           status = (c == -1) ? 1 : 2;
+           break;
+       }
+       if (c == delim)
+           break;
+       char mark = 0;
+       if (c == '\\' && !raw) {
+           c = source_byte(&src);
+           if (c < 0) {
+               status = (c == -1) ? 1 : 2;
+               break;
+           }
+           if (c == delim)
+               continue;   /* line continuation */
+           mark = 1;
+       }
+       char ch = c;
+       strbuf_append(line, &ch, 1);
+       strbuf_append(escaped, &mark, 1);
+       count++;
+   }
+   source_close(&src);
+   if (line->buf == NULL)
+       strbuf_append(line, "", 0);
+   return status;
+}
+
+
+/*
+* Function: read_assign
+* ---------------------
+* Splits a record on IFS into the named variables; the last one gets the rest of the line.
+* Escaped bytes never split.
+*/
+void read_assign(char *names[], int count, const char *text, const char *escaped, size_t len) {
+   const char *ifs = var_get("IFS");
+   if (ifs == NULL)
+       ifs = " \t\n";
+   size_t ifs_len = strlen(ifs);
+   #define READ_IFS(k) (!escaped[k] && memchr(ifs, text[k], ifs_len) != NULL)
+   #define READ_IFS_SPACE(k) (READ_IFS(k) && (text[k] == ' ' || text[k] == '\t' || text[k] == '\n'))
+   size_t p = 0;
+   while (p < len && READ_IFS_SPACE(p))
+       p++;
+   for (int n = 0; n < count; n++) {
+       size_t start = p;
+       size_t end;
+       if (n == count - 1) {
+           end = len;
+           while (end > start && READ_IFS_SPACE(end - 1))
+               end--;
+           p = len;
+       } else {
+           while (p < len && !READ_IFS(p))
+               p++;
+           end = p;
+           /* one separator: white space around at most one other IFS character */
+           while (p < len && READ_IFS_SPACE(p))
+               p++;
+           if (p < len && READ_IFS(p) && !READ_IFS_SPACE(p)) {
+               p++;
+               while (p < len && READ_IFS_SPACE(p))
+                   p++;
+           }
+       }
+       char *value = strndup(text + start, end - start);
+       var_set(names[n], value, 0);
+       free(value);
+   }
+   #undef READ_IFS
+   #undef READ_IFS_SPACE
+}
+
+
+/*
+* Function: builtin_read
+* ----------------------
+* read [-r] [-d delim] [-n nchars] [-p prompt] [name...]: reads one record from standard input
+* and assigns its fields to the names (REPLY, unsplit, when none are given).
+* Returns 1 at end of file.
+*/
+int builtin_read(char *args[]) {
+   int raw = 0;
+   int delim = '\n';
+   int nchars = -1;
+   const char *prompt = NULL;
+   int i = 1;
+   for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+       if (strcmp(args[i], "--") == 0) {
+           i++;
+           break;
+       }
+       for (char *o = args[i] + 1; *o != '\0'; o++) {
+           if (*o == 'r') {
+               raw = 1;
+               continue;
+           }
+           if (*o != 'd' && *o != 'n' && *o != 'p') {
+               fprintf(stderr, "read: -%c: invalid option\nusage: read [-r] [-d delim] [-n nchars] [-p prompt] [name ...]\n", *o);
+               return 2;
+           }
+           char *value = o[1] != '\0' ? o + 1 : args[i + 1];
+           if (value == NULL) {
+               fprintf(stderr, "read: -%c: option requires an argument\n", *o);
+               return 2;
+           }
+           if (value == args[i + 1])
+               i++;
+           if (*o == 'd') {
+               delim = (unsigned char)value[0];
+           } else if (*o == 'n') {
+               char *end;
+               long n = strtol(value, &end, 10);
+               if (*value == '\0' || *end != '\0' || n < 0 || n > INT_MAX) {
+                   fprintf(stderr, "read: %s: invalid number\n", value);
+                   return 2;
+               }
+               nchars = n;
+           } else {
+               prompt = value;
+           }
+           break;
+       }
+   }
+   for (int j = i; args[j] != NULL; j++) {
+       int k = 1;
+       while (is_name_char(args[j][k], 0))
+           k++;
+       if (!is_name_char(args[j][0], 1) || args[j][k] != '\0') {
+           fprintf(stderr, "read: '%s': not a valid identifier\n", args[j]);
+           return 2;
+       }
+   }
+   if (prompt != NULL && isatty(STDIN_FILENO)) {
+       fputs(prompt, stderr);
+       fflush(stderr);
+   }
+
+
+   struct strbuf line = { NULL, 0, 0 };
+   struct strbuf escaped = { NULL, 0, 0 };
+   int status = read_record(STDIN_FILENO, delim, nchars, raw, &line, &escaped);
+   if (status == 2) {
+       fprintf(stderr, "read: %s\n", strerror(errno));
+   } else if (args[i] == NULL) {
+       var_set("REPLY", line.buf, 0);
+   } else {
+       int count = 0;
+       while (args[i + count] != NULL)
+           count++;
+       read_assign(args + i, count, line.buf, escaped.buf ? escaped.buf : "", line.len);
+   }
+   free(line.buf);
+   free(escaped.buf);
+   return status;
+}
+
+
+/*
+* Function: print_alias
+* ---------------------
+* Prints an alias in a form that can be read back: alias name='value'.
+*/
+void print_alias(const struct command_entry *e) {
+   shell_printf("alias %s='", e->name);
+   for (const char *p = e->alias; *p != '\0'; p++) {
+       if (*p == '\'')
+           shell_write("'\\''", 4);   /* close the quotes, escaped quote, reopen */
+       else
+           shell_write(p, 1);
+   }
+   shell_write("'\n", 2);
+}
+
+
+/*
+* Function: builtin_alias
+* -----------------------
+* Defines aliases (alias name=value), prints some (alias name) or lists them all. An alias is
+* replaced by its text when a command line is parsed.
+*/
+int builtin_alias(char *args[]) {
+   if (args[1] == NULL || (strcmp(args[1], "-p") == 0 && args[2] == NULL)) {
+       char **names = malloc((command_used + 1) * sizeof(char *));
+       if (names == NULL) {
+           perror("malloc failed");
+           return 1;
+       }
+       size_t count = 0;
+       for (size_t i = 0; i < command_capacity; i++) {
+           if (command_table[i].name != NULL && command_table[i].name != TOMBSTONE && command_table[i].alias != NULL)
+               names[count++] = command_table[i].name;
+       }
+       qsort(names, count, sizeof(char *), compare_strings);
+       for (size_t i = 0; i < count; i++)
+           print_alias(command_lookup(names[i], strlen(names[i])));
+       free(names);
+       return 0;
+   }
+   int status = 0;
+   for (int i = 1; args[i] != NULL; i++) {
+       char *equals = strchr(args[i], '=');
+       if (equals == NULL) {
+           struct command_entry *e = command_lookup(args[i], strlen(args[i]));
+           if (e != NULL && e->alias != NULL) {
+               print_alias(e);
+           } else {
+               fprintf(stderr, "alias: %s: not found\n", args[i]);
+               status = 1;
+           }
+           continue;
+       }
+       char *bad = strpbrk(args[i], " \t\n'\"\\$`/|&;<>()");
+       if (equals == args[i] || (bad != NULL && bad < equals)) {
+           fprintf(stderr, "alias: '%.*s': invalid alias name\n", (int)(equals - args[i]), args[i]);
+           status = 1;
+           continue;
+       }
+       *equals = '\0';
+       struct command_entry *e = command_insert(args[i]);
+       free(e->alias);
+       e->alias = strdup(equals + 1);
+   }
+   return status;
+}
+
+
+/*
+* Function: builtin_unalias
+* -------------------------
+* Removes aliases; -a removes them all.
+*/
+int builtin_unalias(char *args[]) {
+   if (args[1] != NULL && strcmp(args[1], "-a") == 0) {
+       for (size_t i = 0; i < command_capacity; i++) {
+           struct command_entry *e = &command_table[i];
+           if (e->name != NULL && e->name != TOMBSTONE && e->alias != NULL) {
+               free(e->alias);
+               e->alias = NULL;
+               command_drop_if_unused(e);
+           }
+       }
+       return 0;
+   }
+   int status = 0;
+   for (int i = 1; args[i] != NULL; i++) {
+       struct command_entry *e = command_lookup(args[i], strlen(args[i]));
+       if (e == NULL || e->alias == NULL) {
+           fprintf(stderr, "unalias: %s: not found\n", args[i]);
+           status = 1;
+           continue;
+       }
+       free(e->alias);
+       e->alias = NULL;
+       command_drop_if_unused(e);
+   }
+   return status;
+}
+
+
+/*
+* Function: builtin_hash
+* ----------------------
+* Shows the cached command paths, looks names up and caches them (hash name), or forgets
+* them all (hash -r).
+*/
+int builtin_hash(char *args[]) {
+   if (args[1] != NULL && strcmp(args[1], "-r") == 0) {
+       for (size_t i = 0; i < command_capacity; i++) {
+           struct command_entry *e = &command_table[i];
+           if (e->name != NULL && e->name != TOMBSTONE && e->path != NULL) {
+               free(e->path);
+               e->path = NULL;
+               command_drop_if_unused(e);
+           }
+       }
+       return 0;
+   }
+   if (args[1] == NULL) {
+       for (size_t i = 0; i < command_capacity; i++) {
+           struct command_entry *e = &command_table[i];
+           if (e->name != NULL && e->name != TOMBSTONE && e->path != NULL && e->path_generation == path_generation)
+               shell_printf("%s\t%s\n", e->name, e->path);
+       }
+       return 0;
+   }
+   int status = 0;
+   for (int i = 1; args[i] != NULL; i++) {
+       if (command_path(args[i]) == NULL && strchr(args[i], '/') == NULL) {
+           fprintf(stderr, "hash: %s: not found\n", args[i]);
+           status = 1;
+       }
+   }
+   return status;
+}
+
+
+/*
+* Function: builtin_return
+* ------------------------
+* Leaves the function being run, with the given status or that of the last command.
+*/
+int builtin_return(char *args[]) {
+   if (function_depth == 0) {
+       fprintf(stderr, "return: can only `return' from a function\n");
+       return 1;
+   }
+   function_returning = 1;
+   return args[1] ? atoi(args[1]) : last_status;
+}
+
+
+/*
+* Function: builtin_break
+* -----------------------
+* break and continue inside a loop are compiled into jumps; reaching the builtin means there
+* is no enclosing loop.
+*/
+int builtin_break(char *args[]) {
+   fprintf(stderr, "%s: only meaningful in a `for', `while', or `until' loop\n", args[0]);
+   return 0;
+}
+
+
+/*
+* Function: make_sealed_memfd
+* ---------------------------
+* Copies a buffer into an anonymous memfd, seals it against further changes and rewinds it,
+* so it can be handed to a child as stdin without touching the filesystem. Returns -1 on failure.
+*/
+int make_sealed_memfd(const char *data, size_t len) {
+   int fd = memfd_create("osc-heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+   if (fd < 0) {
+       perror("memfd_create failed");
+       return -1;
+   }
+   size_t written = 0;
+   while (written < len) {
+       ssize_t n = write(fd, data + written, len - written);
+       if (n < 0) {
+           if (errno == EINTR)
+               continue;   /* interrupted, try again */
+           perror("memfd write failed");
+           close(fd);
+           return -1;
+       }
+       written += n;
+   }
+   /* Freeze the contents; a failure here only loses the guarantee, not the data */
+   fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+   lseek(fd, 0, SEEK_SET);  /* the child starts reading from the beginning */
+   return fd;
+}
+
+
+/*
+* Function: strip_quotes
+* ----------------------
+* Removes quote characters and backslashes from a here-document delimiter in place ('EOF',
+* "EOF" and \EOF mean EOF). Returns 1 if there were any: the body is then taken literally.
+*/
+int strip_quotes(char *word) {
+   size_t len = strlen(word);
+   char *out = word;
+   for (char *in = word; *in != '\0'; in++) {
+       if (*in == '\\' && in[1] != '\0')
+           *out++ = *++in;
+       else if (*in != '\'' && *in != '"')
+           *out++ = *in;
+   }
+   *out = '\0';
+   return out != word + len;
+}
+
+
+/*
+* Function: handle_input_or_output
+* --------------------------------
+* Applies a command's redirections (<, >, >>, <&, >&, &>, here-documents and here-strings) to
+* the current process in order. With saved, each descriptor's original is parked above the low
+* fds first so restore_redirections can put it back. Returns -1 if one of them fails.
+*/
+int handle_input_or_output(struct program *prog, int first, int count, struct saved_fds *saved) {
+   for (int i = first; i < first + count; i++) {
+       const struct credir *r = &prog->redirs[i];
+       const struct cword *w = &prog->words[r->word];
+       int input = (r->type == R_IN || r->type == R_DUP_IN || r->type == R_HEREDOC || r->type == R_HERESTRING);
+       int target = r->fd >= 0 ? r->fd : input ? STDIN_FILENO : STDOUT_FILENO;
+       int fd = -1;        /* descriptor to move onto target */
+       int owned = 1;      /* fd was opened here and is closed once moved */
+       int close_target = 0;
+
+
+       if (r->type == R_HEREDOC && w->nparts == 0) {
+           const char *body = prog->pool + w->text;   /* quoted delimiter: taken as it is */
+           fd = make_sealed_memfd(body, strlen(body));
+       } else if (r->type == R_HEREDOC) {
+           char *body = expand_cword_string(prog, w);
+           fd = make_sealed_memfd(body, strlen(body));
+           free(body);
+       } else {
+           char *word = expand_cword_string(prog, w);
+           if (r->type == R_HERESTRING) {
+               size_t n = strlen(word);
+               char *body = realloc(word, n + 2);
+               if (body != NULL) {
+                   word = body;
+                   memcpy(word + n, "\n", 2);   /* a here-string always ends with a newline */
+                   fd = make_sealed_memfd(word, n + 1);
+               }
+           } else if (r->type == R_DUP_IN || r->type == R_DUP_OUT) {
+               /* n>&m duplicates m, n>&- closes n */
+               char *end;
+               long source = strtol(word, &end, 10);
+               if (strcmp(word, "-") == 0) {
+                   close_target = 1;
+               } else if (*word == '\0' || *end != '\0' || source < 0 || fcntl(source, F_GETFD) < 0) {
+                   fprintf(stderr, "%s: bad file descriptor\n", word);
+               } else {
+                   fd = source;
+                   owned = 0;
+               }
+           } else {
+               int flags = O_RDONLY;
+               if (r->type == R_OUT || r->type == R_OUT_ERR)
+                   flags = O_WRONLY | O_CREAT | O_TRUNC;
+               else if (r->type == R_APPEND || r->type == R_APPEND_ERR)
+                   flags = O_WRONLY | O_CREAT | O_APPEND;
+               fd = open(word, flags | O_CLOEXEC, 0644);
+               if (fd < 0)
+                   fprintf(stderr, "Error: Unable to open %s file '%s'\n", input ? "input" : "output", word);
+           }
+           free(word);
+       }
+       if (fd < 0 && !close_target)
+           return -1;
+
+
+       /* &> and &>> send both stdout and stderr to the file */
+       int targets[2] = { target, -1 };
+       if (r->type == R_OUT_ERR || r->type == R_APPEND_ERR)
+           targets[1] = STDERR_FILENO;
+       for (int k = 0; k < 2 && targets[k] >= 0; k++) {
+           if (targets[k] == STDOUT_FILENO)
+               fflush(stdout);
+           if (saved != NULL) {
+               if (saved->count >= MAX_REDIRS) {
+                   fprintf(stderr, "too many redirections\n");
+                   if (owned && fd >= 0)
+                       close(fd);
+                   return -1;
+               }
+               saved->fd[saved->count] = targets[k];
+               saved->copy[saved->count++] = fcntl(targets[k], F_DUPFD_CLOEXEC, 10);
+           }
+           if (close_target)
+               close(targets[k]);
+           else if (fd != targets[k] && dup2(fd, targets[k]) < 0)
+               perror("dup2 failed");
+       }
+       if (owned && fd >= 0 && fd != target)
+           close(fd);
+   }
+   return 0;
+}
+
+
+/*
+* Function: redirect_in_child
+* ---------------------------
+* Applies a command's redirections to the current process (a freshly forked child), exiting on failure.
+*/
+void redirect_in_child(struct program *prog, int first, int count) {
+   if (count > 0 && handle_input_or_output(prog, first, count, NULL) < 0)
+       _exit(EXIT_FAILURE);
+}
+
+
+/*
+* Function: restore_redirections
+* ------------------------------
+* Puts back the descriptors saved by redirect_in_shell, newest first, and finishes any process
+* substitution (< <(cmd)) the redirections opened.
+*/
+void restore_redirections(struct saved_fds *saved) {
+   for (int i = saved->count - 1; i >= 0; i--) {
+       if (saved->fd[i] == STDOUT_FILENO)
+           fflush(stdout);
+       if (saved->copy[i] >= 0) {
+           dup2(saved->copy[i], saved->fd[i]);
+           close(saved->copy[i]);
+       } else {
+           close(saved->fd[i]);   /* it wasn't open before */
+       }
+   }
+   saved->count = 0;
+   procsub_close(saved->procsubs, 1);
+}
+
+
+/*
+* Function: redirect_in_shell
+* ---------------------------
+* Applies redirections to the shell itself (for builtins and compound commands), recording the
+* originals in saved. On failure everything is put back and -1 returned.
+*/
+int redirect_in_shell(struct program *prog, int first, int count, struct saved_fds *saved) {
+   saved->count = 0;
+   saved->procsubs = nprocsubs;
+   if (handle_input_or_output(prog, first, count, saved) < 0) {
+       restore_redirections(saved);
+       return -1;
+   }
+   return 0;
+}
+
+
+/*
+* Function: redirects_stdout
+* --------------------------
+* True if one of a command's redirections replaces its standard output.
+*/
+int redirects_stdout(struct program *prog, const struct ccommand *cmd) {
+   for (int i = cmd->first_redir; i < cmd->first_redir + cmd->nredirs; i++) {
+       const struct credir *r = &prog->redirs[i];
+       if (r->type == R_OUT_ERR || r->type == R_APPEND_ERR)
+           return 1;
+       if ((r->type == R_OUT || r->type == R_APPEND || r->type == R_DUP_OUT) && (r->fd < 0 || r->fd == STDOUT_FILENO))
+           return 1;
+   }
+   return 0;
+}
+
+
+/*
+* Function: vector_reserve
+* ------------------------
+* Makes room for at least needed elements of the given size in a growable array, doubling it.
+* Returns -1 if memory runs out.
+*/
+int vector_reserve(void *items, int *capacity, int needed, size_t size) {
+   if (needed <= *capacity)
+       return 0;
+   int grown_capacity = *capacity ? *capacity * 2 : 16;
+   while (grown_capacity < needed)
+       grown_capacity *= 2;
+   void *grown = realloc(*(void **)items, grown_capacity * size);
+   if (grown == NULL) {
+       perror("realloc failed");
+       return -1;
+   }
+   *(void **)items = grown;
+   *capacity = grown_capacity;
+   return 0;
+}
+
+
+/*
+* Function: pool_add
+* ------------------
+* Copies text into a program's string pool, null terminated, and returns its offset.
+*/
+int pool_add(struct program *prog, const char *text, int len) {
+   if (vector_reserve(&prog->pool, &prog->pool_cap, prog->pool_len + len + 1, 1) < 0)
+       return 0;
+   int offset = prog->pool_len;
+   memcpy(prog->pool + offset, text, len);
+   prog->pool[offset + len] = '\0';
+   prog->pool_len += len + 1;
+   return offset;
+}
+
+
+/*
+* Function: emit
+* --------------
+* Appends an instruction to a program's code and returns its index.
+*/
+int emit(struct program *prog, int op, int flags, int a, int b, int c) {
+   if (vector_reserve(&prog->code, &prog->code_cap, prog->ncode + 1, sizeof(struct instr)) < 0)
+       return 0;
+   prog->code[prog->ncode] = (struct instr){ op, flags, a, b, c };
+   return prog->ncode++;
+}
+
+
+/*
+* Function: arith_digit
+* ---------------------
+* Returns the value of a digit in the given base (up to 64: 0-9, a-z, A-Z, @ and _, with letters
+* of either case the same below 37), or -1 if it isn't one.
+*/
+int arith_digit(char c, int base) {
+   int d;
+   if (c >= '0' && c <= '9')
+       d = c - '0';
+   else if (c >= 'a' && c <= 'z')
+       d = c - 'a' + 10;
+   else if (c >= 'A' && c <= 'Z')
+       d = c - 'A' + (base <= 36 ? 10 : 36);
+   else if (c == '@')
+       d = 62;
+   else if (c == '_')
+       d = 63;
+   else
+       return -1;
+   return d < base ? d : -1;
+}
+
+
+/*
+* Function: arith_number
+* ----------------------
+* Reads an integer constant: decimal, 0x hexadecimal, 0 octal or base#digits. Returns the
+* characters used, 0 if s doesn't start with a digit, or -1 for a malformed constant.
+*/
+int arith_number(const char *s, long long *out) {
+   const char *p = s;
+   int base = 10;
+   if (!isdigit((unsigned char)*p))
+       return 0;
+   if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+       base = 16;
+       p += 2;
+   } else if (p[0] == '0') {
+       base = 8;
+   } else {
+       const char *q = p;
+       int prefix = 0;
+       while (isdigit((unsigned char)*q) && prefix <= 64)
+           prefix = prefix * 10 + (*q++ - '0');
+       if (*q == '#') {
+           if (prefix < 2 || prefix > 64)
+               return -1;
+           base = prefix;
+           p = q + 1;
+       }
+   }
+   unsigned long long value = 0;
+   int digits = 0;
+   for (int d; (d = arith_digit(*p, base)) >= 0; p++, digits++)
+       value = value * base + d;
+   if (digits == 0 || is_name_char(*p, 0))
+       return -1;
+   *out = (long long)value;
+   return p - s;
+}
+
+
+/*
+* Function: arith_plain
+* ---------------------
+* Tells whether a variable's value is just an integer (possibly signed, blanks around it, or
+* empty for 0) and stores it, so the common case needs no parsing.
+*/
+int arith_plain(const char *value, long long *out) {
+   while (isspace((unsigned char)*value))
+       value++;
+   if (*value == '\0') {
+       *out = 0;
+       return 1;
+   }
+   int negative = (*value == '-');
+   if (*value == '-' || *value == '+')
+       value++;
+   long long number;
+   int used = arith_number(value, &number);
+   if (used <= 0)
+       return 0;
+   value += used;
+   while (isspace((unsigned char)*value))
+       value++;
+   if (*value != '\0')
+       return 0;
+   *out = negative ? (long long)(0ULL - (unsigned long long)number) : number;
+   return 1;
+}
+
+
+/*
+* Function: arith_skip_space
+* --------------------------
+* Moves the expression parser past blanks and newlines.
+*/
+void arith_skip_space(struct arith_parser *ap) {
+   while (isspace((unsigned char)*ap->p))
+       ap->p++;
+}
+
+
+/*
+* Function: arith_error
+* ---------------------
+* Records the first error of an expression being parsed. Returns -1 for the caller to pass up.
+*/
+int arith_error(struct arith_parser *ap, const char *message) {
+   if (ap->error == NULL)
+       ap->error = message;
+   return -1;
+}
+
+
+/*
+* Function: arith_node
+* --------------------
+* Appends a node to the parser's table and returns its index, or -1 once there was an error.
+*/
+int arith_node(struct arith_parser *ap, int type, int op, int flags, int a, int b, int c) {
+   if (ap->error != NULL)
+       return -1;
+   if (vector_reserve(ap->nodes, ap->capacity, *ap->count + 1, sizeof(struct anode)) < 0)
+       return arith_error(ap, "out of memory");
+   (*ap->nodes)[*ap->count] = (struct anode){ type, op, flags, a, b, c, 0 };
+   return (*ap->count)++;
+}
+
+
+/*  Binary operators, two-character ones first, with their precedence (higher binds tighter) */
+struct arith_binop arith_binops[] = {
+   { "||", AO_OR, 1 }, { "&&", AO_AND, 2 }, { "==", AO_EQ, 6 }, { "!=", AO_NE, 6 }, { "<=", AO_LE, 7 },
+   { ">=", AO_GE, 7 }, { "<<", AO_SHL, 8 }, { ">>", AO_SHR, 8 }, { "**", AO_POW, 11 }, { "|", AO_BOR, 3 },
+   { "^", AO_XOR, 4 }, { "&", AO_BAND, 5 }, { "<", AO_LT, 7 }, { ">", AO_GT, 7 }, { "+", AO_ADD, 9 },
+   { "-", AO_SUB, 9 }, { "*", AO_MUL, 10 }, { "/", AO_DIV, 10 }, { "%", AO_MOD, 10 }, { NULL, 0, 0 }
+};
+
+/*  Assignment operators other than = */
+struct arith_binop arith_assignops[] = {
+   { "<<=", AO_SHL, 0 }, { ">>=", AO_SHR, 0 }, { "*=", AO_MUL, 0 }, { "/=", AO_DIV, 0 }, { "%=", AO_MOD, 0 },
+   { "+=", AO_ADD, 0 }, { "-=", AO_SUB, 0 }, { "&=", AO_BAND, 0 }, { "^=", AO_XOR, 0 }, { "|=", AO_BOR, 0 },
+   { NULL, 0, 0 }
+};
+
+
+/*
+* Function: arith_match
+* ---------------------
+* Finds the operator of a table that the text starts with. A binary operator directly followed
+* by = is really an assignment (x += 1) and isn't matched.
+*/
+const struct arith_binop *arith_match(const struct arith_binop *table, const char *p) {
+   for (const struct arith_binop *o = table; o->text != NULL; o++) {
+       size_t len = strlen(o->text);
+       if (strncmp(p, o->text, len) != 0)
+           continue;
+       if (table == arith_binops && p[len] == '=' && o->text[len - 1] != '=')
+           return NULL;
+       return o;
+   }
+   return NULL;
+}
+
+
+/*
+* Function: arith_name
+* --------------------
+* Returns the length of the variable name at p, 0 if there is none.
+*/
+int arith_name(const char *p) {
+   int len = 0;
+   if (is_name_char(p[0], 1))
+       while (is_name_char(p[len], 0))
+           len++;
+   return len;
+}
+
+
+/*
+* Function: arith_primary
+* -----------------------
+* Parses a constant, a variable (with ++ or -- after it), $name or a parenthesised expression.
+*/
+int arith_primary(struct arith_parser *ap) {
+   arith_skip_space(ap);
+   const char *p = ap->p;
+   if (*p == '(') {
+       ap->p++;
+       int inner = arith_comma(ap);
+       arith_skip_space(ap);
+       if (*ap->p != ')')
+           return arith_error(ap, "missing ')'");
+       ap->p++;
+       return inner;
+   }
+   if (isdigit((unsigned char)*p)) {
+       long long value;
+       int used = arith_number(p, &value);
+       if (used < 0)
+           return arith_error(ap, "invalid number");
+       int n = arith_node(ap, A_NUM, 0, 0, 0, 0, 0);
+       if (n >= 0)
+           (*ap->nodes)[n].value = value;
+       ap->p += used;
+       return n;
+   }
+   if (*p == '$' && ap->dollars) {
+       /* $name, ${name} or a special parameter: only its value's text is wanted */
+       const char *name = p + 1;
+       int len = arith_name(name);
+       int braced = (*name == '{');
+       if (braced) {
+           name++;
+           len = arith_name(name);
+       }
+       if (len == 0 && *name != '\0' && strchr("?$!#0123456789", *name) != NULL)
+           len = 1;
+       if (len == 0 || (braced && name[len] != '}'))
+           return arith_error(ap, "unsupported expansion");
+       ap->has_dollar = 1;
+       ap->p = name + len + braced;
+       return arith_node(ap, A_VAR, 0, AF_TEXTUAL, name - ap->base, len, 0);
+   }
+   int len = arith_name(p);
+   if (len == 0)
+       return arith_error(ap, *p == '\0' ? "operand expected" : "syntax error in expression");
+   ap->p += len;
+   arith_skip_space(ap);
+   if ((ap->p[0] == '+' || ap->p[0] == '-') && ap->p[1] == ap->p[0]) {
+       int op = (ap->p[0] == '+') ? AO_ADD : AO_SUB;
+       ap->p += 2;
+       ap->has_assign = 1;
+       return arith_node(ap, A_INCDEC, op, AF_POSTFIX, p - ap->base, len, 0);
+   }
+   return arith_node(ap, A_VAR, 0, 0, p - ap->base, len, 0);
+}
+
+
+/*
+* Function: arith_unary
+* ---------------------
+* Parses the prefix operators + - ! ~ ++ -- and what they apply to.
+*/
+int arith_unary(struct arith_parser *ap) {
+   arith_skip_space(ap);
+   char c = *ap->p;
+   if ((c == '+' || c == '-') && ap->p[1] == c) {
+       const char *name = ap->p + 2;
+       while (isspace((unsigned char)*name))
+           name++;
+       int len = arith_name(name);
+       if (len > 0) {
+           ap->p = name + len;
+           ap->has_assign = 1;
+           return arith_node(ap, A_INCDEC, c == '+' ? AO_ADD : AO_SUB, 0, name - ap->base, len, 0);
+       }
+   }
+   if (c == '+' || c == '-' || c == '!' || c == '~') {
+       ap->p++;
+       int operand = arith_unary(ap);
+       int op = (c == '+') ? AO_PLUS : (c == '-') ? AO_NEG : (c == '!') ? AO_NOT : AO_BNOT;
+       return arith_node(ap, A_UNARY, op, 0, operand, 0, 0);
+   }
+   return arith_primary(ap);
+}
+
+
+/*
+* Function: arith_binary
+* ----------------------
+* Parses binary operators of at least the given precedence by precedence climbing. All are left
+* associative except **.
+*/
+int arith_binary(struct arith_parser *ap, int min_prec) {
+   int left = arith_unary(ap);
+   for (;;) {
+       arith_skip_space(ap);
+       const struct arith_binop *o = arith_match(arith_binops, ap->p);
+       if (o == NULL || o->prec < min_prec || ap->error != NULL)
+           return left;
+       ap->p += strlen(o->text);
+       int right = arith_binary(ap, o->op == AO_POW ? o->prec : o->prec + 1);
+       left = arith_node(ap, A_BINARY, o->op, 0, left, right, 0);
+   }
+}
+
+
+/*
+* Function: arith_conditional
+* ---------------------------
+* Parses a ? b : c.
+*/
+int arith_conditional(struct arith_parser *ap) {
+   int test = arith_binary(ap, 1);
+   arith_skip_space(ap);
+   if (*ap->p != '?')
+       return test;
+   ap->p++;
+   int then = arith_comma(ap);
+   arith_skip_space(ap);
+   if (*ap->p != ':')
+       return arith_error(ap, "':' expected for conditional expression");
+   ap->p++;
+   int otherwise = arith_conditional(ap);
+   return arith_node(ap, A_COND, 0, 0, test, then, otherwise);
+}
+
+
+/*
+* Function: arith_assignment
+* --------------------------
+* Parses name = value and the compound assignments (+=, <<= ...), which group to the right.
+*/
+int arith_assignment(struct arith_parser *ap) {
+   arith_skip_space(ap);
+   const char *name = ap->p;
+   int len = arith_name(name);
+   if (len > 0) {
+       const char *q = name + len;
+       while (isspace((unsigned char)*q))
+           q++;
+       const struct arith_binop *o = arith_match(arith_assignops, q);
+       if (o != NULL || (q[0] == '=' && q[1] != '=')) {
+           ap->p = q + (o != NULL ? strlen(o->text) : 1);
+           ap->has_assign = 1;
+           int value = arith_assignment(ap);
+           return arith_node(ap, A_ASSIGN, o != NULL ? o->op : AO_NONE, 0, name - ap->base, len, value);
+       }
+   }
+   return arith_conditional(ap);
+}
+
+
+/*
+* Function: arith_comma
+* ---------------------
+* Parses expressions separated by commas; the value is the last one's.
+*/
+int arith_comma(struct arith_parser *ap) {
+   int left = arith_assignment(ap);
+   for (;;) {
+       arith_skip_space(ap);
+       if (*ap->p != ',' || ap->error != NULL)
+           return left;
+       ap->p++;
+       int right = arith_assignment(ap);
+       left = arith_node(ap, A_COMMA, 0, 0, left, right, 0);
+   }
+}
+
+
+/*
+* Function: arith_parse
+* ---------------------
+* Parses a whole expression into the parser's node table (an empty one is 0). Returns the root
+* node, or -1 with ap->error set.
+*/
+int arith_parse(struct arith_parser *ap) {
+   arith_skip_space(ap);
+   if (*ap->p == '\0')
+       return arith_node(ap, A_NUM, 0, 0, 0, 0, 0);
+   int root = arith_comma(ap);
+   arith_skip_space(ap);
+   if (*ap->p != '\0')
+       arith_error(ap, "syntax error in expression");
+   return ap->error != NULL ? -1 : root;
+}
+
+
+/*
+* Function: arith_fail
+* --------------------
+* Reports an evaluation error such as division by zero, once, and stops the evaluation.
+*/
+long long arith_fail(struct arith_eval *ev, const char *message) {
+   if (!ev->failed)
+       fprintf(stderr, "%s: %s\n", ev->text, message);
+   ev->failed = 1;
+   return 0;
+}
+
+
+/*
+* Function: arith_variable
+* ------------------------
+* Returns a variable's value as a number. A value that isn't a plain integer is evaluated as an
+* expression in turn, except for $name, whose text bash would have pasted into the expression:
+* that needs the whole text expanded and parsed again, so the evaluation is abandoned.
+*/
+long long arith_variable(struct arith_eval *ev, const char *name, int len, int textual) {
+   char tmp[32];
+   const char *value = param_value(name, len, tmp, sizeof(tmp));
+   long long number = 0;
+   if (value == NULL || arith_plain(value, &number))
+       return number;
+   if (textual) {
+       ev->fallback = ev->failed = 1;
+       return 0;
+   }
+   if (ev->depth >= MAX_ARITH_DEPTH)
+       return arith_fail(ev, "expression recursion level exceeded");
+   char *copy = strdup(value);
+   if (copy == NULL)
+       return arith_fail(ev, "out of memory");
+   int failed;
+   number = arith_evaluate(copy, ev->depth + 1, &failed);
+   free(copy);
+   ev->failed |= failed;
+   return number;
+}
+
+
+/*
+* Function: arith_store
+* ---------------------
+* Assigns a number to a variable and returns it.
+*/
+long long arith_store(struct arith_eval *ev, const char *name, int len, long long value) {
+   if (ev->failed)
+       return 0;
+   char var_name[MAX_LENGTH];
+   char text[32];
+   snprintf(var_name, sizeof(var_name), "%.*s", len, name);
+   snprintf(text, sizeof(text), "%lld", value);
+   var_set(var_name, text, 0);
+   return value;
+}
+
+
+/*
+* Function: arith_apply
+* ---------------------
+* Applies a binary operator. Arithmetic wraps around like two's complement hardware instead of
+* being undefined on overflow.
+*/
+long long arith_apply(struct arith_eval *ev, int op, long long l, long long r) {
+   unsigned long long ul = l, ur = r;
+   switch (op) {
+   case AO_POW: {
+       if (r < 0)
+           return arith_fail(ev, "exponent less than 0");
+       unsigned long long result = 1;
+       for (; ur > 0; ur >>= 1, ul *= ul)
+           if (ur & 1)
+               result *= ul;
+       return (long long)result;
+   }
+   case AO_MUL: return (long long)(ul * ur);
+   case AO_DIV:
+   case AO_MOD:
+       if (r == 0)
+           return arith_fail(ev, "division by 0");
+       if (r == -1)   /* LLONG_MIN / -1 overflows */
+           return op == AO_DIV ? (long long)(0ULL - ul) : 0;
+       return op == AO_DIV ? l / r : l % r;
+   case AO_ADD: return (long long)(ul + ur);
+   case AO_SUB: return (long long)(ul - ur);
+   case AO_SHL: return (long long)(ul << (r & 63));
+   case AO_SHR: return l >> (r & 63);
+   case AO_LT: return l < r;
+   case AO_LE: return l <= r;
+   case AO_GT: return l > r;
+   case AO_GE: return l >= r;
+   case AO_EQ: return l == r;
+   case AO_NE: return l != r;
+   case AO_BAND: return l & r;
+   case AO_XOR: return l ^ r;
+   case AO_BOR: return l | r;
+   }
+   return 0;
+}
+
+
+/*
+* Function: arith_eval
+* --------------------
+* Evaluates a parsed expression from the given node.
+*/
+long long arith_eval(struct arith_eval *ev, int index) {
+   if (ev->failed)
+       return 0;
+   const struct anode *n = &ev->nodes[index];
+   switch (n->type) {
+   case A_NUM:
+       return n->value;
+   case A_VAR:
+       return arith_variable(ev, ev->base + n->a, n->b, n->flags & AF_TEXTUAL);
+   case A_UNARY: {
+       long long v = arith_eval(ev, n->a);
+       if (n->op == AO_NEG)
+           return (long long)(0ULL - (unsigned long long)v);
+       return n->op == AO_NOT ? !v : n->op == AO_BNOT ? ~v : v;
+   }
+   case A_BINARY: {
+       /* && and || don't evaluate their right side when the left decides */
+       if (n->op == AO_AND)
+           return arith_eval(ev, n->a) && arith_eval(ev, n->b);
+       if (n->op == AO_OR)
+           return arith_eval(ev, n->a) || arith_eval(ev, n->b);
+       long long left = arith_eval(ev, n->a);
+       return arith_apply(ev, n->op, left, arith_eval(ev, n->b));
+   }
+   case A_ASSIGN: {
+       long long v = arith_eval(ev, n->c);
+       if (n->op != AO_NONE)
+           v = arith_apply(ev, n->op, arith_variable(ev, ev->base + n->a, n->b, 0), v);
+       return arith_store(ev, ev->base + n->a, n->b, v);
+   }
+   case A_INCDEC: {
+       long long old = arith_variable(ev, ev->base + n->a, n->b, 0);
+       long long v = arith_store(ev, ev->base + n->a, n->b, arith_apply(ev, n->op, old, 1));
+       return (n->flags & AF_POSTFIX) ? old : v;
+   }
+   case A_COND:
+       return arith_eval(ev, n->a) ? arith_eval(ev, n->b) : arith_eval(ev, n->c);
+   case A_COMMA:
+       arith_eval(ev, n->a);
+       return arith_eval(ev, n->b);
+   }
+   return 0;
+}
+
+
+/*
+* Function: arith_evaluate
+* ------------------------
+* Parses and evaluates an already expanded expression. Errors are reported and set *failed.
+*/
+long long arith_evaluate(const char *text, int depth, int *failed) {
+   struct anode *nodes = NULL;
+   int count = 0, capacity = 0;
+   struct arith_parser ap = { text, text, &nodes, &count, &capacity, 0, NULL, 0, 0 };
+   int root = arith_parse(&ap);
+   struct arith_eval ev = { nodes, text, text, depth, 0, 0 };
+   long long result = 0;
+   if (root < 0)
+       fprintf(stderr, "%s: %s (error token is \"%s\")\n", text, ap.error, ap.p);
+   else
+       result = arith_eval(&ev, root);
+   free(nodes);
+   *failed = (root < 0 || ev.failed);
+   return result;
+}
+
+
+/*
+* Function: arith_expand
+* ----------------------
+* Evaluates a $((...)) or ((...)). One compiled into prog (entry > 0) runs from its parsed form
+* unless a $name in it turns out not to hold a number; then, like one that wasn't compiled, its
+* text is expanded and parsed. Returns -1 after an error, which also sets expansion_failed.
+*/
+int arith_expand(struct program *prog, int entry, const char *raw, int len, long long *result) {
+   char *text;
+   if (prog != NULL && entry > 0) {
+       const struct carith *ca = &prog->arith[entry - 1];
+       const struct cword *w = &prog->words[ca->word];
+       if (ca->root >= 0) {
+           struct arith_eval ev = { prog->exprs, prog->pool, prog->pool + w->text, 0, 0, 0 };
+           *result = arith_eval(&ev, ca->root);
+           if (!ev.fallback) {
+               expansion_failed |= ev.failed;
+               return ev.failed ? -1 : 0;
+           }
+       }
+       text = expand_cword_string(prog, w);
+   } else {
+       char *copy = strndup(raw, len);
+       text = copy ? expand_string(copy) : NULL;
+       free(copy);
+   }
+   int failed = 1;
+   *result = text ? arith_evaluate(text, 0, &failed) : 0;
+   free(text);
+   expansion_failed |= failed;
+   return failed ? -1 : 0;
+}
+
+
+/*
+* Function: builtin_let
+* ---------------------
+* Evaluates each argument as an arithmetic expression. Returns 0 if the last one is non-zero.
+*/
+int builtin_let(char *args[]) {
+   if (args[1] == NULL) {
+       fprintf(stderr, "let: expression expected\n");
+       return 1;
+   }
+   long long value = 0;
+   for (int i = 1; args[i] != NULL; i++) {
+       int failed;
+       value = arith_evaluate(args[i], 0, &failed);
+       if (failed)
+           return 1;
+   }
+   return value == 0;
+}
+
+
+/*
+* Function: substitution_text
+* ---------------------------
+* Returns an allocated copy of the text of a $(...) or `...`; inside backquotes \\ \` and \$
+* stand for the plain character.
+*/
+char *substitution_text(const char *text, size_t len, int backquoted) {
+   char *line = malloc(len + 1);
+   if (line == NULL) {
+       perror("malloc failed");
+       return NULL;
+   }
+   size_t n = 0;
+   for (size_t i = 0; i < len; i++) {
+       if (backquoted && text[i] == '\\' && i + 1 < len && strchr("\\`$", text[i + 1]) != NULL)
+           i++;
+       line[n++] = text[i];
+   }
+   line[n] = '\0';
+   return line;
+}
+
+
+/*
+* Function: read_heredoc_bodies
+* -----------------------------
+* Takes the bodies of the here-documents started on the line just ended from the lines that
+* follow, each up to its delimiter line, and stores them in the program, compiled for expansion
+* unless the delimiter was quoted. With <<- leading tabs are removed from every line, delimiter
+* included. Interactively, missing lines mean the
+* command is incomplete; in a script the end of the text ends the document.
+*/
+void read_heredoc_bodies(struct parser *ps) {
+   struct program *prog = ps->cc->prog;
+   const char *p = ps->p;
+   for (int h = 0; h < ps->npending; h++) {
+       struct pending_heredoc *hd = &ps->pending[h];
+       struct strbuf body = { NULL, 0, 0 };
+       size_t delimiter_len = strlen(hd->delimiter);
+       int found = 0;
+       while (*p != '\0') {
+           const char *eol = strchr(p, '\n');
+           size_t n = eol ? (size_t)(eol - p) : strlen(p);
+           const char *line = p;
+           p = eol ? eol + 1 : p + n;
+           if (hd->strip_tabs) {
+               while (n > 0 && *line == '\t') {
+                   line++;
+                   n--;
+               }
+           }
+           if (n == delimiter_len && memcmp(line, hd->delimiter, n) == 0) {
+               found = 1;
+               break;
+           }
+           strbuf_append(&body, line, n);
+           strbuf_append(&body, "\n", 1);
+       }
+       if (!found && ps->interactive && ps->cc->status == PARSE_OK)
+           ps->cc->status = PARSE_INCOMPLETE;
+       struct cword w;
+       if (!hd->quoted && ps->cc->status == PARSE_OK && body.len > 0) {
+           /* $name, $(...), $((...)) and `...` in it are expanded each time it is used */
+           if (compile_word_token(ps, body.buf, body.len, WORD_HEREDOC, &w) == 0)
+               prog->words[hd->word] = w;
+       } else {
+           prog->words[hd->word].text = pool_add(prog, body.buf ? body.buf : "", body.len);
+       }
+       free(body.buf);
+       free(hd->delimiter);
+   }
+   ps->npending = 0;
+   ps->p = p;
+}
+
+
+/*
+* Function: lex_next
+* ------------------
+* Reads the next token into ps->tok: a raw word (quotes kept), a redirection operator with the
+* descriptor number glued to it, a control operator, a newline or the end of the text. Blanks,
+* comments and backslash-newlines are skipped; here-document bodies are read after a newline.
+* At the end of an alias's text lexing goes back to where the alias was used.
+*/
+void lex_next(struct parser *ps) {
+   const char *p = ps->p;
+   while (*p == ' ' || *p == '\t' || *p == '#' || (*p == '\\' && p[1] == '\n') || (*p == '\0' && ps->nalias > 0)) {
+       if (*p == '\0') {
+           p = ps->aliases[--ps->nalias].resume;
+       } else if (*p == '#') {
+           while (*p != '\0' && *p != '\n')
+               p++;   /* the rest of the line is a comment */
+       } else {
+           p += (*p == '\\') ? 2 : 1;
+       }
+   }
+   struct token *t = &ps->tok;
+   t->text = p;
+   t->len = 0;
+   t->fd = -1;
+   t->strip_tabs = 0;
+   if (*p == '\0' || *p == '\n') {
+       t->type = (*p == '\0') ? TK_EOF : TK_NEWLINE;
+       t->len = (*p == '\n');
+       ps->p = p + t->len;
+       if (ps->npending > 0)
+           read_heredoc_bodies(ps);
+       return;
+   }
+
+
+   /* a number glued to a redirection names the descriptor: 2>file */
+   const char *digits = p;
+   while (*digits >= '0' && *digits <= '9')
+       digits++;
+   if (digits > p && (*digits == '<' || *digits == '>') && !is_process_substitution(digits)) {
+       t->fd = atoi(p);
+       p = digits;
+   }
+   char *op = is_process_substitution(p) ? NULL : match_operator(p);
+   if (op == NULL) {
+       const char *end = skip_word((char *)p, ps->pattern_word, ps->element_word);
+       if (end == NULL) {
+           /* an unclosed quote or $( swallows the rest of the text */
+           if (ps->interactive) {
+               ps->cc->status = PARSE_INCOMPLETE;
+           } else if (ps->cc->status == PARSE_OK) {
+               fprintf(stderr, "syntax error: unterminated quote\n");
+               ps->cc->status = PARSE_ERROR;
+           }
+           t->type = TK_EOF;
+           ps->p = p + strlen(p);
+           return;
+       }
+       t->type = TK_WORD;
+       t->len = end - p;
+       ps->p = end;
+       return;
+   }
+   ps->p = p + strlen(op);
+   t->len = ps->p - t->text;
+
+
+   static const struct { const char *op; int type; int redir; } kinds[] = {
+       { "<<<", TK_REDIR, R_HERESTRING }, { "<<-", TK_REDIR, R_HEREDOC }, { "<<", TK_REDIR, R_HEREDOC },
+       { "<&", TK_REDIR, R_DUP_IN }, { "<", TK_REDIR, R_IN }, { ">>", TK_REDIR, R_APPEND },
+       { ">&", TK_REDIR, R_DUP_OUT }, { ">", TK_REDIR, R_OUT }, { "&>>", TK_REDIR, R_APPEND_ERR },
+       { "&>", TK_REDIR, R_OUT_ERR }, { "&&", TK_AND, 0 }, { "&", TK_AMP, 0 }, { "||", TK_OR, 0 },
+       { "|", TK_PIPE, 0 }, { ";;", TK_DSEMI, 0 }, { ";", TK_SEMI, 0 }, { "(", TK_LPAREN, 0 },
+       { ")", TK_RPAREN, 0 }, { NULL, 0, 0 }
+   };
+   for (int i = 0; kinds[i].op != NULL; i++) {
+       if (strcmp(op, kinds[i].op) == 0) {
+           t->type = kinds[i].type;
+           t->redir = kinds[i].redir;
+           break;
+       }
+   }
+   t->strip_tabs = (strcmp(op, "<<-") == 0);
+}
+
+
+/*
+* Function: expand_alias
+* ----------------------
+* If the current token is a word naming an alias, switches the lexer over to the alias's
+* text and reads its first token. An alias is not expanded again inside its own text, so
+* alias ls='ls -F' works. Returns 1 if the token was replaced.
+*/
+int expand_alias(struct parser *ps) {
+   if (ps->tok.type != TK_WORD || ps->nalias >= MAX_ALIAS_DEPTH)
+       return 0;
+   struct command_entry *e = command_lookup(ps->tok.text, ps->tok.len);
+   if (e == NULL || e->alias == NULL)
+       return 0;
+   for (int i = 0; i < ps->nalias; i++) {
+       if (ps->aliases[i].name == e->name)
+           return 0;
+   }
+   ps->aliases[ps->nalias++] = (struct alias_frame){ e->name, ps->p };
+   ps->p = e->alias;
+   lex_next(ps);
+   return 1;
+}
+
+
+/*
+* Function: syntax_error
+* ----------------------
+* Reports the current token as unexpected, once. Running out of text at the prompt is not an
+* error but a request for another line.
+*/
+void syntax_error(struct parser *ps) {
+   if (ps->cc->status != PARSE_OK)
+       return;
+   if (ps->tok.type == TK_EOF && ps->interactive) {
+       ps->cc->status = PARSE_INCOMPLETE;
+       return;
+   }
+   if (ps->tok.type == TK_EOF)
+       fprintf(stderr, "syntax error: unexpected end of file\n");
+   else if (ps->tok.type == TK_NEWLINE)
+       fprintf(stderr, "syntax error near unexpected token 'newline'\n");
+   else
+       fprintf(stderr, "syntax error near unexpected token '%.*s'\n", ps->tok.len, ps->tok.text);
+   ps->cc->status = PARSE_ERROR;
+}
+
+
+/*
+* Function: is_reserved
+* ---------------------
+* True if the current token is the given reserved word (an unquoted word spelled exactly so).
+*/
+int is_reserved(struct parser *ps, const char *word) {
+   return ps->tok.type == TK_WORD && (size_t)ps->tok.len == strlen(word) && memcmp(ps->tok.text, word, ps->tok.len) == 0;
+}
+
+
+/*
+* Function: accept_reserved
+* -------------------------
+* Consumes the current token if it is the given reserved word.
+*/
+int accept_reserved(struct parser *ps, const char *word) {
+   if (!is_reserved(ps, word))
+       return 0;
+   lex_next(ps);
+   return 1;
+}
+
+
+/*
+* Function: expect_reserved
+* -------------------------
+* Consumes the given reserved word, or reports a syntax error.
+*/
+void expect_reserved(struct parser *ps, const char *word) {
+   if (!accept_reserved(ps, word))
+       syntax_error(ps);
+}
+
+
+/*
+* Function: relex_pattern
+* -----------------------
+* Where only a pattern can be, reads a ! followed by ( again, as one word holding !(...).
+*/
+void relex_pattern(struct parser *ps) {
+   if (is_reserved(ps, "!") && *ps->p == '(') {
+       ps->p = ps->tok.text;
+       ps->pattern_word = 1;
+       lex_next(ps);
+       ps->pattern_word = 0;
+   }
+}
+
+
+/*
+* Function: skip_newlines
+* -----------------------
+* Skips newline tokens; returns how many there were.
+*/
+int skip_newlines(struct parser *ps) {
+   int count = 0;
+   while (ps->tok.type == TK_NEWLINE && ps->cc->status == PARSE_OK) {
+       lex_next(ps);
+       count++;
+   }
+   return count;
+}
+
+
+/*
+* Function: new_node
+* ------------------
+* Allocates a zeroed syntax tree node, chained for freeing.
+*/
+struct node *new_node(struct parser *ps, int type) {
+   struct node *n = calloc(1, sizeof(struct node));
+   if (n == NULL) {
+       perror("calloc failed");
+       exit(EXIT_FAILURE);
+   }
+   n->type = type;
+   n->all = ps->cc->nodes;
+   ps->cc->nodes = n;
+   return n;
+}
+
+
+/*
+* Function: add_block
+* -------------------
+* Registers a syntax tree to be compiled as a separate block and returns the block's index.
+*/
+int add_block(struct compiler *cc, struct node *body) {
+   if (vector_reserve(&cc->block_nodes, &cc->blocks_cap, cc->nblocks + 1, sizeof(struct node *)) < 0)
+       return 0;
+   cc->block_nodes[cc->nblocks] = body;
+   return cc->nblocks++;
+}
+
+
+/*
+* Function: compile_substitution
+* ------------------------------
+* Parses the text of a $(...), `...` or <(...) in a word into its own block, so running it later needs
+* no parsing. Returns the block index, or -1 on a syntax error.
+*/
+int compile_substitution(struct parser *ps, int offset, int len, int backquoted) {
+   char *text = substitution_text(ps->cc->prog->pool + offset, len, backquoted);
+   if (text == NULL)
+       return -1;
+   struct parser sub = { ps->cc, text, { 0 }, 0, { { 0 } }, 0, { { 0 } }, 0, 0, 0 };
+   int block = add_block(ps->cc, NULL);
+   lex_next(&sub);
+   struct node *body = parse_list(&sub);
+   if (sub.tok.type != TK_EOF)
+       syntax_error(&sub);
+   for (int h = 0; h < sub.npending; h++)
+       free(sub.pending[h].delimiter);
+   free(text);
+   ps->cc->block_nodes[block] = body;
+   return ps->cc->status == PARSE_OK ? block : -1;
+}
+
+
+/*
+* Function: compile_word_token
+* ----------------------------
+* Stores a raw word in the program and breaks it into parts; a $(...), <(...) or $((...)) inside
+* is compiled right away. For an assignment (WORD_ASSIGNMENT) only the value is broken up, and for
+* an element of NAME=(...) (WORD_ELEMENT) what follows any [subscript]=. The body of a
+* here-document (WORD_HEREDOC) may have any number of parts. Returns -1 on an error.
+*/
+int compile_word_token(struct parser *ps, const char *text, int len, int assignment, struct cword *out) {
+   struct program *prog = ps->cc->prog;
+   int offset = pool_add(prog, text, len);
+   int skip = 0;
+   if (assignment == WORD_ASSIGNMENT)
+       skip = is_assignment(prog->pool + offset) + 1;
+   else if (assignment == WORD_ELEMENT)
+       skip = element_subscript(prog->pool + offset);
+   struct wpart word_parts[MAX_PARTS];
+   struct wpart *parts = word_parts;
+   int max = MAX_PARTS;
+   if (assignment == WORD_HEREDOC) {
+       max = len + 1;   /* every part takes at least one character */
+       parts = malloc(max * sizeof(struct wpart));
+       if (parts == NULL) {
+           perror("malloc failed");
+           return -1;
+       }
+   }
+   int n = compile_word(prog->pool + offset + skip, parts, max, assignment == WORD_HEREDOC);
+   int failed = (n < 0);
+   if (failed) {
+       fprintf(stderr, "syntax error: word too complex: %s\n", prog->pool + offset);
+       ps->cc->status = PARSE_ERROR;
+   }
+   for (int i = 0; i < n && !failed; i++) {
+       parts[i].off += skip;
+       if (parts[i].type == WP_CMDSUB || parts[i].type == WP_BACKQUOTE || parts[i].type == WP_PROCSUB) {
+           parts[i].block = compile_substitution(ps, offset + parts[i].off, parts[i].len, parts[i].type == WP_BACKQUOTE);
+           failed = (parts[i].block < 0);
+       } else if (parts[i].type == WP_ARITH) {
+           int entry = add_arith(ps, prog->pool + offset + parts[i].off, parts[i].len);
+           failed = (entry < 0);
+           parts[i].block = entry + 1;
+       }
+   }
+   if (!failed && vector_reserve(&prog->parts, &prog->parts_cap, prog->nparts + n, sizeof(struct wpart)) < 0)
+       failed = 1;
+   if (!failed) {
+       memcpy(prog->parts + prog->nparts, parts, n * sizeof(struct wpart));
+       *out = (struct cword){ offset, prog->nparts, n, 0, -1 };
+       prog->nparts += n;
+   }
+   if (parts != word_parts)
+       free(parts);
+   return failed ? -1 : 0;
+}
+
+
+/*
+* Function: add_word
+* ------------------
+* Appends a compiled word to the program's word table and returns its index.
+*/
+int add_word(struct program *prog, struct cword w) {
+   if (vector_reserve(&prog->words, &prog->words_cap, prog->nwords + 1, sizeof(struct cword)) < 0)
+       return 0;
+   prog->words[prog->nwords] = w;
+   return prog->nwords++;
+}
+
+
+/*
+* Function: add_arith
+* -------------------
+* Adds a $((...)) or ((...)) to the program's arithmetic table: its text as a word, so any
+* $(...) inside is compiled, and its parsed form, so running it needs no parsing. An expression
+* that only parses once expanded, or that both uses $name and assigns (changing what $name
+* would have expanded to), is left to be parsed when it runs. Returns the entry or -1.
+*/
+int add_arith(struct parser *ps, const char *text, int len) {
+   struct program *prog = ps->cc->prog;
+   char *copy = strndup(text, len);
+   if (copy == NULL)
+       return -1;
+   struct cword w;
+   int failed = compile_word_token(ps, copy, len, WORD_PLAIN, &w);
+   free(copy);
+   if (failed < 0 || vector_reserve(&prog->arith, &prog->arith_cap, prog->narith + 1, sizeof(struct carith)) < 0)
+       return -1;
+
+
+   int mark = prog->nexprs;
+   struct arith_parser ap = { prog->pool, prog->pool + w.text, &prog->exprs, &prog->nexprs, &prog->exprs_cap, 1, NULL, 0, 0 };
+   int root = arith_parse(&ap);
+   if (root < 0 || (ap.has_dollar && ap.has_assign)) {
+       prog->nexprs = mark;
+       root = -1;
+   }
+   prog->arith[prog->narith] = (struct carith){ add_word(prog, w), root };
+   return prog->narith++;
+}
+
+
+/*
+* Function: arith_command_end
+* ---------------------------
+* Given the text after the (( of a command, returns where its closing )) starts, or NULL if the
+* parentheses don't close that way and it is a subshell inside a subshell instead.
+*/
+const char *arith_command_end(const char *p) {
+   int depth = 0;
+   while (*p != '\0') {
+       if (*p == '\'' || *p == '"' || *p == '`' || (p[0] == '$' && (p[1] == '(' || p[1] == '{'))) {
+           p = skip_construct(p);
+           if (p == NULL)
+               return NULL;
+           continue;
+       }
+       if (*p == '(') {
+           depth++;
+       } else if (*p == ')') {
+           if (depth == 0)
+               return p[1] == ')' ? p : NULL;
+           depth--;
+       }
+       p++;
+   }
+   return NULL;
+}
+
+
+/*
+* Function: parse_redirect
+* ------------------------
+* Parses a redirection operator and its target word into a growable list. For a here-document
+* a word is reserved for the body, which is read once the line ends. Returns -1 on an error.
+*/
+int parse_redirect(struct parser *ps, struct credir **list, int *count, int *capacity) {
+   struct program *prog = ps->cc->prog;
+   struct credir r = { ps->tok.redir, ps->tok.fd, 0 };
+   int strip_tabs = ps->tok.strip_tabs;
+   lex_next(ps);
+   if (ps->tok.type != TK_WORD) {
+       syntax_error(ps);
+       return -1;
+   }
+   if (r.type == R_HEREDOC) {
+       if (ps->npending >= MAX_HEREDOCS) {
+           fprintf(stderr, "too many here-documents on one line\n");
+           ps->cc->status = PARSE_ERROR;
+           return -1;
+       }
+       char *delimiter = strndup(ps->tok.text, ps->tok.len);
+       int quoted = strip_quotes(delimiter);
+       r.word = add_word(prog, (struct cword){ pool_add(prog, "", 0), 0, 0, 0, -1 });
+       ps->pending[ps->npending++] = (struct pending_heredoc){ r.word, delimiter, strip_tabs, quoted };
+   } else {
+       struct cword w;
+       if (compile_word_token(ps, ps->tok.text, ps->tok.len, WORD_PLAIN, &w) < 0)
+           return -1;
+       r.word = add_word(prog, w);
+   }
+   if (vector_reserve(list, capacity, *count + 1, sizeof(struct credir)) < 0)
+       return -1;
+   (*list)[(*count)++] = r;
+   lex_next(ps);   /* may end the line and read the body */
+   return 0;
+}
+
+
+/*
+* Function: is_declaration
+* ------------------------
+* Tells whether the words of a simple command so far are a declare or typeset command, whose
+* NAME=(...) arguments are array assignments.
+*/
+int is_declaration(struct program *prog, const struct cword *words, int nwords, int nassigns) {
+   if (nwords <= nassigns)
+       return 0;
+   const char *command = prog->pool + words[nassigns].text;
+   return strcmp(command, "declare") == 0 || strcmp(command, "typeset") == 0;
+}
+
+
+/*
+* Function: parse_array_literal
+* -----------------------------
+* Parses the (word ...) after NAME= into element words, which go into the program's word table
+* together. The current token is left on the closing parenthesis. Returns -1 on an error.
+*/
+int parse_array_literal(struct parser *ps, struct cword *w) {
+   struct program *prog = ps->cc->prog;
+   struct cword *elements = NULL;
+   int count = 0, capacity = 0;
+   ps->p++;   /* the ( */
+   ps->element_word = 1;
+   lex_next(ps);
+   while (ps->cc->status == PARSE_OK && (ps->tok.type == TK_WORD || ps->tok.type == TK_NEWLINE)) {
+       if (ps->tok.type == TK_WORD) {
+           if (vector_reserve(&elements, &capacity, count + 1, sizeof(struct cword)) < 0 ||
+               compile_word_token(ps, ps->tok.text, ps->tok.len, WORD_ELEMENT, &elements[count]) < 0)
+               break;
+           count++;
+       }
+       lex_next(ps);
+   }
+   ps->element_word = 0;
+   if (ps->tok.type != TK_RPAREN)
+       syntax_error(ps);
+   int failed = (ps->cc->status != PARSE_OK ||
+                 vector_reserve(&prog->words, &prog->words_cap, prog->nwords + count, sizeof(struct cword)) < 0);
+   if (!failed) {
+       w->first_element = prog->nwords;
+       w->nelements = count;
+       memcpy(prog->words + prog->nwords, elements, count * sizeof(struct cword));
+       prog->nwords += count;
+   }
+   free(elements);
+   return failed ? -1 : 0;
+}
+
+
+/*
+* Function: parse_simple
+* ----------------------
+* Parses a simple command: leading NAME=value assignments, words and redirections in any order.
+* Returns NULL if there is none here.
+*/
+struct node *parse_simple(struct parser *ps) {
+   struct program *prog = ps->cc->prog;
+   struct cword *words = NULL;
+   int nwords = 0, words_cap = 0, nassigns = 0;
+   struct credir *redirs = NULL;
+   int nredirs = 0, redirs_cap = 0;
+   while (ps->cc->status == PARSE_OK) {
+       if (ps->tok.type == TK_REDIR) {
+           if (parse_redirect(ps, &redirs, &nredirs, &redirs_cap) < 0)
+               break;
+           continue;
+       }
+       if (ps->tok.type != TK_WORD)
+           break;
+       if (nwords > 0 && nwords == nassigns && expand_alias(ps))
+           continue;   /* the command word after assignments can be an alias too */
+       int assignment = (nwords == nassigns && is_assignment(ps->tok.text) > 0);
+       if (vector_reserve(&words, &words_cap, nwords + 1, sizeof(struct cword)) < 0 ||
+           compile_word_token(ps, ps->tok.text, ps->tok.len, assignment ? WORD_ASSIGNMENT : WORD_PLAIN, &words[nwords]) < 0)
+           break;
+       /* NAME=(...), also as an argument of declare */
+       if (*ps->p == '(' && ps->tok.text[ps->tok.len - 1] == '=' && is_assignment(ps->tok.text) == ps->tok.len - 1 &&
+           (assignment || is_declaration(prog, words, nwords, nassigns)) &&
+           parse_array_literal(ps, &words[nwords]) < 0)
+           break;
+       nwords++;
+       nassigns += assignment;
+       /* after the command name a word can't be the ! keyword: !(...) is a pattern */
+       ps->pattern_word = nwords > nassigns;
+       lex_next(ps);
+       ps->pattern_word = 0;
+   }
+
+
+   struct node *n = NULL;
+   if (ps->cc->status == PARSE_OK && (nwords > 0 || nredirs > 0) &&
+       vector_reserve(&prog->words, &prog->words_cap, prog->nwords + nwords, sizeof(struct cword)) == 0 &&
+       vector_reserve(&prog->redirs, &prog->redirs_cap, prog->nredirs + nredirs, sizeof(struct credir)) == 0 &&
+       vector_reserve(&prog->commands, &prog->commands_cap, prog->ncommands + 1, sizeof(struct ccommand)) == 0) {
+       /* the command's words and redirections sit together in the tables */
+       struct ccommand cmd = { prog->nwords, nassigns, nwords, prog->nredirs, nredirs };
+       memcpy(prog->words + prog->nwords, words, nwords * sizeof(struct cword));
+       memcpy(prog->redirs + prog->nredirs, redirs, nredirs * sizeof(struct credir));
+       prog->nwords += nwords;
+       prog->nredirs += nredirs;
+       prog->commands[prog->ncommands] = cmd;
+       n = new_node(ps, N_SIMPLE);
+       n->a = prog->ncommands++;
+   }
+   free(words);
+   free(redirs);
+   return n;
+}
+
+
+/*
+* Function: parse_body
+* --------------------
+* Parses a list that must not be empty (the parts of compound commands).
+*/
+struct node *parse_body(struct parser *ps) {
+   struct node *n = parse_list(ps);
+   if (n == NULL)
+       syntax_error(ps);
+   return n;
+}
+
+
+/*
+* Function: parse_if
+* ------------------
+* Parses the rest of an if (or elif) command: condition, then part and optional elif/else parts.
+*/
+struct node *parse_if(struct parser *ps) {
+   struct node *n = new_node(ps, N_IF);
+   n->left = parse_body(ps);
+   expect_reserved(ps, "then");
+   n->right = parse_body(ps);
+   if (accept_reserved(ps, "elif")) {
+       n->extra = parse_if(ps);   /* the nested if consumes the fi */
+       return n;
+   }
+   if (accept_reserved(ps, "else"))
+       n->extra = parse_body(ps);
+   expect_reserved(ps, "fi");
+   return n;
+}
+
+
+/*
+* Function: parse_for
+* -------------------
+* Parses the rest of a for loop: the variable, an optional in-list and the do ... done body.
+*/
+struct node *parse_for(struct parser *ps) {
+   struct program *prog = ps->cc->prog;
+   struct node *n = new_node(ps, N_FOR);
+   int valid = ps->tok.type == TK_WORD && is_name_char(ps->tok.text[0], 1);
+   for (int i = 1; valid && i < ps->tok.len; i++)
+       valid = is_name_char(ps->tok.text[i], 0);
+   if (!valid) {
+       syntax_error(ps);
+       return n;
+   }
+   n->a = pool_add(prog, ps->tok.text, ps->tok.len);
+   n->c = -1;   /* no in-list: the positional parameters */
+   lex_next(ps);
+   skip_newlines(ps);
+
+
+   if (accept_reserved(ps, "in")) {
+       struct cword *words = NULL;
+       int nwords = 0, words_cap = 0;
+       while (ps->tok.type == TK_WORD && ps->cc->status == PARSE_OK) {
+           if (vector_reserve(&words, &words_cap, nwords + 1, sizeof(struct cword)) < 0 ||
+               compile_word_token(ps, ps->tok.text, ps->tok.len, WORD_PLAIN, &words[nwords]) < 0)
+               break;
+           nwords++;
+           lex_next(ps);
+       }
+       n->b = prog->nwords;
+       n->c = nwords;
+       for (int i = 0; i < nwords; i++)
+           add_word(prog, words[i]);
+       free(words);
+       if (ps->tok.type == TK_SEMI || ps->tok.type == TK_NEWLINE)
+           lex_next(ps);
+       else
+           syntax_error(ps);
+   } else if (ps->tok.type == TK_SEMI) {
+       lex_next(ps);
+   }
+   skip_newlines(ps);
+   expect_reserved(ps, "do");
+   n->right = parse_body(ps);
+   expect_reserved(ps, "done");
+   return n;
+}
+
+
+/*
+* Function: parse_case
+* --------------------
+* Parses the rest of a case command: the subject word, then arms of |-separated patterns with
+* their lists, up to esac.
+*/
+struct node *parse_case(struct parser *ps) {
+   struct program *prog = ps->cc->prog;
+   struct node *n = new_node(ps, N_CASE);
+   struct cword subject;
+   if (ps->tok.type != TK_WORD) {
+       syntax_error(ps);
+       return n;
+   }
+   if (compile_word_token(ps, ps->tok.text, ps->tok.len, WORD_PLAIN, &subject) < 0)
+       return n;
+   n->a = add_word(prog, subject);
+   lex_next(ps);
+   skip_newlines(ps);
+   expect_reserved(ps, "in");
+   skip_newlines(ps);
+
+
+   struct node **tail = &n->left;
+   while (ps->cc->status == PARSE_OK && !is_reserved(ps, "esac")) {
+       if (ps->tok.type == TK_LPAREN)
+           lex_next(ps);
+       struct cword *patterns = NULL;
+       int count = 0, capacity = 0;
+       relex_pattern(ps);
+       while (ps->tok.type == TK_WORD && ps->cc->status == PARSE_OK) {
+           if (vector_reserve(&patterns, &capacity, count + 1, sizeof(struct cword)) < 0 ||
+               compile_word_token(ps, ps->tok.text, ps->tok.len, WORD_PLAIN, &patterns[count]) < 0)
+               break;
+           count++;
+           lex_next(ps);
+           if (ps->tok.type != TK_PIPE)
+               break;
+           lex_next(ps);
+           relex_pattern(ps);
+       }
+       struct node *arm = new_node(ps, N_CASE_ARM);
+       arm->a = prog->nwords;
+       arm->b = count;
+       for (int i = 0; i < count; i++)
+           add_word(prog, patterns[i]);
+       free(patterns);
+       if (count == 0 || ps->tok.type != TK_RPAREN) {
+           syntax_error(ps);
+           break;
+       }
+       lex_next(ps);
+       arm->right = parse_list(ps);   /* may be empty */
+       *tail = arm;
+       tail = &arm->next;
+       if (ps->tok.type == TK_DSEMI) {
+           lex_next(ps);
+           skip_newlines(ps);
+       } else if (!is_reserved(ps, "esac")) {
+           syntax_error(ps);
+       }
+   }
+   expect_reserved(ps, "esac");
+   return n;
+}
+
+
+/*
+* Function: starts_command
+* ------------------------
+* True if the current token can begin a command (reserved words that close a construct can't).
+*/
+int starts_command(struct parser *ps) {
+   static const char *closers[] = { "then", "else", "elif", "fi", "do", "done", "esac", "}", NULL };
+   if (ps->cc->status != PARSE_OK)
+       return 0;
+   if (ps->tok.type == TK_LPAREN || ps->tok.type == TK_REDIR)
+       return 1;
+   if (ps->tok.type != TK_WORD)
+       return 0;
+   for (int i = 0; closers[i] != NULL; i++) {
+       if (is_reserved(ps, closers[i]))
+           return 0;
+   }
+   return 1;
+}
+
+
+/*
+* Function: is_function_definition
+* --------------------------------
+* True if the current token is a name followed by "()", the start of a function definition.
+*/
+int is_function_definition(struct parser *ps) {
+   if (ps->tok.type != TK_WORD || !is_name_char(ps->tok.text[0], 1))
+       return 0;
+   for (int i = 1; i < ps->tok.len; i++) {
+       if (!is_name_char(ps->tok.text[i], 0))
+           return 0;
+   }
+   const char *p = ps->p;
+   while (*p == ' ' || *p == '\t')
+       p++;
+   if (*p++ != '(')
+       return 0;
+   while (*p == ' ' || *p == '\t')
+       p++;
+   return *p == ')';
+}
+
+
+/*
+* Function: parse_function
+* ------------------------
+* Parses name() body or function name [()] body. The body, a compound command, is compiled
+* into a block of its own that the definition hands to the function table when it runs.
+*/
+struct node *parse_function(struct parser *ps) {
+   accept_reserved(ps, "function");
+   struct node *n = new_node(ps, N_FUNCTION);
+   if (ps->tok.type != TK_WORD) {
+       syntax_error(ps);
+       return n;
+   }
+   n->a = pool_add(ps->cc->prog, ps->tok.text, ps->tok.len);
+   lex_next(ps);
+   if (ps->tok.type == TK_LPAREN) {
+       lex_next(ps);
+       if (ps->tok.type != TK_RPAREN) {
+           syntax_error(ps);
+           return n;
+       }
+       lex_next(ps);
+   }
+   skip_newlines(ps);
+   n->left = starts_command(ps) ? parse_command(ps) : NULL;
+   if (n->left == NULL || n->left->type == N_SIMPLE)
+       syntax_error(ps);   /* the body must be a compound command */
+   return n;
+}
+
+
+/*
+* Function: is_coproc_name
+* ------------------------
+* True if the current token is a name followed by a compound command, making it the name of a
+* coprocess rather than the command it runs.
+*/
+int is_coproc_name(struct parser *ps) {
+   static const char *openers[] = { "{", "[[", "if", "while", "until", "for", "case", NULL };
+   if (ps->tok.type != TK_WORD || !is_name_char(ps->tok.text[0], 1))
+       return 0;
+   for (int i = 1; i < ps->tok.len; i++) {
+       if (!is_name_char(ps->tok.text[i], 0))
+           return 0;
+   }
+   const char *p = ps->p;
+   while (*p == ' ' || *p == '\t')
+       p++;
+   if (*p == '(')
+       return 1;
+   for (int i = 0; openers[i] != NULL; i++) {
+       size_t len = strlen(openers[i]);
+       if (strncmp(p, openers[i], len) == 0 && strchr(" \t\n;", p[len]) != NULL)
+           return 1;
+   }
+   return 0;
+}
+
+
+/*
+* Function: parse_coproc
+* ----------------------
+* Parses coproc [NAME] command. A NAME is only taken before a compound command, so coproc cmd
+* args starts cmd as COPROC. The command is compiled into a block of its own.
+*/
+struct node *parse_coproc(struct parser *ps) {
+   struct node *n = new_node(ps, N_COPROC);
+   if (is_coproc_name(ps)) {
+       n->a = pool_add(ps->cc->prog, ps->tok.text, ps->tok.len);
+       lex_next(ps);
+   } else {
+       n->a = pool_add(ps->cc->prog, "COPROC", 6);
+   }
+   n->left = starts_command(ps) ? parse_command(ps) : NULL;
+   if (n->left == NULL)
+       syntax_error(ps);
+   return n;
+}
+
+
+/*
+* Function: add_cond
+* ------------------
+* Appends a node to the program's condition table and returns its index, or -1 on failure.
+*/
+int add_cond(struct parser *ps, int type, int op, int a, int b) {
+   struct program *prog = ps->cc->prog;
+   if (ps->cc->status != PARSE_OK || a < 0 || (b < 0 && type != C_NOT && type != C_STRING && type != C_UNARY))
+       return -1;
+   if (vector_reserve(&prog->conds, &prog->conds_cap, prog->nconds + 1, sizeof(struct ccond)) < 0) {
+       ps->cc->status = PARSE_ERROR;
+       return -1;
+   }
+   int regex = (type == C_BINARY && op == CO_REGEX) ? prog->nregex++ : -1;
+   prog->conds[prog->nconds] = (struct ccond){ type, op, a, b, regex };
+   return prog->nconds++;
+}
+
+
+/*
+* Function: cond_word
+* -------------------
+* Compiles the current token as an operand of a [[ ... ]] and returns its word index, or -1.
+*/
+int cond_word(struct parser *ps) {
+   struct cword w;
+   if (ps->tok.type != TK_WORD || is_reserved(ps, "]]")) {
+       syntax_error(ps);
+       return -1;
+   }
+   if (compile_word_token(ps, ps->tok.text, ps->tok.len, WORD_PLAIN, &w) < 0)
+       return -1;
+   lex_next(ps);
+   return add_word(ps->cc->prog, w);
+}
+
+
+/*
+* Function: cond_regex_word
+* -------------------------
+* Takes the pattern after =~ straight from the text, since ( ) and | in it are part of the
+* regular expression: it runs to a blank outside parentheses. Returns its word index, or -1.
+*/
+int cond_regex_word(struct parser *ps) {
+   const char *p = ps->p;
+   while (*p == ' ' || *p == '\t')
+       p++;
+   const char *start = p;
+   int depth = 0;
+   while (p != NULL && *p != '\0' && *p != '\n' && (depth > 0 || (*p != ' ' && *p != '\t'))) {
+       if (*p == '\\' && p[1] != '\0') {
+           p += 2;
+       } else if (*p == '\'' || *p == '"' || *p == '`' || (p[0] == '$' && (p[1] == '(' || p[1] == '{'))) {
+           p = skip_construct(p);
+       } else if (*p == ')' && depth == 0) {
+           break;
+       } else {
+           depth += (*p == '(') - (*p == ')');
+           p++;
+       }
+   }
+   struct cword w;
+   if (p == NULL || p == start) {
+       syntax_error(ps);
+       return -1;
+   }
+   if (compile_word_token(ps, start, p - start, WORD_PLAIN, &w) < 0)
+       return -1;
+   ps->p = p;
+   lex_next(ps);
+   return add_word(ps->cc->prog, w);
+}
+
+
+/*
+* Function: cond_binary_op
+* ------------------------
+* Returns the CO_* operator the current token is inside a [[ ... ]] (where < and > compare
+* strings rather than redirect), or -1.
+*/
+int cond_binary_op(struct parser *ps) {
+   static const struct { const char *text; int op; } ops[] = {
+       { "==", CO_MATCH }, { "=", CO_MATCH }, { "!=", CO_NOMATCH }, { "=~", CO_REGEX }, { "-eq", CO_EQ },
+       { "-ne", CO_NE }, { "-lt", CO_LT }, { "-le", CO_LE }, { "-gt", CO_GT }, { "-ge", CO_GE },
+       { "-nt", CO_NT }, { "-ot", CO_OT }, { "-ef", CO_EF }, { NULL, 0 }
+   };
+   if (ps->tok.type == TK_REDIR && ps->tok.fd < 0 && ps->tok.len == 1)
+       return ps->tok.redir == R_IN ? CO_LESS : ps->tok.redir == R_OUT ? CO_GREATER : -1;
+   for (int i = 0; ops[i].text != NULL; i++) {
+       if (is_reserved(ps, ops[i].text))
+           return ops[i].op;
+   }
+   return -1;
+}
+
+
+/*
+* Function: cond_term
+* -------------------
+* Parses one term of a [[ ... ]]: ! term, ( expression ), a unary test, a binary test or a
+* lone string. Returns its condition index, or -1.
+*/
+int cond_term(struct parser *ps) {
+   skip_newlines(ps);
+   if (accept_reserved(ps, "!"))
+       return add_cond(ps, C_NOT, 0, cond_term(ps), -1);
+   if (ps->tok.type == TK_LPAREN) {
+       lex_next(ps);
+       int inner = cond_or(ps);
+       skip_newlines(ps);
+       if (ps->tok.type != TK_RPAREN) {
+           syntax_error(ps);
+           return -1;
+       }
+       lex_next(ps);
+       return inner;
+   }
+   const char *text = ps->tok.text;
+   int unary = (ps->tok.type == TK_WORD && ps->tok.len == 2 && text[0] == '-' &&
+                strchr("abcdefghknprstuvwxzGLOS", text[1]) != NULL);
+   int left = cond_word(ps);
+   int op = cond_binary_op(ps);
+   if (op == CO_REGEX)
+       return add_cond(ps, C_BINARY, op, left, cond_regex_word(ps));
+   if (op >= 0) {
+       lex_next(ps);
+       if (op == CO_MATCH || op == CO_NOMATCH)
+           relex_pattern(ps);
+       return add_cond(ps, C_BINARY, op, left, cond_word(ps));
+   }
+   if (unary && ps->tok.type == TK_WORD && !is_reserved(ps, "]]"))
+       return add_cond(ps, C_UNARY, text[1], cond_word(ps), -1);
+   return add_cond(ps, C_STRING, 0, left, -1);
+}
+
+
+/*
+* Function: cond_and
+* ------------------
+* Parses terms of a [[ ... ]] joined by &&.
+*/
+int cond_and(struct parser *ps) {
+   int result = cond_term(ps);
+   while (ps->cc->status == PARSE_OK && ps->tok.type == TK_AND) {
+       lex_next(ps);
+       result = add_cond(ps, C_AND, 0, result, cond_term(ps));
+   }
+   return result;
+}
+
+
+/*
+* Function: cond_or
+* -----------------
+* Parses && groups of a [[ ... ]] joined by || (lower precedence than &&).
+*/
+int cond_or(struct parser *ps) {
+   int result = cond_and(ps);
+   while (ps->cc->status == PARSE_OK && ps->tok.type == TK_OR) {
+       lex_next(ps);
+       result = add_cond(ps, C_OR, 0, result, cond_and(ps));
+   }
+   return result;
+}
+
+
+/*
+* Function: parse_command
+* -----------------------
+* Parses one command: a compound command (with any redirections after it) or a simple command.
+*/
+struct node *parse_command(struct parser *ps) {
+   while (expand_alias(ps))
+       ;
+   if (is_reserved(ps, "function") || is_function_definition(ps))
+       return parse_function(ps);
+   if (accept_reserved(ps, "coproc"))
+       return parse_coproc(ps);
+   struct node *n;
+   const char *end;
+   if (ps->tok.type == TK_LPAREN && ps->p[0] == '(' && (end = arith_command_end(ps->p + 1)) != NULL) {
+       /* ((expression)) */
+       n = new_node(ps, N_ARITH);
+       n->a = add_arith(ps, ps->p + 1, end - ps->p - 1);
+       ps->p = end + 2;
+       lex_next(ps);
+   } else if (ps->tok.type == TK_LPAREN) {
+       lex_next(ps);
+       n = new_node(ps, N_SUBSHELL);
+       n->left = parse_body(ps);
+       if (ps->tok.type != TK_RPAREN)
+           syntax_error(ps);
+       else
+           lex_next(ps);
+   } else if (accept_reserved(ps, "[[")) {
+       n = new_node(ps, N_COND);
+       n->a = cond_or(ps);
+       skip_newlines(ps);
+       expect_reserved(ps, "]]");
+   } else if (accept_reserved(ps, "{")) {
+       n = new_node(ps, N_GROUP);
+       n->left = parse_body(ps);
+       expect_reserved(ps, "}");
+   } else if (accept_reserved(ps, "if")) {
+       n = parse_if(ps);
+   } else if (is_reserved(ps, "while") || is_reserved(ps, "until")) {
+       n = new_node(ps, is_reserved(ps, "while") ? N_WHILE : N_UNTIL);
+       lex_next(ps);
+       n->left = parse_body(ps);
+       expect_reserved(ps, "do");
+       n->right = parse_body(ps);
+       expect_reserved(ps, "done");
+   } else if (accept_reserved(ps, "for")) {
+       n = parse_for(ps);
+   } else if (accept_reserved(ps, "case")) {
+       n = parse_case(ps);
+   } else {
+       return parse_simple(ps);
+   }
+   if (ps->cc->status != PARSE_OK || ps->tok.type != TK_REDIR)
+       return n;
+
+
+   /* redirections after a compound command apply to all of it */
+   struct credir *redirs = NULL;
+   int nredirs = 0, capacity = 0;
+   while (ps->tok.type == TK_REDIR && parse_redirect(ps, &redirs, &nredirs, &capacity) == 0)
+       ;
+   struct node *wrapper = new_node(ps, N_REDIRECT);
+   wrapper->left = n;
+   wrapper->a = ps->cc->prog->nredirs;
+   wrapper->b = nredirs;
+   if (vector_reserve(&ps->cc->prog->redirs, &ps->cc->prog->redirs_cap, ps->cc->prog->nredirs + nredirs, sizeof(struct credir)) == 0) {
+       memcpy(ps->cc->prog->redirs + ps->cc->prog->nredirs, redirs, nredirs * sizeof(struct credir));
+       ps->cc->prog->nredirs += nredirs;
+   }
+   free(redirs);
+   return wrapper;
+}
+
+
+/*
+* Function: parse_pipeline
+* ------------------------
+* Parses [!] command [| command]...
+*/
+struct node *parse_pipeline(struct parser *ps) {
+   int negate = accept_reserved(ps, "!");
+   struct node *first = starts_command(ps) ? parse_command(ps) : NULL;
+   if (first == NULL) {
+       syntax_error(ps);
+       return NULL;
+   }
+   struct node *n = first;
+   if (ps->tok.type == TK_PIPE) {
+       n = new_node(ps, N_PIPELINE);
+       n->left = first;
+       n->a = 1;
+       struct node *last = first;
+       while (ps->tok.type == TK_PIPE && ps->cc->status == PARSE_OK) {
+           lex_next(ps);
+           skip_newlines(ps);
+           struct node *stage = starts_command(ps) ? parse_command(ps) : NULL;
+           if (stage == NULL) {
+               syntax_error(ps);
+               return NULL;
+           }
+           last->next = stage;
+           last = stage;
+           n->a++;
+       }
+   }
+   if (negate) {
+       struct node *not = new_node(ps, N_NOT);
+       not->left = n;
+       n = not;
+   }
+   return n;
+}
+
+
+/*
+* Function: parse_and_or
+* ----------------------
+* Parses pipelines joined by && and ||, which bind left to right with equal precedence.
+*/
+struct node *parse_and_or(struct parser *ps) {
+   struct node *left = parse_pipeline(ps);
+   while (left != NULL && (ps->tok.type == TK_AND || ps->tok.type == TK_OR)) {
+       struct node *n = new_node(ps, ps->tok.type == TK_AND ? N_AND : N_OR);
+       lex_next(ps);
+       skip_newlines(ps);
+       n->left = left;
+       n->right = parse_pipeline(ps);
+       if (n->right == NULL)
+           return NULL;
+       left = n;
+   }
+   return left;
+}
+
+
+/*
+* Function: parse_list
+* --------------------
+* Parses and-or lists separated by ;, & or newlines, up to a token that can't start a command.
+* Returns NULL for an empty list or after an error.
+*/
+struct node *parse_list(struct parser *ps) {
+   struct node *first = NULL;
+   struct node **tail = &first;
+   int count = 0;
+   skip_newlines(ps);
+   while (starts_command(ps)) {
+       struct node *n = parse_and_or(ps);
+       if (n == NULL)
+           return NULL;
+       int separated = 1;
+       if (ps->tok.type == TK_AMP) {
+           struct node *background = new_node(ps, N_BACKGROUND);
+           background->left = n;
+           n = background;
+           lex_next(ps);
+       } else if (ps->tok.type == TK_SEMI) {
+           lex_next(ps);
+       } else {
+           separated = 0;
+       }
+       *tail = n;
+       tail = &n->next;
+       count++;
+       if (skip_newlines(ps) == 0 && !separated)
+           break;   /* a command must be followed by a separator or the end of the list */
+   }
+   if (ps->cc->status != PARSE_OK)
+       return NULL;
+   if (count <= 1)
+       return first;
+   struct node *seq = new_node(ps, N_SEQ);
+   seq->left = first;
+   return seq;
+}
+
+
+/*
+* Function: loop_add_jump
+* -----------------------
+* Records a break or continue instruction to be pointed at its loop's target later.
+*/
+void loop_add_jump(int **list, int *count, int *capacity, int pc) {
+   if (vector_reserve(list, capacity, *count + 1, sizeof(int)) == 0)
+       (*list)[(*count)++] = pc;
+}
+
+
+/*
+* Function: gen_break
+* -------------------
+* Compiles a literal break or continue [n] inside a loop into a direct jump that first drops the
+* frames of whatever it leaves. Returns 0 to leave anything else to the builtin.
+*/
+int gen_break(struct codegen *g, struct node *n) {
+   struct program *prog = g->cc->prog;
+   const struct ccommand *cmd = &prog->commands[n->a];
+   if (g->nloops == 0 || cmd->nassigns > 0 || cmd->nredirs > 0 || cmd->nwords > 2)
+       return 0;
+   const char *name = prog->pool + prog->words[cmd->first_word].text;
+   int is_break = strcmp(name, "break") == 0;
+   if (!is_break && strcmp(name, "continue") != 0)
+       return 0;
+   long levels = 1;
+   if (cmd->nwords == 2) {
+       const char *arg = prog->pool + prog->words[cmd->first_word + 1].text;
+       char *end;
+       levels = strtol(arg, &end, 10);
+       if (*arg == '\0' || *end != '\0' || levels < 1)
+           return 0;
+       if (levels > g->nloops)
+           levels = g->nloops;
+   }
+   struct loop_ctx *loop = &g->loops[g->nloops - levels];
+   int pc = emit(prog, is_break ? OP_BREAK : OP_CONTINUE, 0, 0, loop->depth, 0);
+   if (is_break)
+       loop_add_jump(&loop->breaks, &loop->nbreaks, &loop->breaks_cap, pc);
+   else
+       loop_add_jump(&loop->continues, &loop->ncontinues, &loop->continues_cap, pc);
+   return 1;
+}
+
+
+/*
+* Function: loop_begin
+* --------------------
+* Opens a loop for break and continue, after its frame has been counted in g->depth.
+*/
+int loop_begin(struct codegen *g) {
+   if (g->nloops >= MAX_LOOP_NESTING) {
+       fprintf(stderr, "loops nested too deeply\n");
+       g->cc->status = PARSE_ERROR;
+       return -1;
+   }
+   g->loops[g->nloops++] = (struct loop_ctx){ g->depth, NULL, 0, 0, NULL, 0, 0 };
+   return 0;
+}
+
+
+/*
+* Function: loop_end
+* ------------------
+* Closes the innermost loop, pointing its breaks at exit and its continues at next.
+*/
+void loop_end(struct codegen *g, int exit_pc, int next_pc) {
+   struct loop_ctx *loop = &g->loops[--g->nloops];
+   for (int i = 0; i < loop->nbreaks; i++)
+       g->cc->prog->code[loop->breaks[i]].a = exit_pc;
+   for (int i = 0; i < loop->ncontinues; i++)
+       g->cc->prog->code[loop->continues[i]].a = next_pc;
+   free(loop->breaks);
+   free(loop->continues);
+}
+
+
+/*
+* Function: gen_pipeline
+* ----------------------
+* Makes each stage of a pipeline a block of its own, numbered consecutively, and emits the
+* instruction that runs them.
+*/
+void gen_pipeline(struct codegen *g, struct node *n, int flags) {
+   int first = g->cc->nblocks;
+   for (struct node *c = n->left; c != NULL; c = c->next)
+       add_block(g->cc, c);
+   emit(g->cc->prog, OP_PIPELINE, flags, first, n->a, 0);
+}
+
+
+/*
+* Function: gen_node
+* ------------------
+* Generates the bytecode for a syntax tree node. Conditions become conditional jumps on $?,
+* loops keep their state in interpreter frames, and anything that runs in another process
+* (pipeline stages, subshells, background lists) becomes a separate block.
+*/
+void gen_node(struct codegen *g, struct node *n) {
+   struct program *prog = g->cc->prog;
+   if (n == NULL || g->cc->status != PARSE_OK)
+       return;
+   int jump, top, exit_pc;
+   switch (n->type) {
+   case N_SIMPLE:
+       if (!gen_break(g, n))
+           emit(prog, OP_SIMPLE, 0, n->a, 0, 0);
+       break;
+   case N_SEQ:
+       for (struct node *c = n->left; c != NULL; c = c->next)
+           gen_node(g, c);
+       break;
+   case N_BACKGROUND:
+       if (n->left->type == N_SIMPLE) {
+           emit(prog, OP_SIMPLE, INSTR_BACKGROUND, n->left->a, 0, 0);
+       } else if (n->left->type == N_PIPELINE) {
+           gen_pipeline(g, n->left, INSTR_BACKGROUND);
+       } else {
+           emit(prog, OP_BACKGROUND, 0, add_block(g->cc, n->left), 0, 0);
+       }
+       break;
+   case N_PIPELINE:
+       gen_pipeline(g, n, 0);
+       break;
+   case N_AND:
+   case N_OR:
+       gen_node(g, n->left);
+       jump = emit(prog, n->type == N_AND ? OP_JUMP_FALSE : OP_JUMP_TRUE, 0, 0, 0, 0);
+       gen_node(g, n->right);
+       prog->code[jump].a = prog->ncode;
+       break;
+   case N_NOT:
+       gen_node(g, n->left);
+       emit(prog, OP_NOT, 0, 0, 0, 0);
+       break;
+   case N_SUBSHELL:
+       emit(prog, OP_SUBSHELL, 0, add_block(g->cc, n->left), 0, 0);
+       break;
+   case N_ARITH:
+       emit(prog, OP_ARITH, 0, n->a, 0, 0);
+       break;
+   case N_COND:
+       emit(prog, OP_COND, 0, n->a, 0, 0);
+       break;
+   case N_GROUP:
+       gen_node(g, n->left);
+       break;
+   case N_FUNCTION:
+       emit(prog, OP_FUNCTION, 0, n->a, add_block(g->cc, n->left), 0);
+       break;
+   case N_COPROC:
+       emit(prog, OP_COPROC, 0, n->a, add_block(g->cc, n->left), 0);
+       break;
+   case N_REDIRECT:
+       g->depth++;
+       jump = emit(prog, OP_REDIR_PUSH, 0, n->a, n->b, 0);
+       gen_node(g, n->left);
+       emit(prog, OP_REDIR_POP, 0, 0, 0, 0);
+       prog->code[jump].c = prog->ncode;
+       g->depth--;
+       break;
+   case N_IF:
+       gen_node(g, n->left);
+       jump = emit(prog, OP_JUMP_FALSE, 0, 0, 0, 0);
+       gen_node(g, n->right);
+       exit_pc = emit(prog, OP_JUMP, 0, 0, 0, 0);
+       prog->code[jump].a = prog->ncode;
+       if (n->extra != NULL)
+           gen_node(g, n->extra);
+       else
+           emit(prog, OP_STATUS, 0, 0, 0, 0);   /* no branch taken: status 0 */
+       prog->code[exit_pc].a = prog->ncode;
+       break;
+   case N_WHILE:
+   case N_UNTIL:
+       g->depth++;
+       emit(prog, OP_LOOP_INIT, 0, 0, 0, 0);
+       top = prog->ncode;
+       gen_node(g, n->left);
+       jump = emit(prog, n->type == N_WHILE ? OP_JUMP_FALSE : OP_JUMP_TRUE, 0, 0, 0, 0);
+       if (loop_begin(g) < 0)
+           return;
+       gen_node(g, n->right);
+       int next = emit(prog, OP_LOOP_NEXT, 0, top, 0, 0);
+       exit_pc = emit(prog, OP_LOOP_END, 0, 0, 0, 0);
+       prog->code[jump].a = exit_pc;
+       loop_end(g, exit_pc, next);
+       g->depth--;
+       break;
+   case N_FOR:
+       g->depth++;
+       emit(prog, OP_FOR_INIT, 0, n->a, n->b, n->c);
+       top = emit(prog, OP_FOR_NEXT, 0, 0, 0, 0);
+       if (loop_begin(g) < 0)
+           return;
+       gen_node(g, n->right);
+       emit(prog, OP_JUMP, 0, top, 0, 0);
+       exit_pc = emit(prog, OP_FOR_END, 0, 0, 0, 0);
+       prog->code[top].a = exit_pc;
+       loop_end(g, exit_pc, top);
+       g->depth--;
+       break;
+   case N_CASE: {
+       g->depth++;
+       /* with no expansions in the patterns, all the arms can be matched together */
+       int fixed = 1;
+       for (struct node *arm = n->left; arm != NULL; arm = arm->next) {
+           for (int i = arm->a; i < arm->a + arm->b; i++) {
+               const struct cword *w = &prog->words[i];
+               for (int k = 0; k < w->nparts; k++)
+                   fixed &= (prog->parts[w->first_part + k].type == WP_LIT);
+           }
+       }
+       emit(prog, OP_CASE_BEGIN, 0, n->a, fixed ? ++prog->ncases : 0, 0);
+       int *ends = NULL;
+       int nends = 0, ends_cap = 0;
+       for (struct node *arm = n->left; arm != NULL; arm = arm->next) {
+           jump = emit(prog, OP_CASE_MATCH, 0, arm->a, arm->b, 0);
+           gen_node(g, arm->right);
+           loop_add_jump(&ends, &nends, &ends_cap, emit(prog, OP_JUMP, 0, 0, 0, 0));
+           prog->code[jump].c = prog->ncode;
+       }
+       for (int i = 0; i < nends; i++)
+           prog->code[ends[i]].a = prog->ncode;
+       free(ends);
+       emit(prog, OP_CASE_END, 0, 0, 0, 0);
+       g->depth--;
+       break;
+   }
+   }
+}
+
+
+/*
+* Function: compile_program
+* -------------------------
+* Compiles source text into a new program: parses it into a syntax tree, then generates the
+* main code and every block it needs, each ending in OP_END. The caller holds the one reference
+* and drops it with program_release. Sets status and returns NULL unless it is PARSE_OK; with
+* interactive set, text that stops in the middle of a command gives PARSE_INCOMPLETE so the
+* caller can read more lines.
+*/
+struct program *compile_program(const char *text, int interactive, int *status) {
+   struct program *prog = calloc(1, sizeof(struct program));
+   if (prog == NULL) {
+       perror("calloc failed");
+       *status = PARSE_ERROR;
+       return NULL;
+   }
+   prog->refs = 1;
+   struct compiler cc = { prog, NULL, NULL, 0, 0, PARSE_OK };
+   struct parser ps = { &cc, text, { 0 }, interactive, { { 0 } }, 0, { { 0 } }, 0, 0, 0 };
+   add_block(&cc, NULL);   /* block 0 is the main code */
+   lex_next(&ps);
+   struct node *root = parse_list(&ps);
+   if (ps.tok.type != TK_EOF)
+       syntax_error(&ps);
+   for (int h = 0; h < ps.npending; h++)
+       free(ps.pending[h].delimiter);
+   cc.block_nodes[0] = root;
+
+
+   struct codegen g = { &cc, { { 0 } }, 0, 0 };
+   for (int i = 0; i < cc.nblocks && cc.status == PARSE_OK; i++) {
+       if (vector_reserve(&prog->blocks, &prog->blocks_cap, i + 1, sizeof(int)) < 0)
+           break;
+       prog->blocks[i] = prog->ncode;
+       prog->nblocks = i + 1;
+       gen_node(&g, cc.block_nodes[i]);   /* may add more blocks */
+       emit(prog, OP_END, 0, 0, 0, 0);
+   }
+   while (cc.nodes != NULL) {
+       struct node *next = cc.nodes->all;
+       free(cc.nodes);
+       cc.nodes = next;
+   }
+   free(cc.block_nodes);
+   *status = cc.status;
+   if (cc.status != PARSE_OK) {
+       program_release(prog);
+       return NULL;
+   }
+   return prog;
+}
+
+
+/*
+* Function: load_text
+* -------------------
+* Returns the contents of a file as null terminated text. A regular file is mapped, with a page
+* of zeros reserved behind it so the text ends even when its size is a multiple of the page
+* size; *mapped_len is then the length to unmap. Anything else is read into memory and
+* *mapped_len is 0. Returns NULL on failure.
+*/
+char *load_text(int fd, const struct stat *st, size_t *mapped_len) {
+   *mapped_len = 0;
+   if (!S_ISREG(st->st_mode)) {
+       struct strbuf text = { NULL, 0, 0 };
+       drain_fd(fd, &text);
+       return text.buf ? text.buf : strdup("");
+   }
+   size_t page = sysconf(_SC_PAGESIZE);
+   size_t size = st->st_size;
+   size_t len = (size + 1 + page - 1) & ~(page - 1);
+   char *base = mmap(NULL, len, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (base == MAP_FAILED)
+       return NULL;
+   if (size > 0 && mmap(base, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+       munmap(base, len);
+       return NULL;
+   }
+   *mapped_len = len;
+   return base;
+}
+
+
+/*
+* Function: unload_text
+* ---------------------
+* Releases text returned by load_text.
+*/
+void unload_text(char *text, size_t mapped_len) {
+   if (mapped_len > 0)
+       munmap(text, mapped_len);
+   else
+       free(text);
+}
+
+
+/*
+* Function: find_source_file
+* --------------------------
+* Finds the file source reads: a name without a slash is looked for in PATH first (it need
+* not be executable), then in the current directory.
+*/
+const char *find_source_file(const char *name, char *found, size_t size) {
+   if (strchr(name, '/') != NULL)
+       return name;
+   const char *dir = var_get("PATH");
+   while (dir != NULL && *dir != '\0') {
+       const char *colon = strchr(dir, ':');
+       int n = colon ? (int)(colon - dir) : (int)strlen(dir);
+       struct stat st;
+       if (n > 0 && snprintf(found, size, "%.*s/%s", n, dir, name) < (int)size &&
+           stat(found, &st) == 0 && S_ISREG(st.st_mode) && access(found, R_OK) == 0)
+           return found;
+       dir = colon ? colon + 1 : NULL;
+   }
+   return name;
+}
+
+
+/*
+* Function: builtin_source
+* ------------------------
+* Implements source and .: runs a file in the current shell, so its variables, functions and
+* directory changes stay. Extra arguments become the positional parameters while it runs and
+* return leaves it early.
+*/
+int builtin_source(char *args[]) {
+   if (args[1] == NULL) {
+       fprintf(stderr, "%s: filename argument required\n", args[0]);
+       return 2;
+   }
+   char found[PATH_MAX];
+   const char *path = find_source_file(args[1], found, sizeof(found));
+   int fd = open(path, O_RDONLY | O_CLOEXEC);
+   struct stat st;
+   if (fd < 0 || fstat(fd, &st) < 0 || S_ISDIR(st.st_mode)) {
+       fprintf(stderr, "%s: %s: %s\n", args[0], args[1], fd < 0 || !S_ISDIR(st.st_mode) ? strerror(errno) : "is a directory");
+       if (fd >= 0)
+           close(fd);
+       return 1;
+   }
+   size_t mapped_len;
+   char *text = load_text(fd, &st, &mapped_len);
+   close(fd);
+   if (text == NULL) {
+       fprintf(stderr, "%s: %s: %s\n", args[0], args[1], strerror(errno));
+       return 1;
+   }
+   int status;
+   struct program *prog = compile_program(text, 0, &status);
+   unload_text(text, mapped_len);   /* the program holds copies of everything it needs */
+   if (prog == NULL)
+       return 2;
+
+
+   char **saved_positional = positional;
+   int saved_count = positional_count;
+   if (args[2] != NULL) {
+       positional = args + 2;
+       positional_count = 0;
+       while (positional[positional_count] != NULL)
+           positional_count++;
+   }
+   function_depth++;
+   vm_run(prog, 0);
+   function_depth--;
+   function_returning = 0;
+   positional = saved_positional;
+   positional_count = saved_count;
+   program_release(prog);
+   return last_status;
+}
+
+
+/*
+* Function: parse_size
+* --------------------
+* Parses a byte count such as 65536, 512K or 1M. Returns -1 if it isn't one.
+*/
+long long parse_size(const char *text) {
+   char *end;
+   errno = 0;
+   long long n = strtoll(text, &end, 10);
+   if (end == text || n < 0 || errno != 0)
+       return -1;
+   int shift = 0;
+   switch (toupper((unsigned char)*end)) {
+   case 'K': shift = 10; end++; break;
+   case 'M': shift = 20; end++; break;
+   case 'G': shift = 30; end++; break;
+   }
+   if (toupper((unsigned char)*end) == 'B' && shift > 0)
+       end++;
+   if (*end != '\0' || n > (LLONG_MAX >> shift))
+       return -1;
+   return n << shift;
+}
+
+
+/*
+* Function: option_pipesize
+* -------------------------
+* set -o pipesize=SIZE: the capacity of the pipes made for pipelines and $(...) from now on (0
+* for the kernel's default). The kernel rounds it up to a power of two pages and limits it to
+* /proc/sys/fs/pipe-max-size without CAP_SYS_RESOURCE, so a test pipe finds out what is
+* really possible; if that differs from what was asked for it is reported.
+*/
+int option_pipesize(const char *text) {
+   long long wanted = parse_size(text);
+   if (wanted < 0 || wanted > INT_MAX) {
+       fprintf(stderr, "set: pipesize: %s: invalid size\n", text);
+       return -1;
+   }
+   if (wanted == 0) {
+       pipe_size = 0;
+       return 0;
+   }
+   int ends[2];
+   if (pipe2(ends, O_CLOEXEC) < 0) {
+       perror("pipe failed");
+       return -1;
+   }
+   int achieved = fcntl(ends[1], F_SETPIPE_SZ, (int)wanted);
+   int err = errno;
+   close(ends[0]);
+   close(ends[1]);
+   if (achieved < 0) {
+       fprintf(stderr, "set: pipesize: %s: %s\n", text, strerror(err));
+       if (err == EPERM)
+           fprintf(stderr, "set: pipesize: the limit is in /proc/sys/fs/pipe-max-size\n");
+       return -1;
+   }
+   if (achieved != wanted)
+       fprintf(stderr, "set: pipesize: using %d bytes\n", achieved);
+   pipe_size = achieved;
+   return 0;
+}
+
+
+/*
+* Function: option_cmdtimeout
+* ---------------------------
+* set -o cmdtimeout=DURATION: from now on every external command the shell waits for is stopped
+* (TERM, then KILL) if it runs longer than that, with $? 124, so a runaway command can't hang a
+* batch script. 0 turns it off. set -o shows it in milliseconds.
+*/
+int option_cmdtimeout(const char *text) {
+   double seconds = parse_duration(text);
+   if (seconds < 0) {
+       fprintf(stderr, "set: cmdtimeout: %s: invalid time interval\n", text);
+       return -1;
+   }
+   command_timeout = (long long)(seconds * 1000);
+   return 0;
+}
+
+
+/*
+* Function: option_joboutput
+* --------------------------
+* set -o joboutput=SIZE: the stdout and stderr of background jobs started from now on go into a
+* ring of SIZE bytes per job instead of onto the terminal, to be seen with jobs -o. 0 turns it off.
+*/
+int option_joboutput(const char *text) {
+   long long size = parse_size(text);
+   if (size < 0) {
+       fprintf(stderr, "set: joboutput: %s: invalid size\n", text);
+       return -1;
+   }
+   job_output_size = size;
+   return 0;
+}
+
+
+/*
+* Function: telemetry_start
+* -------------------------
+* Opens the telemetry file ($OSC_TELEMETRY, by default ~/.osc_telemetry.jsonl) for appending
+* and starts the process that writes the records into it. That is forked twice, so nobody
+* has to wait for it: it finishes once every copy of the shell's end (subshells have them too)
+* is closed. It is in a process group of its own, so ^C at a command doesn't lose the log, and
+* keeps nothing else of the shell's open. Returns -1 on failure.
+*/
+int telemetry_start() {
+   char path[PATH_MAX];
+   const char *file = var_get("OSC_TELEMETRY");
+   const char *home = var_get("HOME");
+   if (file == NULL || *file == '\0')
+       snprintf(path, sizeof(path), "%s/.osc_telemetry.jsonl", home && *home ? home : ".");
+   else
+       snprintf(path, sizeof(path), "%s", file);
+   int log = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+   if (log < 0) {
+       fprintf(stderr, "set: telemetry: %s: %s\n", path, strerror(errno));
+       return -1;
+   }
+   int ends[2];
+   if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, ends) < 0) {
+       perror("socketpair failed");
+       close(log);
+       return -1;
+   }
+   pid_t pid = fork();
+   if (pid == 0) {
+       if (fork() != 0)
+           _exit(0);
+       setpgid(0, 0);
+       dup2(ends[1], STDIN_FILENO);
+       dup2(log, STDOUT_FILENO);
+       syscall(SYS_close_range, 3, ~0U, 0);
+       /* whatever records have queued up go to the file in one write; each is sized before it
+          is received, so none is cut short, however long */
+       size_t cap = 1 << 20, len = 0;
+       char *batch = malloc(cap);
+       while (batch != NULL) {
+           ssize_t n = recv(STDIN_FILENO, NULL, 0, MSG_PEEK | MSG_TRUNC | (len > 0 ? MSG_DONTWAIT : 0));
+           if (n < 0 && errno == EINTR)
+               continue;
+           if (n > 0 && len + n <= cap) {
+               if (recv(STDIN_FILENO, batch + len, n, 0) == n)
+                   len += n;
+               continue;
+           }
+           if (len > 0 && write(STDOUT_FILENO, batch, len) < 0)
+               _exit(1);
+           len = 0;
+           if (n > 0) {
+               if ((size_t)n > cap && (batch = realloc(batch, cap = n)) == NULL)
+                   _exit(1);
+               continue;   /* now it fits */
+           }
+           if (n == 0 || errno != EAGAIN)
+               _exit(0);   /* every copy of the shell's end is closed */
+       }
+       _exit(1);
+   }
+   close(ends[1]);
+   close(log);
+   if (pid < 0) {
+       perror("fork failed");
+       close(ends[0]);
+       return -1;
+   }
+   while (waitpid(pid, NULL, 0) < 0 && errno == EINTR)
+       ;
+   telemetry_fd = fcntl(ends[0], F_DUPFD_CLOEXEC, 60);   /* out of the way of redirections */
+   close(ends[0]);
+   telemetry_dropped = 0;
+   return telemetry_fd < 0 ? -1 : 0;
+}
+
+
+/*
+* Function: option_telemetry
+* --------------------------
+* set -o telemetry=1 logs every command the shell starts a process for, and the builtin stages
+* of pipelines, as a JSON line to $OSC_TELEMETRY: when, where, what (the argv, or with 2 just
+* a hash of it), the shape of the command and per stage the time fork took, the wall, user and
+* system time, the peak memory and the exit status. 0 turns it off.
+*/
+int option_telemetry(const char *text) {
+   char *end;
+   long mode = strtol(text, &end, 10);
+   if (*text == '\0' || *end != '\0' || mode < 0 || mode > 2) {
+       fprintf(stderr, "set: telemetry: %s: must be 0, 1 (argv as text) or 2 (argv hashed)\n", text);
+       return -1;
+   }
+   if (mode == 0 && telemetry_fd >= 0) {
+       close(telemetry_fd);   /* the writer finishes what it has and exits */
+       telemetry_fd = -1;
+   } else if (mode > 0 && telemetry_fd < 0 && telemetry_start() < 0) {
+       return -1;
+   }
+   telemetry_mode = mode;
+   return 0;
+}
+
+
+/*  Options of set -o, listed by set -o with no name */
+struct shell_option shell_options[] = {
+   { "pipesize", &pipe_size, option_pipesize },
+   { "cmdtimeout", &command_timeout, option_cmdtimeout },
+   { "joboutput", &job_output_size, option_joboutput },
+   { "telemetry", &telemetry_mode, option_telemetry },
+   { NULL, NULL, NULL }
+};
+
+
+/*
+* Function: builtin_set
+* ---------------------
+* set -o lists the shell's options, set -o name=value sets one and set +o name puts it back to
+* its default.
+*/
+int builtin_set(char *args[]) {
+   if (args[1] == NULL || (strcmp(args[1], "-o") == 0 && args[2] == NULL)) {
+       for (struct shell_option *o = shell_options; o->name != NULL; o++)
+           shell_printf("%-15s %lld\n", o->name, *o->value);
+       return 0;
+   }
+   int status = 0;
+   for (int i = 1; args[i] != NULL; i++) {
+       int reset = (strcmp(args[i], "+o") == 0);
+       if ((!reset && strcmp(args[i], "-o") != 0) || args[i + 1] == NULL) {
+           fprintf(stderr, "set: usage: set [-o name=value] [+o name]\n");
+           return 2;
+       }
+       const char *name = args[++i];
+       const char *equals = strchr(name, '=');
+       size_t len = equals ? (size_t)(equals - name) : strlen(name);
+       struct shell_option *o = shell_options;
+       while (o->name != NULL && (strlen(o->name) != len || strncmp(o->name, name, len) != 0))
+           o++;
+       if (o->name == NULL) {
+           fprintf(stderr, "set: %.*s: invalid option name\n", (int)len, name);
+           status = 1;
+       } else if (reset || equals != NULL) {
+           if (o->set(reset ? "0" : equals + 1) < 0)
+               status = 1;
+       } else {
+           shell_printf("%-15s %lld\n", o->name, *o->value);
+       }
+   }
+   return status;
+}
+
+
+/*  Builtin commands run inside the shell process, with no fork or exec */
+struct builtin builtin_table[] = {
+   { "cd", builtin_cd },
+   { "exit", builtin_exit },
+   { "export", builtin_export },
+   { "unset", builtin_unset },
+   { "echo", builtin_echo },
+   { "printf", builtin_printf },
+   { "pwd", builtin_pwd },
+   { "test", builtin_test },
+   { "[", builtin_test },
+   { "true", builtin_true },
+   { ":", builtin_true },
+   { "false", builtin_false },
+   { "sleep", builtin_sleep },
+   { "kill", builtin_kill },
+   { "cat", builtin_cat },
+   { "cp", builtin_cp },
+   { "tee", builtin_tee },
+   { "read", builtin_read },
+   { "break", builtin_break },
+   { "continue", builtin_break },
+   { "alias", builtin_alias },
+   { "unalias", builtin_unalias },
+   { "hash", builtin_hash },
+   { "return", builtin_return },
+   { "source", builtin_source },
+   { "let", builtin_let },
+   { "declare", builtin_declare },
+   { "typeset", builtin_declare },
+   { "set", builtin_set },
+   { "timeout", builtin_timeout },
+   { "jobs", builtin_jobs },
+   { ".", builtin_source },
+   { NULL, NULL }
+};
+
+
+/*
+* Function: command_resolve
+* -------------------------
+* Returns the command table entry for a name, or NULL if it isn't an alias, function, builtin
+* or cached program. The builtins are entered into the table on the first call.
+*/
+struct command_entry *command_resolve(const char *name) {
+   if (!builtins_registered) {
+       for (struct builtin *b = builtin_table; b->name != NULL; b++)
+           command_insert(b->name)->builtin = b;
+       builtins_registered = 1;
+   }
+   return command_lookup(name, strlen(name));
+}
+
+
+/*
+* Function: find_builtin
+* ----------------------
+* Looks a command name up in the command table; NULL if it is not a builtin.
+*/
+struct builtin *find_builtin(const char *name) {
+   struct command_entry *e = command_resolve(name);
+   return e ? e->builtin : NULL;
+}
+
+
+/*
+* Function: job_free
+* ------------------
+* Closes the descriptor and unmaps the ring a job entry holds.
+*/
+void job_free(struct job *j) {
+   if (j->pidfd >= 0)
+       close(j->pidfd);
+   if (j->ring != NULL)
+       munmap((void *)j->ring, JOB_RING_HEADER + j->size);
+}
+
+
+/*
+* Function: event_loop_init
+* -------------------------
+* Makes the epoll set if this process doesn't have one yet. A forked child inherits its
+* parent's, which it must not change, so it closes that and the jobs' descriptors and starts over.
+* Returns -1 if epoll isn't available.
+*/
+int event_loop_init() {
+   if (event_fd >= 0 && event_owner == getpid())
+       return 0;
+   if (event_fd >= 0) {
+       close(event_fd);
+       if (timer_fd >= 0)
+           close(timer_fd);
+       for (int i = 0; i < njobs; i++)
+           job_free(&jobs[i]);
+       njobs = 0;
+       timer_fd = -1;
+       tty_watched = 0;
+   }
+   event_fd = epoll_create1(EPOLL_CLOEXEC);
+   if (event_fd < 0)
+       return -1;
+   event_owner = getpid();
+   return 0;
+}
+
+
+/*
+* Function: event_watch
+* ---------------------
+* Adds a descriptor to the epoll set, tagged with what it is and (for a job) its PID.
+* Returns -1 if it can't be watched.
+*/
+int event_watch(int fd, int type, pid_t id) {
+   struct epoll_event ev;
+   ev.events = EPOLLIN;
+   ev.data.u64 = ((uint64_t)type << 32) | (uint32_t)id;
+   return epoll_ctl(event_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+
+/*
+* Function: job_reap
+* ------------------
+* Collects a background job's status if it has finished. Returns 1 if it has.
+*/
+int job_reap(struct job *j) {
+   int status;
+   pid_t r = waitpid(j->pid, &status, WNOHANG);
+   if (r == 0)
+       return 0;
+   j->status = r < 0 ? 127 : WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+   j->done = 1;
+   if (j->pidfd >= 0)
+       close(j->pidfd);   /* which also takes it out of the epoll set */
+   j->pidfd = -1;
+   return 1;
+}
+
+
+/*
+* Function: event_loop_run
+* ------------------------
+* Waits up to timeout milliseconds (-1: until something happens) and handles the batch of
+* events that arrived: finished jobs are reaped, and at the prompt $TMOUT running out logs out.
+* Returns 1 if the terminal has input.
+*/
+int event_loop_run(int timeout) {
+   struct epoll_event events[EVENT_BATCH];
+   int n = epoll_wait(event_fd, events, EVENT_BATCH, timeout);
+   int input = 0;
+   for (int i = 0; i < n; i++) {
+       int type = events[i].data.u64 >> 32;
+       pid_t id = (pid_t)(uint32_t)events[i].data.u64;
+       if (type == EV_TTY) {
+           input = 1;
+       } else if (type == EV_TIMER) {
+           printf("\ntimed out waiting for input: auto-logout\n");
+           exit(last_status);
+       } else {
+           for (int k = 0; k < njobs; k++) {
+               if (jobs[k].pid == id && !jobs[k].done) {
+                   job_reap(&jobs[k]);
+                   break;
+               }
+           }
+       }
+   }
+
+
+   /* jobs without a pidfd are checked whenever the loop wakes */
+   for (int k = 0; k < njobs; k++) {
+       if (jobs[k].pidfd < 0 && !jobs[k].done)
+           job_reap(&jobs[k]);
+   }
+   return input;
+}
+
+
+/*
+* Function: event_wait_input
+* --------------------------
+* Waits in the event loop until the terminal has input, with the $TMOUT timer armed if it is
+* set. Input that can't be watched (a regular file) is just read.
+*/
+void event_wait_input() {
+   if (event_loop_init() < 0)
+       return;
+   if (tty_watched == 0)
+       tty_watched = event_watch(STDIN_FILENO, EV_TTY, 0) == 0 ? 1 : -1;
+   if (tty_watched < 0)
+       return;
+
+
+   const char *tmout = var_get("TMOUT");
+   long seconds = tmout ? strtol(tmout, NULL, 10) : 0;
+   if (seconds > 0 && timer_fd < 0) {
+       timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+       if (timer_fd >= 0 && event_watch(timer_fd, EV_TIMER, 0) < 0) {
+           close(timer_fd);
+           timer_fd = -1;
+       }
+   }
+   struct itimerspec when = { { 0, 0 }, { seconds > 0 ? seconds : 0, 0 } };
+   if (timer_fd >= 0)
+       timerfd_settime(timer_fd, 0, &when, NULL);
+   while (!event_loop_run(-1))
+       ;
+   if (timer_fd >= 0 && seconds > 0) {
+       when.it_value.tv_sec = 0;
+       timerfd_settime(timer_fd, 0, &when, NULL);   /* disarmed while a command runs */
+   }
+}
+
+
+/*
+* Function: jobs_report
+* ---------------------
+* Reports the background jobs that have been reaped at the prompt and drops them, except the
+* last JOBS_KEPT with captured output, which stay for jobs -o.
+*/
+void jobs_report() {
+   int finished = 0;
+   for (int i = 0; i < njobs; i++)
+       finished += (jobs[i].done && jobs[i].ring != NULL);
+   int kept = 0;
+   for (int i = 0; i < njobs; i++) {
+       struct job *j = &jobs[i];
+       if (j->done && !j->reported) {
+           if (interactive)
+               printf("Process %d finished (exit status %d)\n", j->pid, j->status);
+           j->reported = 1;
+       }
+       if (!j->done || (j->ring != NULL && finished-- <= JOBS_KEPT))
+           jobs[kept++] = *j;
+       else
+           job_free(j);
+   }
+   njobs = kept;
+   fflush(stdout);
+}
+
+
+/*
+* Function: job_output_open
+* -------------------------
+* With set -o joboutput on, makes the pipe a background job's stdout and stderr are to go into.
+* Only the top-level shell does: a subshell's jobs are gone with it. Both ends are -1 otherwise.
+*/
+void job_output_open(int ends[2]) {
+   if (job_output_size <= 0 || in_forked_child || open_pipe(ends) < 0)
+       ends[0] = ends[1] = -1;
+}
+
+
+/*
+* Function: job_output_attach
+* ---------------------------
+* In a background job's child, sends stderr (and with out set stdout) into the capture pipe,
+* before its own redirections so those still win.
+*/
+void job_output_attach(int ends[2], int out) {
+   if (ends[1] < 0)
+       return;
+   if (out)
+       dup2(ends[1], STDOUT_FILENO);
+   dup2(ends[1], STDERR_FILENO);
+   close(ends[0]);
+   close(ends[1]);
+}
+
+
+/*
+* Function: job_output_ring
+* -------------------------
+* Makes the file a job's ring of size bytes (and its header) is kept in: a memfd, or where
+* memfds aren't available an unlinked file in $TMPDIR. Returns -1 on failure.
+*/
+int job_output_ring(long long size) {
+   int fd = memfd_create("osc-job", MFD_CLOEXEC);
+   if (fd < 0) {
+       const char *dir = var_get("TMPDIR");
+       fd = open(dir && *dir ? dir : "/tmp", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+   }
+   if (fd < 0 || ftruncate(fd, JOB_RING_HEADER + size) < 0) {
+       perror("jobs: can't keep output");
+       if (fd >= 0)
+           close(fd);
+       return -1;
+   }
+   return fd;
+}
+
+
+/*
+* Function: job_output_pump
+* -------------------------
+* The body of a job's reader process: copies everything the job writes into the ring until it
+* closes its output, then marks the ring done and exits.
+*/
+void job_output_pump(int input, int ring_fd, long long size) {
+   struct job_ring *ring = mmap(NULL, JOB_RING_HEADER + size, PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd, 0);
+   if (ring == MAP_FAILED)
+       _exit(1);
+   char *data = (char *)ring + JOB_RING_HEADER;
+   dup2(input, STDIN_FILENO);
+   syscall(SYS_close_range, 1, ~0U, 0);   /* holding the shell's descriptors would keep them open */
+   static char buf[COPY_BUFFER_SIZE];
+   unsigned long long written = 0;
+   while (1) {
+       ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+       if (n < 0 && errno == EINTR)
+           continue;
+       if (n <= 0)
+           break;
+       const char *from = buf;
+       if (n > size) {
+           /* only the end of it fits */
+           from += n - size;
+           written += n - size;
+           n = size;
+       }
+       long long at = written % size;
+       long long first = (n < size - at) ? n : size - at;
+       memcpy(data + at, from, first);
+       memcpy(data, from + first, n - first);
+       written += n;
+       __atomic_store_n(&ring->written, written, __ATOMIC_RELEASE);
+   }
+   __atomic_store_n(&ring->done, 1, __ATOMIC_RELEASE);
+   _exit(0);
+}
+
+
+/*
+* Function: job_output_reader
+* ---------------------------
+* Starts the reader process for a job's capture pipe (whose read end it takes over) and returns
+* the ring it fills, mapped read-only, or NULL if it can't. The reader is forked twice so no one
+* has to wait for it, and has a process group of its own, so ^C at a command doesn't lose the
+* output.
+*/
+const struct job_ring *job_output_reader(int output, long long size) {
+   int ring_fd = job_output_ring(size);
+   if (ring_fd < 0) {
+       close(output);
+       return NULL;
+   }
+   const struct job_ring *ring = mmap(NULL, JOB_RING_HEADER + size, PROT_READ, MAP_SHARED, ring_fd, 0);
+   pid_t pid = ring == MAP_FAILED ? -1 : fork();
+   if (pid == 0) {
+       pid_t reader = fork();
+       if (reader == 0) {
+           setpgid(0, 0);
+           job_output_pump(output, ring_fd, size);
+       }
+       _exit(reader < 0);
+   }
+   close(output);
+   close(ring_fd);
+   int status = 1;
+   while (pid > 0 && waitpid(pid, &status, 0) < 0 && errno == EINTR)
+       ;
+   if (status != 0) {
+       perror(ring == MAP_FAILED ? "jobs: mmap failed" : "jobs: fork failed");
+       if (ring != MAP_FAILED)
+           munmap((void *)ring, JOB_RING_HEADER + size);
+       return NULL;
+   }
+   return ring;
+}
+
+
+/*
+* Function: note_background
+* -------------------------
+* Records a job started in the background as $! and, at the prompt, reports its PID. The job
+* goes into the event loop with a pidfd, to be reaped once it finishes; any that already have
+* are collected now, so a script starting many jobs doesn't pile up zombies. output is the read
+* end of its capture pipe (or -1), which goes to the job's reader process.
+*/
+void note_background(pid_t pid, int output) {
+   last_background_pid = pid;
+   last_status = 0;
+   if (interactive) {
+       printf("Process running in background (PID: %d)\n", pid);
+       fflush(stdout);
+   }
+   if (event_loop_init() < 0 || vector_reserve(&jobs, &jobs_cap, njobs + 1, sizeof(struct job)) < 0) {
+       if (output >= 0)
+           close(output);
+       return;
+   }
+   int pidfd = syscall(SYS_pidfd_open, pid, 0);
+   if (pidfd >= 0 && event_watch(pidfd, EV_JOB, pid) < 0) {
+       close(pidfd);
+       pidfd = -1;
+   }
+   int number = njobs > 0 ? jobs[njobs - 1].number + 1 : 1;
+   /* with no reader its writes fail from now on rather than block it */
+   const struct job_ring *ring = output >= 0 ? job_output_reader(output, job_output_size) : NULL;
+   jobs[njobs++] = (struct job){ pid, pidfd, 0, 0, 0, number, ring, job_output_size };
+   event_loop_run(0);
+   if (!interactive)
+       jobs_report();
+}
+
+
+/*
+* Function: job_output_show
+* -------------------------
+* Writes a job's captured output from byte from (counted since it started) to what it has
+* written so far, or as much of that as is still in the ring. The reader may be overwriting
+* the ring meanwhile, so each piece is copied out first and only the part still there after
+* the copy is written. Returns where it got to.
+*/
+long long job_output_show(struct job *j, long long from) {
+   static char buf[COPY_BUFFER_SIZE];
+   const char *data = (const char *)j->ring + JOB_RING_HEADER;
+   while (1) {
+       long long written = __atomic_load_n(&j->ring->written, __ATOMIC_ACQUIRE);
+       if (from < written - j->size)
+           from = written - j->size;   /* overwritten already */
+       if (from >= written)
+           return from;
+       long long at = from % j->size;
+       long long n = written - from;
+       if (n > j->size - at)
+           n = j->size - at;
+       if (n > (long long)sizeof(buf))
+           n = sizeof(buf);
+       memcpy(buf, data + at, n);
+       /* bytes at the start of the copy that were overwritten while it was made */
+       long long lost = __atomic_load_n(&j->ring->written, __ATOMIC_ACQUIRE) - j->size - from;
+       if (lost >= n)
+           continue;
+       if (lost < 0)
+           lost = 0;
+       shell_write(buf + lost, n - lost);
+       from += n;
+   }
+}
+
+
+/*
+* Function: builtin_jobs
+* ----------------------
+* Lists the background jobs. jobs -o %n writes the output captured from job n (set -o joboutput),
+* by default the latest; jobs -f %n also follows it as it grows, until the job closes its output
+* or a key is pressed.
+*/
+int builtin_jobs(char *args[]) {
+   /* a forked child has copies of the jobs, but only the shell can reap them */
+   if (event_fd >= 0 && event_owner == getpid())
+       event_loop_run(0);
+   int show = 0, follow = 0;
+   int i = 1;
+   for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+       if (strcmp(args[i], "--") == 0) {
+           i++;
+           break;
+       }
+       for (const char *o = args[i] + 1; *o != '\0'; o++) {
+           if (*o == 'o') {
+               show = 1;
+           } else if (*o == 'f') {
+               show = follow = 1;
+           } else {
+               fprintf(stderr, "jobs: -%c: invalid option\njobs: usage: jobs [-o | -f] [%%n]\n", *o);
+               return 2;
+           }
+       }
+   }
+
+
+   if (!show) {
+       for (int k = 0; k < njobs; k++) {
+           char state[32];
+           if (!jobs[k].done)
+               snprintf(state, sizeof(state), "Running");
+           else if (jobs[k].status == 0)
+               snprintf(state, sizeof(state), "Done");
+           else
+               snprintf(state, sizeof(state), "Exit %d", jobs[k].status);
+           shell_printf("[%d]  %-10s %d\n", jobs[k].number, state, jobs[k].pid);
+       }
+       return 0;
+   }
+   struct job *j = njobs > 0 ? &jobs[njobs - 1] : NULL;
+   if (args[i] != NULL) {
+       const char *spec = args[i][0] == '%' ? args[i] + 1 : args[i];
+       char *end;
+       long number = strtol(spec, &end, 10);
+       j = NULL;
+       for (int k = 0; k < njobs && *spec != '\0' && *end == '\0'; k++) {
+           if (jobs[k].number == number)
+               j = &jobs[k];
+       }
+       if (j == NULL) {
+           fprintf(stderr, "jobs: %s: no such job\n", args[i]);
+           return 1;
+       }
+   }
+   if (j == NULL) {
+       fprintf(stderr, "jobs: no current job\n");
+       return 1;
+   }
+   if (j->ring == NULL) {
+       fprintf(stderr, "jobs: %%%d: output not captured (set -o joboutput=SIZE)\n", j->number);
+       return 1;
+   }
+
+
+   long long at = job_output_show(j, 0);
+   while (follow && !__atomic_load_n(&j->ring->done, __ATOMIC_ACQUIRE)) {
+       fflush(stdout);
+       struct pollfd key = { interactive ? STDIN_FILENO : -1, POLLIN, 0 };
+       if (poll(&key, 1, JOB_FOLLOW_MS) > 0) {
+           char c;
+           if (read(STDIN_FILENO, &c, 1) >= 0)   /* the key that stopped it */
+               break;
+       }
+       at = job_output_show(j, at);
+   }
+   if (follow)
+       job_output_show(j, at);   /* what came in with the end */
+   return 0;
+}
+
+
+/*
+* Function: run_builtin
+* ---------------------
+* Runs a builtin inside the shell with its redirections applied around it and records its status.
+* Prefix assignments (IFS=: read ...) only last for the duration of the builtin.
+*/
+void run_builtin(struct builtin *b, char *args[], struct program *prog, const struct ccommand *cmd) {
+   struct saved_fds saved;
+   if (redirect_in_shell(prog, cmd->first_redir, cmd->nredirs, &saved) < 0) {
+       last_status = 1;
+       return;
+   }
+   struct strbuf *saved_capture = capture_output;
+   if (redirects_stdout(prog, cmd))
+       capture_output = NULL;   /* output explicitly goes to the file */
+
+
+   /* set -o telemetry: what the builtin used, in the shell and in anything it waited for */
+   int logged = telemetry_fd >= 0;
+   struct telemetry_stage stage;
+   struct rusage before[2];
+   if (logged) {
+       telemetry_begin(&stage, args, INT_MAX);
+       stage.builtin = 1;
+       telemetry_usage_begin(before);
+   }
+
+
+   int mark = undo_count;
+   undo_recording++;
+   int failed = apply_assignments(prog, cmd, VAR_EXPORT) < 0;
+   undo_recording--;
+   if (failed) {
+       expansion_failed = 0;
+       last_status = 1;
+   } else
+       last_status = b->run(args);
+   var_rollback(mark);
+   if (logged && telemetry_fd >= 0) {
+       telemetry_usage_end(before);
+       telemetry_end(&stage);
+       telemetry_record("builtin", &stage, 1);
+   } else if (logged) {
+       free(stage.text);   /* it was set -o telemetry=0 */
+   }
+
+
+   capture_output = saved_capture;
+   restore_redirections(&saved);
+}
+
+
+/*
+* Function: call_function
+* -----------------------
+* Runs a function body with args as its positional parameters and returns its status.
+*/
+int call_function(struct program *body, int block, char *args[]) {
+   char **saved_positional = positional;
+   int saved_count = positional_count;
+   positional = args + 1;
+   positional_count = 0;
+   while (positional[positional_count] != NULL)
+       positional_count++;
+   body->refs++;   /* the function may redefine itself while it runs */
+   function_depth++;
+   vm_run(body, block);
+   function_depth--;
+   function_returning = 0;
+   program_release(body);
+   positional = saved_positional;
+   positional_count = saved_count;
+   return last_status;
+}
+
+
+/*
+* Function: run_function
+* ----------------------
+* Calls a function in the shell with the command's redirections applied around it. Prefix
+* assignments only last for the duration of the call.
+*/
+void run_function(struct program *body, int block, char *args[], struct program *prog, const struct ccommand *cmd) {
+   struct saved_fds saved;
+   if (redirect_in_shell(prog, cmd->first_redir, cmd->nredirs, &saved) < 0) {
+       last_status = 1;
+       return;
+   }
+   int mark = undo_count;
+   undo_recording++;
+   int failed = apply_assignments(prog, cmd, VAR_EXPORT) < 0;
+   undo_recording--;
+   if (failed) {
+       expansion_failed = 0;
+       last_status = 1;
+   } else
+       call_function(body, block, args);
+   var_rollback(mark);
+   restore_redirections(&saved);
+}
+
+
+/*
+* Function: run_instruction
+* -------------------------
+* Executes the command in a child process, handling background execution and I/O redirection.
+* Leading NAME=value words are exported to this command only. With SIMPLE_EXEC the shell is
+* already a child with nothing left to do, so it execs without another fork. The program is
+* found through the PATH cache, searched in the shell so the result is kept for next time.
+*/
+void run_instruction(char *args[], int flags, struct program *prog, const struct ccommand *cmd) {
+   /* PATH=... cmd must search the new PATH */
+   const char *path = cmd->nassigns == 0 ? command_path(args[0]) : NULL;
+   /* set -o cmdtimeout: a deadline for a command the shell waits for */
+   int timed = command_timeout > 0 && !timed_group && !(flags & (SIMPLE_EXEC | INSTR_BACKGROUND));
+   /* set -o joboutput: a background command's output goes to the shell, not the terminal */
+   int output[2] = { -1, -1 };
+   if ((flags & INSTR_BACKGROUND) && !(flags & SIMPLE_EXEC))
+       job_output_open(output);
+   /* set -o telemetry: figures for a command the shell waits for */
+   int logged = telemetry_fd >= 0 && !(flags & (SIMPLE_EXEC | INSTR_BACKGROUND));
+   struct telemetry_stage stage;
+   if (logged)
+       telemetry_begin(&stage, args, INT_MAX);
+   pid_t pid = 0;
+   if (!(flags & SIMPLE_EXEC)) {
+       fflush(stdout);
+       pid = fork();
+   }
+   if (pid < 0) {
+       perror("fork failed");
+       if (output[0] >= 0) {
+           close(output[0]);
+           close(output[1]);
+       }
+       if (logged)
+           free(stage.text);
+       last_status = 1;
+       return;
+   }
+   else if (pid == 0) {  /* Child process */
+       in_forked_child = 1;
+       if (timed)
+           setpgid(0, 0);   /* its own process group, all of which the deadline stops */
+       job_output_attach(output, 1);
+       redirect_in_child(prog, cmd->first_redir, cmd->nredirs);
+
+
+       /* Per-command assignments only change the child's copy of the variables */
+       if (cmd->nassigns > 0 && apply_assignments(prog, cmd, VAR_EXPORT) < 0)
+           _exit(1);
+       environ = build_envp();
+
+
+       /* A function or builtin sent to the background runs in this child */
+       struct command_entry *e = command_resolve(args[0]);
+       if (e != NULL && (e->function != NULL || e->builtin != NULL)) {
+           int status = e->function ? call_function(e->function, e->function_block, args) : e->builtin->run(args);
+           fflush(stdout);
+           _exit(status);
+       }
+
+
+       /* Execute the actual command, keeping its /dev/fd/N arguments open; a stale cached path
+          falls back to the full search */
+       procsub_inherit(1);
+       if (path != NULL)
+           execv(path, args);
+       execvp(args[0], args);
+       int exec_errno = errno;   /* perror may clobber errno */
+       perror("execvp failed");
+       _exit(exec_errno == ENOENT ? 127 : 126);
+   }
+   else { /* Parent process */
+       if (logged)
+           stage.spawn_us = elapsed_us(&stage.start);
+       if (timed)
+           wait_deadline(pid, command_timeout, SIGTERM, KILL_GRACE_MS, -1, NULL);
+       else if (!(flags & INSTR_BACKGROUND))
+           wait_for_status(pid);
+       else {
+           if (output[1] >= 0)
+               close(output[1]);
+           note_background(pid, output[0]);
+       }
+       if (logged) {
+           telemetry_end(&stage);
+           telemetry_record("simple", &stage, 1);
+       }
+   }
+}
+
+
+/*
+* Function: run_simple
+* --------------------
+* Expands a simple command and runs it: a function or builtin in the shell, anything else in a
+* child.
+* A command of only assignments sets shell variables; its redirections are still performed.
+*/
+void run_simple(struct program *prog, int index, int flags) {
+   const struct ccommand *cmd = &prog->commands[index];
+   struct wordlist words = { NULL, 0, 0 };
+   int procsub_mark = nprocsubs;
+   /* set -o telemetry: this is a pipeline stage's command, whose argv the shell wants */
+   int report = telemetry_report_fd;
+   telemetry_report_fd = -1;
+   for (int i = cmd->nassigns; i < cmd->nwords; i++) {
+       const struct cword *w = &prog->words[cmd->first_word + i];
+       /* export and declare NAME=value keep the value in one piece */
+       int declaration = words.count > 0 && (strcmp(words.words[0], "export") == 0 ||
+                                             strcmp(words.words[0], "declare") == 0 || strcmp(words.words[0], "typeset") == 0);
+       int split = !(declaration && is_assignment(prog->pool + w->text));
+       expand_cword(prog, w, &words, split);
+   }
+   if (report >= 0) {
+       telemetry_report(report, words.words, words.count);
+       close(telemetry_fd);   /* the pipeline's record covers the rest of this stage */
+       telemetry_fd = -1;
+   }
+   if (expansion_failed) {
+       /* an expansion went wrong (say division by zero): the command isn't run */
+       expansion_failed = 0;
+       last_status = 1;
+       wordlist_free(&words);
+       procsub_close(procsub_mark, 1);
+       return;
+   }
+
+
+   struct command_entry *e = words.count > 0 ? command_resolve(words.words[0]) : NULL;
+   if (words.count == 0) {
+       /* $? comes from any $(...) in the assignments */
+       last_status = 0;
+       struct saved_fds saved;
+       if (apply_assignments(prog, cmd, 0) < 0) {
+           expansion_failed = 0;
+           last_status = 1;
+       } else if (redirect_in_shell(prog, cmd->first_redir, cmd->nredirs, &saved) < 0)
+           last_status = 1;
+       else
+           restore_redirections(&saved);
+   } else if (e != NULL && e->function != NULL && !(flags & INSTR_BACKGROUND)) {
+       run_function(e->function, e->function_block, words.words, prog, cmd);
+   } else if (e != NULL && e->builtin != NULL && !(flags & INSTR_BACKGROUND)) {
+       run_builtin(e->builtin, words.words, prog, cmd);
+       /* the NAME=(...) arguments of declare, once it has set up the arrays */
+       for (int i = cmd->nassigns; i < cmd->nwords; i++) {
+           const struct cword *w = &prog->words[cmd->first_word + i];
+           if (w->nelements >= 0) {
+               const char *raw = prog->pool + w->text;
+               int name_len = is_assignment(raw);
+               int append = raw[name_len - 1] == '+';
+               char name[MAX_LENGTH];
+               snprintf(name, sizeof(name), "%.*s", name_len - append, raw);
+               array_assign(prog, w, name, append);
+           }
+       }
+   } else {
+       run_instruction(words.words, flags, prog, cmd);
+   }
+   wordlist_free(&words);
+   /* a background command keeps its substitutions' children running */
+   procsub_close(procsub_mark, !(flags & INSTR_BACKGROUND));
+}
+
+
+/*
+* Function: run_in_child
+* ----------------------
+* Runs a block as the whole of a freshly forked child and exits with its status.
+*/
+void run_in_child(struct program *prog, int block) {
+   in_forked_child = 1;
+   vm_nesting = 0;
+   capture_output = NULL;
+   vm_run(prog, block);
+   fflush(stdout);
+   _exit(last_status);
+}
+
+
+/*
+* Function: fork_timed
+* --------------------
+* Forks a child for a pipeline or subshell under set -o cmdtimeout: it leads a process group of
+* its own for the parent's deadline to stop, and times nothing itself, so everything it starts
+* stays in that group. Returns what fork returns.
+*/
+pid_t fork_timed() {
+   pid_t pid = fork();
+   if (pid == 0) {
+       setpgid(0, 0);
+       in_forked_child = 1;
+       timed_group = 1;
+   }
+   return pid;
+}
+
+
+/*
+* Function: pipeline_builtin
+* --------------------------
+* True if stage k of a pipeline is a plain builtin command (a literal name, no assignments or
+* redirections) that can run in the shell once the stages before it have finished. Only
+* builtins whose output is bounded by their arguments, and which change nothing the virtual
+* subshell can't undo, qualify anywhere; one reading stdin (whose output has no such bound)
+* only as the last stage, where it writes straight out instead of into memory, and not first,
+* where it would hold the output back until the terminal is done.
+*/
+int pipeline_builtin(struct program *prog, int block, int k, int last) {
+   static const char *producers[] = { "echo", "printf", "pwd", "true", ":", "false", "test", "[", NULL };
+   static const char *filters[] = { "cat", "read", "tee", NULL };
+   const struct instr *code = &prog->code[prog->blocks[block]];
+   if (code[0].op != OP_SIMPLE || code[0].flags != 0 || code[1].op != OP_END)
+       return 0;
+   const struct ccommand *cmd = &prog->commands[code[0].a];
+   if (cmd->nassigns != 0 || cmd->nredirs != 0 || cmd->nwords == 0)
+       return 0;
+   const struct cword *w = &prog->words[cmd->first_word];
+   const struct wpart *part = &prog->parts[w->first_part];
+   if (w->nparts != 1 || part->type != WP_LIT || part->flags != 0)
+       return 0;
+   const char *name = prog->pool + w->text + part->off;
+   for (int i = 0; producers[i] != NULL; i++) {
+       if ((size_t)part->len == strlen(producers[i]) && strncmp(name, producers[i], part->len) == 0)
+           return 1;
+   }
+   for (int i = 0; k > 0 && last && filters[i] != NULL; i++) {
+       if ((size_t)part->len == strlen(filters[i]) && strncmp(name, filters[i], part->len) == 0)
+           return 1;
+   }
+   return 0;
+}
+
+
+/*
+* Function: feed_through_pipe
+* ---------------------------
+* Hands data to the next stage of a pipeline through a pipe, for when it can't go in a memfd. A
+* grandchild of the shell writes it, so nothing is left to reap. Returns the read end, or -1.
+*/
+int feed_through_pipe(const char *data, size_t len) {
+   int pipe_ends[2];
+   if (open_pipe(pipe_ends) < 0) {
+       perror("pipe failed");
+       return -1;
+   }
+   fflush(stdout);
+   pid_t pid = fork();
+   if (pid == 0) {
+       close(pipe_ends[0]);
+       if (fork() == 0)
+           write_all(pipe_ends[1], data, len);
+       _exit(0);
+   }
+   close(pipe_ends[1]);
+   if (pid < 0) {
+       perror("fork failed");
+       close(pipe_ends[0]);
+       return -1;
+   }
+   while (waitpid(pid, NULL, 0) < 0 && errno == EINTR)
+       ;
+   return pipe_ends[0];
+}
+
+
+/*
+* Function: run_builtin_stages
+* ----------------------------
+* Runs the leading builtin stages of a pipeline in the shell, each a virtual subshell as in
+* $(...), with no fork and no pipe: a stage's output is collected in memory and becomes the next
+* one's stdin through a memfd (a pipe fed by a child if there is no memfd to be had). Returns how
+* many stages ran; the output of the last is left in *input for the first forked stage, or, if
+* every stage was a builtin, the last one wrote it out itself. With stats, each stage's
+* telemetry goes there.
+*/
+int run_builtin_stages(struct program *prog, int first, int stages, int *input, struct telemetry_stage *stats) {
+   struct strbuf out = { NULL, 0, 0 };
+   int fd = -1;   /* the previous stage's output */
+   int k = 0;
+   for (; k < stages; k++) {
+       int last = k + 1 == stages;
+       if (!pipeline_builtin(prog, first + k, k, last))
+           break;
+       const struct ccommand *cmd = &prog->commands[prog->code[prog->blocks[first + k]].a];
+       struct command_entry *e = command_resolve(prog->pool + prog->words[cmd->first_word].text);
+       if (e == NULL || e->function != NULL || e->builtin == NULL)
+           break;   /* a function of the same name runs in a child like anything else */
+
+
+       struct wordlist words = { NULL, 0, 0 };
+       for (int i = 0; i < cmd->nwords; i++)
+           expand_cword(prog, &prog->words[cmd->first_word + i], &words, 1);
+       int saved_stdin = -1;
+       if (fd >= 0) {
+           saved_stdin = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 10);
+           dup2(fd, STDIN_FILENO);
+           close(fd);
+           fd = -1;
+       }
+       out.len = 0;
+       struct rusage before[2];
+       if (stats != NULL) {
+           telemetry_begin(&stats[k], words.words, words.count);
+           stats[k].builtin = 1;
+           telemetry_usage_begin(before);
+       }
+       if (words.count > 0)
+           run_builtin_captured(words.words, last ? capture_output : &out);
+       if (stats != NULL) {
+           telemetry_usage_end(before);
+           telemetry_end(&stats[k]);
+       }
+       wordlist_free(&words);
+       if (saved_stdin >= 0) {
+           dup2(saved_stdin, STDIN_FILENO);
+           close(saved_stdin);
+       }
+       if (!last) {
+           fd = make_sealed_memfd(out.buf ? out.buf : "", out.len);
+           if (fd < 0)
+               fd = feed_through_pipe(out.buf ? out.buf : "", out.len);
+           if (fd < 0)
+               fd = open("/dev/null", O_RDONLY | O_CLOEXEC);   /* never the shell's own stdin */
+       }
+   }
+
+
+   if (k < stages)
+       *input = fd;
+   free(out.buf);
+   return k;
+}
+
+
+/*
+* Function: handle_pipe
+* ---------------------
+* Runs the stages of a pipeline (consecutive blocks) in children connected by pipes. A stage
+* that is a single command execs straight from its child; the status is the last stage's.
+* Leading builtin stages run in the shell instead, handing their output to the rest in memory.
+* Under set -o cmdtimeout the whole pipeline runs in a child of the shell, whose process group
+* the deadline stops.
+*/
+void handle_pipe(struct program *prog, int first, int stages, int background) {
+   if (command_timeout > 0 && !timed_group && !background) {
+       fflush(stdout);
+       pid_t pid = fork_timed();
+       if (pid == 0) {
+           handle_pipe(prog, first, stages, 0);
+           fflush(stdout);
+           _exit(last_status);
+       }
+       if (pid < 0) {
+           perror("fork failed");
+           last_status = 1;
+       } else {
+           wait_deadline(pid, command_timeout, SIGTERM, KILL_GRACE_MS, -1, NULL);
+       }
+       return;
+   }
+   int prev_read = -1;   /* read end of the pipe from the previous stage */
+   struct telemetry_stage *stats = (telemetry_fd >= 0 && !background) ? calloc(stages, sizeof(struct telemetry_stage)) : NULL;
+   int start = background ? 0 : run_builtin_stages(prog, first, stages, &prev_read, stats);
+   if (start == stages) {
+       if (stats != NULL)
+           telemetry_record("pipeline", stats, stages);
+       free(stats);
+       return;
+   }
+   pid_t *pids = malloc(stages * sizeof(pid_t));
+   if (pids == NULL) {
+       perror("malloc failed");
+       if (prev_read >= 0)
+           close(prev_read);
+       if (stats != NULL)
+           telemetry_record("pipeline", stats, start);
+       free(stats);
+       last_status = 1;
+       return;
+   }
+   int spawned = 0;
+   int output[2] = { -1, -1 };   /* set -o joboutput: every stage's stderr and the last one's stdout */
+   if (background)
+       job_output_open(output);
+   int report[2] = { -1, -1 };   /* set -o telemetry: the stages' expanded argv come back on this */
+   if (stats != NULL && socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, report) < 0)
+       report[0] = report[1] = -1;
+   for (int k = start; k < stages; k++) {
+       int pipe_ends[2] = { -1, -1 };   /* read and write */
+       if (k + 1 < stages && open_pipe(pipe_ends) < 0)
+           perror("pipe failed");
+
+
+       fflush(stdout);
+       struct telemetry_stage stage;
+       if (stats != NULL)
+           telemetry_begin_block(&stage, prog, first + k);
+       pid_t pid = fork();
+       if (pid < 0) {
+           perror("fork failed");
+           if (stats != NULL)
+               free(stage.text);
+       } else if (pid == 0) {
+           /* child: stdin from the previous stage, stdout into the next one */
+           if (prev_read >= 0) {
+               dup2(prev_read, STDIN_FILENO);
+               close(prev_read);
+           }
+           if (pipe_ends[1] >= 0) {
+               dup2(pipe_ends[1], STDOUT_FILENO);
+               close(pipe_ends[1]);
+               close(pipe_ends[0]);
+           }
+           job_output_attach(output, k + 1 == stages);
+           const struct instr *code = &prog->code[prog->blocks[first + k]];
+           if (report[1] >= 0 && code[0].op == OP_SIMPLE && code[1].op == OP_END) {
+               telemetry_report_fd = report[1];
+               telemetry_report_stage = start + spawned;
+           } else if (report[1] >= 0) {
+               close(report[1]);
+           }
+           if (report[0] >= 0)
+               close(report[0]);
+           run_in_child(prog, first + k);
+       } else {
+           if (stats != NULL) {
+               stage.spawn_us = elapsed_us(&stage.start);
+               stats[start + spawned] = stage;
+           }
+           pids[spawned++] = pid;
+       }
+
+
+       /*  Parent: the pipe ends now belong to the children */
+       if (prev_read >= 0)
+           close(prev_read);
+       if (pipe_ends[1] >= 0)
+           close(pipe_ends[1]);
+       prev_read = pipe_ends[0];
+   }
+   if (prev_read >= 0)
+       close(prev_read);
+   if (output[1] >= 0)
+       close(output[1]);
+   if (report[1] >= 0)
+       close(report[1]);
+
+
+   if (background && spawned > 0) {
+       note_background(pids[spawned - 1], output[0]);
+   } else {
+       if (output[0] >= 0)
+           close(output[0]);
+       /*  Wait for every stage; the pipeline's status is the last one's */
+       for (int k = 0; k < spawned; k++) {
+           wait_for_status(pids[k]);
+           if (stats != NULL)
+               telemetry_end(&stats[start + k]);
+       }
+       if (report[0] >= 0)
+           telemetry_collect(report[0], stats, start + spawned);
+       if (stats != NULL)
+           telemetry_record("pipeline", stats, start + spawned);
+   }
+   if (report[0] >= 0)
+       close(report[0]);
+   free(stats);
+   free(pids);
+}
+
+
+/*
+* Function: run_subshell
+* ----------------------
+* Runs a block in a forked child, for ( ... ) and for lists sent to the background. Under
+* set -o cmdtimeout one the shell waits for has a deadline.
+*/
+void run_subshell(struct program *prog, int block, int background) {
+   int output[2] = { -1, -1 };   /* set -o joboutput */
+   if (background)
+       job_output_open(output);
+   int logged = telemetry_fd >= 0 && !background;
+   struct telemetry_stage stage;
+   if (logged)
+       telemetry_begin(&stage, NULL, 0);
+   int timed = command_timeout > 0 && !timed_group && !background;
+   fflush(stdout);
+   pid_t pid = timed ? fork_timed() : fork();
+   if (pid == 0) {
+       job_output_attach(output, 1);
+       run_in_child(prog, block);
+   }
+   if (output[1] >= 0)
+       close(output[1]);
+   if (pid < 0) {
+       perror("fork failed");
+       if (output[0] >= 0)
+           close(output[0]);
+       last_status = 1;
+       return;
+   }
+   if (background) {
+       note_background(pid, output[0]);
+   } else {
+       if (logged)
+           stage.spawn_us = elapsed_us(&stage.start);
+       if (timed)
+           wait_deadline(pid, command_timeout, SIGTERM, KILL_GRACE_MS, -1, NULL);
+       else
+           wait_for_status(pid);
+       if (logged) {
+           telemetry_end(&stage);
+           telemetry_record("subshell", &stage, 1);
+       }
+   }
+}
+
+
+/*
+* Function: start_coproc
+* ----------------------
+* Runs a block in the background with its stdin and stdout on two pipes, as with handle_pipe
+* but with both far ends kept by the shell: name[0] reads the coprocess's output, name[1]
+* writes to its input, and name_PID is its PID (also $!). The shell's ends are close-on-exec
+* and moved up out of the way of the descriptors scripts redirect.
+*/
+void start_coproc(struct program *prog, int block, const char *name) {
+   int to_child[2], from_child[2];   /* read and write ends */
+   if (open_pipe(to_child) < 0) {
+       perror("pipe failed");
+       last_status = 1;
+       return;
+   }
+   if (open_pipe(from_child) < 0) {
+       perror("pipe failed");
+       close(to_child[0]);
+       close(to_child[1]);
+       last_status = 1;
+       return;
+   }
+   fflush(stdout);
+   pid_t pid = fork();
+   if (pid == 0) {
+       /* child: the write end of its own input must go, or it would never see end of file */
+       dup2(to_child[0], STDIN_FILENO);
+       dup2(from_child[1], STDOUT_FILENO);
+       close(to_child[0]);
+       close(to_child[1]);
+       close(from_child[0]);
+       close(from_child[1]);
+       run_in_child(prog, block);
+   }
+   close(to_child[0]);
+   close(from_child[1]);
+   if (pid < 0) {
+       perror("fork failed");
+       close(to_child[1]);
+       close(from_child[0]);
+       last_status = 1;
+       return;
+   }
+
+
+   int fds[2] = { from_child[0], to_child[1] };
+   char number[32];
+   var_unset(name);
+   for (int k = 0; k < 2; k++) {
+       int moved = fcntl(fds[k], F_DUPFD_CLOEXEC, 60);
+       if (moved >= 0) {
+           close(fds[k]);
+           fds[k] = moved;
+       }
+       snprintf(number, sizeof(number), "%d", fds[k]);
+       array_set_element(name, k ? "1" : "0", 1, number);
+   }
+   char pid_name[MAX_LENGTH];
+   snprintf(pid_name, sizeof(pid_name), "%s_PID", name);
+   snprintf(number, sizeof(number), "%d", (int)pid);
+   var_set(pid_name, number, 0);
+   note_background(pid, -1);
+
+
+   /* remember the ends for unset; an earlier coprocess of the same name keeps its own open */
+   struct coproc *slot = NULL;
+   for (int i = 0; i < MAX_COPROCS; i++) {
+       if (coprocs[i].name != NULL && strcmp(coprocs[i].name, name) == 0) {
+           free(coprocs[i].name);
+           coprocs[i].name = NULL;
+       }
+       if (coprocs[i].name == NULL && slot == NULL)
+           slot = &coprocs[i];
+   }
+   if (slot != NULL && (slot->name = strdup(name)) != NULL) {
+       slot->fds[0] = fds[0];
+       slot->fds[1] = fds[1];
+   }
+}
+
+
+/*
+* Function: coproc_close
+* ----------------------
+* Closes the shell's end k (0 or 1, both for -1) of the named coprocess's pipes, for unset.
+* Closing NAME[1] is how a helper like sort or bc gets to the end of its input.
+*/
+void coproc_close(const char *name, int k) {
+   for (int i = 0; i < MAX_COPROCS; i++) {
+       struct coproc *c = &coprocs[i];
+       if (c->name == NULL || strcmp(c->name, name) != 0)
+           continue;
+       for (int j = 0; j < 2; j++) {
+           if ((k < 0 || k == j) && c->fds[j] >= 0) {
+               close(c->fds[j]);
+               c->fds[j] = -1;
+           }
+       }
+       if (c->fds[0] < 0 && c->fds[1] < 0) {
+           free(c->name);
+           c->name = NULL;
+       }
+   }
+}
+
+
+/*
+* Function: frame_pop
+* -------------------
+* Drops the innermost interpreter frame, undoing redirections and freeing what it owns.
+*/
+void frame_pop(struct vm_frame *frames, int *count) {
+   struct vm_frame *f = &frames[--*count];
+   if (f->type == FRAME_FOR)
+       wordlist_free(&f->list);
+   else if (f->type == FRAME_CASE)
+       free(f->subject);
+   else if (f->type == FRAME_REDIR)
+       restore_redirections(&f->saved);
+}
+
+
+/*
+* Function: case_matches
+* ----------------------
+* True if one of a case arm's patterns matches the subject. Expanding the patterns leaves $? alone.
+*/
+int case_matches(struct program *prog, int first, int count, const char *subject) {
+   int status = last_status;
+   int matched = 0;
+   for (int i = first; i < first + count && !matched; i++) {
+       char *text = expand_pattern(prog, &prog->words[i]);
+       const struct pattern *pat = pattern_cached(text);
+       matched = (pat != NULL && pattern_match(pat, subject, strlen(subject)));
+       free(text);
+   }
+   last_status = status;
+   return matched;
+}
+
+
+/*
+* Function: case_set_match
+* ------------------------
+* For a case whose patterns have no expansions: the first time it runs, compiles the patterns
+* of all its arms (found through the OP_CASE_MATCH chain after the OP_CASE_BEGIN at pc) into
+* one pattern set, so choosing the arm is a single pass over the subject. Returns the word of
+* the matching pattern, -1 if none matches, or CASE_EACH_ARM if the set can't be used.
+*/
+int case_set_match(struct program *prog, int slot, int pc, const char *subject) {
+   if (prog->case_sets == NULL) {
+       prog->case_sets = calloc(prog->ncases, sizeof(struct pattern_set));
+       if (prog->case_sets == NULL)
+           return CASE_EACH_ARM;
+   }
+   struct pattern_set *set = &prog->case_sets[slot];
+   if (set->status == 0) {
+       set->status = 1;
+       for (int k = pc + 1; set->status > 0 && prog->code[k].op == OP_CASE_MATCH; k = prog->code[k].c) {
+           for (int i = prog->code[k].a; set->status > 0 && i < prog->code[k].a + prog->code[k].b; i++) {
+               char *text = expand_pattern(prog, &prog->words[i]);
+               struct pattern pat;
+               if (pattern_compile(text, strlen(text), &pat) < 0 || pattern_set_add(set, &pat, i) < 0)
+                   set->status = -1;
+               pattern_free(&pat);
+               free(text);
+           }
+       }
+       size_t nlongs = (set->nstates + LONG_BITS - 1) / LONG_BITS;
+       set->current = calloc(nlongs + 1, sizeof(unsigned long));
+       set->next = calloc(nlongs + 1, sizeof(unsigned long));
+       if (set->current == NULL || set->next == NULL)
+           set->status = -1;
+   }
+   return set->status > 0 ? pattern_set_match(set, subject, strlen(subject)) : CASE_EACH_ARM;
+}
+
+
+/*
+* Function: vm_run
+* ----------------
+* Executes a block of a compiled program: a dispatch loop over its instructions, with loop,
+* case and redirection state kept in a stack of frames. Returns the final $?.
+*/
+int vm_run(struct program *prog, int block) {
+   struct vm_frame *frames = NULL;
+   int nframes = 0, frames_cap = 0;
+   int pc = prog->blocks[block];
+   int running = 1;
+   vm_nesting++;
+   while (running) {
+       const struct instr *in = &prog->code[pc++];
+       struct vm_frame *top = nframes > 0 ? &frames[nframes - 1] : NULL;
+       if (in->op == OP_LOOP_INIT || in->op == OP_FOR_INIT || in->op == OP_CASE_BEGIN || in->op == OP_REDIR_PUSH) {
+           if (vector_reserve(&frames, &frames_cap, nframes + 1, sizeof(struct vm_frame)) < 0)
+               break;
+           top = &frames[nframes];
+           memset(top, 0, sizeof(*top));
+       }
+       switch (in->op) {
+       case OP_END:
+           running = 0;
+           break;
+       case OP_SIMPLE: {
+           /* the last command of a forked child needs no fork of its own */
+           int flags = in->flags;
+           if (in_forked_child && vm_nesting == 1 && nframes == 0 && prog->code[pc].op == OP_END)
+               flags |= SIMPLE_EXEC;
+           run_simple(prog, in->a, flags);
+           if (function_returning || subshell_exited)
+               running = 0;   /* return, or exit in a virtual subshell */
+           break;
+       }
+       case OP_PIPELINE:
+           handle_pipe(prog, in->a, in->b, in->flags & INSTR_BACKGROUND);
+           break;
+       case OP_SUBSHELL:
+       case OP_BACKGROUND:
+           run_subshell(prog, in->a, in->op == OP_BACKGROUND);
+           break;
+       case OP_JUMP:
+           pc = in->a;
+           break;
+       case OP_JUMP_FALSE:
+           if (last_status != 0)
+               pc = in->a;
+           break;
+       case OP_JUMP_TRUE:
+           if (last_status == 0)
+               pc = in->a;
+           break;
+       case OP_NOT:
+           last_status = !last_status;
+           break;
+       case OP_STATUS:
+           last_status = in->a;
+           break;
+       case OP_ARITH: {
+           long long value;
+           last_status = (arith_expand(prog, in->a + 1, NULL, 0, &value) < 0 || value == 0);
+           expansion_failed = 0;
+           break;
+       }
+       case OP_COND: {
+           int error = 0;
+           int result = cond_eval(prog, in->a, &error);
+           last_status = error ? 2 : !result;
+           expansion_failed = 0;
+           break;
+       }
+       case OP_LOOP_INIT:
+           top->type = FRAME_LOOP;
+           nframes++;
+           break;
+       case OP_LOOP_NEXT:
+           top->status = last_status;
+           pc = in->a;
+           break;
+       case OP_LOOP_END:
+       case OP_FOR_END:
+           last_status = top->status;
+           frame_pop(frames, &nframes);
+           break;
+       case OP_FOR_INIT:
+           top->type = FRAME_FOR;
+           top->subject = prog->pool + in->a;
+           if (in->c < 0) {
+               for (int i = 0; i < positional_count; i++)
+                   wordlist_add(&top->list, strdup(positional[i]));
+           } else {
+               for (int i = in->b; i < in->b + in->c; i++)
+                   expand_cword(prog, &prog->words[i], &top->list, 1);
+           }
+           nframes++;
+           break;
+       case OP_FOR_NEXT:
+           if (top->index > 0)
+               top->status = last_status;
+           if (top->index >= top->list.count)
+               pc = in->a;
+           else
+               var_set(top->subject, top->list.words[top->index++], 0);
+           break;
+       case OP_CASE_BEGIN:
+           top->type = FRAME_CASE;
+           top->subject = expand_cword_string(prog, &prog->words[in->a]);
+           top->index = in->b ? case_set_match(prog, in->b - 1, in - prog->code, top->subject) : CASE_EACH_ARM;
+           nframes++;
+           last_status = 0;   /* no arm matching is success */
+           break;
+       case OP_CASE_MATCH:
+           if (top->index == CASE_EACH_ARM ? !case_matches(prog, in->a, in->b, top->subject)
+                                           : (top->index < in->a || top->index >= in->a + in->b))
+               pc = in->c;
+           break;
+       case OP_CASE_END:
+           frame_pop(frames, &nframes);
+           break;
+       case OP_REDIR_PUSH:
+           top->type = FRAME_REDIR;
+           if (redirect_in_shell(prog, in->a, in->b, &top->saved) < 0) {
+               last_status = 1;   /* bad redirection: the command doesn't run */
+               pc = in->c;
+           } else {
+               nframes++;
+           }
+           break;
+       case OP_REDIR_POP:
+           frame_pop(frames, &nframes);
+           break;
+       case OP_FUNCTION:
+           function_set(prog->pool + in->a, prog, in->b);
+           last_status = 0;
+           break;
+       case OP_COPROC:
+           start_coproc(prog, in->b, prog->pool + in->a);
+           break;
+       case OP_BREAK:
+       case OP_CONTINUE:
+           while (nframes > in->b)
+               frame_pop(frames, &nframes);
+           if (in->op == OP_BREAK)
+               frames[nframes - 1].status = 0;
+           last_status = 0;
+           pc = in->a;
+           break;
+       }
+   }
+   while (nframes > 0)
+       frame_pop(frames, &nframes);
+   free(frames);
+   vm_nesting--;
+   return last_status;
+}
+
+
+/*
+* Function: execute_line
+* ----------------------
+* Compiles source text (a command line, a script, the text of a $(...)) and runs it.
+* A syntax error anywhere means none of it runs.
+*/
+void execute_line(const char *line) {
+   int status;
+   struct program *prog = compile_program(line, 0, &status);
+   if (prog == NULL) {
+       last_status = 2;
+       return;
+   }
+   vm_run(prog, 0);
+   program_release(prog);
+}
+
+
+/*
+* Function: builtin_changes_shell
+* -------------------------------
+* True for the builtins that change more of the shell than its variables and working directory
+* (functions, aliases, the command table, options, or whatever a sourced file does), which a
+* virtual subshell has no way to undo, so they need a real one.
+*/
+int builtin_changes_shell(const char *name) {
+   static const char *names[] = { "unset", "alias", "unalias", "hash", "set", "source", ".", NULL };
+   for (int i = 0; names[i] != NULL; i++) {
+       if (strcmp(name, names[i]) == 0)
+           return 1;
+   }
+   return 0;
+}
+
+
+/*
+* Function: function_is_virtual
+* -----------------------------
+* True if a function body can run as a virtual subshell: it puts nothing in the background,
+* defines no functions and names each command literally, none of them one of the
+* builtin_changes_shell builtins. Functions it calls are checked the same way, a few levels deep.
+*/
+int function_is_virtual(struct program *body, int block, int depth) {
+   if (depth > VIRTUAL_CALL_DEPTH)
+       return 0;
+   for (int pc = body->blocks[block]; body->code[pc].op != OP_END; pc++) {
+       const struct instr *in = &body->code[pc];
+       if (in->op == OP_BACKGROUND || in->op == OP_FUNCTION || in->op == OP_COPROC)
+           return 0;
+       if ((in->op == OP_SIMPLE || in->op == OP_PIPELINE) && (in->flags & INSTR_BACKGROUND))
+           return 0;
+       if (in->op != OP_SIMPLE)
+           continue;
+       const struct ccommand *cmd = &body->commands[in->a];
+       if (cmd->nwords == cmd->nassigns)
+           continue;
+       const struct cword *w = &body->words[cmd->first_word + cmd->nassigns];
+       const struct wpart *part = &body->parts[w->first_part];
+       if (w->nparts != 1 || part->type != WP_LIT || part->flags != 0)
+           return 0;   /* the command is only known once it is expanded */
+       char name[MAX_LENGTH];
+       snprintf(name, sizeof(name), "%.*s", part->len, body->pool + w->text + part->off);
+       if (builtin_changes_shell(name))
+           return 0;
+       struct command_entry *e = command_resolve(name);
+       if (e != NULL && e->function != NULL && !function_is_virtual(e->function, e->function_block, depth + 1))
+           return 0;
+   }
+   return 1;
+}
+
+
+/*
+* Function: virtual_begin
+* -----------------------
+* Enters a virtual subshell whose builtin output goes to out (NULL: to stdout). Variable changes
+* are logged from here on and the first cd remembers where to come back to.
+*/
+void virtual_begin(struct virtual_subshell *vs, struct strbuf *out) {
+   vs->capture = capture_output;
+   vs->cwd_fd = subshell_cwd_fd;
+   vs->mark = undo_count;
+   capture_output = out;
+   subshell_cwd_fd = -1;
+   subshell_depth++;
+   undo_recording++;
+}
+
+
+/*
+* Function: virtual_end
+* ---------------------
+* Leaves a virtual subshell: undoes its variable changes, goes back to the directory it started
+* in and forgets any exit run inside it.
+*/
+void virtual_end(struct virtual_subshell *vs) {
+   undo_recording--;
+   subshell_depth--;
+   var_rollback(vs->mark);
+   if (subshell_cwd_fd >= 0) {
+       if (fchdir(subshell_cwd_fd) < 0)
+           perror("fchdir failed");
+       close(subshell_cwd_fd);
+   }
+   subshell_cwd_fd = vs->cwd_fd;
+   subshell_exited = 0;
+   capture_output = vs->capture;
+}
+
+
+/*
+* Function: run_builtin_captured
+* ------------------------------
+* Runs a builtin in-process as a virtual subshell, collecting its output in out. Variable and
+* directory changes are undone afterwards and exit only ends the substitution.
+* Returns 0 if args[0] isn't a builtin.
+*/
+int run_builtin_captured(char *args[], struct strbuf *out) {
+   struct builtin *b = find_builtin(args[0]);
+   if (b == NULL)
+       return 0;
+   struct virtual_subshell vs;
+   virtual_begin(&vs, out);
+   last_status = b->run(args);
+   virtual_end(&vs);
+   return 1;
+}
+
+
+/*
+* Function: run_function_captured
+* -------------------------------
+* Calls a function in-process as a virtual subshell, collecting its output in out. Anything the
+* body starts writes to stdout too, so for the call stdout is a memfd, read back afterwards and
+* kept for the next call. Returns 0 (nothing run) if the memfd can't be made.
+*/
+int run_function_captured(struct program *body, int block, char *args[], struct strbuf *out) {
+   int fd = capture_owner == getpid() ? capture_memfd : -1;
+   capture_memfd = -1;   /* a $(g) inside the body needs one of its own */
+   if (fd < 0)
+       fd = memfd_create("osc-capture", MFD_CLOEXEC);
+   if (fd < 0)
+       return 0;
+   fflush(stdout);
+   int saved_stdout = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+   if (dup2(fd, STDOUT_FILENO) < 0) {
+       perror("dup2 failed");
+       close(fd);
+       if (saved_stdout >= 0)
+           close(saved_stdout);
+       return 0;
+   }
+   struct virtual_subshell vs;
+   virtual_begin(&vs, NULL);
+   call_function(body, block, args);
+   fflush(stdout);
+   virtual_end(&vs);
+   if (saved_stdout >= 0) {
+       dup2(saved_stdout, STDOUT_FILENO);
+       close(saved_stdout);
+   } else {
+       close(STDOUT_FILENO);
+   }
+   if (lseek(fd, 0, SEEK_SET) == 0)
+       drain_fd(fd, out);
+   if (capture_memfd < 0 && ftruncate(fd, 0) == 0 && lseek(fd, 0, SEEK_SET) == 0) {
+       capture_memfd = fd;
+       capture_owner = getpid();
+   } else
+       close(fd);
+   return 1;
+}
+
+
+/*
+* Function: fork_captured
+* -----------------------
+* Runs a block of a program (pipes, redirections, ...) in a forked subshell and reads its output into out.
+*/
+void fork_captured(struct program *prog, int block, struct strbuf *out) {
+   int pipe_ends[2];
+   if (open_pipe(pipe_ends) < 0) {
+       perror("pipe failed");
+       return;
+   }
+   fflush(stdout);
+   pid_t pid = fork();
+   if (pid < 0) {
+       perror("fork failed");
+       close(pipe_ends[0]);
+       close(pipe_ends[1]);
+       return;
+   }
+   if (pid == 0) {
+       /* child: stdout is the pipe, run the block and exit with its status */
+       dup2(pipe_ends[1], STDOUT_FILENO);
+       run_in_child(prog, block);
+   }
+   close(pipe_ends[1]);
+   drain_fd(pipe_ends[0], out);
+   close(pipe_ends[0]);
+   wait_for_status(pid);
+}
+
+
+/*
+* Function: capture_block
+* -----------------------
+* Runs the compiled body of a $(...) and stores its output, minus trailing newlines, in out.
+* A lone builtin or function runs in-process with no fork at all, a lone external command goes
+* through posix_spawn, and anything more complex (or that changes the shell in ways that can't be
+* undone, like alias or a function defining another) runs in a forked subshell.
+*/
+void capture_block(struct program *prog, int block, struct strbuf *out) {
+   const struct instr *code = &prog->code[prog->blocks[block]];
+   const struct ccommand *cmd = code[0].op == OP_SIMPLE ? &prog->commands[code[0].a] : NULL;
+   if (cmd != NULL && code[0].flags == 0 && code[1].op == OP_END && cmd->nassigns == 0 && cmd->nredirs == 0) {
+       struct wordlist words = { NULL, 0, 0 };
+       int procsub_mark = nprocsubs;
+       for (int i = 0; i < cmd->nwords; i++)
+           expand_cword(prog, &prog->words[cmd->first_word + i], &words, 1);
+       struct command_entry *e = words.count > 0 ? command_resolve(words.words[0]) : NULL;
+       if (words.count == 0)
+           last_status = 0;
+       else if (e != NULL && e->function != NULL) {
+           if (!function_is_virtual(e->function, e->function_block, 0) ||
+               !run_function_captured(e->function, e->function_block, words.words, out))
+               fork_captured(prog, block, out);
+       } else if (e != NULL && e->builtin != NULL && builtin_changes_shell(words.words[0]))
+           fork_captured(prog, block, out);
+       else if (!run_builtin_captured(words.words, out))
+           spawn_captured(words.words, out);
+       wordlist_free(&words);
+       procsub_close(procsub_mark, 1);
+   } else if (code[0].op != OP_END) {
+       fork_captured(prog, block, out);
+   }
+
+
+   /* trailing newlines are removed */
+   while (out->len > 0 && out->buf[out->len - 1] == '\n')
+       out->buf[--out->len] = '\0';
+}
+
+
+/*
+* Function: command_substitution
+* ------------------------------
+* Runs the text of a $(...) or `...` that wasn't compiled with its word (one expanded outside
+* a program) and stores its output, minus trailing newlines, in out.
+*/
+void command_substitution(const char *text, size_t len, int backquoted, struct strbuf *out) {
+   char *line = substitution_text(text, len, backquoted);
+   if (line == NULL)
+       return;
+   int status;
+   struct program *prog = compile_program(line, 0, &status);
+   if (prog != NULL)
+       capture_block(prog, 0, out);
+   else
+       last_status = 2;
+   program_release(prog);
+   free(line);
+}
+
+
+/*
+* Function: process_substitution
+* ------------------------------
+* Starts the command of a <(...) (with output set, a >(...)) in a child joined to the shell by
+* a pipe and returns the shell's end, kept open until the command it was expanded for is done.
+* A body compiled into prog runs from there, others are parsed in the child. Returns -1 on failure.
+*/
+int process_substitution(struct program *prog, int block, const char *text, int len, int output) {
+   int pipe_ends[2];
+   if (vector_reserve(&procsubs, &procsubs_cap, nprocsubs + 1, sizeof(struct procsub)) < 0)
+       return -1;
+   if (open_pipe(pipe_ends) < 0) {
+       perror("pipe failed");
+       return -1;
+   }
+   fflush(stdout);
+   pid_t pid = fork();
+   if (pid < 0) {
+       perror("fork failed");
+       close(pipe_ends[0]);
+       close(pipe_ends[1]);
+       return -1;
+   }
+   if (pid == 0) {
+       /* child: its end of the pipe is stdout (stdin for >(...)). Write ends of the shell's other
+          >(...) pipes are dropped so their readers still see end of file */
+       dup2(pipe_ends[output ? 0 : 1], output ? STDIN_FILENO : STDOUT_FILENO);
+       close(pipe_ends[0]);
+       close(pipe_ends[1]);
+       int kept = 0;
+       for (int i = 0; i < nprocsubs; i++) {
+           if (procsubs[i].output)
+               close(procsubs[i].fd);
+           else
+               procsubs[kept++] = procsubs[i];
+       }
+       nprocsubs = kept;
+       if (prog == NULL || block <= 0) {
+           char *line = substitution_text(text, len, 0);
+           int status;
+           prog = line ? compile_program(line, 0, &status) : NULL;
+           if (prog == NULL)
+               _exit(2);
+           block = 0;
+       }
+       run_in_child(prog, block);
+   }
+   int fd = pipe_ends[output ? 1 : 0];
+   close(pipe_ends[output ? 0 : 1]);
+   procsubs[nprocsubs++] = (struct procsub){ fd, pid, output };
+   return fd;
+}
+
+
+/*
+* Function: script_cache_file
+* ---------------------------
+* Builds the name of the cache file for a script (by its absolute path) under
+* $XDG_CACHE_HOME/osc or ~/.cache/osc, creating the directories. Returns -1 if there is nowhere
+* to keep it.
+*/
+int script_cache_file(const char *script, char *out, size_t size) {
+   char dir[PATH_MAX];
+   const char *base = var_get("XDG_CACHE_HOME");
+   int n;
+   if (base != NULL && base[0] == '/') {
+       n = snprintf(dir, sizeof(dir), "%s", base);
+   } else {
+       const char *home = var_get("HOME");
+       if (home == NULL || home[0] == '\0')
+           return -1;
+       n = snprintf(dir, sizeof(dir), "%s/.cache", home);
+   }
+   if (n < 0 || (size_t)n >= sizeof(dir) - 8)
+       return -1;
+   mkdir(dir, 0700);
+   strcat(dir, "/osc");
+   if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+       return -1;
+   n = snprintf(out, size, "%s/%016lx.oscc", dir, hash_name(script, strlen(script)));
+   return (n < 0 || (size_t)n >= size) ? -1 : 0;
+}
+
+
+/*
+* Function: shell_build_id
+* ------------------------
+* Identifies this build of the shell for the script cache by the identity of its own executable
+* (device, inode, size and modification time), so installing any other build changes it with one
+* stat and no reading of the image. Computed once; 0 if the executable can't be found, in which
+* case nothing is cached.
+*/
+unsigned long long shell_build_id() {
+   static unsigned long long id;
+   static int known;
+   if (known)
+       return id;
+   known = 1;
+   struct stat st;
+   if (stat("/proc/self/exe", &st) < 0)
+       return 0;
+   unsigned long long key[5] = { st.st_dev, st.st_ino, st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec };
+   id = hash_name((const char *)key, sizeof(key));
+   if (id == 0)
+       id = 1;
+   return id;
+}
+
+
+/*
+* Function: cache_layout
+* ----------------------
+* Computes where each section of a cache file starts (the script path, then the program's
+* tables and pool, each 8-byte aligned) and returns the file's total size, or 0 if a count in
+* the header is negative.
+*/
+size_t cache_layout(const struct cache_header *h, size_t offsets[CACHE_SECTIONS]) {
+   if (h->path_len < 0 || h->ncode < 0 || h->nblocks < 0 || h->ncommands < 0 || h->nwords < 0 ||
+       h->nparts < 0 || h->nredirs < 0 || h->narith < 0 || h->nexprs < 0 || h->nconds < 0 ||
+       h->nregex < 0 || h->ncases < 0 || h->pool_len < 0)
+       return 0;
+   size_t sizes[CACHE_SECTIONS] = {
+       h->path_len + 1,
+       h->ncode * sizeof(struct instr),
+       h->nblocks * sizeof(int),
+       h->ncommands * sizeof(struct ccommand),
+       h->nwords * sizeof(struct cword),
+       h->nparts * sizeof(struct wpart),
+       h->nredirs * sizeof(struct credir),
+       h->narith * sizeof(struct carith),
+       h->nexprs * sizeof(struct anode),
+       h->nconds * sizeof(struct ccond),
+       h->pool_len
+   };
+   size_t pos = sizeof(struct cache_header);
+   for (int i = 0; i < CACHE_SECTIONS; i++) {
+       pos = (pos + 7) & ~(size_t)7;
+       offsets[i] = pos;
+       pos += sizes[i];
+   }
+   return pos;
+}
+
+
+/*
+* Function: cache_header_for
+* --------------------------
+* Fills in the part of a cache header that identifies the script and this shell.
+*/
+void cache_header_for(struct cache_header *h, const char *script, const struct stat *st) {
+   memset(h, 0, sizeof(*h));
+   h->magic = SCRIPT_CACHE_MAGIC;
+   h->format = SCRIPT_CACHE_FORMAT;
+   h->build = shell_build_id();
+   h->dev = st->st_dev;
+   h->ino = st->st_ino;
+   h->size = st->st_size;
+   h->mtime_sec = st->st_mtim.tv_sec;
+   h->mtime_nsec = st->st_mtim.tv_nsec;
+   h->path_len = strlen(script);
+}
+
+
+/*
+* Function: cache_span
+* --------------------
+* Whether entries first .. first+n-1 all lie within a table of total entries.
+*/
+int cache_span(long long first, long long n, int total) {
+   return first >= 0 && n >= 0 && first + n <= total;
+}
+
+
+/*
+* Function: cache_check
+* ---------------------
+* Checks that every index and pool offset in a program read from the script cache stays inside
+* its table, so a damaged cache file is compiled again rather than run. Returns 1 if it is sound.
+*/
+int cache_check(const struct program *prog) {
+   if (prog->ncode == 0 || prog->code[prog->ncode - 1].op != OP_END ||
+       (prog->pool_len > 0 && prog->pool[prog->pool_len - 1] != '\0'))
+       return 0;
+   for (int i = 0; i < prog->nblocks; i++)
+       if (!cache_span(prog->blocks[i], 1, prog->ncode))
+           return 0;
+   for (int i = 0; i < prog->ncode; i++) {
+       const struct instr *in = &prog->code[i];
+       int ok;
+       switch (in->op) {
+       case OP_SIMPLE: ok = cache_span(in->a, 1, prog->ncommands); break;
+       case OP_PIPELINE: ok = cache_span(in->a, in->b, prog->nblocks) && in->b > 0; break;
+       case OP_SUBSHELL:
+       case OP_BACKGROUND: ok = cache_span(in->a, 1, prog->nblocks); break;
+       case OP_JUMP:
+       case OP_JUMP_FALSE:
+       case OP_JUMP_TRUE:
+       case OP_LOOP_NEXT:
+       case OP_FOR_NEXT: ok = cache_span(in->a, 1, prog->ncode); break;
+       case OP_FOR_INIT:
+           ok = cache_span(in->a, 1, prog->pool_len) && (in->c < 0 || cache_span(in->b, in->c, prog->nwords));
+           break;
+       case OP_CASE_BEGIN: ok = cache_span(in->a, 1, prog->nwords) && in->b >= 0 && in->b <= prog->ncases; break;
+       case OP_CASE_MATCH: ok = cache_span(in->a, in->b, prog->nwords) && cache_span(in->c, 1, prog->ncode); break;
+       case OP_REDIR_PUSH: ok = cache_span(in->a, in->b, prog->nredirs) && cache_span(in->c, 1, prog->ncode); break;
+       case OP_BREAK:
+       case OP_CONTINUE: ok = cache_span(in->a, 1, prog->ncode) && in->b > 0; break;
+       case OP_FUNCTION:
+       case OP_COPROC: ok = cache_span(in->a, 1, prog->pool_len) && cache_span(in->b, 1, prog->nblocks); break;
+       case OP_ARITH: ok = cache_span(in->a, 1, prog->narith); break;
+       case OP_COND: ok = cache_span(in->a, 1, prog->nconds); break;
+       default: ok = in->op <= OP_COPROC; break;
+       }
+       if (!ok)
+           return 0;
+   }
+   for (int i = 0; i < prog->ncommands; i++) {
+       const struct ccommand *c = &prog->commands[i];
+       if (!cache_span(c->first_word, c->nwords, prog->nwords) || c->nassigns < 0 || c->nassigns > c->nwords ||
+           !cache_span(c->first_redir, c->nredirs, prog->nredirs))
+           return 0;
+   }
+   for (int i = 0; i < prog->nredirs; i++)
+       if (!cache_span(prog->redirs[i].word, 1, prog->nwords) || prog->redirs[i].type < 0 ||
+           prog->redirs[i].type > R_HERESTRING)
+           return 0;
+   for (int i = 0; i < prog->nwords; i++) {
+       const struct cword *w = &prog->words[i];
+       if (!cache_span(w->text, 1, prog->pool_len) || !cache_span(w->first_part, w->nparts, prog->nparts) ||
+           (w->nelements != -1 && !cache_span(w->first_element, w->nelements, prog->nwords)))
+           return 0;
+       int len = strlen(prog->pool + w->text);
+       for (int j = w->first_part; j < w->first_part + w->nparts; j++) {
+           const struct wpart *part = &prog->parts[j];
+           if (!cache_span(part->off, part->len, len) || part->type > WP_PROCSUB)
+               return 0;
+           if (part->type == WP_ARITH ? part->block != 0 && !cache_span(part->block - 1, 1, prog->narith)
+                                      : !cache_span(part->block, 1, prog->nblocks))
+               return 0;
+       }
+   }
+   for (int i = 0; i < prog->narith; i++)
+       if (!cache_span(prog->arith[i].word, 1, prog->nwords) || prog->arith[i].root < -1 ||
+           prog->arith[i].root >= prog->nexprs)
+           return 0;
+   /* operands always come before the node using them, so evaluation can't loop */
+   for (int i = 0; i < prog->nexprs; i++) {
+       const struct anode *n = &prog->exprs[i];
+       int ok;
+       switch (n->type) {
+       case A_NUM: ok = 1; break;
+       case A_VAR:
+       case A_INCDEC: ok = cache_span(n->a, n->b, prog->pool_len); break;
+       case A_ASSIGN: ok = cache_span(n->a, n->b, prog->pool_len) && cache_span(n->c, 1, i); break;
+       case A_UNARY: ok = cache_span(n->a, 1, i); break;
+       case A_BINARY:
+       case A_COMMA: ok = cache_span(n->a, 1, i) && cache_span(n->b, 1, i); break;
+       case A_COND: ok = cache_span(n->a, 1, i) && cache_span(n->b, 1, i) && cache_span(n->c, 1, i); break;
+       default: ok = 0; break;
+       }
+       if (!ok)
+           return 0;
+   }
+   for (int i = 0; i < prog->nconds; i++) {
+       const struct ccond *c = &prog->conds[i];
+       int ok;
+       switch (c->type) {
+       case C_AND:
+       case C_OR: ok = cache_span(c->a, 1, i) && cache_span(c->b, 1, i); break;
+       case C_NOT: ok = cache_span(c->a, 1, i); break;
+       case C_STRING:
+       case C_UNARY: ok = cache_span(c->a, 1, prog->nwords); break;
+       case C_BINARY:
+           ok = cache_span(c->a, 1, prog->nwords) && cache_span(c->b, 1, prog->nwords) &&
+                (c->op != CO_REGEX || cache_span(c->regex, 1, prog->nregex));
+           break;
+       default: ok = 0; break;
+       }
+       if (!ok)
+           return 0;
+   }
+   return 1;
+}
+
+
+/*
+* Function: cache_load
+* --------------------
+* Maps the cached compiled form of a script and returns a program whose tables point straight
+* into the mapping, or NULL if there is no cache entry or it is for another version of the
+* script or of the shell. Only a regular file owned by the user, which no one else can write,
+* is used, and only once cache_check has found its tables consistent.
+*/
+struct program *cache_load(const char *cache_file, const char *script, const struct stat *st) {
+   int fd = open(cache_file, O_RDONLY | O_CLOEXEC);
+   if (fd < 0)
+       return NULL;
+   struct stat cst;
+   char *base = MAP_FAILED;
+   if (fstat(fd, &cst) == 0 && S_ISREG(cst.st_mode) && cst.st_uid == geteuid() &&
+       (cst.st_mode & (S_IWGRP | S_IWOTH)) == 0 && (size_t)cst.st_size >= sizeof(struct cache_header))
+       base = mmap(NULL, cst.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (base == MAP_FAILED)
+       return NULL;
+
+
+   struct cache_header expected;
+   cache_header_for(&expected, script, st);
+   const struct cache_header *h = (const struct cache_header *)base;
+   size_t offsets[CACHE_SECTIONS];
+   struct program *prog = NULL;
+   /* everything up to the table sizes must match, then the sizes must add up to the file */
+   if (memcmp(h, &expected, offsetof(struct cache_header, ncode)) == 0 &&
+       cache_layout(h, offsets) == (size_t)cst.st_size &&
+       memcmp(base + offsets[0], script, h->path_len + 1) == 0)
+       prog = calloc(1, sizeof(struct program));
+   if (prog == NULL) {
+       munmap(base, cst.st_size);
+       return NULL;
+   }
+   prog->code = (struct instr *)(base + offsets[1]);
+   prog->ncode = prog->code_cap = h->ncode;
+   prog->blocks = (int *)(base + offsets[2]);
+   prog->nblocks = prog->blocks_cap = h->nblocks;
+   prog->commands = (struct ccommand *)(base + offsets[3]);
+   prog->ncommands = prog->commands_cap = h->ncommands;
+   prog->words = (struct cword *)(base + offsets[4]);
+   prog->nwords = prog->words_cap = h->nwords;
+   prog->parts = (struct wpart *)(base + offsets[5]);
+   prog->nparts = prog->parts_cap = h->nparts;
+   prog->redirs = (struct credir *)(base + offsets[6]);
+   prog->nredirs = prog->redirs_cap = h->nredirs;
+   prog->arith = (struct carith *)(base + offsets[7]);
+   prog->narith = prog->arith_cap = h->narith;
+   prog->exprs = (struct anode *)(base + offsets[8]);
+   prog->nexprs = prog->exprs_cap = h->nexprs;
+   prog->conds = (struct ccond *)(base + offsets[9]);
+   prog->nconds = prog->conds_cap = h->nconds;
+   prog->nregex = h->nregex;
+   prog->ncases = h->ncases;
+   prog->pool = base + offsets[10];
+   prog->pool_len = prog->pool_cap = h->pool_len;
+   prog->mapping = base;
+   prog->mapping_len = cst.st_size;
+   prog->refs = 1;
+   if (!cache_check(prog)) {
+       free(prog);
+       munmap(base, cst.st_size);
+       return NULL;
+   }
+   return prog;
+}
+
+
+/*
+* Function: cache_store
+* ---------------------
+* Writes a compiled script to its cache file. The file is written under a temporary name and
+* renamed into place, so a concurrent run never maps a half-written one. Failures are ignored:
+* the cache only saves time.
+*/
+void cache_store(const struct program *prog, const char *cache_file, const char *script, const struct stat *st) {
+   struct cache_header h;
+   cache_header_for(&h, script, st);
+   h.ncode = prog->ncode;
+   h.nblocks = prog->nblocks;
+   h.ncommands = prog->ncommands;
+   h.nwords = prog->nwords;
+   h.nparts = prog->nparts;
+   h.nredirs = prog->nredirs;
+   h.narith = prog->narith;
+   h.nexprs = prog->nexprs;
+   h.nconds = prog->nconds;
+   h.nregex = prog->nregex;
+   h.ncases = prog->ncases;
+   h.pool_len = prog->pool_len;
+   size_t offsets[CACHE_SECTIONS];
+   size_t total = cache_layout(&h, offsets);
+   char *image = calloc(1, total);
+   if (image == NULL)
+       return;
+   memcpy(image, &h, sizeof(h));
+   memcpy(image + offsets[0], script, h.path_len + 1);
+   if (prog->ncode > 0)
+       memcpy(image + offsets[1], prog->code, h.ncode * sizeof(struct instr));
+   if (prog->nblocks > 0)
+       memcpy(image + offsets[2], prog->blocks, h.nblocks * sizeof(int));
+   if (prog->ncommands > 0)
+       memcpy(image + offsets[3], prog->commands, h.ncommands * sizeof(struct ccommand));
+   if (prog->nwords > 0)
+       memcpy(image + offsets[4], prog->words, h.nwords * sizeof(struct cword));
+   if (prog->nparts > 0)
+       memcpy(image + offsets[5], prog->parts, h.nparts * sizeof(struct wpart));
+   if (prog->nredirs > 0)
+       memcpy(image + offsets[6], prog->redirs, h.nredirs * sizeof(struct credir));
+   if (prog->narith > 0)
+       memcpy(image + offsets[7], prog->arith, h.narith * sizeof(struct carith));
+   if (prog->nexprs > 0)
+       memcpy(image + offsets[8], prog->exprs, h.nexprs * sizeof(struct anode));
+   if (prog->nconds > 0)
+       memcpy(image + offsets[9], prog->conds, h.nconds * sizeof(struct ccond));
+   if (prog->pool_len > 0)
+       memcpy(image + offsets[10], prog->pool, h.pool_len);
+
+
+   char temp[PATH_MAX + 8];
+   snprintf(temp, sizeof(temp), "%s.XXXXXX", cache_file);
+   int fd = mkstemp(temp);
+   if (fd >= 0) {
+       int failed = write_all(fd, image, total) < 0;
+       if (close(fd) < 0 || failed || rename(temp, cache_file) < 0)
+           unlink(temp);
+   }
+   free(image);
+}
+
+
+/*
+* Function: run_script
+* --------------------
+* Runs a script file. Its compiled form is kept in a cache keyed by the script's path, size and
+* modification time and by the shell's build id, so later runs map it and skip reading and parsing
+* the script altogether. Returns the exit status.
+*/
+int run_script(const char *path) {
+   int fd = open(path, O_RDONLY | O_CLOEXEC);
+   struct stat st;
+   if (fd < 0 || fstat(fd, &st) < 0) {
+       fprintf(stderr, "%s: %s\n", path, strerror(errno));
+       if (fd >= 0)
+           close(fd);
+       return 127;
+   }
+   char script[PATH_MAX];
+   char cache_file[PATH_MAX];
+   int cacheable = S_ISREG(st.st_mode) && shell_build_id() != 0 && realpath(path, script) != NULL &&
+                   script_cache_file(script, cache_file, sizeof(cache_file)) == 0;
+   struct program *prog = cacheable ? cache_load(cache_file, script, &st) : NULL;
+   if (prog == NULL) {
+       size_t mapped_len;
+       char *text = load_text(fd, &st, &mapped_len);
+       int status;
+       prog = text ? compile_program(text, 0, &status) : NULL;
+       if (text != NULL)
+           unload_text(text, mapped_len);
+       else
+           fprintf(stderr, "%s: %s\n", path, strerror(errno));
+       if (prog != NULL && cacheable)
+           cache_store(prog, cache_file, script, &st);
+   }
+   close(fd);
+   if (prog == NULL)
+       return 2;
+   vm_run(prog, 0);
+   program_release(prog);
+   return last_status;
+}
+
+
+/*
+* Function: load_rc_file
+* ----------------------
+* Sources ~/.oscrc, if there is one, when an interactive shell starts.
+*/
+void load_rc_file() {
+   const char *home = var_get("HOME");
+   char rc[PATH_MAX];
+   struct stat st;
+   if (home == NULL || snprintf(rc, sizeof(rc), "%s/.oscrc", home) >= (int)sizeof(rc) || stat(rc, &st) < 0)
+       return;
+   char *args[] = { "source", rc, NULL };
+   builtin_source(args);
+}
+
+
+/*
+* Main function:
+* --------------
+* Runs "osc -c command [name [args...]]" or "osc script [args...]"; with no arguments, the
+* interactive loop: prompt, user input, history, and more lines until the command is complete.
+* Batch runs only import the environment; the rc file and the terminal are interactive-only,
+* and the terminal is set up just before the first prompt. --norc skips ~/.oscrc and
+* --startup-profile reports the time of each startup phase.
+*/
+int main(int argc, char *argv[]) {
+   clock_gettime(CLOCK_MONOTONIC, &startup_time);
+   int use_rc = 1;
+   int first = 1;   /* first argument that isn't a long option */
+   for (; first < argc && strncmp(argv[first], "--", 2) == 0; first++) {
+       if (strcmp(argv[first], "--startup-profile") == 0) {
+           startup_profile = 1;
+       } else if (strcmp(argv[first], "--norc") == 0) {
+           use_rc = 0;
+       } else if (strcmp(argv[first], "--") == 0) {
+           first++;
+           break;
+       } else {
+           fprintf(stderr, "osc: %s: invalid option\n", argv[first]);
+           return 2;
+       }
+   }
+   argc -= first - 1;
+   argv += first - 1;   /* argv[0] stays the shell's own name */
+
+
+   struct timespec phase = startup_time;
+   import_environment();
+   profile_phase("environment", &phase);
+   if (argc > 2 && strcmp(argv[1], "-c") == 0) {
+       if (argc > 3)
+           shell_name = argv[3];
+       if (argc > 4) {
+           positional = argv + 4;
+           positional_count = argc - 4;
+       }
+       execute_line(argv[2]);
+       profile_phase("command", &phase);
+       return last_status;
+   }
+   if (argc > 1) {
+       shell_name = argv[1];
+       positional = argv + 2;
+       positional_count = argc - 2;
+       int status = run_script(argv[1]);
+       profile_phase("script", &phase);
+       return status;
+   }
+
+
+   interactive = 1;
+   if (use_rc && isatty(STDIN_FILENO)) {
+       load_rc_file();
+       profile_phase("rc file", &phase);
+   }
+   char input[MAX_LENGTH];  /* stores user input */
+   int prompted = 0;
+   struct strbuf text = { NULL, 0, 0 };   /* the command being read, possibly several lines */
+
+
+   while (1) {
+       /* Report background jobs that finished since the last prompt */
+       if (njobs > 0) {
+           event_loop_run(0);
+           jobs_report();
+       }
+
+
+       /* Print the prompt once per loop, right before reading input. */
+       if (!prompted) {
+           enable_noncanonical_mode();
+           profile_phase("ready", &startup_time);   /* total time to the first prompt */
+           prompted = 1;
+       }
+       print_prompt();
+
+
+       /*  Get user input using non-canonical mode (with arrow key handling) */
+       if (get_input(input) < 0)
+           break;
+
+
+       /*  Ignore empty input */
+       if (strlen(input) == 0)
+           continue;
+
+
+       /* Check for !! */
+       if (strcmp(input, "!!") == 0) {
+           if (command_count == 0) {
+               printf("No commands in history.\n");
+               continue;
+           }
+           int last_index = (next_command - 1 + BUFFER_SIZE) % BUFFER_SIZE;
+           char last_cmd[MAX_LENGTH];
+           strcpy(last_cmd, history[last_index]);
+           printf("%s\n", last_cmd); /* display last command */
+           strcpy(input, last_cmd);  /* Replace input with the last command */
+       } else {
+           /*  Add non-"!!" commands to history */
+           add_to_buffer(input);
+       }
+
+
+       /* Compile the command, reading more lines while it is unfinished (if ... fi, quotes, here-documents) */
+       text.len = 0;
+       strbuf_append(&text, input, strlen(input));
+       struct program *prog;
+       int status;
+       while ((prog = compile_program(text.buf, 1, &status)) == NULL && status == PARSE_INCOMPLETE) {
+           if (isatty(STDIN_FILENO)) {
+               printf("> ");
+               fflush(stdout);
+           }
+           if (get_input(input) < 0)
+               break;
+           strbuf_append(&text, "\n", 1);
+           strbuf_append(&text, input, strlen(input));
+       }
+       if (status == PARSE_INCOMPLETE) {
+           fprintf(stderr, "syntax error: unexpected end of file\n");
+           last_status = 2;
+           break;
+       }
 
 
-       /* Execute the command */
-       run_instruction(args, background, input_file, output_file);
+       /* Run the command */
+       if (prog != NULL)
+           vm_run(prog, 0);
+       else
+           last_status = 2;
+       program_release(prog);
    }
+   free(text.buf);
    return 0;
 }